@@ -0,0 +1,196 @@
+/*
+ * Benchmarks the debugger library against a program written by gen.c and
+ * prints the results as a single JSON object, so that revisions can be compared.
+ */
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Must match gen.c */
+#define BIG_ELEMS (1 << 22)
+#define DEEP_DEPTH 500
+#define NUM_HITS 20000
+
+#define TRACE_ROUNDS 2000
+#define READ_CHUNK (64 * 1024)
+#define READ_ROUNDS 8
+#define SMALL_READS 100000
+#define STEP_COUNT 5000
+
+static void fail(const char *what) {
+	fprintf(stderr, "bench: %s\n", what);
+	exit(1);
+}
+
+static uint64_t residentKiB(void) {
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == NULL) return 0;
+	if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double perSecond(uint64_t count, uint64_t nanos) {
+	return nanos > 0 ? count * 1e9 / nanos : 0;
+}
+
+static uint64_t functionAddress(TcdContext *debug, const char *name) {
+	TcdFunction *func = tcdFunctionByName(debug->info, (char*)name);
+	if (func == NULL || func->numLines == 0) fail("function not found in the target");
+	return func->lines[0].address + debug->loadBias;
+}
+
+/* Runs into the one-shot breakpoint at <address> and rewinds the IP onto it */
+static void runTo(TcdContext *debug, uint64_t address) {
+	tcdInsertBreakpoint(debug, address, 0);
+	tcdContinue(debug, 0);
+	tcdSync(debug);
+	if (!WIFSTOPPED(debug->status)) fail("target ended early");
+	uint64_t bip = tcdReadIP(debug) - 1;
+	if (tcdRemoveBreakpoint(debug, bip) != 0) fail("target stopped somewhere else");
+	tcdWriteIP(debug, bip);
+}
+
+static TcdInfo *benchLoad(TcdJson *json, const char *path) {
+	uint64_t rss = residentKiB();
+	uint64_t start = tcdNow();
+	TcdInfo *info;
+	if (tcdLoadInfo(path, &info) != TCDE_OK) fail("unable to load debug info");
+	uint64_t nanos = tcdNow() - start;
+	tcdJsonKey(json, "load");
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "units");
+	tcdJsonUint(json, info->numCompUnits);
+	tcdJsonKey(json, "nanos");
+	tcdJsonUint(json, nanos);
+	tcdJsonKey(json, "rssKiB");
+	tcdJsonUint(json, residentKiB() - rss);
+	tcdJsonObjectEnd(json);
+	return info;
+}
+
+static void benchStackTrace(TcdJson *json, TcdContext *debug) {
+	runTo(debug, functionAddress(debug, "bench_bottom"));
+	uint64_t trace[1024];
+	uint16_t depth = 0;
+	uint64_t start = tcdNow();
+	for (int i = 0; i < TRACE_ROUNDS; i++) {
+		depth = tcdGetStackTrace(debug, trace, 1024);
+	}
+	uint64_t nanos = tcdNow() - start;
+	tcdJsonKey(json, "stackTrace");
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "depth");
+	tcdJsonUint(json, depth);
+	tcdJsonKey(json, "perSecond");
+	tcdJsonDouble(json, perSecond(TRACE_ROUNDS, nanos));
+	tcdJsonObjectEnd(json);
+}
+
+static void benchMemory(TcdJson *json, TcdContext *debug) {
+	TcdLocal *big = tcdGlobalByName(debug->info, "bench_big");
+	TcdRtLoc rtloc;
+	if (big == NULL || tcdInterpretLocation(debug, big->locdesc, &rtloc) != 0 || rtloc.region != TCDR_ADDRESS) {
+		fail("bench_big not found in the target");
+	}
+	uint8_t *buffer = malloc(READ_CHUNK);
+	uint64_t size = (uint64_t)BIG_ELEMS * sizeof(long);
+	uint64_t start = tcdNow();
+	for (int r = 0; r < READ_ROUNDS; r++) {
+		for (uint64_t offset = 0; offset < size; offset += READ_CHUNK) {
+			tcdReadMemory(debug, rtloc.address + offset, READ_CHUNK, buffer);
+		}
+	}
+	uint64_t bulkNanos = tcdNow() - start;
+	start = tcdNow();
+	for (int i = 0; i < SMALL_READS; i++) {
+		tcdReadMemory(debug, rtloc.address + (i % BIG_ELEMS) * sizeof(long), sizeof(long), buffer);
+	}
+	uint64_t smallNanos = tcdNow() - start;
+	free(buffer);
+	tcdJsonKey(json, "memoryRead");
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "bytes");
+	tcdJsonUint(json, size * READ_ROUNDS);
+	tcdJsonKey(json, "mbPerSecond");
+	tcdJsonDouble(json, perSecond(size * READ_ROUNDS, bulkNanos) / (1024 * 1024));
+	tcdJsonKey(json, "smallReadsPerSecond");
+	tcdJsonDouble(json, perSecond(SMALL_READS, smallNanos));
+	tcdJsonObjectEnd(json);
+}
+
+/* Stops at every call of bench_hit(), stepping over the breakpoint to re-arm it */
+static void benchBreakpoints(TcdJson *json, TcdContext *debug) {
+	uint64_t address = functionAddress(debug, "bench_hit");
+	uint64_t start = tcdNow();
+	for (int i = 0; i < NUM_HITS; i++) {
+		runTo(debug, address);
+		tcdStepInstruction(debug, 0);
+		tcdSync(debug);
+	}
+	uint64_t nanos = tcdNow() - start;
+	tcdJsonKey(json, "breakpoints");
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "hits");
+	tcdJsonUint(json, NUM_HITS);
+	tcdJsonKey(json, "perSecond");
+	tcdJsonDouble(json, perSecond(NUM_HITS, nanos));
+	tcdJsonObjectEnd(json);
+}
+
+static void benchStep(TcdJson *json, TcdContext *debug) {
+	runTo(debug, functionAddress(debug, "bench_loop"));
+	uint64_t start = tcdNow();
+	for (int i = 0; i < STEP_COUNT; i++) {
+		tcdStep(debug);
+	}
+	uint64_t stepNanos = tcdNow() - start;
+	start = tcdNow();
+	for (int i = 0; i < STEP_COUNT; i++) {
+		tcdNext(debug);
+	}
+	uint64_t nextNanos = tcdNow() - start;
+	tcdJsonKey(json, "step");
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "count");
+	tcdJsonUint(json, STEP_COUNT);
+	tcdJsonKey(json, "stepsPerSecond");
+	tcdJsonDouble(json, perSecond(STEP_COUNT, stepNanos));
+	tcdJsonKey(json, "nextsPerSecond");
+	tcdJsonDouble(json, perSecond(STEP_COUNT, nextNanos));
+	tcdJsonObjectEnd(json);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <target>\n", argv[0]);
+		return 1;
+	}
+	TcdContext debug = {0};
+	TcdJson json;
+	tcdJsonInit(&json, stdout);
+	tcdJsonObjectBegin(&json);
+	TcdInfo *info = benchLoad(&json, argv[1]);
+	char *targetArgv[] = {argv[1], NULL};
+	if (tcdSpawn(&debug, argv[1], targetArgv, 0) != 0) fail("unable to start the target");
+	tcdUseInfo(&debug, info);
+	tcdReleaseInfo(info);
+	benchStackTrace(&json, &debug);
+	benchMemory(&json, &debug);
+	benchBreakpoints(&json, &debug);
+	benchStep(&json, &debug);
+	kill(debug.pid, SIGKILL);
+	tcdSync(&debug);
+	tcdJsonKey(&json, "stats");
+	tcdJsonStats(&debug, &json);
+	tcdJsonObjectEnd(&json);
+	tcdJsonLineEnd(&json);
+	tcdFreeContext(&debug);
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Writes a large synthetic C program for the benchmarks: <units> compilation
+ * units with their own types, globals and functions, plus a main.c with a big
+ * array, a deep recursion, a function that is called over and over and a hot loop.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Must match bench.c */
+#define BIG_ELEMS (1 << 22)
+#define DEEP_DEPTH 500
+#define NUM_HITS 20000
+
+static FILE *openFile(const char *dir, const char *name) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	return file;
+}
+
+static void writeUnit(const char *dir, int u) {
+	char name[64];
+	snprintf(name, sizeof(name), "unit%d.c", u);
+	FILE *f = openFile(dir, name);
+	fprintf(f, "struct rec%d {\n\tint id;\n\tlong value;\n\tchar name[16];\n\tdouble weight;\n\tstruct rec%d *next;\n};\n", u, u);
+	fprintf(f, "typedef struct rec%d Rec%d;\n", u, u);
+	fprintf(f, "enum kind%d { KIND%d_A, KIND%d_B, KIND%d_C };\n", u, u, u, u);
+	fprintf(f, "static Rec%d table%d[64];\n", u, u);
+	fprintf(f, "long counter%d;\n", u);
+	fprintf(f, "static long helper%d(Rec%d *rec, long x) {\n\tlong acc = rec->value;\n\tfor (int k = 0; k < 4; k++) {\n\t\tacc += x * k;\n\t}\n\treturn acc;\n}\n", u, u);
+	fprintf(f, "long work%d(long x) {\n\tenum kind%d kind = x & 1 ? KIND%d_B : KIND%d_C;\n\tRec%d *rec = &table%d[x & 63];\n\trec->id = kind;\n\trec->value += x;\n\tcounter%d += helper%d(rec, x);\n\treturn counter%d;\n}\n",
+		u, u, u, u, u, u, u, u, u);
+	fclose(f);
+}
+
+static void writeMain(const char *dir, int units) {
+	FILE *f = openFile(dir, "main.c");
+	for (int u = 0; u < units; u++) {
+		fprintf(f, "long work%d(long);\n", u);
+	}
+	fprintf(f, "long bench_big[%d];\n", BIG_ELEMS);
+	fprintf(f, "volatile long bench_sink;\n");
+	fprintf(f, "void bench_bottom(void) {\n\tbench_sink++;\n}\n");
+	fprintf(f, "long bench_deep(int depth) {\n\tif (depth == 0) {\n\t\tbench_bottom();\n\t\treturn 0;\n\t}\n\treturn bench_deep(depth - 1) + 1;\n}\n");
+	fprintf(f, "void bench_hit(long i) {\n\tbench_sink += i;\n}\n");
+	fprintf(f, "void bench_loop(void) {\n\tfor (long i = 0; ; i++) {\n\t\tbench_sink += i;\n\t\tbench_sink ^= i >> 3;\n\t}\n}\n");
+	fprintf(f, "int main(void) {\n\tlong x = 0;\n");
+	for (int u = 0; u < units; u++) {
+		fprintf(f, "\tx += work%d(x);\n", u);
+	}
+	fprintf(f, "\tfor (long i = 0; i < %d; i++) {\n\t\tbench_big[i] = i ^ x;\n\t}\n", BIG_ELEMS);
+	fprintf(f, "\tbench_deep(%d);\n", DEEP_DEPTH);
+	fprintf(f, "\tfor (long i = 0; i < %d; i++) {\n\t\tbench_hit(i);\n\t}\n", NUM_HITS);
+	fprintf(f, "\tbench_loop();\n\treturn 0;\n}\n");
+	fclose(f);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <dir> <units>\n", argv[0]);
+		return 1;
+	}
+	int units = atoi(argv[2]);
+	for (int u = 0; u < units; u++) {
+		writeUnit(argv[1], u);
+	}
+	writeMain(argv[1], units);
+	return 0;
+}
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 /* ----- Error Codes ----- */
 
@@ -17,7 +18,9 @@ enum TcdErrorCode {
 	TCDE_LOAD_LINES,
 	TCDE_LOAD_FUNCTION,
 	TCDE_LOAD_LOCAL,
-	TCDE_LOAD_TYPE
+	TCDE_LOAD_TYPE,
+	TCDE_CORE_OPEN,
+	TCDE_CORE_FORMAT
 };
 typedef enum TcdErrorCode TcdErrorCode;
 
@@ -25,27 +28,72 @@ const char *tcdFormulateErrorMessage(int code);
 
 /* ----- Address ----- */
 
+enum TcdLocKind {
+	TCDL_NONE,     /* Unknown, unsupported or optimized out */
+	TCDL_FBREG,    /* Frame base + offset */
+	TCDL_ADDR,     /* Fixed address (offset) */
+	TCDL_REGISTER, /* Lives in DWARF register (offset) */
+	TCDL_PROGRAM,  /* Anything else, evaluated from ops */
+	TCDL_LIST      /* Location list, picked by the instruction pointer */
+};
+typedef enum TcdLocKind TcdLocKind;
+
+/* A decoded DWARF expression op; branch operands are op indices */
+struct TcdLocOp {
+	uint8_t op;
+	uint16_t reg;
+	int64_t operand;
+};
+typedef struct TcdLocOp TcdLocOp;
+
+/* A location expression, compiled at load time */
 struct TcdLocDesc {
-	uint8_t *expr;
+	TcdLocKind kind;
+	int64_t offset;
+	TcdLocOp *ops;
+	uint32_t numOps;
+	struct TcdLocRange *ranges;
+	uint32_t numRanges;
 	uint64_t baseAddress;
 };
 
+/* One entry of a location list, valid for begin <= ip < end */
+struct TcdLocRange {
+	uint64_t begin, end;
+	struct TcdLocDesc desc;
+};
+
+/* Where to find the location or range lists of a compilation unit, and how to decode them */
+struct TcdLocListInfo {
+	const uint8_t *section; /* .debug_loc or .debug_ranges, .debug_loclists or .debug_rnglists for DWARF 5 */
+	uint64_t sectionSize;
+	const uint8_t *addrs;   /* .debug_addr, starting at DW_AT_addr_base */
+	uint64_t addrsSize;
+	uint16_t version;
+	uint64_t base;          /* Base address of the compilation unit */
+};
+
 struct TcdRtLoc {
 	uint64_t address;
 	enum {
 		TCDR_ADDRESS,
-		TCDR_REGISTER,
-		TCDR_HOST_TEMP
+		TCDR_REGISTER,    /* address is a DWARF register number */
+		TCDR_HOST_TEMP,   /* address is the value itself */
+		TCDR_HOST_BUFFER  /* address is an offset into the context's host buffer */
 	} region;
 };
 
-typedef struct TcdLocDesc TcdLocDesc;
-typedef struct TcdRtLoc   TcdRtLoc;
+typedef struct TcdLocDesc     TcdLocDesc;
+typedef struct TcdLocRange    TcdLocRange;
+typedef struct TcdLocListInfo TcdLocListInfo;
+typedef struct TcdRtLoc       TcdRtLoc;
 
 /* ----- Type ----- */
 
 enum TcdTypeClass {
-	TCDT_BASE, TCDT_POINTER, TCDT_ARRAY, TCDT_STRUCT
+	TCDT_BASE, TCDT_POINTER, TCDT_ARRAY, TCDT_STRUCT,
+	TCDT_UNION, TCDT_ENUM,
+	TCDT_TYPEDEF, TCDT_CONST, TCDT_VOLATILE, TCDT_RESTRICT
 };
 typedef enum TcdTypeClass TcdTypeClass;
 
@@ -60,6 +108,22 @@ enum TcdBaseInterp {
 };
 typedef enum TcdBaseInterp TcdBaseInterp;
 
+/* Bitfields occupy bitSize bits, starting bitOffset bits above the least significant bit at offset */
+struct TcdMember {
+	char *name;
+	struct TcdType *type;
+	uint32_t offset;
+	uint8_t bitOffset;
+	uint8_t bitSize;
+};
+typedef struct TcdMember TcdMember;
+
+struct TcdEnumerator {
+	char *name;
+	int64_t value;
+};
+typedef struct TcdEnumerator TcdEnumerator;
+
 struct TcdType {
 	TcdTypeClass tclass;
 	uint32_t size;
@@ -73,10 +137,25 @@ struct TcdType {
 		} pointer;
 		struct {
 			struct TcdType *of;
+			uint64_t count;
 		} array;
+		/* Structs and unions */
 		struct {
 			char *name;
+			TcdMember *members;
+			uint32_t numMembers;
 		} struc;
+		struct {
+			char *name;
+			TcdEnumerator *values;
+			uint32_t numValues;
+			TcdBaseInterp interp;
+		} enumer;
+		/* Typedefs and qualifiers; only typedefs have a name */
+		struct {
+			char *name;
+			struct TcdType *to;
+		} alias;
 	} as;
 };
 typedef struct TcdType TcdType;
@@ -93,12 +172,24 @@ struct TcdLocal {
 	char *name;
 	TcdLocDesc locdesc;
 	TcdType *type;
+	/* Only for globals: visible to other compilation units, unlike statics */
+	int external;
 };
 typedef struct TcdLocal TcdLocal;
 
+struct TcdRange {
+	uint64_t begin, end;
+};
+typedef struct TcdRange TcdRange;
+
 struct TcdFunction {
 	char *name;
+	/* The part holding the entry point; <ranges> lists all parts of
+	 * code that isn't contiguous, like hot/cold splits, else it is NULL */
 	uint64_t begin, end;
+	TcdRange *ranges;
+	uint32_t numRanges;
+	TcdLocDesc frameBase;
 	TcdLine *lines;
 	uint32_t numLines;
 	TcdLocal *locals;
@@ -111,30 +202,220 @@ struct TcdCompUnit {
 	char *compDir;
 	char *producer;
 	uint64_t begin, end;
+	TcdRange *ranges;
+	uint32_t numRanges;
 	TcdFunction *funcs;
 	uint32_t numFuncs;
 	TcdType *types;
 	uint32_t numTypes;
+	TcdLocal *globals;
+	uint32_t numGlobals;
 	/* TcdStruct *structs;
 	uint32_t numStructs; */
 };
 typedef struct TcdCompUnit TcdCompUnit;
 
+/* A variable at a fixed address */
+struct TcdVarAddress {
+	uint64_t address;
+	TcdLocal *var;
+};
+typedef struct TcdVarAddress TcdVarAddress;
+
+/* A contiguous part of the code of a function */
+struct TcdFunctionRange {
+	uint64_t begin, end;
+	TcdFunction *func;
+	/* Largest end of this and all earlier entries, as parts can overlap */
+	uint64_t maxEnd;
+};
+typedef struct TcdFunctionRange TcdFunctionRange;
+
+/* Call frame information, see frame.c */
+struct TcdFde {
+	uint64_t begin, end;
+	uint64_t offset;
+};
+typedef struct TcdFde TcdFde;
+
+struct TcdFrameInfo {
+	uint8_t *section; /* .eh_frame or .debug_frame */
+	uint64_t sectionSize;
+	uint64_t address;
+	int eh;
+	TcdFde *fdes;
+	uint32_t numFdes;
+};
+typedef struct TcdFrameInfo TcdFrameInfo;
+
+/* Phases of tcdLoadInfo(), timed separately */
+enum {
+	TCD_LOAD_UNITS,
+	TCD_LOAD_DIES,
+	TCD_LOAD_TYPES,
+	TCD_LOAD_LINES,
+	TCD_LOAD_FIXUP,
+	TCD_NUM_LOAD_PHASES
+};
+
+/* Debug information of one executable, in link time addresses. It doesn't change
+ * once loaded, so any number of contexts can share it by reference count. */
 struct TcdInfo {
 	TcdCompUnit *compUnits;
 	uint32_t numCompUnits;
+	/* Open addressing hash table of global variables, by name */
+	TcdLocal **globalsByName;
+	uint32_t globalsByNameSize;
+	/* Global and static variables, sorted by address */
+	TcdVarAddress *varsByAddress;
+	uint32_t numVarsByAddress;
+	/* Every part of every function with code, sorted by begin address */
+	TcdFunctionRange *funcRanges;
+	uint32_t numFuncRanges;
+	/* Open addressing hash table of functions, by name */
+	TcdFunction **funcsByName;
+	uint32_t funcsByNameSize;
+	TcdFrameInfo frames;
+	uint64_t loadNanos[TCD_NUM_LOAD_PHASES];
+	uint64_t entry;
+	int refs;
 };
 typedef struct TcdInfo TcdInfo;
 
-int tcdLoadInfo(const char*, TcdInfo*);
+int tcdLoadInfo(const char*, TcdInfo**);
+int tcdLoadSymbols(const char*, TcdInfo**);
+TcdInfo *tcdRetainInfo(TcdInfo*);
+void tcdReleaseInfo(TcdInfo*);
 TcdCompUnit *tcdSurroundingCompUnit(TcdInfo*, uint64_t);
 TcdFunction *tcdSurroundingFunction(TcdInfo*, uint64_t);
 TcdFunction *tcdFunctionByName(TcdInfo*, char*);
+int tcdFunctionContains(TcdFunction*, uint64_t);
+TcdFunctionRange *tcdIndexFunctionRanges(TcdFunction*, uint32_t, uint32_t*);
+TcdFunction *tcdFunctionInRanges(const TcdFunctionRange*, uint32_t, uint64_t);
 TcdLine *tcdNearestLine(TcdFunction*, uint64_t);
-void tcdFreeInfo(TcdInfo*);
+void tcdIndexGlobals(TcdInfo*);
+TcdLocal *tcdGlobalByName(TcdInfo*, const char*);
+TcdLocal *tcdVariableByAddress(TcdInfo*, uint64_t, uint64_t*);
+
+/* ----- ELF ----- */
+
+struct TcdElf {
+	void *map;
+	uint64_t mapSize;
+	/* SHF_COMPRESSED sections by index, inflated on first use and
+	 * kept until the file is closed */
+	uint8_t **inflated;
+};
+typedef struct TcdElf TcdElf;
+
+/* What libdwarf wants to know of a section; the size is the inflated one */
+struct TcdElfSectionInfo {
+	const char *name;
+	uint64_t addr;
+	uint64_t size;
+	uint32_t type;
+	uint32_t link;
+	uint32_t info;
+	uint64_t entrySize;
+};
+typedef struct TcdElfSectionInfo TcdElfSectionInfo;
+
+int tcdElfOpen(const char*, TcdElf*);
+const uint8_t *tcdElfSection(TcdElf*, const char*, uint64_t*);
+int tcdElfSectionIndex(TcdElf*, const char*);
+uint16_t tcdElfSectionCount(TcdElf*);
+int tcdElfSectionInfo(TcdElf*, uint16_t, TcdElfSectionInfo*);
+const uint8_t *tcdElfSectionAt(TcdElf*, uint16_t, uint64_t*);
+int tcdElfFindDebugFile(TcdElf*, const char*, char*, size_t);
+uint64_t tcdElfEntry(TcdElf*);
+void tcdElfClose(TcdElf*);
+
+int tcdLoadFrames(TcdElf*, TcdFrameInfo*);
+int tcdFrameRule(const TcdFrameInfo*, uint64_t, uint32_t*, int64_t*);
+void tcdFreeFrames(TcdFrameInfo*);
+
+/* ----- Registers ----- */
+
+/* x86-64 registers, in DWARF numbering */
+enum TcdRegister {
+	TCD_RAX, TCD_RDX, TCD_RCX, TCD_RBX,
+	TCD_RSI, TCD_RDI, TCD_RBP, TCD_RSP,
+	TCD_R8,  TCD_R9,  TCD_R10, TCD_R11,
+	TCD_R12, TCD_R13, TCD_R14, TCD_R15,
+	TCD_RIP,
+	TCD_NUM_REGS
+};
+typedef enum TcdRegister TcdRegister;
+
+/* Size of struct user_regs_struct, in words */
+#define TCD_NUM_RAW_REGS 27
+
+/* ----- Mappings ----- */
+
+enum TcdProtection {
+	TCDP_READ   = 1,
+	TCDP_WRITE  = 2,
+	TCDP_EXEC   = 4,
+	TCDP_SHARED = 8
+};
+
+struct TcdMapping {
+	uint64_t begin, end;
+	uint64_t offset;
+	uint64_t device, inode;
+	uint32_t prot;
+	char *name;
+};
+typedef struct TcdMapping TcdMapping;
+
+/* ----- Core ----- */
+
+struct TcdCoreSegment {
+	uint64_t begin, end;
+	uint64_t fileSize;
+	uint32_t prot;
+	const uint8_t *data;
+};
+typedef struct TcdCoreSegment TcdCoreSegment;
+
+/* An ELF core file, mapped into memory but never read up front */
+struct TcdCore {
+	void *map;
+	uint64_t mapSize;
+	TcdCoreSegment *segments;
+	uint32_t numSegments;
+	int pid;
+	int signal;
+	uint64_t entry;
+};
+typedef struct TcdCore TcdCore;
+
+/* ----- Snapshot ----- */
+
+struct TcdSnapshotRegion {
+	uint64_t begin, end;
+	uint64_t *hashes;
+};
+typedef struct TcdSnapshotRegion TcdSnapshotRegion;
+
+/* Old memory contents are kept by a frozen copy-on-write fork of the inferior,
+ * so only the pages that change afterwards take up any extra memory. */
+struct TcdSnapshot {
+	int pid;
+	TcdSnapshotRegion *regions;
+	uint32_t numRegions;
+};
+typedef struct TcdSnapshot TcdSnapshot;
+
+struct TcdMemRange {
+	uint64_t begin, end;
+};
+typedef struct TcdMemRange TcdMemRange;
 
 /* ----- Context ----- */
 
+#define TCD_MAX_SYSCALLS 512
+
 struct TcdBreakpoint {
 	uint64_t address;
 	TcdFunction *func;
@@ -143,46 +424,309 @@ struct TcdBreakpoint {
 };
 typedef struct TcdBreakpoint TcdBreakpoint;
 
+/* A frozen copy-on-write fork of the inferior. */
+struct TcdCheckpoint {
+	int pid;
+	uint64_t address;
+	TcdBreakpoint *breaks;
+	uint32_t numBreaks;
+	uint64_t linkerBreak;
+};
+typedef struct TcdCheckpoint TcdCheckpoint;
+
+/* A shared library mapped into the process; its info is loaded on first use */
+struct TcdLibrary {
+	char *path;
+	/* Tells the file apart from one that replaced it at the same path */
+	uint64_t device, inode;
+	uint64_t begin, end;
+	uint64_t bias;
+	TcdInfo *info;
+	int loadFailed;
+};
+typedef struct TcdLibrary TcdLibrary;
+
+/* A breakpoint on a function of a library that isn't loaded yet */
+struct TcdPendingBreak {
+	char *library;
+	char *function;
+};
+typedef struct TcdPendingBreak TcdPendingBreak;
+
+/* A child or thread of a process with a seccomp filter, traced along with it */
+struct TcdFollower {
+	int pid;
+	/* PTRACE_EVENT_FORK, _VFORK or _CLONE, from the event that created it;
+	 * only forked children have memory of their own */
+	int event;
+	/* Seen stopped, and rid of the breakpoints if it has its own memory */
+	int started;
+};
+typedef struct TcdFollower TcdFollower;
+
+/* What the debugger asked of the kernel, for finding out where time goes */
+struct TcdStats {
+	uint64_t peeks;
+	uint64_t pokes;
+	uint64_t steps;
+	uint64_t continues;
+	uint64_t regReads;
+	uint64_t regWrites;
+	uint64_t vmReads;
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t waits;
+	uint64_t waitNanos;
+};
+typedef struct TcdStats TcdStats;
+
 struct TcdContext {
 	int pid;
 	int status;
-	TcdInfo info;
+	TcdInfo *info;
+	/* Added to link time addresses to get those of the process, for PIE */
+	uint64_t loadBias;
 	TcdBreakpoint *breaks;
 	uint32_t numBreaks;
+	TcdCheckpoint *checkpoints;
+	uint32_t numCheckpoints;
+	uint64_t catchSyscalls[TCD_MAX_SYSCALLS / 64];
+	uint64_t regs[TCD_NUM_REGS];
+	uint64_t rawRegs[TCD_NUM_RAW_REGS];
+	int regsValid;
+	/* Resumed by tcdContinue() or tcdStepInstruction() and not stopped since;
+	 * its registers can't be read then */
+	int running;
+	TcdCore *core;
+	TcdSnapshot *snapshot;
+	/* Composite values assembled from DW_OP_piece; reset at every stop */
+	uint8_t *hostBuffer;
+	uint32_t hostBufferSize;
+	uint32_t hostBufferUsed;
+	TcdStats stats;
+	/* Libraries as of the last look at the process's mappings */
+	TcdLibrary *libs;
+	uint32_t numLibs;
+	int libsStale;
+	TcdPendingBreak *pending;
+	uint32_t numPending;
+	/* The dynamic linker's _dl_debug_state(), which it calls around every
+	 * change to the list of loaded libraries. While there are breakpoints in
+	 * libraries, pending or not, a hidden breakpoint is kept there and
+	 * linkerBreak is set to it. */
+	uint64_t linkerHook;
+	uint64_t linkerBreak;
+	uint8_t linkerSaved;
+	/* Signals that arrived while a syscall was injected, by bit sig - 1;
+	 * handed on one per resume */
+	uint64_t deferredSignals;
+	/* How the process was last resumed, to go on after the hidden breakpoint */
+	int resumeRequest;
+	/* PTRACE_O_* options in effect, as PTRACE_SETOPTIONS replaces all of them */
+	long ptraceOptions;
+	/* Set once a seccomp filter is installed. It can't be taken out again, and
+	 * without a tracer the syscalls it catches fail with ENOSYS, so from then on
+	 * children and threads are traced as well, and the process can't be detached. */
+	int seccompFilter;
+	TcdFollower *followers;
+	uint32_t numFollowers;
 };
 typedef struct TcdContext TcdContext;
 
 void tcdFreeContext(TcdContext*);
+void tcdUseInfo(TcdContext*, TcdInfo*);
+TcdFunction *tcdFunctionAt(TcdContext*, uint64_t);
+
+int tcdLoadCore(const char*, TcdContext*);
+uint32_t tcdReadCoreMemory(TcdCore*, uint64_t, uint32_t, void*);
+void tcdFreeCore(TcdCore*);
+int tcdWriteCore(TcdContext*, const char*);
 
 /* ----- Control ----- */
 
+/*
+ * Contexts share no state apart from the infos of libraries, which are
+ * cached behind a lock, so any number of them can be used at once from
+ * different threads; a single context must not be used by two threads at a
+ * time. The process of a context has to be controlled from the thread that
+ * spawned or attached it, as ptrace only takes requests from the tracer thread.
+ */
+
+/* Flags for tcdSpawn() */
+#define TCD_SPAWN_NULL_STDIN 1
+
+int tcdSpawn(TcdContext*, const char*, char *const*, int);
+int tcdAttach(TcdContext*, int);
+int tcdDetach(TcdContext*);
+
 void tcdSync(TcdContext*);
+int tcdPoll(TcdContext*);
+int tcdInterrupt(TcdContext*);
 
-void tcdReadMemory (TcdContext*, uint64_t, uint32_t, void*);
+uint32_t tcdReadMemory(TcdContext*, uint64_t, uint32_t, void*);
 void tcdWriteMemory(TcdContext*, uint64_t, uint32_t, void*);
+uint32_t tcdReadProgramMemory(TcdContext*, uint64_t, uint32_t, void*);
+
+struct TcdReadRequest {
+	uint64_t address;
+	uint32_t size;
+	void *data;
+};
+typedef struct TcdReadRequest TcdReadRequest;
 
+void tcdReadMemoryBatch(TcdContext*, TcdReadRequest*, uint32_t);
+
+int tcdReadMappings(TcdContext*, TcdMapping**, uint32_t*);
+void tcdFreeMappings(TcdMapping*, uint32_t);
+
+const uint8_t *tcdMemSearch(const uint8_t*, uint64_t, const uint8_t*, uint32_t);
+uint64_t tcdMemMismatch(const uint8_t*, const uint8_t*, uint64_t);
+uint64_t tcdMemMatch(const uint8_t*, const uint8_t*, uint64_t);
+uint32_t tcdFindMemory(TcdContext*, const void*, uint32_t, uint64_t*, uint32_t);
+
+int tcdTakeSnapshot(TcdContext*);
+uint32_t tcdDiffSnapshot(TcdContext*, TcdMemRange*, uint32_t);
+void tcdFreeSnapshot(TcdSnapshot*);
+
+void tcdUnpackRegisters(TcdContext*, const void*);
+int tcdReadRegisters(TcdContext*);
+int tcdWriteRawRegisters(TcdContext*, const void*);
 uint64_t tcdReadIP(TcdContext*);
 uint64_t tcdReadBP(TcdContext*);
+void tcdWriteIP(TcdContext*, uint64_t);
 
 void tcdReadRtLoc(TcdContext*, TcdRtLoc, uint32_t, void*);
 
-void tcdStepInstruction(TcdContext*);
+void tcdStepInstruction(TcdContext*, int);
+void tcdContinue(TcdContext*, int);
 uint64_t tcdStep(TcdContext*);
 uint64_t tcdNext(TcdContext*);
 
 uint16_t tcdGetStackTrace(TcdContext*, uint64_t*, int);
+uint64_t tcdFindCallSite(TcdContext*);
 
 void tcdInsertBreakpoint(TcdContext*, uint64_t, uint32_t);
+int tcdRemoveBreakpoint(TcdContext*, uint64_t);
+
+int tcdInjectSyscall(TcdContext*, uint64_t, const uint64_t*, int64_t*);
+
+int tcdForkProcess(TcdContext*, int*);
+int tcdCheckpoint(TcdContext*);
+int tcdRestart(TcdContext*, uint32_t);
+
+/* ----- Libraries ----- */
+
+enum {
+	TCD_BREAK_INSERTED,
+	TCD_BREAK_PENDING,
+	TCD_BREAK_NOT_FOUND
+};
+
+void tcdTrackLibraries(TcdContext*, uint64_t);
+void tcdRefreshLibraries(TcdContext*);
+int tcdStepOverLinkerBreak(TcdContext*);
+TcdFunction *tcdSymbolize(TcdContext*, uint64_t, uint64_t*);
+int tcdBreakAtFunction(TcdContext*, const char*, uint64_t*, uint32_t*);
+void tcdFreeLibraries(TcdContext*);
+
+/* ----- Syscalls ----- */
+
+struct TcdSyscall {
+	uint32_t number;
+	uint64_t args[6];
+	int64_t result;
+};
+typedef struct TcdSyscall TcdSyscall;
+
+const char *tcdSyscallName(uint32_t);
+int tcdSyscallNumber(const char*);
+
+int tcdCatchSyscalls(TcdContext*, const uint32_t*, uint32_t);
+int tcdSyscallStop(TcdContext*, TcdSyscall*);
+int tcdFinishSyscall(TcdContext*, TcdSyscall*);
 
 /* ----- Address Functions ----- */
 
+uint64_t tcdDecodeUleb128(const uint8_t**, const uint8_t*);
+int64_t tcdDecodeSleb128(const uint8_t**, const uint8_t*);
+
+int tcdCompileLocation(const uint8_t*, uint64_t, const TcdLocListInfo*, TcdLocDesc*);
+int tcdCompileLocationList(const TcdLocListInfo*, uint64_t, TcdLocDesc*);
+int tcdReadRangeList(const TcdLocListInfo*, uint64_t, TcdRange**, uint32_t*);
+void tcdFreeLocation(TcdLocDesc*);
 int tcdInterpretLocation(TcdContext*, TcdLocDesc, TcdRtLoc*);
 
+TcdType *tcdResolveType(TcdType*);
+TcdMember *tcdFindMember(TcdType*, const char*, uint32_t*);
 int tcdDeref(TcdContext*, TcdType*, TcdRtLoc, TcdType**, TcdRtLoc*);
 int tcdDerefIndex(TcdContext*, TcdType*, TcdRtLoc, uint64_t, TcdType**, TcdRtLoc*);
 
-void cexprFreeType(TcdType*);
-int cexprParse(TcdContext*, const char*, TcdType**, TcdRtLoc*);
+/* ----- Formatting ----- */
+
+struct TcdFormat {
+	/* '\0' for the natural format of each type, or 'x', 'd' or 'f' */
+	char format;
+	/* Maximum number of array elements or string characters; 0 for no limit */
+	uint64_t maxElems;
+};
+typedef struct TcdFormat TcdFormat;
+
+void tcdFormatValue(TcdContext*, TcdType*, TcdRtLoc, const TcdFormat*, FILE*);
+void tcdFormatBuffer(TcdContext*, TcdType*, const void*, uint64_t, const TcdFormat*, FILE*);
+void tcdDumpMemory(TcdContext*, uint64_t address, uint64_t length, FILE*);
+
+/* ----- JSON ----- */
+
+struct TcdJson {
+	FILE *out;
+	uint32_t depth;
+	/* Bit n is set once nesting level n has an element */
+	uint64_t hasElems;
+	int afterKey;
+	/* Escapes what is written to it into the current string value */
+	FILE *string;
+};
+typedef struct TcdJson TcdJson;
+
+void tcdJsonInit(TcdJson*, FILE*);
+void tcdJsonFree(TcdJson*);
+void tcdJsonObjectBegin(TcdJson*);
+void tcdJsonObjectEnd(TcdJson*);
+void tcdJsonArrayBegin(TcdJson*);
+void tcdJsonArrayEnd(TcdJson*);
+void tcdJsonKey(TcdJson*, const char*);
+void tcdJsonString(TcdJson*, const char*);
+void tcdJsonInt(TcdJson*, int64_t);
+void tcdJsonUint(TcdJson*, uint64_t);
+void tcdJsonHex(TcdJson*, uint64_t);
+void tcdJsonDouble(TcdJson*, double);
+void tcdJsonBool(TcdJson*, int);
+void tcdJsonNull(TcdJson*);
+void tcdJsonBytes(TcdJson*, const void*, uint64_t);
+void tcdJsonBytesBegin(TcdJson*);
+void tcdJsonBytesPart(TcdJson*, const void*, uint64_t);
+void tcdJsonBytesEnd(TcdJson*);
+FILE *tcdJsonStringBegin(TcdJson*);
+void tcdJsonStringEnd(TcdJson*);
+void tcdJsonLineEnd(TcdJson*);
+
+/* ----- GDB Server ----- */
+
+int tcdServe(TcdContext*, const char*);
+
+/* ----- Stats ----- */
+
+uint64_t tcdNow(void);
+void tcdPrintStats(TcdContext*, FILE*);
+void tcdJsonStats(TcdContext*, TcdJson*);
+
+/* ----- C Expressions ----- */
+
+typedef struct CexprNode CexprNode;
+
+CexprNode *cexprCompile(TcdContext*, const char*);
+int cexprEvaluate(TcdContext*, CexprNode*, TcdType**, TcdRtLoc*);
+void cexprFree(CexprNode*);
 
 #ifdef __cplusplus
 }
@@ -1,188 +1,597 @@
 #include "tcd.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <libdwarf/dwarf.h>
 
-static uint64_t decodeUnsignedLeb128(uint8_t **data) {
+#define LOC_STACK_SIZE 64
+
+uint64_t tcdDecodeUleb128(const uint8_t **data, const uint8_t *end) {
 	uint64_t result = 0;
 	uint8_t shift = 0;
 	uint8_t byte;
 	do {
+		if (*data >= end) return result;
 		byte = **data;
 		(*data)++;
-		result |= (byte | 0x7F) << shift;
+		if (shift < 64)
+			result |= (uint64_t)(byte & 0x7F) << shift;
 		shift += 7;
 	} while (byte & 0x80);
 	return result;
 }
 
-static int64_t decodeSignedLeb128(uint8_t **data) {
+int64_t tcdDecodeSleb128(const uint8_t **data, const uint8_t *end) {
 	int64_t result = 0;
 	uint8_t shift = 0;
 	uint8_t byte;
 	do {
+		if (*data >= end) return result;
 		byte = **data;
 		(*data)++;
-		result |= (byte & 0x7F) << shift;
+		if (shift < 64)
+			result |= (uint64_t)(byte & 0x7F) << shift;
 		shift += 7;
 	} while (byte & 0x80);
 	/* Sign extend negative numbers. */
-	if (byte & 0x40)
+	if (shift < 64 && (byte & 0x40))
 		result |= (-1ULL) << shift;
 	return result;
 }
 
-#if 0
-/** Logical right shift **/
-static int64_t shrLog(int64_t x, int64_t n) {
-    return (uint64_t)x >> n;
+/* Reads a fixed size little endian operand */
+static bool decodeFixed(const uint8_t **instr, const uint8_t *end, uint32_t size, bool sign, int64_t *value) {
+	if (end - *instr < size) return false;
+	uint64_t raw = 0;
+	for (uint32_t i = 0; i < size; i++) {
+		raw |= (uint64_t)(*instr)[i] << (i * 8);
+	}
+	if (sign && size < 8 && (raw >> (size * 8 - 1)) & 1)
+		raw |= (-1ULL) << (size * 8);
+	*instr += size;
+	*value = raw;
+	return true;
 }
 
-/** Arithmetical right shift **/
-static int64_t shrAr(int64_t x, int64_t n) {
-    if (x < 0 && n > 0)
-        return x >> n | ~(~0U >> n);
-    else
-        return x >> n;
+static uint64_t readAddress(const uint8_t **data, const uint8_t *end) {
+	int64_t address = 0;
+	decodeFixed(data, end, 8, false, &address);
+	return address;
 }
-#endif
 
-struct StackElem {
-	int64_t data;
-	struct StackElem *next;
-};
+/* Fetches entry <index> of the compilation unit's .debug_addr table */
+static bool indexedAddress(const TcdLocListInfo *info, uint64_t index, uint64_t *address) {
+	if (info == NULL || info->addrs == NULL || index >= info->addrsSize / 8) return false;
+	const uint8_t *entry = info->addrs + index * 8;
+	*address = readAddress(&entry, info->addrs + info->addrsSize);
+	return true;
+}
 
-static void stackPush(struct StackElem **stack, int64_t value) {
-	struct StackElem *elem = malloc(sizeof(**stack));
-	elem->data = value;
-	elem->next = *stack;
-	*stack = elem;
+/*
+ * Compiling a location expression decodes all operands once, checks that
+ * every operand and branch target is in bounds, and resolves branch targets
+ * to op indices. The two shapes nearly every unoptimized local or global
+ * has, DW_OP_fbreg <n> and DW_OP_addr <a>, are reduced to constants that
+ * need no evaluation at all. DWARF 5 address indices are looked up in the
+ * .debug_addr table of <info> here already; it may be NULL outside of units.
+ */
+int tcdCompileLocation(const uint8_t *expr, uint64_t size, const TcdLocListInfo *info, TcdLocDesc *desc) {
+	const uint8_t *instr = expr;
+	const uint8_t *end = expr + size;
+	TcdLocOp *ops = malloc(size * sizeof(*ops));
+	uint32_t *offsets = malloc((size + 1) * sizeof(*offsets));
+	uint32_t numOps = 0;
+	while (instr < end) {
+		TcdLocOp lop = {0};
+		offsets[numOps] = instr - expr;
+		lop.op = *instr++;
+		bool ok = true;
+		switch (lop.op) {
+			case DW_OP_addr:
+				ok = decodeFixed(&instr, end, 8, false, &lop.operand);
+				break;
+			case DW_OP_addrx:
+			case DW_OP_constx: {
+				uint64_t address = 0;
+				ok = indexedAddress(info, tcdDecodeUleb128(&instr, end), &address);
+				lop.operand = address;
+				lop.op = lop.op == DW_OP_addrx ? DW_OP_addr : DW_OP_const8u;
+			} break;
+			case DW_OP_const1u: ok = decodeFixed(&instr, end, 1, false, &lop.operand); break;
+			case DW_OP_const1s: ok = decodeFixed(&instr, end, 1, true,  &lop.operand); break;
+			case DW_OP_const2u: ok = decodeFixed(&instr, end, 2, false, &lop.operand); break;
+			case DW_OP_const2s: ok = decodeFixed(&instr, end, 2, true,  &lop.operand); break;
+			case DW_OP_const4u: ok = decodeFixed(&instr, end, 4, false, &lop.operand); break;
+			case DW_OP_const4s: ok = decodeFixed(&instr, end, 4, true,  &lop.operand); break;
+			case DW_OP_const8u: ok = decodeFixed(&instr, end, 8, false, &lop.operand); break;
+			case DW_OP_const8s: ok = decodeFixed(&instr, end, 8, true,  &lop.operand); break;
+			case DW_OP_pick:
+			case DW_OP_deref_size:
+				ok = decodeFixed(&instr, end, 1, false, &lop.operand);
+				break;
+			case DW_OP_constu:
+			case DW_OP_plus_uconst:
+				lop.operand = tcdDecodeUleb128(&instr, end);
+				break;
+			case DW_OP_consts:
+			case DW_OP_fbreg:
+				lop.operand = tcdDecodeSleb128(&instr, end);
+				break;
+			case DW_OP_piece:
+				lop.operand = tcdDecodeUleb128(&instr, end);
+				break;
+			case DW_OP_regx:
+				lop.reg = tcdDecodeUleb128(&instr, end);
+				break;
+			case DW_OP_bregx:
+				lop.reg = tcdDecodeUleb128(&instr, end);
+				lop.operand = tcdDecodeSleb128(&instr, end);
+				break;
+			case DW_OP_implicit_value: {
+				/* Only values that fit into a stack slot */
+				uint64_t len = tcdDecodeUleb128(&instr, end);
+				ok = len <= 8 && decodeFixed(&instr, end, len, false, &lop.operand);
+			} break;
+			case DW_OP_skip:
+			case DW_OP_bra: {
+				int64_t skip;
+				ok = decodeFixed(&instr, end, 2, true, &skip);
+				/* Byte offset for now, resolved below */
+				lop.operand = (instr - expr) + skip;
+			} break;
+			case DW_OP_lit0:  case DW_OP_lit1:  case DW_OP_lit2:  case DW_OP_lit3:
+			case DW_OP_lit4:  case DW_OP_lit5:  case DW_OP_lit6:  case DW_OP_lit7:
+			case DW_OP_lit8:  case DW_OP_lit9:  case DW_OP_lit10: case DW_OP_lit11:
+			case DW_OP_lit12: case DW_OP_lit13: case DW_OP_lit14: case DW_OP_lit15:
+			case DW_OP_lit16: case DW_OP_lit17: case DW_OP_lit18: case DW_OP_lit19:
+			case DW_OP_lit20: case DW_OP_lit21: case DW_OP_lit22: case DW_OP_lit23:
+			case DW_OP_lit24: case DW_OP_lit25: case DW_OP_lit26: case DW_OP_lit27:
+			case DW_OP_lit28: case DW_OP_lit29: case DW_OP_lit30: case DW_OP_lit31:
+				lop.operand = lop.op - DW_OP_lit0;
+				lop.op = DW_OP_const8s;
+				break;
+			case DW_OP_nop:
+			case DW_OP_deref:
+			case DW_OP_push_object_address:
+			case DW_OP_dup:   case DW_OP_drop: case DW_OP_over:  case DW_OP_swap:
+			case DW_OP_rot:   case DW_OP_abs:  case DW_OP_and:   case DW_OP_or:
+			case DW_OP_xor:   case DW_OP_plus: case DW_OP_minus: case DW_OP_mul:
+			case DW_OP_div:   case DW_OP_mod:  case DW_OP_neg:   case DW_OP_not:
+			case DW_OP_shl:   case DW_OP_shr:  case DW_OP_shra:
+			case DW_OP_le:    case DW_OP_ge:   case DW_OP_eq:    case DW_OP_ne:
+			case DW_OP_lt:    case DW_OP_gt:
+			case DW_OP_stack_value:
+			case DW_OP_call_frame_cfa:
+				break;
+			default:
+				/* DW_OP_reg0..31 and DW_OP_breg0..31 */
+				if (lop.op >= DW_OP_reg0 && lop.op <= DW_OP_reg31) {
+					lop.reg = lop.op - DW_OP_reg0;
+					lop.op = DW_OP_regx;
+				} else if (lop.op >= DW_OP_breg0 && lop.op <= DW_OP_breg31) {
+					lop.reg = lop.op - DW_OP_breg0;
+					lop.op = DW_OP_bregx;
+					lop.operand = tcdDecodeSleb128(&instr, end);
+				} else {
+					ok = false;
+				}
+				break;
+		}
+		if (!ok) goto INVALID;
+		ops[numOps++] = lop;
+	}
+	offsets[numOps] = size;
+	/* Turn branch targets into op indices */
+	for (uint32_t i = 0; i < numOps; i++) {
+		if (ops[i].op != DW_OP_skip && ops[i].op != DW_OP_bra) continue;
+		uint32_t target = 0;
+		while (target <= numOps && offsets[target] != ops[i].operand) target++;
+		if (target > numOps) goto INVALID;
+		ops[i].operand = target;
+	}
+	free(offsets);
+	/* Reduce common shapes to constant form */
+	if (numOps == 1 && ops[0].op == DW_OP_fbreg) {
+		desc->kind = TCDL_FBREG;
+		desc->offset = ops[0].operand;
+		free(ops);
+		return 0;
+	}
+	if (numOps == 1 && ops[0].op == DW_OP_addr) {
+		desc->kind = TCDL_ADDR;
+		desc->offset = ops[0].operand;
+		free(ops);
+		return 0;
+	}
+	if (numOps == 1 && ops[0].op == DW_OP_regx) {
+		desc->kind = TCDL_REGISTER;
+		desc->offset = ops[0].reg;
+		free(ops);
+		return 0;
+	}
+	desc->kind = TCDL_PROGRAM;
+	desc->ops = realloc(ops, numOps * sizeof(*ops));
+	desc->numOps = numOps;
+	return 0;
+INVALID:
+	free(ops);
+	free(offsets);
+	desc->kind = TCDL_NONE;
+	return -1;
 }
 
-static int64_t stackPop(struct StackElem **stack) {
-	struct StackElem *old = *stack;
-	int64_t ret = old->data;
-	*stack = (*stack)->next;
-	free(old);
-	return ret;
+static int compareRanges(const void *a, const void *b) {
+	const TcdLocRange *ra = a, *rb = b;
+	return ra->begin < rb->begin ? -1 : ra->begin > rb->begin;
 }
 
+/*
+ * Decodes the location list at <offset> into a table of PC ranges, each with
+ * its own compiled expression, sorted for a binary search. Handles both the
+ * pre-DWARF 5 .debug_loc format and DWARF 5 .debug_loclists.
+ */
+int tcdCompileLocationList(const TcdLocListInfo *info, uint64_t offset, TcdLocDesc *desc) {
+	desc->kind = TCDL_NONE;
+	if (info->section == NULL || offset >= info->sectionSize) return -1;
+	const uint8_t *data = info->section + offset;
+	const uint8_t *end = info->section + info->sectionSize;
+	uint64_t base = info->base;
+	TcdLocRange *ranges = NULL;
+	uint32_t numRanges = 0;
+	for (;;) {
+		uint64_t begin = 0, stop = 0, length = 0;
+		if (info->version < 5) {
+			if (end - data < 16) break;
+			begin = readAddress(&data, end);
+			stop = readAddress(&data, end);
+			if (begin == 0 && stop == 0) break;
+			/* Base address selection entry */
+			if (begin == ~0ULL) {
+				base = stop;
+				continue;
+			}
+			begin += base;
+			stop += base;
+			int64_t len;
+			if (!decodeFixed(&data, end, 2, false, &len)) break;
+			length = len;
+		} else {
+			if (data >= end) break;
+			uint8_t kind = *data++;
+			bool ok = true;
+			switch (kind) {
+				case DW_LLE_end_of_list:
+					goto DONE;
+				case DW_LLE_base_addressx:
+					/* Without a base, the entries after it can't be placed */
+					if (!indexedAddress(info, tcdDecodeUleb128(&data, end), &base)) goto DONE;
+					continue;
+				case DW_LLE_base_address:
+					base = readAddress(&data, end);
+					continue;
+				case DW_LLE_startx_endx:
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &begin);
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &stop) && ok;
+					break;
+				case DW_LLE_startx_length:
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &begin);
+					stop = begin + tcdDecodeUleb128(&data, end);
+					break;
+				case DW_LLE_offset_pair:
+					begin = base + tcdDecodeUleb128(&data, end);
+					stop = base + tcdDecodeUleb128(&data, end);
+					break;
+				case DW_LLE_start_end:
+					begin = readAddress(&data, end);
+					stop = readAddress(&data, end);
+					break;
+				case DW_LLE_start_length:
+					begin = readAddress(&data, end);
+					stop = begin + tcdDecodeUleb128(&data, end);
+					break;
+				case DW_LLE_default_location:
+					/* Not used by our compilers; skip its expression */
+					ok = false;
+					break;
+				default:
+					goto DONE;
+			}
+			length = tcdDecodeUleb128(&data, end);
+			if (!ok) {
+				data += length;
+				continue;
+			}
+		}
+		if (end - data < length) break;
+		TcdLocRange range = {begin, stop, {0}};
+		/* Empty ranges and unsupported expressions read as optimized out anyway */
+		if (begin < stop && tcdCompileLocation(data, length, info, &range.desc) == 0) {
+			ranges = realloc(ranges, ++numRanges * sizeof(*ranges));
+			ranges[numRanges - 1] = range;
+		}
+		data += length;
+	}
+DONE:
+	if (numRanges == 0) return -1;
+	qsort(ranges, numRanges, sizeof(*ranges), compareRanges);
+	desc->kind = TCDL_LIST;
+	desc->ranges = ranges;
+	desc->numRanges = numRanges;
+	return 0;
+}
+
+/*
+ * Decodes the range list at <offset>, from .debug_ranges before DWARF 5 and
+ * from .debug_rnglists since. The ranges stay in the order of the list,
+ * which compilers mostly, but not necessarily, start with the entry point.
+ */
+int tcdReadRangeList(const TcdLocListInfo *info, uint64_t offset, TcdRange **oRanges, uint32_t *oNumRanges) {
+	*oRanges = NULL;
+	*oNumRanges = 0;
+	if (info->section == NULL || offset >= info->sectionSize) return -1;
+	const uint8_t *data = info->section + offset;
+	const uint8_t *end = info->section + info->sectionSize;
+	uint64_t base = info->base;
+	TcdRange *ranges = NULL;
+	uint32_t numRanges = 0;
+	for (;;) {
+		uint64_t begin = 0, stop = 0;
+		if (info->version < 5) {
+			if (end - data < 16) break;
+			begin = readAddress(&data, end);
+			stop = readAddress(&data, end);
+			if (begin == 0 && stop == 0) break;
+			/* Base address selection entry */
+			if (begin == ~0ULL) {
+				base = stop;
+				continue;
+			}
+			begin += base;
+			stop += base;
+		} else {
+			if (data >= end) break;
+			uint8_t kind = *data++;
+			bool ok = true;
+			switch (kind) {
+				case DW_RLE_end_of_list:
+					goto DONE;
+				case DW_RLE_base_addressx:
+					if (!indexedAddress(info, tcdDecodeUleb128(&data, end), &base)) goto DONE;
+					continue;
+				case DW_RLE_base_address:
+					base = readAddress(&data, end);
+					continue;
+				case DW_RLE_startx_endx:
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &begin);
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &stop) && ok;
+					break;
+				case DW_RLE_startx_length:
+					ok = indexedAddress(info, tcdDecodeUleb128(&data, end), &begin);
+					stop = begin + tcdDecodeUleb128(&data, end);
+					break;
+				case DW_RLE_offset_pair:
+					begin = base + tcdDecodeUleb128(&data, end);
+					stop = base + tcdDecodeUleb128(&data, end);
+					break;
+				case DW_RLE_start_end:
+					begin = readAddress(&data, end);
+					stop = readAddress(&data, end);
+					break;
+				case DW_RLE_start_length:
+					begin = readAddress(&data, end);
+					stop = begin + tcdDecodeUleb128(&data, end);
+					break;
+				default:
+					goto DONE;
+			}
+			if (!ok) continue;
+		}
+		/* Code removed by the linker leaves empty ranges behind */
+		if (begin < stop) {
+			ranges = realloc(ranges, ++numRanges * sizeof(*ranges));
+			ranges[numRanges - 1] = (TcdRange){begin, stop};
+		}
+	}
+DONE:
+	if (numRanges == 0) return -1;
+	*oRanges = ranges;
+	*oNumRanges = numRanges;
+	return 0;
+}
+
+void tcdFreeLocation(TcdLocDesc *desc) {
+	if (desc->kind == TCDL_PROGRAM)
+		free(desc->ops);
+	if (desc->kind == TCDL_LIST) {
+		for (uint32_t i = 0; i < desc->numRanges; i++) {
+			tcdFreeLocation(&desc->ranges[i].desc);
+		}
+		free(desc->ranges);
+	}
+}
+
+static uint64_t readRegister(TcdContext *debug, uint32_t reg) {
+	if (reg >= TCD_NUM_REGS) return 0;
+	tcdReadRegisters(debug);
+	return debug->regs[reg];
+}
+
+/*
+ * The canonical frame address, by the rule of the call frame information.
+ * Code without any is only understood in functions that set up rbp the usual
+ * way, past their push %rbp; mov %rsp,%rbp; anywhere else it is an error,
+ * so that locals read as optimized out rather than from a wrong address.
+ */
+static int frameAddress(TcdContext *debug, uint64_t *cfa) {
+	static const uint8_t PROLOGUE[] = {0x55, 0x48, 0x89, 0xE5};
+	uint64_t ip = tcdReadIP(debug);
+	uint32_t reg;
+	int64_t offset;
+	if (tcdFrameRule(&debug->info->frames, ip - debug->loadBias, &reg, &offset) == 0) {
+		if (reg >= TCD_NUM_REGS) return -1;
+		*cfa = readRegister(debug, reg) + offset;
+		return 0;
+	}
+	TcdFunction *func = tcdFunctionAt(debug, ip);
+	if (func == NULL || ip - debug->loadBias < func->begin + sizeof(PROLOGUE)) return -1;
+	uint8_t code[sizeof(PROLOGUE)];
+	tcdReadProgramMemory(debug, func->begin + debug->loadBias, sizeof(code), code);
+	if (memcmp(code, PROLOGUE, sizeof(code)) != 0) return -1;
+	*cfa = tcdReadBP(debug) + 16;
+	return 0;
+}
+
+/* Evaluates DW_AT_frame_base of the current function; rbp if there is none */
+static int frameBase(TcdContext *debug, uint64_t *base) {
+	TcdFunction *func = tcdFunctionAt(debug, tcdReadIP(debug));
+	if (func == NULL || func->frameBase.kind == TCDL_FBREG) {
+		*base = tcdReadBP(debug);
+		return 0;
+	}
+	TcdRtLoc rtloc;
+	if (tcdInterpretLocation(debug, func->frameBase, &rtloc) != 0) return -1;
+	/* A register as frame base means its contents */
+	*base = rtloc.region == TCDR_REGISTER ? readRegister(debug, rtloc.address) : rtloc.address;
+	return 0;
+}
+
+/* Appends a piece of a composite location to the context's host buffer */
+static void appendPiece(TcdContext *debug, TcdRtLoc piece, uint32_t size) {
+	if (debug->hostBufferUsed + size > debug->hostBufferSize) {
+		debug->hostBufferSize = (debug->hostBufferUsed + size) * 2;
+		debug->hostBuffer = realloc(debug->hostBuffer, debug->hostBufferSize);
+	}
+	tcdReadRtLoc(debug, piece, size, debug->hostBuffer + debug->hostBufferUsed);
+	debug->hostBufferUsed += size;
+}
+
+#define POP(v)  do { if (sp == 0) return -1; (v) = stack[--sp]; } while (0)
+#define PUSH(v) do { if (sp == LOC_STACK_SIZE) return -1; int64_t v_ = (v); stack[sp++] = v_; } while (0)
+#define NEED(n) do { if (sp < (n)) return -1; } while (0)
+
 #define ADDR_BINOP(n, o) \
 case n: \
-	first  = stackPop(&stack); \
-	second = stackPop(&stack); \
-	stackPush(&stack, second o first); \
+	NEED(2); \
+	stack[sp - 2] = stack[sp - 2] o stack[sp - 1]; \
+	sp--; \
 	break;
 #define ADDR_COND(n, o) \
 case n: \
-	first  = stackPop(&stack); \
-	second = stackPop(&stack); \
-	stackPush(&stack, (second o first) ? 1 : 0); \
+	NEED(2); \
+	stack[sp - 2] = (stack[sp - 2] o stack[sp - 1]) ? 1 : 0; \
+	sp--; \
 	break;
 
-int tcdInterpretLocation(TcdContext *debug, TcdLocDesc desc, TcdRtLoc *rtloc) {
-	int res = 0;
-	bool done = false;
-	uint8_t *instr = desc.expr;
-	struct StackElem *stack = NULL;
-	while (!done) {
-		uint8_t op = *instr++;
-		int64_t first, second;
-		switch (op) {
+static int runProgram(TcdContext *debug, TcdLocDesc *desc, TcdRtLoc *rtloc) {
+	int64_t stack[LOC_STACK_SIZE];
+	uint32_t sp = 0;
+	bool isValue = false;
+	/* Set by DW_OP_reg*, consumed by the next DW_OP_piece */
+	int64_t pendingReg = -1;
+	/* Offset of the first piece in the host buffer, if any */
+	int64_t composite = -1;
+	/* Bounds the number of executed ops, as branches may loop */
+	uint32_t budget = 1 << 16;
+	for (uint32_t pc = 0; pc < desc->numOps; pc++) {
+		if (budget-- == 0) return -1;
+		TcdLocOp *lop = &desc->ops[pc];
+		int64_t first;
+		switch (lop->op) {
 			case DW_OP_nop: break;
-			
-			case DW_OP_lit0:  case DW_OP_lit1:  case DW_OP_lit2:  case DW_OP_lit3:
-			case DW_OP_lit4:  case DW_OP_lit5:  case DW_OP_lit6:  case DW_OP_lit7:
-			case DW_OP_lit8:  case DW_OP_lit9:  case DW_OP_lit10: case DW_OP_lit11:
-			case DW_OP_lit12: case DW_OP_lit13: case DW_OP_lit14: case DW_OP_lit15:
-			case DW_OP_lit16: case DW_OP_lit17: case DW_OP_lit18: case DW_OP_lit19:
-			case DW_OP_lit20: case DW_OP_lit21: case DW_OP_lit22: case DW_OP_lit23:
-			case DW_OP_lit24: case DW_OP_lit25: case DW_OP_lit26: case DW_OP_lit27:
-			case DW_OP_lit28: case DW_OP_lit29: case DW_OP_lit30: case DW_OP_lit31:
-				stackPush(&stack, op - DW_OP_lit0);
-				break;
-#if 0
-			case DW_OP_reg0:  case DW_OP_reg1:  case DW_OP_reg2:  case DW_OP_reg3:
-			case DW_OP_reg4:  case DW_OP_reg5:  case DW_OP_reg6:  case DW_OP_reg7:
-			case DW_OP_reg8:  case DW_OP_reg9:  case DW_OP_reg10: case DW_OP_reg11:
-			case DW_OP_reg12: case DW_OP_reg13: case DW_OP_reg14: case DW_OP_reg15:
-			case DW_OP_reg16: case DW_OP_reg17: case DW_OP_reg18: case DW_OP_reg19:
-			case DW_OP_reg20: case DW_OP_reg21: case DW_OP_reg22: case DW_OP_reg23:
-			case DW_OP_reg24: case DW_OP_reg25: case DW_OP_reg26: case DW_OP_reg27:
-			case DW_OP_reg28: case DW_OP_reg29: case DW_OP_reg30: case DW_OP_reg31:
-				rtloc->address = op - DW_OP_reg0;
-				if (rtloc->address >= input.numRegs) {
-					res = -1;
-				}
-				rtloc->region = TCDR_REGISTER;
-				done = true;
-				break;
-			case DW_OP_breg0:  case DW_OP_breg1:  case DW_OP_breg2:  case DW_OP_breg3:
-			case DW_OP_breg4:  case DW_OP_breg5:  case DW_OP_breg6:  case DW_OP_breg7:
-			case DW_OP_breg8:  case DW_OP_breg9:  case DW_OP_breg10: case DW_OP_breg11:
-			case DW_OP_breg12: case DW_OP_breg13: case DW_OP_breg14: case DW_OP_breg15:
-			case DW_OP_breg16: case DW_OP_breg17: case DW_OP_breg18: case DW_OP_breg19:
-			case DW_OP_breg20: case DW_OP_breg21: case DW_OP_breg22: case DW_OP_breg23:
-			case DW_OP_breg24: case DW_OP_breg25: case DW_OP_breg26: case DW_OP_breg27:
-			case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31: {
-				uint32_t reg = op - DW_OP_breg0;
-				if (reg >= input.numRegs) {
-					res = -1;
-					done = true;
-					break;
-				}
-				int64_t address = input.regs[op - DW_OP_breg0];
-				address += decodeSignedLeb128(&instr);
-				stackPush(&stack, address);
-			} break;
-#endif
-			case DW_OP_fbreg: {
-				int64_t address = tcdReadBP(debug);
-				address += decodeSignedLeb128(&instr);
-				stackPush(&stack, address);
-			} break;
-			case DW_OP_const1u: case DW_OP_const1s:
-				stackPush(&stack, *instr);
-				instr++;
+			case DW_OP_addr:
+				PUSH(lop->operand + debug->loadBias);
 				break;
+			case DW_OP_const1u: case DW_OP_const1s:
 			case DW_OP_const2u: case DW_OP_const2s:
-				stackPush(&stack, *(int16_t*)instr);
-				instr += 2;
-				break;
 			case DW_OP_const4u: case DW_OP_const4s:
-				stackPush(&stack, *(int32_t*)instr);
-				instr += 4;
-				break;
 			case DW_OP_const8u: case DW_OP_const8s:
-				stackPush(&stack, *(int64_t*)instr);
-				instr += 8;
+			case DW_OP_constu:  case DW_OP_consts:
+				PUSH(lop->operand);
 				break;
-			case DW_OP_constu:
-				stackPush(&stack, decodeUnsignedLeb128(&instr));
+			case DW_OP_fbreg: {
+				uint64_t base;
+				if (frameBase(debug, &base) != 0) return -1;
+				PUSH((int64_t)base + lop->operand);
+			} break;
+			case DW_OP_bregx:
+				PUSH((int64_t)readRegister(debug, lop->reg) + lop->operand);
 				break;
-			case DW_OP_consts:
-				stackPush(&stack, decodeSignedLeb128(&instr));
+			case DW_OP_call_frame_cfa: {
+				uint64_t cfa;
+				if (frameAddress(debug, &cfa) != 0) return -1;
+				PUSH(cfa);
+			} break;
+			case DW_OP_regx:
+				pendingReg = lop->reg;
+				break;
+			case DW_OP_implicit_value:
+				PUSH(lop->operand);
+				isValue = true;
 				break;
+			case DW_OP_piece: {
+				if (lop->operand > 1 << 16) return -1;
+				if (composite < 0) composite = debug->hostBufferUsed;
+				TcdRtLoc piece;
+				if (pendingReg >= 0) {
+					piece = (TcdRtLoc){pendingReg, TCDR_REGISTER};
+				} else if (sp > 0) {
+					piece = (TcdRtLoc){stack[--sp], isValue ? TCDR_HOST_TEMP : TCDR_ADDRESS};
+				} else {
+					/* An empty piece is optimized out */
+					piece = (TcdRtLoc){0, TCDR_HOST_TEMP};
+				}
+				appendPiece(debug, piece, lop->operand);
+				pendingReg = -1;
+				isValue = false;
+			} break;
 			case DW_OP_push_object_address:
-				stackPush(&stack, desc.baseAddress);
+				PUSH(desc->baseAddress);
 				break;
+			case DW_OP_deref: {
+				NEED(1);
+				uint64_t value = 0;
+				tcdReadMemory(debug, stack[sp - 1], 8, &value);
+				stack[sp - 1] = value;
+			} break;
+			case DW_OP_deref_size: {
+				NEED(1);
+				uint64_t value = 0;
+				if (lop->operand > 8) return -1;
+				tcdReadMemory(debug, stack[sp - 1], lop->operand, &value);
+				stack[sp - 1] = value;
+			} break;
 			case DW_OP_dup:
-				stackPush(&stack, stack->data);
+				NEED(1);
+				PUSH(stack[sp - 1]);
 				break;
 			case DW_OP_drop:
-				stackPop(&stack);
+				POP(first);
 				break;
 			case DW_OP_over:
-				stackPush(&stack, stack->next->data);
+				NEED(2);
+				PUSH(stack[sp - 2]);
+				break;
+			case DW_OP_pick:
+				NEED(lop->operand + 1);
+				PUSH(stack[sp - 1 - lop->operand]);
 				break;
 			case DW_OP_swap:
-				first = stack->data;
-				stack->data = stack->next->data;
-				stack->next->data = first;
+				NEED(2);
+				first = stack[sp - 1];
+				stack[sp - 1] = stack[sp - 2];
+				stack[sp - 2] = first;
+				break;
+			case DW_OP_rot:
+				NEED(3);
+				first = stack[sp - 1];
+				stack[sp - 1] = stack[sp - 2];
+				stack[sp - 2] = stack[sp - 3];
+				stack[sp - 3] = first;
 				break;
 			case DW_OP_abs:
-				stack->data = stack->data >= 0 ? stack->data : -stack->data;
+				NEED(1);
+				stack[sp - 1] = stack[sp - 1] >= 0 ? stack[sp - 1] : -stack[sp - 1];
 				break;
 			ADDR_BINOP(DW_OP_and,   &);
 			ADDR_BINOP(DW_OP_or,    |);
@@ -190,54 +599,171 @@ int tcdInterpretLocation(TcdContext *debug, TcdLocDesc desc, TcdRtLoc *rtloc) {
 			ADDR_BINOP(DW_OP_plus,  +);
 			ADDR_BINOP(DW_OP_minus, -);
 			ADDR_BINOP(DW_OP_mul,   *);
-			ADDR_BINOP(DW_OP_div,   /);
-			ADDR_BINOP(DW_OP_mod,   %);
 			ADDR_COND (DW_OP_le,   <=);
 			ADDR_COND (DW_OP_ge,   >=);
 			ADDR_COND (DW_OP_eq,   ==);
 			ADDR_COND (DW_OP_ne,   !=);
 			ADDR_COND (DW_OP_lt,    <);
 			ADDR_COND (DW_OP_gt,    >);
+			case DW_OP_div:
+			case DW_OP_mod:
+				NEED(2);
+				if (stack[sp - 1] == 0) return -1;
+				if (lop->op == DW_OP_div) {
+					/* Negate in unsigned, so that INT64_MIN / -1 wraps instead of trapping */
+					if (stack[sp - 1] == -1) {
+						stack[sp - 2] = -(uint64_t)stack[sp - 2];
+					} else {
+						stack[sp - 2] = stack[sp - 2] / stack[sp - 1];
+					}
+				} else {
+					stack[sp - 2] = (uint64_t)stack[sp - 2] % (uint64_t)stack[sp - 1];
+				}
+				sp--;
+				break;
+			case DW_OP_shl:
+				NEED(2);
+				stack[sp - 2] = (uint64_t)stack[sp - 2] << (stack[sp - 1] & 63);
+				sp--;
+				break;
+			case DW_OP_shr:
+				NEED(2);
+				stack[sp - 2] = (uint64_t)stack[sp - 2] >> (stack[sp - 1] & 63);
+				sp--;
+				break;
+			case DW_OP_shra:
+				NEED(2);
+				stack[sp - 2] = stack[sp - 2] >> (stack[sp - 1] & 63);
+				sp--;
+				break;
 			case DW_OP_neg:
-				stack->data = -stack->data;
+				NEED(1);
+				stack[sp - 1] = -stack[sp - 1];
 				break;
 			case DW_OP_not:
-				stack->data = ~stack->data;
+				NEED(1);
+				stack[sp - 1] = ~stack[sp - 1];
 				break;
-			case DW_OP_plus_uconst: {
-				uint64_t cv = decodeUnsignedLeb128(&instr);
-				stack->data += cv;
-			} break;
-			case DW_OP_skip: {
-				int16_t skip = *(int16_t*)instr;
-				instr = instr + 2 + skip;
-			} break;
-			case DW_OP_bra: {
-				int64_t flag = stackPop(&stack);
-				if (flag) {
-					instr += *(int16_t*)instr;
-				}
-				instr += 2;
-			} break;
-			default:
-				res = -1;
-				done = true;
+			case DW_OP_plus_uconst:
+				NEED(1);
+				stack[sp - 1] += lop->operand;
+				break;
+			case DW_OP_skip:
+				pc = lop->operand - 1;
+				break;
+			case DW_OP_bra:
+				POP(first);
+				if (first) pc = lop->operand - 1;
+				break;
+			case DW_OP_stack_value:
+				isValue = true;
 				break;
+			default:
+				return -1;
+		}
+	}
+	if (composite >= 0) {
+		rtloc->address = composite;
+		rtloc->region = TCDR_HOST_BUFFER;
+		return 0;
+	}
+	if (pendingReg >= 0) {
+		rtloc->address = pendingReg;
+		rtloc->region = TCDR_REGISTER;
+		return 0;
+	}
+	if (sp == 0) return -1;
+	rtloc->address = stack[sp - 1];
+	rtloc->region = isValue ? TCDR_HOST_TEMP : TCDR_ADDRESS;
+	return 0;
+}
+
+static int interpretList(TcdContext *debug, TcdLocDesc *desc, TcdRtLoc *rtloc) {
+	/* Ranges are in link time addresses */
+	uint64_t ip = tcdReadIP(debug) - debug->loadBias;
+	/* Find the last range beginning at or before ip */
+	uint32_t lo = 0, hi = desc->numRanges;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (desc->ranges[mid].begin <= ip) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || ip >= desc->ranges[lo - 1].end) return -1;
+	return tcdInterpretLocation(debug, desc->ranges[lo - 1].desc, rtloc);
+}
+
+int tcdInterpretLocation(TcdContext *debug, TcdLocDesc desc, TcdRtLoc *rtloc) {
+	switch (desc.kind) {
+		case TCDL_FBREG: {
+			uint64_t base;
+			if (frameBase(debug, &base) != 0) return -1;
+			rtloc->address = base + desc.offset;
+			rtloc->region = TCDR_ADDRESS;
+			return 0;
 		}
-		if (*instr == 0) {
-			rtloc->address = stack->data;
+		case TCDL_ADDR:
+			rtloc->address = desc.offset + debug->loadBias;
 			rtloc->region = TCDR_ADDRESS;
-			done = true;
+			return 0;
+		case TCDL_REGISTER:
+			rtloc->address = desc.offset;
+			rtloc->region = TCDR_REGISTER;
+			return 0;
+		case TCDL_PROGRAM:
+			return runProgram(debug, &desc, rtloc);
+		case TCDL_LIST:
+			return interpretList(debug, &desc, rtloc);
+		default:
+			return -1;
+	}
+}
+
+/* Strips typedefs and qualifiers */
+TcdType *tcdResolveType(TcdType *type) {
+	for (uint32_t depth = 0; type != NULL && depth < 64; depth++) {
+		switch (type->tclass) {
+			case TCDT_TYPEDEF:
+			case TCDT_CONST:
+			case TCDT_VOLATILE:
+			case TCDT_RESTRICT:
+				type = type->as.alias.to;
+				break;
+			default:
+				return type;
 		}
 	}
-	while (stack != NULL) {
-		stackPop(&stack);
+	return type;
+}
+
+/* Finds a member of a struct or union, looking into anonymous members; <offset> receives its total offset */
+TcdMember *tcdFindMember(TcdType *type, const char *name, uint32_t *offset) {
+	type = tcdResolveType(type);
+	if (type == NULL || (type->tclass != TCDT_STRUCT && type->tclass != TCDT_UNION)) return NULL;
+	for (uint32_t i = 0; i < type->as.struc.numMembers; i++) {
+		TcdMember *member = &type->as.struc.members[i];
+		if (member->name != NULL) {
+			if (strcmp(member->name, name) == 0) {
+				*offset = member->offset;
+				return member;
+			}
+		} else {
+			uint32_t inner;
+			TcdMember *found = tcdFindMember(member->type, name, &inner);
+			if (found != NULL) {
+				*offset = member->offset + inner;
+				return found;
+			}
+		}
 	}
-	return res;
+	return NULL;
 }
 
 int tcdDeref(TcdContext *debug, TcdType *in_type, TcdRtLoc in_rtloc, TcdType **out_type, TcdRtLoc *out_rtloc) {
-	if (in_type->tclass != TCDT_POINTER)
+	in_type = tcdResolveType(in_type);
+	if (in_type == NULL || in_type->tclass != TCDT_POINTER)
 		return -1;
 	*out_type = in_type->as.pointer.to;
 	out_rtloc->region = TCDR_ADDRESS;
@@ -247,14 +773,18 @@ int tcdDeref(TcdContext *debug, TcdType *in_type, TcdRtLoc in_rtloc, TcdType **o
 
 int tcdDerefIndex(TcdContext *debug, TcdType *in_type, TcdRtLoc in_rtloc, uint64_t index, TcdType **out_type, TcdRtLoc *out_rtloc) {
 	uint64_t beg;
+	in_type = tcdResolveType(in_type);
+	if (in_type == NULL) return -1;
 	if (in_type->tclass == TCDT_POINTER) {
 		tcdReadRtLoc(debug, in_rtloc, 8, &beg);
 		*out_type = in_type->as.pointer.to;
 	} else if (in_type->tclass == TCDT_ARRAY) {
+		if (in_rtloc.region != TCDR_ADDRESS) return -1;
 		beg = in_rtloc.address;
 		*out_type = in_type->as.array.of;
 		/* TODO check bounds */
 	} else return -1;
+	if (*out_type == NULL) return -1;
 	out_rtloc->region = TCDR_ADDRESS;
 	out_rtloc->address = beg + (*out_type)->size * index;
 	return 0;
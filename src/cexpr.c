@@ -4,35 +4,73 @@
 #include <string.h>
 #include <ctype.h>
 
-static TcdType *cloneType(TcdType *in) {
-	TcdType *out = malloc(sizeof(TcdType));
-	memcpy(out, in, sizeof(TcdType));
-	switch (in->tclass) {
-		case TCDT_BASE: out->as.base.name = strdup(in->as.base.name); break;
-		case TCDT_POINTER: out->as.pointer.to = cloneType(in->as.pointer.to); break;
-		case TCDT_ARRAY:   out->as.array.of   = cloneType(in->as.array.of  ); break;
-		default: break;
-	}
-	return out;
-}
+/*
+ * Expressions are parsed once into an AST by cexprCompile() and can then be
+ * evaluated any number of times by cexprEvaluate(). Symbols are resolved at
+ * evaluation time, as the same expression may be evaluated in different
+ * functions, but the resolution is cached per node. Locals shadow globals.
+ * Evaluation does not allocate: types that have to be synthesized (e.g. for
+ * &x) live in the node.
+ */
 
-void cexprFreeType(TcdType *type) {
-	switch (type->tclass) {
-		case TCDT_BASE:
-			free(type->as.base.name);
-			break;
-		case TCDT_POINTER:
-			cexprFreeType(type->as.pointer.to);
-			break;
-		case TCDT_ARRAY:
-			cexprFreeType(type->as.array.of);
-			break;
-		default: break;
-	}
-	free(type);
-}
+typedef enum {
+	NODE_NUMBER,
+	NODE_SYMBOL,
+	NODE_UNARY,
+	NODE_BINARY,
+	NODE_CAST,
+	NODE_INDEX,
+	NODE_SLICE,
+	NODE_MEMBER
+} NodeKind;
+
+/* Multi-character operators */
+enum {
+	OP_SHL = 256, OP_SHR,
+	OP_LE, OP_GE, OP_EQ, OP_NE,
+	OP_AND, OP_OR,
+	OP_ARROW
+};
+
+struct CexprNode {
+	NodeKind kind;
+	int op;
+	CexprNode *left, *right;
+	/* End of a[begin:end] slices */
+	CexprNode *upper;
+	char *name;
+	/* Literals */
+	TcdType *litType;
+	uint64_t litValue;
+	/* Casts; every level of a pointer cast is owned by the node */
+	TcdType *castType;
+	TcdType *owned;
+	uint32_t numOwned;
+	/* Type synthesized at evaluation */
+	TcdType synth;
+	/* Symbol resolution cache */
+	int resolved;
+	TcdFunction *func;
+	TcdLocal *local;
+};
+
+/* Result types of arithmetic */
+static TcdType intType    = {TCDT_BASE, 4, .as.base = {"int",           TCDI_SIGNED}};
+static TcdType longType   = {TCDT_BASE, 8, .as.base = {"long",          TCDI_SIGNED}};
+static TcdType ulongType  = {TCDT_BASE, 8, .as.base = {"unsigned long", TCDI_UNSIGNED}};
+static TcdType doubleType = {TCDT_BASE, 8, .as.base = {"double",        TCDI_FLOAT}};
+static TcdType charType   = {TCDT_BASE, 1, .as.base = {"char",          TCDI_CHAR}};
 
-static int parseExpr(TcdContext*, const char**, TcdType**, TcdRtLoc*);
+/* ----- Parser ----- */
+
+struct Parser {
+	TcdContext *debug;
+	const char *str;
+};
+typedef struct Parser Parser;
+
+static CexprNode *parseExpr(Parser*);
+static CexprNode *parseUnary(Parser*);
 
 static int isSymbolBeg(char c) {
 	return isalpha(c) || c == '_';
@@ -46,155 +84,784 @@ static int isDigit(char c) {
 	return isdigit(c);
 }
 
-static void skipSpace(const char **str) {
-	while (**str == ' ' || **str == '\n') (*str)++;
-}
-
-static int parseSuffix(TcdContext *debug, const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	skipSpace(str);
-	switch (**str) {
-		case '[':
-			(*str)++;
-			TcdType *atype = *type;
-			TcdRtLoc artloc = *rtloc;
-			TcdType *itype;
-			TcdRtLoc irtloc;
-			if (parseExpr(debug, str, &itype, &irtloc) != 0) return -1;
-			skipSpace(str);
-			if (**str != ']') return -1;
-			(*str)++;
-			if (itype->tclass != TCDT_BASE) return -1;
-			if (itype->as.base.interp != TCDI_SIGNED &&
-				itype->as.base.interp != TCDI_UNSIGNED) return -1;
-			int64_t index = 0; /* Sign bit */
-			tcdReadRtLoc(debug, irtloc, itype->size, &index);
-			if (tcdDerefIndex(debug, atype, artloc, index, type, rtloc) != 0) return -1;
-			free(atype);
-			return 0;
-		default: return 1;
+static void skipSpace(Parser *p) {
+	while (*p->str == ' ' || *p->str == '\t' || *p->str == '\n') p->str++;
+}
+
+static int accept(Parser *p, const char *token) {
+	skipSpace(p);
+	size_t len = strlen(token);
+	if (strncmp(p->str, token, len) != 0) return 0;
+	p->str += len;
+	return 1;
+}
+
+static int parseSymbol(Parser *p, char *symbol, size_t max) {
+	skipSpace(p);
+	if (!isSymbolBeg(*p->str)) return -1;
+	size_t i = 0;
+	while (isSymbol(*p->str)) {
+		if (i + 1 < max) symbol[i++] = *p->str;
+		p->str++;
+	}
+	symbol[i] = '\0';
+	return 0;
+}
+
+static CexprNode *newNode(NodeKind kind) {
+	CexprNode *node = calloc(1, sizeof(*node));
+	node->kind = kind;
+	return node;
+}
+
+static CexprNode *parseNumber(Parser *p) {
+	CexprNode *node = newNode(NODE_NUMBER);
+	char *end;
+	if (p->str[0] == '\'') {
+		/* Character literal */
+		char c = p->str[1];
+		int len = 3;
+		if (c == '\\') {
+			if (p->str[2] == '\0') goto ERROR;
+			switch (p->str[2]) {
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case '0': c = '\0'; break;
+				default:  c = p->str[2]; break;
+			}
+			len = 4;
+		}
+		if (c == '\0' && p->str[1] != '\\') goto ERROR;
+		if (p->str[len - 1] != '\'') goto ERROR;
+		p->str += len;
+		node->litType = &charType;
+		node->litValue = (uint8_t)c;
+		return node;
+	}
+	uint64_t num = strtoull(p->str, &end, 0);
+	if (*end == '.' || *end == 'e' || *end == 'E') {
+		double ret = strtod(p->str, &end);
+		node->litType = &doubleType;
+		memcpy(&node->litValue, &ret, 8);
+	} else {
+		node->litType = num > 0x7FFFFFFF ? &longType : &intType;
+		node->litValue = num;
+	}
+	if (end == p->str) goto ERROR;
+	p->str = end;
+	/* Integer suffixes */
+	while (*p->str == 'u' || *p->str == 'U' || *p->str == 'l' || *p->str == 'L') {
+		if (*p->str == 'u' || *p->str == 'U') node->litType = &ulongType;
+		p->str++;
+	}
+	return node;
+ERROR:
+	free(node);
+	return NULL;
+}
+
+static CexprNode *parsePrimary(Parser *p) {
+	skipSpace(p);
+	if (accept(p, "(")) {
+		CexprNode *node = parseExpr(p);
+		if (node == NULL) return NULL;
+		if (!accept(p, ")")) {
+			cexprFree(node);
+			return NULL;
+		}
+		return node;
+	} else if (isSymbolBeg(*p->str)) {
+		char symbol[128];
+		parseSymbol(p, symbol, sizeof(symbol));
+		CexprNode *node = newNode(NODE_SYMBOL);
+		node->name = strdup(symbol);
+		return node;
+	} else if (isDigit(*p->str) || *p->str == '.' || *p->str == '\'') {
+		return parseNumber(p);
+	}
+	return NULL;
+}
+
+static CexprNode *parsePostfix(Parser *p) {
+	CexprNode *node = parsePrimary(p);
+	while (node != NULL) {
+		if (accept(p, "[")) {
+			CexprNode *index = newNode(NODE_INDEX);
+			index->left = node;
+			index->right = parseExpr(p);
+			node = index;
+			if (node->right == NULL) break;
+			if (accept(p, ":")) {
+				node->kind = NODE_SLICE;
+				node->upper = parseExpr(p);
+				if (node->upper == NULL) break;
+			}
+			if (!accept(p, "]")) break;
+		} else if (accept(p, "->") || accept(p, ".")) {
+			CexprNode *member = newNode(NODE_MEMBER);
+			member->op = p->str[-1] == '>' ? OP_ARROW : '.';
+			member->left = node;
+			node = member;
+			char symbol[128];
+			if (parseSymbol(p, symbol, sizeof(symbol)) != 0) break;
+			member->name = strdup(symbol);
+		} else {
+			return node;
+		}
 	}
+	cexprFree(node);
+	return NULL;
 }
 
-static int parseSymbol(const char **str, char *symbol) {
-	if (!isSymbolBeg(**str)) return -1;
-	while (isSymbol(**str)) {
-		*symbol = **str;
-		(*str)++;
-		symbol++;
+/* Looks for a named type in the debug information; TCDT_BASE also finds typedefs */
+static TcdType *findNamedType(TcdInfo *info, TcdTypeClass tclass, const char *name) {
+	for (uint32_t u = 0; u < info->numCompUnits; u++) {
+		TcdCompUnit *cu = &info->compUnits[u];
+		for (uint32_t i = 0; i < cu->numTypes; i++) {
+			TcdType *type = &cu->types[i];
+			const char *tname = NULL;
+			switch (type->tclass) {
+				case TCDT_BASE:    if (tclass == TCDT_BASE) tname = type->as.base.name; break;
+				case TCDT_TYPEDEF: if (tclass == TCDT_BASE) tname = type->as.alias.name; break;
+				case TCDT_STRUCT:
+				case TCDT_UNION:   if (tclass == type->tclass) tname = type->as.struc.name; break;
+				case TCDT_ENUM:    if (tclass == TCDT_ENUM) tname = type->as.enumer.name; break;
+				default: break;
+			}
+			if (tname != NULL && strcmp(tname, name) == 0) return type;
+		}
+	}
+	return NULL;
+}
+
+static int isTypeKeyword(const char *word) {
+	static const char *const keywords[] = {
+		"signed", "unsigned", "char", "short", "int", "long", "float", "double", "_Bool", "void"
+	};
+	for (size_t i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
+		if (strcmp(word, keywords[i]) == 0) return 1;
 	}
-	*symbol = '\0';
 	return 0;
 }
 
-static int parseNumber(const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	int64_t num = 0;
-	if (!isDigit(**str)) return -1;
-	while (isDigit(**str)) {
-		num = num * 10 + *(*str)++ - '0';
-	}
-	if (**str == '.') {
-		(*str)++;
-		int32_t shift = 1;
-		while (isDigit(**str)) {
-			num = num * 10 + *(*str)++ - '0';
-			shift *= 10;
-		}
-		double ret = (double)num / (double)shift;
-		*type = malloc(sizeof(TcdType));
-		(*type)->tclass = TCDT_BASE;
-		(*type)->size = 8;
-		(*type)->as.base.name = strdup("double");
-		(*type)->as.base.interp = TCDI_FLOAT;
-		rtloc->region = TCDR_HOST_TEMP;
-		rtloc->address = *(uint64_t*)&ret;
+/* Tries to parse "(type)" at the current position; returns 0 without consuming input if there is none */
+static int parseCastType(Parser *p, CexprNode *node) {
+	const char *start = p->str;
+	if (!accept(p, "(")) return 0;
+	char spelled[128] = {0};
+	char word[64];
+	int isUnsigned = 0, isFloat = 0, isVoid = 0, longs = 0;
+	uint32_t size = 0;
+	TcdType *named = NULL;
+	for (;;) {
+		const char *before = p->str;
+		if (parseSymbol(p, word, sizeof(word)) != 0) break;
+		if (spelled[0] == '\0' && (strcmp(word, "struct") == 0 || strcmp(word, "union") == 0 || strcmp(word, "enum") == 0)) {
+			TcdTypeClass tclass = word[0] == 's' ? TCDT_STRUCT : word[0] == 'u' ? TCDT_UNION : TCDT_ENUM;
+			if (parseSymbol(p, word, sizeof(word)) != 0) return -1;
+			named = findNamedType(p->debug->info, tclass, word);
+			if (named == NULL) return -1;
+			strcpy(spelled, word);
+			break;
+		}
+		if (!isTypeKeyword(word)) {
+			/* Only a single non-keyword name, e.g. a typedef */
+			if (spelled[0] == '\0') named = findNamedType(p->debug->info, TCDT_BASE, word);
+			if (named == NULL) {
+				p->str = before;
+				break;
+			}
+		}
+		if (strcmp(word, "unsigned") == 0) isUnsigned = 1;
+		else if (strcmp(word, "char") == 0) size = 1;
+		else if (strcmp(word, "short") == 0) size = 2;
+		else if (strcmp(word, "int") == 0 && size == 0) size = 4;
+		else if (strcmp(word, "long") == 0) longs++;
+		else if (strcmp(word, "float") == 0) { isFloat = 1; size = 4; }
+		else if (strcmp(word, "double") == 0) { isFloat = 1; size = 8; }
+		else if (strcmp(word, "_Bool") == 0) size = 1;
+		else if (strcmp(word, "void") == 0) isVoid = 1;
+		if (spelled[0] != '\0') strncat(spelled, " ", sizeof(spelled) - strlen(spelled) - 1);
+		strncat(spelled, word, sizeof(spelled) - strlen(spelled) - 1);
+		if (named != NULL) break;
+	}
+	if (spelled[0] == '\0') {
+		p->str = start;
+		return 0;
+	}
+	uint32_t pointers = 0;
+	while (accept(p, "*")) pointers++;
+	if (!accept(p, ")") || (isVoid && pointers == 0)) return -1;
+
+	node->numOwned = 1 + pointers;
+	node->owned = calloc(node->numOwned, sizeof(*node->owned));
+	/* Named types are referenced, only keyword types are built in owned[0] */
+	TcdType *base = &node->owned[0];
+	if (named != NULL) {
+		base = named;
 	} else {
-		*type = malloc(sizeof(TcdType));
-		(*type)->tclass = TCDT_BASE;
-		(*type)->size = 8;
-		(*type)->as.base.name = strdup("long long");
-		(*type)->as.base.interp = TCDI_SIGNED;
-		rtloc->region = TCDR_HOST_TEMP;
-		rtloc->address = *(uint64_t*)&num;
+		if (longs > 0) size = 8;
+		if (size == 0) size = 4;
+		base->tclass = TCDT_BASE;
+		base->size = isVoid ? 1 : size;
+		base->as.base.name = strdup(spelled);
+		if (isFloat) {
+			base->as.base.interp = TCDI_FLOAT;
+		} else if (strcmp(spelled, "_Bool") == 0) {
+			base->as.base.interp = TCDI_BOOL;
+		} else if (size == 1 && strstr(spelled, "char") != NULL) {
+			base->as.base.interp = isUnsigned ? TCDI_UCHAR : TCDI_CHAR;
+		} else {
+			base->as.base.interp = isUnsigned ? TCDI_UNSIGNED : TCDI_SIGNED;
+		}
+	}
+	for (uint32_t i = 1; i <= pointers; i++) {
+		node->owned[i].tclass = TCDT_POINTER;
+		node->owned[i].size = 8;
+		node->owned[i].as.pointer.to = isVoid && i == 1 ? NULL : i == 1 ? base : &node->owned[i - 1];
+	}
+	node->castType = pointers > 0 ? &node->owned[pointers] : base;
+	return 1;
+}
+
+static CexprNode *parseUnary(Parser *p) {
+	skipSpace(p);
+	CexprNode *cast = newNode(NODE_CAST);
+	switch (parseCastType(p, cast)) {
+		case 1:
+			cast->left = parseUnary(p);
+			if (cast->left == NULL) break;
+			return cast;
+		case 0:
+			free(cast);
+			cast = NULL;
+			break;
+		default: break;
+	}
+	if (cast != NULL) {
+		cexprFree(cast);
+		return NULL;
+	}
+	switch (*p->str) {
+		case '-': case '+': case '!': case '~': case '*': case '&': {
+			CexprNode *node = newNode(NODE_UNARY);
+			node->op = *p->str++;
+			node->left = parseUnary(p);
+			if (node->left == NULL) {
+				free(node);
+				return NULL;
+			}
+			return node;
+		}
+		default:
+			return parsePostfix(p);
+	}
+}
+
+/* Returns the binary operator at the current position and its precedence, without consuming it */
+static int peekBinary(Parser *p, int *length) {
+	static const struct { const char *token; int op; int prec; } ops[] = {
+		{"||", OP_OR,  1}, {"&&", OP_AND, 2},
+		{"<<", OP_SHL, 8}, {">>", OP_SHR, 8},
+		{"<=", OP_LE,  7}, {">=", OP_GE,  7},
+		{"==", OP_EQ,  6}, {"!=", OP_NE,  6},
+		{"|",  '|',    3}, {"^",  '^',    4}, {"&",  '&',    5},
+		{"<",  '<',    7}, {">",  '>',    7},
+		{"+",  '+',    9}, {"-",  '-',    9},
+		{"*",  '*',   10}, {"/",  '/',   10}, {"%",  '%',   10},
+	};
+	skipSpace(p);
+	for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+		size_t len = strlen(ops[i].token);
+		if (strncmp(p->str, ops[i].token, len) == 0) {
+			*length = len;
+			return (ops[i].op << 8) | ops[i].prec;
+		}
 	}
 	return 0;
 }
 
-static int parsePrimitive(TcdContext *debug, const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	skipSpace(str);
-	if (**str == '(') {
-		(*str)++;
-		if (parseExpr(debug, str, type, rtloc) != 0) return -1;
-		if (**str != ')') return -1;
-		(*str)++;
-	} else if (isSymbolBeg(**str)) {
-		char symbol[128];
-		if (parseSymbol(str, symbol) != 0) return -1;
-		uint64_t rip = tcdReadIP(debug);
-		TcdFunction *func = tcdSurroundingFunction(&debug->info, rip);
-		if (func == NULL) return -1;
-		for (int i = 0; i < func->numLocals; i++) {
-			if (strcmp(func->locals[i].name, symbol) == 0) {
-				*type = cloneType(func->locals[i].type);
-				if (tcdInterpretLocation(debug,
-					func->locals[i].locdesc, rtloc) != 0) return -1;
-				goto PRIM_END;
+static CexprNode *parseBinary(Parser *p, int minPrec) {
+	CexprNode *left = parseUnary(p);
+	while (left != NULL) {
+		int length;
+		int peek = peekBinary(p, &length);
+		int prec = peek & 0xFF;
+		if (peek == 0 || prec < minPrec) break;
+		p->str += length;
+		CexprNode *node = newNode(NODE_BINARY);
+		node->op = peek >> 8;
+		node->left = left;
+		node->right = parseBinary(p, prec + 1);
+		left = node;
+		if (node->right == NULL) {
+			cexprFree(node);
+			return NULL;
+		}
+	}
+	return left;
+}
+
+static CexprNode *parseExpr(Parser *p) {
+	return parseBinary(p, 1);
+}
+
+/* Returns NULL if the expression is malformed */
+CexprNode *cexprCompile(TcdContext *debug, const char *str) {
+	Parser p = {debug, str};
+	CexprNode *node = parseExpr(&p);
+	if (node == NULL) return NULL;
+	skipSpace(&p);
+	if (*p.str != '\0') {
+		cexprFree(node);
+		return NULL;
+	}
+	return node;
+}
+
+void cexprFree(CexprNode *node) {
+	if (node == NULL) return;
+	cexprFree(node->left);
+	cexprFree(node->right);
+	cexprFree(node->upper);
+	free(node->name);
+	if (node->owned != NULL) {
+		/* owned[0] is zeroed if the cast refers to a named type */
+		free(node->owned[0].as.base.name);
+		free(node->owned);
+	}
+	free(node);
+}
+
+/* ----- Evaluation ----- */
+
+struct Scalar {
+	enum { SCALAR_INT, SCALAR_UINT, SCALAR_FLOAT } kind;
+	union {
+		int64_t i;
+		uint64_t u;
+		double f;
+	} as;
+};
+typedef struct Scalar Scalar;
+
+static int isPointerLike(TcdType *type) {
+	type = tcdResolveType(type);
+	return type != NULL && (type->tclass == TCDT_POINTER || type->tclass == TCDT_ARRAY);
+}
+
+static int isInteger(TcdType *type) {
+	type = tcdResolveType(type);
+	return type != NULL && ((type->tclass == TCDT_BASE && type->as.base.interp != TCDI_FLOAT) ||
+		type->tclass == TCDT_ENUM);
+}
+
+static int isScalar(TcdType *type) {
+	type = tcdResolveType(type);
+	return type != NULL && (type->tclass == TCDT_BASE || type->tclass == TCDT_POINTER || type->tclass == TCDT_ENUM);
+}
+
+static uint32_t elementSize(TcdType *type) {
+	type = tcdResolveType(type);
+	TcdType *elem = type->tclass == TCDT_POINTER ? type->as.pointer.to : type->as.array.of;
+	return elem != NULL && elem->size > 0 ? elem->size : 1;
+}
+
+static int readScalar(TcdContext *debug, TcdType *type, TcdRtLoc rtloc, Scalar *value) {
+	uint64_t raw = 0;
+	type = tcdResolveType(type);
+	if (type == NULL) return -1;
+	switch (type->tclass) {
+		case TCDT_ENUM:
+			if (type->size == 0 || type->size > 8) return -1;
+			tcdReadRtLoc(debug, rtloc, type->size, &raw);
+			if (type->as.enumer.interp == TCDI_SIGNED && type->size < 8 && (raw >> (type->size * 8 - 1)) & 1)
+				raw |= (-1ULL) << (type->size * 8);
+			value->kind = type->as.enumer.interp == TCDI_SIGNED ? SCALAR_INT : SCALAR_UINT;
+			value->as.u = raw;
+			return 0;
+		case TCDT_BASE:
+			if (type->size == 0 || type->size > 8) return -1;
+			tcdReadRtLoc(debug, rtloc, type->size, &raw);
+			switch (type->as.base.interp) {
+				case TCDI_FLOAT:
+					value->kind = SCALAR_FLOAT;
+					if (type->size == 4) {
+						float f;
+						memcpy(&f, &raw, 4);
+						value->as.f = f;
+					} else if (type->size == 8) {
+						memcpy(&value->as.f, &raw, 8);
+					} else return -1;
+					return 0;
+				case TCDI_SIGNED:
+				case TCDI_CHAR:
+					value->kind = SCALAR_INT;
+					/* Sign extend */
+					if (type->size < 8 && (raw >> (type->size * 8 - 1)) & 1)
+						raw |= (-1ULL) << (type->size * 8);
+					value->as.i = raw;
+					return 0;
+				default:
+					value->kind = SCALAR_UINT;
+					value->as.u = raw;
+					return 0;
 			}
+		case TCDT_POINTER:
+			tcdReadRtLoc(debug, rtloc, 8, &raw);
+			value->kind = SCALAR_UINT;
+			value->as.u = raw;
+			return 0;
+		case TCDT_ARRAY:
+			/* Arrays decay to the address of their first element */
+			if (rtloc.region != TCDR_ADDRESS) return -1;
+			value->kind = SCALAR_UINT;
+			value->as.u = rtloc.address;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+static double toDouble(Scalar s) {
+	switch (s.kind) {
+		case SCALAR_INT:  return s.as.i;
+		case SCALAR_UINT: return s.as.u;
+		default:          return s.as.f;
+	}
+}
+
+static int64_t toInt(Scalar s) {
+	return s.kind == SCALAR_FLOAT ? (int64_t)s.as.f : s.as.i;
+}
+
+/* Converts a scalar to <type> and stores it in a host temporary */
+static void storeScalar(TcdType *type, Scalar s, TcdRtLoc *rtloc) {
+	uint64_t raw = 0;
+	type = tcdResolveType(type);
+	if (type->tclass == TCDT_BASE && type->as.base.interp == TCDI_FLOAT) {
+		if (type->size == 4) {
+			float f = toDouble(s);
+			memcpy(&raw, &f, 4);
+		} else {
+			double f = toDouble(s);
+			memcpy(&raw, &f, 8);
 		}
-		return -1;
-	} else if (isDigit(**str)) {
-		if (parseNumber(str, type, rtloc) != 0) return -1;
+	} else if (type->tclass == TCDT_BASE && type->as.base.interp == TCDI_BOOL) {
+		raw = s.kind == SCALAR_FLOAT ? s.as.f != 0 : s.as.u != 0;
 	} else {
-		return -1;
+		raw = toInt(s);
 	}
-PRIM_END:
-	switch (parseSuffix(debug, str, type, rtloc)) {
-		case  0: goto PRIM_END;
-		case -1: return -1;
-		default: return  0;
+	rtloc->address = raw;
+	rtloc->region = TCDR_HOST_TEMP;
+}
+
+/* Finds a symbol among the locals of the current function, then the globals and statics of its
+ * compilation unit, then all globals; the lookup is cached in the node. A running process has
+ * no current function, and only globals at fixed addresses can be read from it. */
+static int resolveSymbol(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	if (debug->running) {
+		TcdLocal *global = tcdGlobalByName(debug->info, node->name);
+		if (global == NULL || global->type == NULL || global->locdesc.kind != TCDL_ADDR) return -1;
+		*type = global->type;
+		return tcdInterpretLocation(debug, global->locdesc, rtloc);
+	}
+	uint64_t ip = tcdReadIP(debug);
+	TcdFunction *func = tcdFunctionAt(debug, ip);
+	if (!node->resolved || node->func != func) {
+		node->resolved = 1;
+		node->func = func;
+		node->local = NULL;
+		for (uint32_t i = 0; func != NULL && i < func->numLocals; i++) {
+			if (strcmp(func->locals[i].name, node->name) == 0) {
+				node->local = &func->locals[i];
+				break;
+			}
+		}
+		TcdCompUnit *cu = func != NULL ? tcdSurroundingCompUnit(debug->info, ip - debug->loadBias) : NULL;
+		for (uint32_t i = 0; node->local == NULL && cu != NULL && i < cu->numGlobals; i++) {
+			if (strcmp(cu->globals[i].name, node->name) == 0)
+				node->local = &cu->globals[i];
+		}
+		if (node->local == NULL)
+			node->local = tcdGlobalByName(debug->info, node->name);
 	}
+	if (node->local == NULL || node->local->type == NULL) return -1;
+	*type = node->local->type;
+	return tcdInterpretLocation(debug, node->local->locdesc, rtloc);
 }
 
-static int parsePrefix(TcdContext *debug, const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	TcdType *ptype;
-	TcdRtLoc prtloc;
-	skipSpace(str);
-	switch (**str) {
+static int evalNode(TcdContext*, CexprNode*, TcdType**, TcdRtLoc*);
+
+static int evalUnary(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	TcdType *otype;
+	TcdRtLoc ortloc;
+	if (evalNode(debug, node->left, &otype, &ortloc) != 0) return -1;
+	Scalar s;
+	switch (node->op) {
+		case '&':
+			if (ortloc.region != TCDR_ADDRESS) return -1;
+			node->synth = (TcdType){TCDT_POINTER, 8, .as.pointer = {otype}};
+			*type = &node->synth;
+			rtloc->address = ortloc.address;
+			rtloc->region = TCDR_HOST_TEMP;
+			return 0;
 		case '*':
-			(*str)++;
-			if (parsePrefix(debug, str, &ptype, &prtloc) != 0) return -1;
-			if (ptype->tclass != TCDT_POINTER) return -1;
-			TcdType *old = ptype;
-			if (tcdDeref(debug, ptype, prtloc, type, rtloc) != 0) return -1;
-			free(old);
+			otype = tcdResolveType(otype);
+			if (otype == NULL) return -1;
+			if (otype->tclass == TCDT_ARRAY) {
+				return tcdDerefIndex(debug, otype, ortloc, 0, type, rtloc);
+			}
+			if (otype->tclass != TCDT_POINTER || otype->as.pointer.to == NULL) return -1;
+			return tcdDeref(debug, otype, ortloc, type, rtloc);
+		case '!':
+			if (readScalar(debug, otype, ortloc, &s) != 0) return -1;
+			s.as.i = s.kind == SCALAR_FLOAT ? s.as.f == 0 : s.as.u == 0;
+			s.kind = SCALAR_INT;
+			*type = &intType;
+			storeScalar(*type, s, rtloc);
 			return 0;
-		case '&':
-			(*str)++;
-			if (parsePrefix(debug, str, &ptype, &prtloc) != 0) return -1;
-			if (prtloc.region != TCDR_ADDRESS) return -1;
-			TcdType *new = malloc(sizeof(TcdType));
-			new->tclass = TCDT_POINTER;
-			new->size = 8;
-			new->as.pointer.to = ptype;
-			*type = new;
-			rtloc->region = TCDR_HOST_TEMP; /* TODO */
+		case '~':
+			if (!isInteger(otype) || readScalar(debug, otype, ortloc, &s) != 0) return -1;
+			s.as.u = ~s.as.u;
+			*type = s.kind == SCALAR_INT ? &longType : &ulongType;
+			storeScalar(*type, s, rtloc);
+			return 0;
+		case '-':
+		case '+':
+			if (isPointerLike(otype) || readScalar(debug, otype, ortloc, &s) != 0) return -1;
+			if (s.kind == SCALAR_FLOAT) {
+				if (node->op == '-') s.as.f = -s.as.f;
+				*type = &doubleType;
+			} else {
+				if (node->op == '-') s.as.i = -s.as.i;
+				*type = s.kind == SCALAR_INT ? &longType : &ulongType;
+			}
+			storeScalar(*type, s, rtloc);
 			return 0;
 		default:
-			return parsePrimitive(debug, str, type, rtloc);
+			return -1;
 	}
 }
 
-#if 0
-static int parseInfix(TcdContext *debug, const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	return -1;
+/* Pointer + integer, integer + pointer and pointer - integer */
+static int evalPointerArith(TcdContext *debug, CexprNode *node, TcdType *ptype, Scalar ptr, Scalar offset,
+	TcdType **type, TcdRtLoc *rtloc) {
+	int64_t delta = toInt(offset) * (int64_t)elementSize(ptype);
+	ptype = tcdResolveType(ptype);
+	rtloc->address = node->op == '+' ? ptr.as.u + delta : ptr.as.u - delta;
+	rtloc->region = TCDR_HOST_TEMP;
+	if (ptype->tclass == TCDT_ARRAY) {
+		node->synth = (TcdType){TCDT_POINTER, 8, .as.pointer = {ptype->as.array.of}};
+		*type = &node->synth;
+	} else {
+		*type = ptype;
+	}
+	return 0;
 }
-#endif
 
-static int parseExpr(TcdContext *debug, const char **str, TcdType **type, TcdRtLoc *rtloc) {
-	return parsePrefix(debug, str, type, rtloc);
+static int evalBinary(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	TcdType *ltype, *rtype;
+	TcdRtLoc lrtloc, rrtloc;
+	Scalar l, r, s;
+	if (evalNode(debug, node->left, &ltype, &lrtloc) != 0) return -1;
+	if (readScalar(debug, ltype, lrtloc, &l) != 0) return -1;
+	/* Short-circuit logical operators */
+	if (node->op == OP_AND || node->op == OP_OR) {
+		int truth = l.kind == SCALAR_FLOAT ? l.as.f != 0 : l.as.u != 0;
+		if (truth == (node->op == OP_AND)) {
+			if (evalNode(debug, node->right, &rtype, &rrtloc) != 0) return -1;
+			if (readScalar(debug, rtype, rrtloc, &r) != 0) return -1;
+			truth = r.kind == SCALAR_FLOAT ? r.as.f != 0 : r.as.u != 0;
+		}
+		s.kind = SCALAR_INT;
+		s.as.i = truth;
+		*type = &intType;
+		storeScalar(*type, s, rtloc);
+		return 0;
+	}
+	if (evalNode(debug, node->right, &rtype, &rrtloc) != 0) return -1;
+	if (readScalar(debug, rtype, rrtloc, &r) != 0) return -1;
+
+	/* Pointer arithmetic */
+	if (isPointerLike(ltype) || isPointerLike(rtype)) {
+		if ((node->op == '+' || node->op == '-') && isPointerLike(ltype) && isInteger(rtype))
+			return evalPointerArith(debug, node, ltype, l, r, type, rtloc);
+		if (node->op == '+' && isInteger(ltype) && isPointerLike(rtype))
+			return evalPointerArith(debug, node, rtype, r, l, type, rtloc);
+		if (node->op == '-' && isPointerLike(ltype) && isPointerLike(rtype)) {
+			s.kind = SCALAR_INT;
+			s.as.i = ((int64_t)l.as.u - (int64_t)r.as.u) / (int64_t)elementSize(ltype);
+			*type = &longType;
+			storeScalar(*type, s, rtloc);
+			return 0;
+		}
+		/* Otherwise only comparisons, on the raw addresses */
+		l.kind = r.kind = SCALAR_UINT;
+		switch (node->op) {
+			case '<': case '>': case OP_LE: case OP_GE: case OP_EQ: case OP_NE: break;
+			default: return -1;
+		}
+	}
+
+	/* Usual arithmetic conversions, simplified to 64 bits */
+	int isFloat = l.kind == SCALAR_FLOAT || r.kind == SCALAR_FLOAT;
+	int isUnsigned = !isFloat && (l.kind == SCALAR_UINT || r.kind == SCALAR_UINT);
+	double lf = toDouble(l), rf = toDouble(r);
+	int64_t li = toInt(l), ri = toInt(r);
+	uint64_t lu = li, ru = ri;
+	s.kind = isFloat ? SCALAR_FLOAT : isUnsigned ? SCALAR_UINT : SCALAR_INT;
+	*type = isFloat ? &doubleType : isUnsigned ? &ulongType : &longType;
+	int cmp = -2;
+	switch (node->op) {
+		case '+': if (isFloat) s.as.f = lf + rf; else s.as.u = lu + ru; break;
+		case '-': if (isFloat) s.as.f = lf - rf; else s.as.u = lu - ru; break;
+		case '*': if (isFloat) s.as.f = lf * rf; else s.as.u = lu * ru; break;
+		case '/':
+			if (isFloat) {
+				s.as.f = lf / rf;
+			} else {
+				if (ri == 0) return -1;
+				/* Negate in unsigned, so that INT64_MIN / -1 wraps instead of trapping */
+				if (isUnsigned) s.as.u = lu / ru; else if (ri == -1) s.as.u = -lu; else s.as.i = li / ri;
+			}
+			break;
+		case '%':
+			if (isFloat || ri == 0) return -1;
+			if (isUnsigned) s.as.u = lu % ru; else s.as.i = ri == -1 ? 0 : li % ri;
+			break;
+		case '&': case '|': case '^': case OP_SHL: case OP_SHR:
+			if (isFloat) return -1;
+			switch (node->op) {
+				case '&':    s.as.u = lu & ru; break;
+				case '|':    s.as.u = lu | ru; break;
+				case '^':    s.as.u = lu ^ ru; break;
+				case OP_SHL: s.as.u = lu << (ru & 63); break;
+				case OP_SHR: s.as.u = isUnsigned ? lu >> (ru & 63) : (uint64_t)(li >> (ru & 63)); break;
+			}
+			break;
+		case '<': case '>': case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+			if (isFloat) cmp = lf < rf ? -1 : lf > rf;
+			else if (isUnsigned) cmp = lu < ru ? -1 : lu > ru;
+			else cmp = li < ri ? -1 : li > ri;
+			break;
+		default:
+			return -1;
+	}
+	if (cmp != -2) {
+		switch (node->op) {
+			case '<':   s.as.i = cmp <  0; break;
+			case '>':   s.as.i = cmp >  0; break;
+			case OP_LE: s.as.i = cmp <= 0; break;
+			case OP_GE: s.as.i = cmp >= 0; break;
+			case OP_EQ: s.as.i = cmp == 0; break;
+			case OP_NE: s.as.i = cmp != 0; break;
+		}
+		s.kind = SCALAR_INT;
+		*type = &intType;
+	}
+	storeScalar(*type, s, rtloc);
+	return 0;
 }
 
-int cexprParse(TcdContext *debug, const char *str, TcdType **type, TcdRtLoc *rtloc) {
-	const char *mstr = str;
-	if (parseExpr(debug, &mstr, type, rtloc) != 0) return -1;
+/* s.m and p->m */
+static int evalMember(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	TcdType *stype;
+	TcdRtLoc srtloc;
+	if (evalNode(debug, node->left, &stype, &srtloc) != 0) return -1;
+	if (node->op == OP_ARROW && tcdDeref(debug, stype, srtloc, &stype, &srtloc) != 0) return -1;
+	uint32_t offset;
+	TcdMember *member = tcdFindMember(stype, node->name, &offset);
+	if (member == NULL || member->type == NULL) return -1;
+	*type = member->type;
+	if (srtloc.region == TCDR_ADDRESS || srtloc.region == TCDR_HOST_BUFFER) {
+		rtloc->address = srtloc.address + offset;
+		rtloc->region = srtloc.region;
+	} else if (offset == 0) {
+		*rtloc = srtloc;
+	} else {
+		return -1;
+	}
+	if (member->bitSize == 0) return 0;
+	/* Bitfields are extracted into a host temporary */
+	uint32_t bytes = (member->bitOffset + member->bitSize + 7) / 8;
+	if (bytes > 8) return -1;
+	uint64_t value = 0;
+	tcdReadRtLoc(debug, *rtloc, bytes, &value);
+	value >>= member->bitOffset;
+	if (member->bitSize < 64) {
+		value &= (1ULL << member->bitSize) - 1;
+		Scalar probe;
+		TcdRtLoc zero = {0, TCDR_HOST_TEMP};
+		/* Sign extend if the declared type is signed */
+		if (readScalar(debug, member->type, zero, &probe) == 0 && probe.kind == SCALAR_INT &&
+			(value >> (member->bitSize - 1)) & 1)
+			value |= (-1ULL) << member->bitSize;
+	}
+	rtloc->address = value;
+	rtloc->region = TCDR_HOST_TEMP;
 	return 0;
 }
+
+static int evalNode(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	switch (node->kind) {
+		case NODE_NUMBER:
+			*type = node->litType;
+			rtloc->address = node->litValue;
+			rtloc->region = TCDR_HOST_TEMP;
+			return 0;
+		case NODE_SYMBOL:
+			return resolveSymbol(debug, node, type, rtloc);
+		case NODE_UNARY:
+			return evalUnary(debug, node, type, rtloc);
+		case NODE_BINARY:
+			return evalBinary(debug, node, type, rtloc);
+		case NODE_CAST: {
+			TcdType *otype;
+			TcdRtLoc ortloc;
+			Scalar s;
+			if (!isScalar(node->castType)) return -1;
+			if (evalNode(debug, node->left, &otype, &ortloc) != 0) return -1;
+			if (readScalar(debug, otype, ortloc, &s) != 0) return -1;
+			*type = node->castType;
+			storeScalar(*type, s, rtloc);
+			return 0;
+		}
+		case NODE_INDEX: {
+			TcdType *atype, *itype;
+			TcdRtLoc artloc, irtloc;
+			Scalar index;
+			if (evalNode(debug, node->left, &atype, &artloc) != 0) return -1;
+			if (evalNode(debug, node->right, &itype, &irtloc) != 0) return -1;
+			if (!isInteger(itype) || readScalar(debug, itype, irtloc, &index) != 0) return -1;
+			return tcdDerefIndex(debug, atype, artloc, index.as.i, type, rtloc);
+		}
+		case NODE_SLICE: {
+			/* a[begin:end] is an array of end - begin elements starting at a[begin] */
+			TcdType *atype, *btype, *etype;
+			TcdRtLoc artloc, brtloc, ertloc;
+			Scalar begin, end;
+			if (evalNode(debug, node->left, &atype, &artloc) != 0) return -1;
+			if (evalNode(debug, node->right, &btype, &brtloc) != 0) return -1;
+			if (evalNode(debug, node->upper, &etype, &ertloc) != 0) return -1;
+			if (!isInteger(btype) || readScalar(debug, btype, brtloc, &begin) != 0) return -1;
+			if (!isInteger(etype) || readScalar(debug, etype, ertloc, &end) != 0) return -1;
+			if (end.as.i < begin.as.i) return -1;
+			TcdType *of;
+			if (tcdDerefIndex(debug, atype, artloc, begin.as.i, &of, rtloc) != 0) return -1;
+			uint64_t count = end.as.i - begin.as.i;
+			node->synth = (TcdType){TCDT_ARRAY, count * of->size, .as.array = {of, count}};
+			*type = &node->synth;
+			return 0;
+		}
+		case NODE_MEMBER:
+			return evalMember(debug, node, type, rtloc);
+		default:
+			return -1;
+	}
+}
+
+/* The resulting type is owned by either the debug information or the expression */
+int cexprEvaluate(TcdContext *debug, CexprNode *node, TcdType **type, TcdRtLoc *rtloc) {
+	return evalNode(debug, node, type, rtloc);
+}
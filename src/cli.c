@@ -4,14 +4,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/reg.h>
 #include <readline/readline.h>
 
-char prompt[128];
-
 /* Debugger commands */
 typedef enum {
 	CONTINUE, BREAK,
@@ -20,79 +24,395 @@ typedef enum {
 	TRACE, WHERE,
 	REGISTERS, LINES, TYPES, LOCALS, POINTS,
 	DUMP, PRINT,
+	CHECKPOINT, RESTART,
+	CATCH, GCORE, FIND,
+	SNAPSHOT, DIFF,
+	DISPLAY, UNDISPLAY,
+	INTERRUPT, SAMPLE,
+	STATS,
 	INVALID
 } Command;
 
-/* Reads command from user */
-static void getNextCommand(Command *cmd, char *arg1, char *arg2) {
-	char *cmdstr = readline(prompt);
-	if (cmdstr == NULL) return;
-	if (cmdstr[0] == '\0') return;
-	char op[128];
-	memset(op, 0, 128);
+/* Names of the commands, in the order of the enum */
+static const char *const commandNames[] = {
+	"continue", "break",
+	"kill",
+	"step", "next",
+	"trace", "where",
+	"registers", "lines", "types", "locals", "points",
+	"dump", "print",
+	"checkpoint", "restart",
+	"catch", "gcore", "find",
+	"snapshot", "diff",
+	"display", "undisplay",
+	"interrupt", "sample",
+	"stats"
+};
+
+#define MAX_REST 512
+
+/* Default number of array elements printed to the terminal */
+#define PRINT_MAX_ELEMS 200
+/* Largest part of a displayed value that is fetched */
+#define DISPLAY_MAX_READ (64 * 1024)
+
+/* Expression printed every time the process stops */
+typedef struct {
+	char *text;
+	CexprNode *expr;
+	char fmt;
+} Display;
+
+/* Lines of a script or pipe, read without stdio so that the descriptor can be polled */
+typedef struct {
+	int fd;
+	int pollable;
+	int eof;
+	char *buf;
+	size_t len;
+	size_t cap;
+} LineReader;
+
+/* Takes a complete line from the buffer, skipping empty lines and # comments */
+static char *takeScriptLine(LineReader *reader) {
+	for (;;) {
+		char *nl = memchr(reader->buf, '\n', reader->len);
+		if (nl == NULL && !(reader->eof && reader->len > 0)) return NULL;
+		size_t len = nl != NULL ? (size_t)(nl - reader->buf) : reader->len;
+		size_t used = nl != NULL ? len + 1 : len;
+		char *line = malloc(len + 1);
+		memcpy(line, reader->buf, len);
+		line[len] = '\0';
+		memmove(reader->buf, reader->buf + used, reader->len - used);
+		reader->len -= used;
+		while (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+		char *c = line;
+		while (*c == ' ' || *c == '\t') c++;
+		if (*c != '\0' && *c != '#') {
+			memmove(line, c, strlen(c) + 1);
+			return line;
+		}
+		free(line);
+	}
+}
+
+static void fillScriptLines(LineReader *reader) {
+	if (reader->cap - reader->len < 4096) {
+		reader->cap = reader->cap * 2 + 4096;
+		reader->buf = realloc(reader->buf, reader->cap);
+	}
+	ssize_t got = read(reader->fd, reader->buf + reader->len, reader->cap - reader->len);
+	if (got > 0) {
+		reader->len += got;
+	} else if (got == 0 || errno != EINTR) {
+		reader->eof = 1;
+	}
+}
+
+/* Things the command loop waits for */
+typedef enum {
+	EVENT_LINE, EVENT_EOF,
+	EVENT_CHILD, EVENT_INTERRUPT, EVENT_TICK
+} Event;
+
+/* Multiplexes user input, SIGCHLD, SIGINT and the sampling timer over one epoll set,
+ * so that commands are accepted while the process runs in the background. */
+typedef struct {
+	int epoll;
+	int signals;
+	int timer;
+	LineReader *script;
+	char prompt[128];
+	int promptShown;
+	int redraw;
+} EventLoop;
+
+/* Readline hands completed lines to a callback without any context */
+static char *typedLine;
+static int typedDone;
+
+static void onTypedLine(char *line) {
+	rl_callback_handler_remove();
+	typedLine = line;
+	typedDone = 1;
+}
+
+static int initEventLoop(EventLoop *loop, LineReader *script) {
+	memset(loop, 0, sizeof(*loop));
+	loop->script = script;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+	loop->signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->epoll < 0 || loop->signals < 0 || loop->timer < 0) return -1;
+	struct epoll_event ev = {.events = EPOLLIN};
+	ev.data.fd = loop->signals;
+	epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->signals, &ev);
+	ev.data.fd = loop->timer;
+	epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->timer, &ev);
+	int input = script != NULL ? script->fd : STDIN_FILENO;
+	ev.data.fd = input;
+	/* Regular files can't be polled, but never block either */
+	int pollable = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, input, &ev) == 0;
+	if (script != NULL) {
+		script->pollable = pollable;
+	}
+	/* Signals arrive through the loop, not through readline */
+	rl_catch_signals = 0;
+	return 0;
+}
+
+static void freeEventLoop(EventLoop *loop) {
+	if (loop->promptShown) {
+		rl_callback_handler_remove();
+	}
+	close(loop->epoll);
+	close(loop->signals);
+	close(loop->timer);
+}
+
+/* Fires EVENT_TICK every <seconds>, or never if it is 0 */
+static void setSampleInterval(EventLoop *loop, double seconds) {
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	its.it_interval.tv_sec = (time_t)seconds;
+	its.it_interval.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+	its.it_value = its.it_interval;
+	timerfd_settime(loop->timer, 0, &its, NULL);
+}
+
+/* Waits for the next event; a completed command line goes to <line> */
+static Event nextEvent(EventLoop *loop, char **line) {
+	LineReader *script = loop->script;
+	if (script == NULL && !loop->promptShown) {
+		fflush(stdout);
+		typedDone = 0;
+		rl_callback_handler_install(loop->prompt, onTypedLine);
+		loop->promptShown = 1;
+	} else if (loop->redraw) {
+		fflush(stdout);
+		rl_forced_update_display();
+	}
+	loop->redraw = 0;
+	for (;;) {
+		int ready = script != NULL ? (!script->pollable || script->eof || memchr(script->buf, '\n', script->len)) : typedDone;
+		struct epoll_event evs[4];
+		int n = epoll_wait(loop->epoll, evs, 4, ready ? 0 : -1);
+		for (int i = 0; i < n; i++) {
+			int fd = evs[i].data.fd;
+			if (fd == loop->signals) {
+				struct signalfd_siginfo si;
+				if (read(loop->signals, &si, sizeof(si)) != sizeof(si)) continue;
+				/* Ctrl-C reaches the process by itself, only discard the typed line */
+				if (si.ssi_signo == SIGINT && si.ssi_code == SI_KERNEL) {
+					if (loop->promptShown) {
+						rl_replace_line("", 0);
+						rl_crlf();
+						rl_on_new_line();
+						rl_redisplay();
+					}
+					continue;
+				}
+				/* Get a half typed command out of the way of the output */
+				if (loop->promptShown) {
+					rl_clear_visible_line();
+					loop->redraw = 1;
+				}
+				return si.ssi_signo == SIGINT ? EVENT_INTERRUPT : EVENT_CHILD;
+			} else if (fd == loop->timer) {
+				uint64_t ticks;
+				if (read(loop->timer, &ticks, sizeof(ticks)) != sizeof(ticks)) continue;
+				if (loop->promptShown) {
+					rl_clear_visible_line();
+					loop->redraw = 1;
+				}
+				return EVENT_TICK;
+			} else if (script != NULL) {
+				fillScriptLines(script);
+			} else {
+				rl_callback_read_char();
+			}
+		}
+		if (script != NULL) {
+			if ((*line = takeScriptLine(script)) != NULL) return EVENT_LINE;
+			if (script->eof) return EVENT_EOF;
+			if (!script->pollable) fillScriptLines(script);
+		} else if (typedDone) {
+			loop->promptShown = 0;
+			*line = typedLine;
+			return typedLine != NULL ? EVENT_LINE : EVENT_EOF;
+		}
+	}
+}
+
+/* Splits a command line; <rest> receives everything after the command name, <fmt>
+ * an output format given as a suffix, e.g. print/x. Takes ownership of <cmdstr>. */
+static void parseCommand(char *cmdstr, Command *cmd, char *fmt, char *arg1, char *arg2, char *rest) {
+	/* An empty line repeats the last command */
+	if (cmdstr[0] == '\0') {
+		free(cmdstr);
+		return;
+	}
+	if (strlen(cmdstr) >= MAX_REST) cmdstr[MAX_REST - 1] = '\0';
+	char op[MAX_REST];
+	memset(op, 0, MAX_REST);
 	memset(arg1, 0, 128);
 	memset(arg2, 0, 128);
+	memset(rest, 0, MAX_REST);
+	*fmt = '\0';
 
 	int i;
 	char *c = cmdstr;
 	for (i = 0; *c != ' ' && *c != '\n' && *c != '\0'; c++)
 		op[i++] = *c;
+	char *slash = strchr(op, '/');
+	if (slash != NULL) {
+		*fmt = slash[1];
+		*slash = '\0';
+	}
 	while (*c == ' ') c++;
+	strncpy(rest, c, MAX_REST - 1);
 	for (i = 0; *c != ' ' && *c != '\n' && *c != '\0'; c++)
-		arg1[i++] = *c;
+		if (i < 127) arg1[i++] = *c;
 	while (*c == ' ') c++;
 	for (i = 0; *c != ' ' && *c != '\n' && *c != '\0'; c++)
-		arg2[i++] = *c;
-
-	if (strcmp(op, "continue") == 0) {
-		*cmd = CONTINUE;
-	} else if (strcmp(op, "kill") == 0) {
-		*cmd = KILL;
-	} else if (strcmp(op, "step") == 0) {
-		*cmd = STEP;
-	} else if (strcmp(op, "next") == 0) {
-		*cmd = NEXT;
-	} else if (strcmp(op, "trace") == 0) {
-		*cmd = TRACE;
-	} else if (strcmp(op, "where") == 0) {
-		*cmd = WHERE;
-	} else if (strcmp(op, "registers") == 0) {
-		*cmd = REGISTERS;
-	} else if (strcmp(op, "lines") == 0) {
-		*cmd = LINES;
-	} else if (strcmp(op, "types") == 0) {
-		*cmd = TYPES;
-	} else if (strcmp(op, "locals") == 0) {
-		*cmd = LOCALS;
-	} else if (strcmp(op, "points") == 0) {
-		*cmd = POINTS;
-	} else if (strcmp(op, "break") == 0) {
-		*cmd = BREAK;
-	} else if (strcmp(op, "dump") == 0) {
-		*cmd = DUMP;
-	} else if (strcmp(op, "print") == 0) {
-		*cmd = PRINT;
-	} else {
-		*cmd = INVALID;
+		if (i < 127) arg2[i++] = *c;
+
+	*cmd = INVALID;
+	for (i = 0; i < INVALID; i++) {
+		if (strcmp(op, commandNames[i]) == 0) {
+			*cmd = i;
+			break;
+		}
 	}
 	free(cmdstr);
 }
 
-static void printWhere(TcdInfo *info, uint64_t address) {
-	printf("0x%lx", address);
-	TcdFunction *func = tcdSurroundingFunction(info, address);
+static void printWhere(TcdContext *debug, uint64_t address, FILE *out) {
+	fprintf(out, "0x%lx", address);
+	uint64_t bias;
+	TcdFunction *func = tcdSymbolize(debug, address, &bias);
 	if (func != NULL) {
-		printf(", in function '%s'", func->name);
-		TcdLine *line = tcdNearestLine(func, address);
+		fprintf(out, ", in function '%s'", func->name);
+		TcdLine *line = tcdNearestLine(func, address - bias);
 		if (line != NULL) {
-			printf(", line %d", line->number);
+			fprintf(out, ", line %d", line->number);
+		}
+	}
+	fprintf(out, ".\n");
+}
+
+/* Describes which known data an address points into */
+static void printDataWhere(TcdContext *debug, TcdMapping *maps, uint32_t numMaps, uint64_t address, FILE *out) {
+	fprintf(out, "0x%lx", address);
+	TcdFunction *func = tcdFunctionAt(debug, tcdReadIP(debug));
+	for (uint32_t i = 0; func != NULL && i < func->numLocals; i++) {
+		TcdLocal *local = func->locals + i;
+		TcdRtLoc rtloc;
+		if (tcdInterpretLocation(debug, local->locdesc, &rtloc) != 0) continue;
+		if (rtloc.region != TCDR_ADDRESS || local->type == NULL) continue;
+		if (address >= rtloc.address && address < rtloc.address + local->type->size) {
+			fprintf(out, ", in local '%s'+%lu", local->name, address - rtloc.address);
+			break;
+		}
+	}
+	uint64_t offset;
+	TcdLocal *var = tcdVariableByAddress(debug->info, address - debug->loadBias, &offset);
+	if (var != NULL) {
+		fprintf(out, ", in '%s'+%lu", var->name, offset);
+	}
+	for (uint32_t i = 0; i < numMaps; i++) {
+		if (address >= maps[i].begin && address < maps[i].end) {
+			fprintf(out, ", in %s+0x%lx", maps[i].name[0] ? maps[i].name : "[anon]", address - maps[i].begin);
+			break;
+		}
+	}
+	fprintf(out, ".\n");
+}
+
+/* Finds a trailing '> file' redirection; comparisons need parentheses */
+static char *findRedirection(char *rest) {
+	int depth = 0;
+	char *redir = NULL;
+	for (char *c = rest; *c != '\0'; c++) {
+		if (*c == '(' || *c == '[') depth++;
+		if (*c == ')' || *c == ']') depth--;
+		if (*c == '>' && depth == 0 && c > rest && c[-1] != '-' && c[-1] != '>' && c[1] != '>' && c[1] != '=') {
+			redir = c;
+		}
+	}
+	return redir;
+}
+
+/* Splits off a trailing '> file' redirection and opens the file. Returns <out>
+ * if there is none, NULL if the file can't be opened. */
+static FILE *splitRedirection(char *rest, FILE *out) {
+	char *redir = findRedirection(rest);
+	if (redir == NULL) return out;
+	char *path = redir + 1;
+	while (*path == ' ') path++;
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == ' ') path[--len] = '\0';
+	if (len == 0) return out;
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		perror(path);
+		return NULL;
+	}
+	*redir = '\0';
+	return file;
+}
+
+/* Turns a quoted string (with C escapes) or an integer of the given size into bytes */
+static int parsePattern(const char *str, const char *size, uint8_t *out, uint32_t *oLen) {
+	uint32_t len = 0;
+	if (str[0] == '"') {
+		for (str++; *str != '"'; str++) {
+			if (*str == '\0' || len >= 128) return -1;
+			if (*str != '\\') {
+				out[len++] = *str;
+				continue;
+			}
+			switch (*++str) {
+				case 'n': out[len++] = '\n'; break;
+				case 't': out[len++] = '\t'; break;
+				case '0': out[len++] = '\0'; break;
+				case 'x': {
+					unsigned int byte;
+					int digits;
+					if (sscanf(str + 1, "%2x%n", &byte, &digits) != 1) return -1;
+					out[len++] = byte;
+					str += digits;
+				} break;
+				case '\0': return -1;
+				default: out[len++] = *str; break;
+			}
 		}
+	} else {
+		char *end;
+		int64_t value = strtoll(str, &end, 0);
+		if (end == str || *end != '\0') return -1;
+		if (size[0] != '\0') {
+			len = atoi(size);
+			if (len != 1 && len != 2 && len != 4 && len != 8) return -1;
+		} else {
+			len = value == (int32_t)value ? 4 : 8;
+		}
+		memcpy(out, &value, len);
 	}
-	printf(".\n");
+	*oLen = len;
+	return len > 0 ? 0 : -1;
 }
 
 static void typeToString(TcdType *type, char *str)
 {
+	if (type == NULL) {
+		strcpy(str, "void");
+		return;
+	}
 	switch (type->tclass) {
 		case TCDT_BASE:
 			strcpy(str, type->as.base.name);
@@ -102,21 +422,571 @@ static void typeToString(TcdType *type, char *str)
 			typeToString(type->as.pointer.to, str + 1);
 			break;
 		case TCDT_ARRAY:
-			str[0] = '[';
-			str[1] = ']';
-			typeToString(type->as.array.of, str + 2);
+			sprintf(str, "[%lu]", type->as.array.count);
+			typeToString(type->as.array.of, str + strlen(str));
+			break;
+		case TCDT_STRUCT:
+		case TCDT_UNION:
+			sprintf(str, "%s %s", type->tclass == TCDT_STRUCT ? "struct" : "union",
+				type->as.struc.name ? type->as.struc.name : "<anonymous>");
+			break;
+		case TCDT_ENUM:
+			sprintf(str, "enum %s", type->as.enumer.name ? type->as.enumer.name : "<anonymous>");
+			break;
+		case TCDT_TYPEDEF:
+			strcpy(str, type->as.alias.name);
+			break;
+		case TCDT_CONST:
+		case TCDT_VOLATILE:
+		case TCDT_RESTRICT:
+			strcpy(str, type->tclass == TCDT_CONST ? "const " :
+				type->tclass == TCDT_VOLATILE ? "volatile " : "restrict ");
+			typeToString(type->as.alias.to, str + strlen(str));
 			break;
 		default: break;
 	}
 }
 
+/* Why cexprEvaluate() failed, as far as we can tell */
+static const char *evalError(TcdContext *debug) {
+	return debug->running ? "unable to evaluate while running, only globals can be read" : "unable to evaluate";
+}
+
+/* Evaluates all displays, fetches their values with one batched read and prints them,
+ * as a JSON array if <json> isn't NULL */
+static void showDisplays(TcdContext *debug, TcdJson *json, Display *displays, uint32_t first, uint32_t numDisplays, FILE *out) {
+	if (numDisplays == 0 && json == NULL) return;
+	struct {
+		TcdType *type;
+		uint8_t *data;
+		uint32_t size;
+		int valid;
+	} *values = calloc(numDisplays, sizeof(*values));
+	TcdReadRequest *reqs = malloc(numDisplays * sizeof(*reqs));
+	uint32_t numReqs = 0;
+	for (uint32_t i = 0; i < numDisplays; i++) {
+		TcdRtLoc rtloc;
+		if (cexprEvaluate(debug, displays[i].expr, &values[i].type, &rtloc) != 0) continue;
+		TcdType *resolved = tcdResolveType(values[i].type);
+		if (resolved == NULL) continue;
+		values[i].size = resolved->size < DISPLAY_MAX_READ ? resolved->size : DISPLAY_MAX_READ;
+		values[i].data = calloc(1, values[i].size + 8);
+		values[i].valid = 1;
+		if (rtloc.region == TCDR_ADDRESS) {
+			reqs[numReqs++] = (TcdReadRequest){rtloc.address, values[i].size, values[i].data};
+		} else {
+			tcdReadRtLoc(debug, rtloc, values[i].size, values[i].data);
+		}
+	}
+	tcdReadMemoryBatch(debug, reqs, numReqs);
+	if (json != NULL) tcdJsonArrayBegin(json);
+	for (uint32_t i = 0; i < numDisplays; i++) {
+		if (json != NULL) {
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "number");
+			tcdJsonUint(json, first + i + 1);
+			tcdJsonKey(json, "expression");
+			tcdJsonString(json, displays[i].text);
+			if (values[i].valid) {
+				TcdFormat format = {displays[i].fmt, PRINT_MAX_ELEMS};
+				tcdJsonKey(json, "value");
+				FILE *value = tcdJsonStringBegin(json);
+				tcdFormatBuffer(debug, values[i].type, values[i].data, values[i].size, &format, value);
+				tcdJsonStringEnd(json);
+			}
+			tcdJsonObjectEnd(json);
+		} else if (values[i].valid) {
+			fprintf(out, "%u: %s = ", first + i + 1, displays[i].text);
+			TcdFormat format = {displays[i].fmt, PRINT_MAX_ELEMS};
+			tcdFormatBuffer(debug, values[i].type, values[i].data, values[i].size, &format, out);
+			fprintf(out, "\n");
+		} else {
+			fprintf(out, "%u: %s = (%s)\n", first + i + 1, displays[i].text, evalError(debug));
+		}
+		free(values[i].data);
+	}
+	if (json != NULL) tcdJsonArrayEnd(json);
+	free(reqs);
+	free(values);
+}
+
+/* ----- JSON interpreter ----- */
+
+static void jsonFrame(TcdJson *json, TcdContext *debug, uint64_t address) {
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "address");
+	tcdJsonHex(json, address);
+	uint64_t bias;
+	TcdFunction *func = tcdSymbolize(debug, address, &bias);
+	if (func != NULL) {
+		tcdJsonKey(json, "function");
+		tcdJsonString(json, func->name);
+		TcdLine *line = tcdNearestLine(func, address - bias);
+		if (line != NULL) {
+			tcdJsonKey(json, "line");
+			tcdJsonUint(json, line->number);
+		}
+	}
+	tcdJsonObjectEnd(json);
+}
+
+static void jsonError(TcdJson *json, const char *message) {
+	tcdJsonKey(json, "error");
+	tcdJsonString(json, message);
+}
+
+/* Reports why the process stopped or that it ended, after it was resumed */
+static void jsonStopEvent(TcdContext *debug, TcdJson *json, int atBreakpoint, Display *displays, uint32_t numDisplays) {
+	tcdJsonObjectBegin(json);
+	tcdJsonKey(json, "event");
+	if (WIFEXITED(debug->status)) {
+		tcdJsonString(json, "exited");
+		tcdJsonKey(json, "code");
+		tcdJsonInt(json, WEXITSTATUS(debug->status));
+	} else if (WIFSIGNALED(debug->status)) {
+		tcdJsonString(json, "signaled");
+		tcdJsonKey(json, "signal");
+		tcdJsonInt(json, WTERMSIG(debug->status));
+	} else {
+		TcdSyscall sc;
+		tcdJsonString(json, "stopped");
+		tcdJsonKey(json, "reason");
+		if (atBreakpoint) {
+			tcdJsonString(json, "breakpoint");
+		} else if (tcdSyscallStop(debug, &sc)) {
+			tcdJsonString(json, "syscall");
+			tcdJsonKey(json, "syscall");
+			tcdJsonString(json, tcdSyscallName(sc.number));
+		} else if (debug->status >> 16 == PTRACE_EVENT_STOP) {
+			tcdJsonString(json, "interrupted");
+		} else if (WSTOPSIG(debug->status) == SIGTRAP) {
+			tcdJsonString(json, "step");
+		} else {
+			tcdJsonString(json, "signal");
+			tcdJsonKey(json, "signal");
+			tcdJsonInt(json, WSTOPSIG(debug->status));
+		}
+		tcdJsonKey(json, "frame");
+		jsonFrame(json, debug, tcdReadIP(debug));
+		tcdJsonKey(json, "displays");
+		showDisplays(debug, json, displays, 0, numDisplays, stdout);
+	}
+	tcdJsonKey(json, "pid");
+	tcdJsonInt(json, debug->pid);
+	tcdJsonObjectEnd(json);
+	tcdJsonLineEnd(json);
+}
+
+/* Writes the structured result of a command; returns -1 for commands whose
+ * result is only available as text */
+static int jsonResult(TcdContext *debug, TcdJson *json, Command cmd, char fmt, char *arg1, char *arg2, char *rest) {
+	switch (cmd) {
+		case BREAK: {
+			uint64_t address;
+			uint32_t line;
+			int result = tcdBreakAtFunction(debug, arg1, &address, &line);
+			if (result == TCD_BREAK_NOT_FOUND) {
+				jsonError(json, "function not found");
+				break;
+			}
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			if (result == TCD_BREAK_PENDING) {
+				tcdJsonKey(json, "pending");
+				tcdJsonString(json, arg1);
+			} else {
+				tcdJsonKey(json, "breakpoint");
+				jsonFrame(json, debug, address);
+			}
+			tcdJsonObjectEnd(json);
+		} break;
+
+		case WHERE:
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "frame");
+			jsonFrame(json, debug, tcdReadIP(debug));
+			tcdJsonObjectEnd(json);
+			break;
+
+		case TRACE: {
+			uint64_t trace[128];
+			uint16_t depth = tcdGetStackTrace(debug, trace, 128);
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "frames");
+			tcdJsonArrayBegin(json);
+			for (uint16_t level = 0; level < depth; level++) {
+				jsonFrame(json, debug, trace[level]);
+			}
+			tcdJsonArrayEnd(json);
+			tcdJsonObjectEnd(json);
+		} break;
+
+		case REGISTERS: {
+			static const char *const names[] = {"rax", "rdx", "rcx", "rbx", "rsi", "rdi", "rbp", "rsp"};
+			tcdReadRegisters(debug);
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "registers");
+			tcdJsonObjectBegin(json);
+			/* The first eight in DWARF numbering */
+			for (uint32_t i = 0; i < 8; i++) {
+				tcdJsonKey(json, names[i]);
+				tcdJsonHex(json, debug->regs[i]);
+			}
+			tcdJsonKey(json, "rip");
+			tcdJsonHex(json, debug->regs[TCD_RIP]);
+			tcdJsonObjectEnd(json);
+			tcdJsonObjectEnd(json);
+		} break;
+
+		case LINES:
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "units");
+			tcdJsonArrayBegin(json);
+			for (uint32_t u = 0; u < debug->info->numCompUnits; u++) {
+				TcdCompUnit *cu = debug->info->compUnits + u;
+				tcdJsonObjectBegin(json);
+				tcdJsonKey(json, "name");
+				tcdJsonString(json, cu->name);
+				tcdJsonKey(json, "compDir");
+				tcdJsonString(json, cu->compDir);
+				tcdJsonKey(json, "functions");
+				tcdJsonArrayBegin(json);
+				for (uint32_t i = 0; i < cu->numFuncs; i++) {
+					TcdFunction *func = cu->funcs + i;
+					tcdJsonObjectBegin(json);
+					tcdJsonKey(json, "name");
+					tcdJsonString(json, func->name);
+					tcdJsonKey(json, "lines");
+					tcdJsonArrayBegin(json);
+					for (uint32_t j = 0; j < func->numLines; j++) {
+						tcdJsonObjectBegin(json);
+						tcdJsonKey(json, "line");
+						tcdJsonUint(json, func->lines[j].number);
+						tcdJsonKey(json, "address");
+						tcdJsonHex(json, func->lines[j].address + debug->loadBias);
+						tcdJsonObjectEnd(json);
+					}
+					tcdJsonArrayEnd(json);
+					tcdJsonObjectEnd(json);
+				}
+				tcdJsonArrayEnd(json);
+				tcdJsonObjectEnd(json);
+			}
+			tcdJsonArrayEnd(json);
+			tcdJsonObjectEnd(json);
+			break;
+
+		case TYPES:
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "units");
+			tcdJsonArrayBegin(json);
+			for (uint32_t u = 0; u < debug->info->numCompUnits; u++) {
+				TcdCompUnit *cu = debug->info->compUnits + u;
+				tcdJsonObjectBegin(json);
+				tcdJsonKey(json, "name");
+				tcdJsonString(json, cu->name);
+				tcdJsonKey(json, "types");
+				tcdJsonArrayBegin(json);
+				for (uint32_t i = 0; i < cu->numTypes; i++) {
+					TcdType *type = cu->types + i;
+					char name[1024] = {0};
+					typeToString(type, name);
+					tcdJsonObjectBegin(json);
+					tcdJsonKey(json, "name");
+					tcdJsonString(json, name);
+					tcdJsonKey(json, "size");
+					tcdJsonUint(json, type->size);
+					if (type->tclass == TCDT_STRUCT || type->tclass == TCDT_UNION) {
+						tcdJsonKey(json, "members");
+						tcdJsonArrayBegin(json);
+						for (uint32_t j = 0; j < type->as.struc.numMembers; j++) {
+							TcdMember *member = &type->as.struc.members[j];
+							typeToString(member->type, name);
+							tcdJsonObjectBegin(json);
+							tcdJsonKey(json, "name");
+							tcdJsonString(json, member->name);
+							tcdJsonKey(json, "type");
+							tcdJsonString(json, name);
+							tcdJsonKey(json, "offset");
+							tcdJsonUint(json, member->offset);
+							tcdJsonObjectEnd(json);
+						}
+						tcdJsonArrayEnd(json);
+					}
+					tcdJsonObjectEnd(json);
+				}
+				tcdJsonArrayEnd(json);
+				tcdJsonObjectEnd(json);
+			}
+			tcdJsonArrayEnd(json);
+			tcdJsonObjectEnd(json);
+			break;
+
+		case LOCALS: {
+			TcdFunction *func = tcdFunctionAt(debug, tcdReadIP(debug));
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "locals");
+			tcdJsonArrayBegin(json);
+			for (uint32_t i = 0; func != NULL && i < func->numLocals; i++) {
+				TcdLocal *local = func->locals + i;
+				char type[1024] = {0};
+				typeToString(local->type, type);
+				TcdRtLoc rtloc = {0};
+				tcdJsonObjectBegin(json);
+				tcdJsonKey(json, "name");
+				tcdJsonString(json, local->name);
+				tcdJsonKey(json, "type");
+				tcdJsonString(json, type);
+				if (tcdInterpretLocation(debug, local->locdesc, &rtloc) == 0) {
+					TcdFormat format = {'\0', PRINT_MAX_ELEMS};
+					if (rtloc.region == TCDR_ADDRESS) {
+						tcdJsonKey(json, "address");
+						tcdJsonHex(json, rtloc.address);
+					}
+					tcdJsonKey(json, "value");
+					FILE *value = tcdJsonStringBegin(json);
+					tcdFormatValue(debug, local->type, rtloc, &format, value);
+					tcdJsonStringEnd(json);
+				}
+				tcdJsonObjectEnd(json);
+			}
+			tcdJsonArrayEnd(json);
+			tcdJsonObjectEnd(json);
+		} break;
+
+		case POINTS:
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "breakpoints");
+			tcdJsonArrayBegin(json);
+			for (uint32_t i = 0; i < debug->numBreaks; i++) {
+				tcdJsonObjectBegin(json);
+				tcdJsonKey(json, "number");
+				tcdJsonUint(json, i);
+				tcdJsonKey(json, "address");
+				tcdJsonHex(json, debug->breaks[i].address);
+				tcdJsonKey(json, "line");
+				tcdJsonUint(json, debug->breaks[i].line);
+				tcdJsonObjectEnd(json);
+			}
+			tcdJsonArrayEnd(json);
+			tcdJsonObjectEnd(json);
+			break;
+
+		case STATS:
+			if (strcmp(arg1, "reset") == 0) return -1;
+			tcdJsonKey(json, "result");
+			tcdJsonStats(debug, json);
+			break;
+
+		/* Memory is streamed out in pages */
+		case DUMP: {
+			/* Redirected output goes to the file as text */
+			if (findRedirection(rest) != NULL) return -1;
+			uint64_t address, length = 32;
+			if (sscanf(arg1, "%lx", &address) != 1 || (arg2[0] != '\0' && sscanf(arg2, "%lu", &length) != 1)) {
+				jsonError(json, "usage: dump <address> [<length>]");
+				break;
+			}
+			uint8_t page[4096];
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "address");
+			tcdJsonHex(json, address);
+			tcdJsonKey(json, "length");
+			tcdJsonUint(json, length);
+			tcdJsonKey(json, "contents");
+			tcdJsonBytesBegin(json);
+			for (uint64_t done = 0; done < length; ) {
+				uint32_t n = length - done < sizeof(page) ? length - done : sizeof(page);
+				tcdReadProgramMemory(debug, address + done, n, page);
+				tcdJsonBytesPart(json, page, n);
+				done += n;
+			}
+			tcdJsonBytesEnd(json);
+			tcdJsonObjectEnd(json);
+		} break;
+
+		case PRINT: {
+			if (findRedirection(rest) != NULL) return -1;
+			TcdType *type;
+			TcdRtLoc rtloc;
+			TcdFormat format = {fmt, 0};
+			CexprNode *expr = cexprCompile(debug, rest);
+			if (expr == NULL) {
+				jsonError(json, "input error");
+				break;
+			}
+			if (cexprEvaluate(debug, expr, &type, &rtloc) != 0) {
+				jsonError(json, evalError(debug));
+				cexprFree(expr);
+				break;
+			}
+			char name[1024] = {0};
+			typeToString(type, name);
+			tcdJsonKey(json, "result");
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "type");
+			tcdJsonString(json, name);
+			tcdJsonKey(json, "value");
+			FILE *value = tcdJsonStringBegin(json);
+			tcdFormatValue(debug, type, rtloc, &format, value);
+			tcdJsonStringEnd(json);
+			tcdJsonObjectEnd(json);
+			cexprFree(expr);
+		} break;
+
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/* Catches a comma-separated list of syscall names or numbers, or all syscalls if the list is empty */
+static int catchSyscallList(TcdContext *debug, const char *list, FILE *out) {
+	if (list[0] == '\0') {
+		return tcdCatchSyscalls(debug, NULL, 0);
+	}
+	uint32_t numbers[TCD_MAX_SYSCALLS];
+	uint32_t count = 0;
+	char name[128];
+	while (*list != '\0' && count < TCD_MAX_SYSCALLS) {
+		size_t len = strcspn(list, ",");
+		if (len >= sizeof(name)) len = sizeof(name) - 1;
+		memcpy(name, list, len);
+		name[len] = '\0';
+		list += strcspn(list, ",");
+		if (*list == ',') list++;
+		int number = tcdSyscallNumber(name);
+		if (number < 0 && sscanf(name, "%d", &number) != 1) {
+			fprintf(out, "Unknown syscall '%s'.\n", name);
+			return -1;
+		}
+		numbers[count++] = number;
+	}
+	return tcdCatchSyscalls(debug, numbers, count);
+}
+
+static void printSyscall(TcdSyscall *sc, FILE *out) {
+	fprintf(out, "%s(0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx)", tcdSyscallName(sc->number),
+		sc->args[0], sc->args[1], sc->args[2], sc->args[3], sc->args[4], sc->args[5]);
+}
+
+/* Says why the process stopped, unless it was a breakpoint or a step */
+static void printStop(TcdContext *debug, FILE *out) {
+	TcdSyscall sc;
+	if (!WIFSTOPPED(debug->status)) return;
+	if (tcdSyscallStop(debug, &sc)) {
+		fprintf(out, "Caught syscall ");
+		printSyscall(&sc, out);
+		fprintf(out, " at ");
+		printWhere(debug, tcdFindCallSite(debug), out);
+	} else if (debug->status >> 16 == PTRACE_EVENT_STOP) {
+		fprintf(out, "Interrupted at ");
+		printWhere(debug, tcdReadIP(debug), out);
+	} else if (WSTOPSIG(debug->status) != SIGTRAP) {
+		fprintf(out, "Stopped by signal %d at ", WSTOPSIG(debug->status));
+		printWhere(debug, tcdReadIP(debug), out);
+	}
+}
+
+/* Runs the process to its end, printing every selected syscall on the way */
+static int traceSyscalls(TcdContext *debug, const char *list) {
+	if (catchSyscallList(debug, list, stdout) != 0) {
+		fprintf(stderr, "FATAL: Unable to set up syscall tracing.\n");
+		return -1;
+	}
+	int sig = 0;
+	for (;;) {
+		tcdContinue(debug, sig);
+		tcdSync(debug);
+		if (!WIFSTOPPED(debug->status)) break;
+		sig = 0;
+		TcdSyscall sc;
+		if (tcdSyscallStop(debug, &sc)) {
+			uint64_t site = tcdFindCallSite(debug);
+			printSyscall(&sc, stdout);
+			if (tcdFinishSyscall(debug, &sc) == 0) {
+				printf(" = %ld at ", sc.result);
+			} else {
+				printf(" = ? at ");
+			}
+			printWhere(debug, site, stdout);
+			if (!WIFSTOPPED(debug->status)) break;
+		} else if (debug->status >> 16 == 0) {
+			sig = WSTOPSIG(debug->status);
+		}
+	}
+	printf("process %d terminated\n", debug->pid);
+	return 0;
+}
+
+/* Exit code of tcd when the process ended with <status> */
+static int exitCode(int status) {
+	if (WIFEXITED(status)) return WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return 0;
+}
+
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		fprintf(stderr, "usage: %s <bin>\n", argv[0]);
+	const char *traceList = NULL;
+	LineReader scriptReader = {-1, 0, 0, NULL, 0, 0};
+	LineReader *script = NULL;
+	const char *serverAddress = NULL;
+	int jsonMode = 0;
+	int statsAtExit = 0;
+	int attachPid = 0;
+	int argi = 1;
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (strcmp(argv[argi], "-x") == 0 && argi + 1 < argc) {
+			scriptReader.fd = open(argv[++argi], O_RDONLY | O_CLOEXEC);
+			if (scriptReader.fd < 0) {
+				perror(argv[argi]);
+				exit(-1);
+			}
+			script = &scriptReader;
+		} else if (strcmp(argv[argi], "--server") == 0 && argi + 1 < argc) {
+			serverAddress = argv[++argi];
+		} else if (strcmp(argv[argi], "--interpreter=json") == 0) {
+			jsonMode = 1;
+		} else if (strcmp(argv[argi], "--attach") == 0 && argi + 1 < argc) {
+			attachPid = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "--stats") == 0) {
+			statsAtExit = 1;
+		} else if (strcmp(argv[argi], "--trace-syscalls") == 0) {
+			traceList = "";
+		} else if (strncmp(argv[argi], "--trace-syscalls=", 17) == 0) {
+			traceList = argv[argi] + 17;
+		} else {
+			break;
+		}
+	}
+	if (argi >= argc) {
+		fprintf(stderr, "usage: %s [-x <script>] [--interpreter=json] [--server <[host:]port|socket>] [--trace-syscalls[=<names>]] [--stats] [--attach <pid>] <bin> [<core>]\n", argv[0]);
 		exit(-1);
 	}
+	/* Commands piped into stdin are run like a script; frontends don't want prompts either */
+	if (script == NULL && (jsonMode || !isatty(STDIN_FILENO))) {
+		scriptReader.fd = STDIN_FILENO;
+		script = &scriptReader;
+	}
+	/* In JSON mode every command and event is one line of JSON on stdout */
+	TcdJson jsonWriter;
+	tcdJsonInit(&jsonWriter, stdout);
+	TcdJson *json = jsonMode ? &jsonWriter : NULL;
+	/* Without a terminal to talk to, output only has to be in order with the process' own */
+	if (script != NULL) {
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	}
+	const char *corePath = argi + 1 < argc ? argv[argi + 1] : NULL;
 
-	const char *path = argv[1];
+	const char *path = argv[argi];
 	const char *name = strrchr(path, '/');
 	if (name) {
 		name += 1;
@@ -126,64 +996,220 @@ int main(int argc, char **argv) {
 
 	/* Init debug context */
 	TcdContext debug = {0};
-	int res = tcdLoadInfo(path, &debug.info);
+	TcdInfo *info;
+	int res = tcdLoadInfo(path, &info);
 	if (res != TCDE_OK) {
 		fprintf(stderr, "FATAL: %s\n", tcdFormulateErrorMessage(res));
 		return -1;
 	}
 
-	switch (debug.pid = fork()) {
-		case -1: { /* Error */
-			perror("fork()");
-		} return -1;
-		case 0: { /* Child process */
-			ptrace(PTRACE_TRACEME, NULL, NULL);     /* Allow child process to be traced */
-			execl(path, name, NULL);                /* Child will be stopped here */
-			perror("execl()");
-		} return -1;
-		/* Parent continues execution */
+	fflush(stdout);
+	if (corePath != NULL) {
+		res = tcdLoadCore(corePath, &debug);
+		if (res != TCDE_OK) {
+			fprintf(stderr, "FATAL: %s\n", tcdFormulateErrorMessage(res));
+			return -1;
+		}
+		tcdUseInfo(&debug, info);
+		/* Make the core look like a process stopped by its fatal signal */
+		debug.status = (debug.core->signal << 8) | 0x7F;
+		if (json != NULL) {
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "event");
+			tcdJsonString(json, "core");
+			tcdJsonKey(json, "pid");
+			tcdJsonInt(json, debug.pid);
+			tcdJsonKey(json, "signal");
+			tcdJsonInt(json, debug.core->signal);
+			tcdJsonKey(json, "frame");
+			jsonFrame(json, &debug, tcdReadIP(&debug));
+			tcdJsonObjectEnd(json);
+			tcdJsonLineEnd(json);
+		} else {
+			printf("Core of process %d, stopped by signal %d at ", debug.pid, debug.core->signal);
+			printWhere(&debug, tcdReadIP(&debug), stdout);
+		}
+	} else {
+		char *childArgv[] = {(char*)name, NULL};
+		/* Keep the process from eating commands piped into stdin */
+		int flags = scriptReader.fd == STDIN_FILENO ? TCD_SPAWN_NULL_STDIN : 0;
+		if (attachPid != 0 ? tcdAttach(&debug, attachPid) != 0 : tcdSpawn(&debug, path, childArgv, flags) != 0) {
+			fprintf(stderr, "FATAL: Unable to %s '%s' under the debugger.\n", attachPid != 0 ? "attach to" : "start", path);
+			tcdFreeContext(&debug);
+			return -1;
+		}
+		tcdUseInfo(&debug, info);
+		if (json != NULL) {
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "event");
+			tcdJsonString(json, attachPid != 0 ? "attached" : "started");
+			tcdJsonKey(json, "pid");
+			tcdJsonInt(json, debug.pid);
+			tcdJsonObjectEnd(json);
+			tcdJsonLineEnd(json);
+		}
 	}
-
-	/* Set up prompt */
-	sprintf(prompt, "tcd/%d] ", debug.pid);
+	/* The context holds its own reference from here on */
+	tcdReleaseInfo(info);
 
 	Command cmd;
-	char arg1[128], arg2[128];
+	char fmt;
+	char arg1[128], arg2[128], rest[MAX_REST];
 
-	tcdSync(&debug);
+	if (serverAddress != NULL) {
+		if (tcdServe(&debug, serverAddress) != 0) {
+			perror(serverAddress);
+			tcdFreeContext(&debug);
+			return -1;
+		}
+		res = debug.core == NULL ? exitCode(debug.status) : 0;
+		if (statsAtExit) tcdPrintStats(&debug, stderr);
+		tcdFreeContext(&debug);
+		return res;
+	}
 
+	if (traceList != NULL && debug.core == NULL) {
+		res = traceSyscalls(&debug, traceList);
+		if (statsAtExit) tcdPrintStats(&debug, stderr);
+		tcdFreeContext(&debug);
+		return res;
+	}
+
+	Display *displays = NULL;
+	uint32_t numDisplays = 0;
+	int terminated = 0;
+	int resumed = 0;
+	EventLoop loop;
+	if (initEventLoop(&loop, script) != 0) {
+		perror("FATAL: event loop");
+		tcdFreeContext(&debug);
+		return -1;
+	}
+	sprintf(loop.prompt, "tcd/%d] ", debug.pid);
 	while (1) {
-		if (WIFEXITED(debug.status) || (WIFSIGNALED(debug.status) && WTERMSIG(debug.status) == SIGKILL)) {
-			printf("process %d terminated\n", debug.pid);
-			exit(0);
-		}
-
-		if (WIFSTOPPED(debug.status)) {
-			uint64_t rip = tcdReadIP(&debug);
-			/* Find breakpoint */
-			uint64_t bip = rip - 1;
-			int32_t index = -1;
-			for (uint32_t i = 0; i < debug.numBreaks; i++) {
-				if (debug.breaks[i].address == bip) {
-					index = i;
-					break;
+		if (!terminated && (WIFEXITED(debug.status) || (WIFSIGNALED(debug.status) && WTERMSIG(debug.status) == SIGKILL))) {
+			if (json != NULL) {
+				jsonStopEvent(&debug, json, 0, displays, numDisplays);
+			} else {
+				printf("process %d terminated\n", debug.pid);
+			}
+			/* Checkpoints can still bring the process back */
+			if (debug.numCheckpoints == 0) {
+				freeEventLoop(&loop);
+				tcdJsonFree(&jsonWriter);
+				if (statsAtExit) tcdPrintStats(&debug, stderr);
+				tcdFreeContext(&debug);
+				exit(exitCode(debug.status));
+			}
+			terminated = 1;
+		}
+
+		if (!debug.running && WIFSTOPPED(debug.status)) {
+			uint64_t bip = tcdReadIP(&debug) - 1;
+			/* Breakpoints are one-shot, put the instruction back and rerun it */
+			int atBreakpoint = tcdRemoveBreakpoint(&debug, bip) == 0;
+			if (atBreakpoint) {
+				tcdWriteIP(&debug, bip);
+				if (json == NULL) {
+					printf("Stopped [at breakpoint] at ");
+					printWhere(&debug, bip, stdout);
 				}
 			}
-			if (index != -1) {
-				TcdBreakpoint point = debug.breaks[index];
-				memmove(debug.breaks + index, debug.breaks + index + 1,
-					(debug.numBreaks - index - 1) * sizeof(*debug.breaks));
-				debug.breaks = realloc(debug.breaks, --debug.numBreaks * sizeof(*debug.breaks));
-				/* Restore instruction(s) */
-				tcdWriteMemory(&debug, point.address, 1, &point.saved);
-				/* Decrement eip */
-				ptrace(PTRACE_POKEUSER, debug.pid, 8 * RIP, bip);
-				printf("Stopped [at breakpoint] at ");
-				printWhere(&debug.info, bip);
+			if (json != NULL && (resumed || atBreakpoint)) {
+				jsonStopEvent(&debug, json, atBreakpoint, displays, numDisplays);
+			} else if (resumed) {
+				showDisplays(&debug, NULL, displays, 0, numDisplays, stdout);
 			}
 		}
+		resumed = 0;
 
-		getNextCommand(&cmd, (char*)arg1, (char*)arg2);
+		char *line;
+		Event event = nextEvent(&loop, &line);
+		if (event == EVENT_EOF) {
+			/* End of input; a process that is still around is killed, unless it was attached */
+			if (debug.core == NULL && !terminated && attachPid != 0) {
+				if (debug.running) {
+					tcdInterrupt(&debug);
+					tcdSync(&debug);
+				}
+				if (tcdDetach(&debug) != 0 && debug.seccompFilter) {
+					fprintf(stderr, "Warning: process %d keeps the syscall filter of 'catch'; "
+						"without tcd, the caught syscalls fail with ENOSYS.\n", debug.pid);
+				}
+			} else if (debug.core == NULL && !terminated) {
+				kill(debug.pid, SIGKILL);
+				tcdSync(&debug);
+			}
+			break;
+		}
+		if (event == EVENT_CHILD) {
+			if (debug.running && tcdPoll(&debug)) {
+				resumed = 1;
+				if (json == NULL) {
+					printStop(&debug, stdout);
+				}
+			}
+			continue;
+		}
+		if (event == EVENT_INTERRUPT) {
+			if (debug.running) {
+				tcdInterrupt(&debug);
+			}
+			continue;
+		}
+		if (event == EVENT_TICK) {
+			if (debug.running && json != NULL) {
+				tcdJsonObjectBegin(json);
+				tcdJsonKey(json, "event");
+				tcdJsonString(json, "sample");
+				tcdJsonKey(json, "displays");
+				showDisplays(&debug, json, displays, 0, numDisplays, stdout);
+				tcdJsonObjectEnd(json);
+				tcdJsonLineEnd(json);
+			} else if (debug.running) {
+				showDisplays(&debug, NULL, displays, 0, numDisplays, stdout);
+			}
+			continue;
+		}
+		parseCommand(line, &cmd, &fmt, (char*)arg1, (char*)arg2, (char*)rest);
+		if (cmd == CONTINUE || cmd == STEP || cmd == NEXT || cmd == KILL || cmd == RESTART) {
+			fflush(stdout);
+		}
+		const char *refusal = NULL;
+		if (cmd == INVALID) {
+			refusal = "invalid or unknown command";
+		} else if (terminated && cmd != RESTART && cmd != LINES && cmd != TYPES && cmd != POINTS) {
+			refusal = "The process has terminated; use 'restart <n>' to resume from a checkpoint.";
+		} else if (debug.core != NULL && (cmd == CONTINUE || cmd == BREAK || cmd == KILL ||
+			cmd == STEP || cmd == NEXT || cmd == CHECKPOINT || cmd == RESTART || cmd == CATCH || cmd == GCORE ||
+			cmd == SNAPSHOT || cmd == DIFF)) {
+			refusal = "Not available when debugging a core file.";
+		} else if (debug.running && cmd != PRINT && cmd != DUMP && cmd != FIND && cmd != DISPLAY && cmd != UNDISPLAY &&
+			cmd != LINES && cmd != TYPES && cmd != POINTS && cmd != KILL && cmd != INTERRUPT && cmd != SAMPLE) {
+			refusal = "The process is running; use 'interrupt' to stop it.";
+		}
+		/* Commands without a structured result get their text output as a string */
+		FILE *out = stdout;
+		if (json != NULL) {
+			tcdJsonObjectBegin(json);
+			tcdJsonKey(json, "command");
+			tcdJsonString(json, cmd != INVALID ? commandNames[cmd] : NULL);
+			if (refusal != NULL) {
+				jsonError(json, refusal);
+			} else if (jsonResult(&debug, json, cmd, fmt, arg1, arg2, rest) != 0) {
+				tcdJsonKey(json, "output");
+				FILE *output = tcdJsonStringBegin(json);
+				if (output != NULL) out = output;
+			}
+			if (out == stdout) {
+				tcdJsonObjectEnd(json);
+				tcdJsonLineEnd(json);
+				continue;
+			}
+		} else if (refusal != NULL) {
+			fprintf(cmd == INVALID ? stderr : stdout, "%s\n", refusal);
+			continue;
+		}
 		switch (cmd) {
 			/* Set break point */
 			case BREAK: {
@@ -191,38 +1217,39 @@ int main(int argc, char **argv) {
 				uint64_t address = 0;
 				uint32_t line = 0;
 				char symbol[256];
+				int result = TCD_BREAK_NOT_FOUND;
 				if (sscanf(arg1, "%s", symbol) == 1) {
-					TcdFunction *func = tcdFunctionByName(&debug.info, symbol);
-					if (func != NULL) {
-						address = func->lines[0].address;
-						line = func->lines[0].number;
-					} else {
-						printf("Couldn't find function '%s'.\n", symbol);
+					result = tcdBreakAtFunction(&debug, symbol, &address, &line);
+					if (result == TCD_BREAK_NOT_FOUND) {
+						fprintf(out, "Couldn't find function '%s'.\n", symbol);
 					}
 				} else {
-					printf("Couldn't interpret breakpoint location.\n");
+					fprintf(out, "Couldn't interpret breakpoint location.\n");
 				}
-				if (address != 0) {
-					tcdInsertBreakpoint(&debug, address, line);
-					printf("Set breakpoint at ");
-					printWhere(&debug.info, address);
+				if (result == TCD_BREAK_PENDING) {
+					fprintf(out, "Breakpoint on '%s' pending until its library is loaded.\n", symbol);
+				} else if (address != 0) {
+					fprintf(out, "Set breakpoint at ");
+					printWhere(&debug, address, out);
 				} else {
-					printf("line %d not found.\n", line);
+					fprintf(out, "line %d not found.\n", line);
 				}
 			} break;
 
 			/* Step into */
 			case STEP: {
+				resumed = 1;
 				uint64_t rip = tcdStep(&debug);
-				printf("Stepped to ");
-				printWhere(&debug.info, rip);
+				fprintf(out, "Stepped to ");
+				printWhere(&debug, rip, out);
 			} break;
 
 			/* Step over */
 			case NEXT: {
+				resumed = 1;
 				uint64_t rip = tcdNext(&debug);
-				printf("Stepped to ");
-				printWhere(&debug.info, rip);
+				fprintf(out, "Stepped to ");
+				printWhere(&debug, rip, out);
 			} break;
 
 			/* Print stack trace */
@@ -230,60 +1257,71 @@ int main(int argc, char **argv) {
 				uint64_t trace[128];
 				uint16_t depth = tcdGetStackTrace(&debug, trace, 128);
 				for (uint16_t level = 0; level < depth; level++) {
-					printf("<%d> ", level);
-					printWhere(&debug.info, trace[level]);
+					fprintf(out, "<%d> ", level);
+					printWhere(&debug, trace[level], out);
 				}
 			} break;
 
 			/* Print current location */
 			case WHERE: {
 				uint64_t rip = tcdReadIP(&debug);
-				printf("At ");
-				printWhere(&debug.info, rip);
+				fprintf(out, "At ");
+				printWhere(&debug, rip, out);
 			} break;
 
 			/* Dump registers */
 			case REGISTERS: {
-				struct user_regs_struct regs;
-				ptrace(PTRACE_GETREGS, debug.pid, NULL, &regs);
-				printf("rax 0x%lx\n", (uint64_t)regs.rax);
-				printf("rbx 0x%lx\n", (uint64_t)regs.rbx);
-				printf("rcx 0x%lx\n", (uint64_t)regs.rcx);
-				printf("rdx 0x%lx\n", (uint64_t)regs.rdx);
-				printf("rsi 0x%lx\n", (uint64_t)regs.rsi);
-				printf("rdi 0x%lx\n", (uint64_t)regs.rdi);
-				printf("rbp 0x%lx\n", (uint64_t)regs.rbp);
-				printf("rsp 0x%lx\n", (uint64_t)regs.rsp);
-				printf("rip 0x%lx\n", (uint64_t)regs.rip);
+				tcdReadRegisters(&debug);
+				fprintf(out, "rax 0x%lx\n", debug.regs[TCD_RAX]);
+				fprintf(out, "rbx 0x%lx\n", debug.regs[TCD_RBX]);
+				fprintf(out, "rcx 0x%lx\n", debug.regs[TCD_RCX]);
+				fprintf(out, "rdx 0x%lx\n", debug.regs[TCD_RDX]);
+				fprintf(out, "rsi 0x%lx\n", debug.regs[TCD_RSI]);
+				fprintf(out, "rdi 0x%lx\n", debug.regs[TCD_RDI]);
+				fprintf(out, "rbp 0x%lx\n", debug.regs[TCD_RBP]);
+				fprintf(out, "rsp 0x%lx\n", debug.regs[TCD_RSP]);
+				fprintf(out, "rip 0x%lx\n", debug.regs[TCD_RIP]);
 			} break;
 
 			case LINES: {
-				for (uint32_t u = 0; u < debug.info.numCompUnits; u++) {
-					TcdCompUnit *cu = debug.info.compUnits + u;
-					printf("%s/%s:\n", cu->compDir, cu->name);
+				for (uint32_t u = 0; u < debug.info->numCompUnits; u++) {
+					TcdCompUnit *cu = debug.info->compUnits + u;
+					fprintf(out, "%s/%s:\n", cu->compDir, cu->name);
 					for (uint32_t i = 0; i < cu->numFuncs; i++) {
 						TcdFunction *func = cu->funcs + i;
-						printf("  %s:\n", func->name);
+						fprintf(out, "  %s:\n", func->name);
 						for (uint32_t j = 0; j < func->numLines; j++) {
-							printf("    %d:0x%lx\n", func->lines[j].number, func->lines[j].address);
+							fprintf(out, "    %d:0x%lx\n", func->lines[j].number, func->lines[j].address + debug.loadBias);
 						}
 					}
 				}
 			} break;
 
 			case TYPES: {
-				for (uint32_t u = 0; u < debug.info.numCompUnits; u++) {
-					TcdCompUnit *cu = debug.info.compUnits + u;
-					printf("%s/%s:\n", cu->compDir, cu->name);
+				for (uint32_t u = 0; u < debug.info->numCompUnits; u++) {
+					TcdCompUnit *cu = debug.info->compUnits + u;
+					fprintf(out, "%s/%s:\n", cu->compDir, cu->name);
 					for (uint32_t i = 0; i < cu->numTypes; i++) {
 						TcdType *type = cu->types + i;
 						switch (type->tclass)
 						{
 							case TCDT_BASE:
-								printf("  %s: size=%d inter=%d\n", type->as.base.name, type->size, type->as.base.interp);
+								fprintf(out, "  %s: size=%d inter=%d\n", type->as.base.name, type->size, type->as.base.interp);
 								break;
 							case TCDT_POINTER:
-								printf("  <pointer>: to=%p\n", (void*)type->as.pointer.to);
+								fprintf(out, "  <pointer>: to=%p\n", (void*)type->as.pointer.to);
+								break;
+							case TCDT_STRUCT:
+							case TCDT_UNION:
+								fprintf(out, "  %s %s: size=%d members=%u\n", type->tclass == TCDT_STRUCT ? "struct" : "union",
+									type->as.struc.name ? type->as.struc.name : "<anonymous>", type->size, type->as.struc.numMembers);
+								break;
+							case TCDT_ENUM:
+								fprintf(out, "  enum %s: size=%d values=%u\n", type->as.enumer.name ? type->as.enumer.name : "<anonymous>",
+									type->size, type->as.enumer.numValues);
+								break;
+							case TCDT_TYPEDEF:
+								fprintf(out, "  typedef %s: size=%d\n", type->as.alias.name, type->size);
 								break;
 							default: break;
 						}
@@ -293,7 +1331,7 @@ int main(int argc, char **argv) {
 
 			case LOCALS: {
 				uint64_t rip = tcdReadIP(&debug);
-				TcdFunction *func = tcdSurroundingFunction(&debug.info, rip);
+				TcdFunction *func = tcdFunctionAt(&debug, rip);
 				if (func == NULL) break;
 				for (uint32_t i = 0; i < func->numLocals; i++) {
 					TcdLocal *local = func->locals + i;
@@ -302,117 +1340,254 @@ int main(int argc, char **argv) {
 					TcdRtLoc rtloc = {0};
 					if (tcdInterpretLocation(&debug, local->locdesc, &rtloc) != 0)
 						continue;
-					printf("%s (%s) 0x%lx\n", local->name, type, rtloc.address);
+					fprintf(out, "%s (%s) 0x%lx\n", local->name, type, rtloc.address);
 				}
 			} break;
 
 			case POINTS: {
 				for (uint32_t i = 0; i < debug.numBreaks; i++) {
-					printf("%d:0x%lx(line %d)\n", i, debug.breaks[i].address, debug.breaks[i].line);
+					fprintf(out, "%d:0x%lx(line %d)\n", i, debug.breaks[i].address, debug.breaks[i].line);
 				}
 			} break;
 
-			/* Dump 8 bytes of data at <arg> in hex */
+			/* Show or reset the ptrace and waitpid counters */
+			case STATS: {
+				if (strcmp(arg1, "reset") == 0) {
+					memset(&debug.stats, 0, sizeof(debug.stats));
+					fprintf(out, "Counters reset.\n");
+					break;
+				}
+				tcdPrintStats(&debug, out);
+			} break;
+
+			/* Dump <length> (default 32) bytes of data at <address> in hex */
 			case DUMP: {
-				uint64_t address;
-				sscanf(arg1, "%lx", &address); /* TODO Check return value? */
-				uint8_t bytes[4 * 8];
-				tcdReadMemory(&debug, address, 4 * 8, bytes);
-				for (uint32_t i = 0; i < 4 * 8; ) {
-					printf("%02X ", bytes[i]);
-					if (++i % 8 == 0) {
-						printf("\n");
-					}
+				uint64_t address, length = 32;
+				FILE *file = splitRedirection(rest, out);
+				if (file == NULL) break;
+				if (sscanf(arg1, "%lx", &address) != 1 || (arg2[0] != '\0' && arg2[0] != '>' && sscanf(arg2, "%lu", &length) != 1)) {
+					fprintf(out, "usage: dump <address> [<length>] [> <file>]\n");
+				} else {
+					tcdDumpMemory(&debug, address, length, file);
 				}
+				if (file != out) fclose(file);
 			} break;
 
 			case PRINT: {
 				TcdType *type;
 				TcdRtLoc rtloc;
-				if (cexprParse(&debug, arg1, &type, &rtloc) != 0) {
-					printf("(input error)\n");
+				if (fmt != '\0' && fmt != 'x' && fmt != 'd' && fmt != 'f') {
+					fprintf(out, "Unknown output format '%c'.\n", fmt);
 					break;
 				}
-				switch (type->tclass) {
-					case TCDT_BASE: {
-						switch (type->as.base.interp) {
-							case TCDI_ADDRESS: break;
-							case TCDI_SIGNED: {
-								int64_t data;
-								tcdReadRtLoc(&debug, rtloc, type->size, &data);
-								printf("%ld\n", data);
-							} break;
-							case TCDI_UNSIGNED: {
-								uint64_t data;
-								tcdReadRtLoc(&debug, rtloc, type->size, &data);
-								printf("%lu\n", data);
-							} break;
-							case TCDI_CHAR: { /* TODO wide characters */
-								char data;
-								tcdReadRtLoc(&debug, rtloc, 1, &data);
-								printf("%d = '%c'\n", data, data);
-							} break;
-							case TCDI_UCHAR: { /* TODO wide characters */
-								unsigned char data;
-								tcdReadRtLoc(&debug, rtloc, 1, &data);
-								printf("%u = '%c'\n", data, data);
-							} break;
-							case TCDI_FLOAT:
-								if (type->size == 4) {
-									float data;
-									tcdReadRtLoc(&debug, rtloc, 4, &data);
-									printf("%f\n", data);
-								} else if (type->size == 8) {
-									double data;
-									tcdReadRtLoc(&debug, rtloc, 8, &data);
-									printf("%lf\n", data);
-								} else {
-									printf("(error: floating point value is neither float nor double)\n");
-								}
-								break;
-							case TCDI_BOOL: {
-								uint8_t data;
-								tcdReadRtLoc(&debug, rtloc, 1, &data);
-								printf("%s\n", data ? "true" : "false");
-							} break;
-						}
-					} break;
-					case TCDT_POINTER: {
-						uint64_t address;
-						tcdReadRtLoc(&debug, rtloc, 8, &address);
-						printf("(pointer) 0x%lx", address);
-						if  (type->as.pointer.to->tclass == TCDT_BASE &&
-							(type->as.pointer.to->as.base.interp == TCDI_CHAR ||
-							 type->as.pointer.to->as.base.interp == TCDI_UCHAR)) {
-							char data[256];
-							data[255] = '\0';
-							tcdReadRtLoc(&debug, (TcdRtLoc){address, TCDR_ADDRESS}, 255, data);
-							printf(" = \"%s\"", data);
-						}
-						printf("\n");
-					} break;
-					case TCDT_ARRAY: {
-						printf("(array)");
-						if  (type->as.array.of->tclass == TCDT_BASE &&
-							(type->as.array.of->as.base.interp == TCDI_CHAR ||
-							 type->as.array.of->as.base.interp == TCDI_UCHAR)) {
-							char data[256];
-							data[255] = '\0';
-							tcdReadRtLoc(&debug, rtloc, 255, data);
-							printf(" = \"%s\"", data);
-						}
-						printf("\n");
-					} break;
-					default: break;
+				FILE *file = splitRedirection(rest, out);
+				if (file == NULL) break;
+				/* Files get every element */
+				TcdFormat format = {fmt, file == out ? PRINT_MAX_ELEMS : 0};
+				CexprNode *expr = cexprCompile(&debug, rest);
+				if (expr == NULL) {
+					fprintf(out, "(input error)\n");
+				} else if (cexprEvaluate(&debug, expr, &type, &rtloc) != 0) {
+					fprintf(out, "(%s)\n", evalError(&debug));
+				} else {
+					tcdFormatValue(&debug, type, rtloc, &format, file);
+					fprintf(file, "\n");
+				}
+				cexprFree(expr);
+				if (file != out) fclose(file);
+			} break;
+
+			/* Add an expression to print at every stop, or show all of them */
+			case DISPLAY: {
+				if (rest[0] == '\0') {
+					showDisplays(&debug, NULL, displays, 0, numDisplays, out);
+					break;
+				}
+				if (fmt != '\0' && fmt != 'x' && fmt != 'd' && fmt != 'f') {
+					fprintf(out, "Unknown output format '%c'.\n", fmt);
+					break;
+				}
+				CexprNode *expr = cexprCompile(&debug, rest);
+				if (expr == NULL) {
+					fprintf(out, "(input error)\n");
+					break;
+				}
+				displays = realloc(displays, ++numDisplays * sizeof(*displays));
+				displays[numDisplays - 1] = (Display){strdup(rest), expr, fmt};
+				showDisplays(&debug, NULL, displays + numDisplays - 1, numDisplays - 1, 1, out);
+			} break;
+
+			case UNDISPLAY: {
+				uint32_t index;
+				if (sscanf(arg1, "%u", &index) != 1 || index == 0 || index > numDisplays) {
+					fprintf(out, "No display number '%s'.\n", arg1);
+					break;
+				}
+				free(displays[index - 1].text);
+				cexprFree(displays[index - 1].expr);
+				memmove(displays + index - 1, displays + index, (numDisplays - index) * sizeof(*displays));
+				numDisplays--;
+			} break;
+
+			/* Fork the stopped process into a frozen snapshot */
+			case CHECKPOINT: {
+				int index = tcdCheckpoint(&debug);
+				if (index < 0) {
+					fprintf(out, "Unable to create checkpoint.\n");
+					break;
+				}
+				fprintf(out, "Checkpoint %d at ", index);
+				printWhere(&debug, debug.checkpoints[index].address, out);
+			} break;
+
+			/* Switch over to a copy of a checkpoint */
+			case RESTART: {
+				uint32_t index;
+				if (sscanf(arg1, "%u", &index) != 1 || index >= debug.numCheckpoints) {
+					fprintf(out, "No such checkpoint '%s'.\n", arg1);
+					break;
+				}
+				if (tcdRestart(&debug, index) != 0) {
+					fprintf(out, "Unable to restart from checkpoint %u.\n", index);
+					break;
+				}
+				terminated = 0;
+				resumed = 1;
+				sprintf(loop.prompt, "tcd/%d] ", debug.pid);
+				fprintf(out, "Restarted from checkpoint %u at ", index);
+				printWhere(&debug, tcdReadIP(&debug), out);
+			} break;
+
+			/* Stop whenever the process enters one of the given syscalls */
+			case CATCH: {
+				if (strcmp(arg1, "syscall") != 0) {
+					fprintf(out, "Can only catch 'syscall'.\n");
+					break;
+				}
+				if (catchSyscallList(&debug, arg2, out) != 0) {
+					fprintf(out, "Unable to catch syscalls.\n");
+					break;
+				}
+				fprintf(out, "Catching syscalls %s.\n", arg2[0] ? arg2 : "(all)");
+			} break;
+
+			/* Search all readable memory for a string or an integer */
+			case FIND: {
+				uint8_t pattern[128];
+				uint32_t len;
+				if (parsePattern(arg1, arg2, pattern, &len) != 0) {
+					fprintf(out, "usage: find \"<string>\" | find <integer> [1|2|4|8]\n");
+					break;
+				}
+				uint64_t results[64];
+				uint32_t count = tcdFindMemory(&debug, pattern, len, results, 64);
+				TcdMapping *maps = NULL;
+				uint32_t numMaps = 0;
+				tcdReadMappings(&debug, &maps, &numMaps);
+				for (uint32_t i = 0; i < count && i < 64; i++) {
+					printDataWhere(&debug, maps, numMaps, results[i], out);
+				}
+				tcdFreeMappings(maps, numMaps);
+				if (count > 64) {
+					fprintf(out, "(%u more)\n", count - 64);
 				}
-				cexprFreeType(type);
+				fprintf(out, "%u match%s.\n", count, count == 1 ? "" : "es");
+			} break;
+
+			/* Remember the writable memory of the process */
+			case SNAPSHOT: {
+				if (tcdTakeSnapshot(&debug) != 0) {
+					fprintf(out, "Unable to take snapshot.\n");
+					break;
+				}
+				uint64_t size = 0;
+				for (uint32_t i = 0; i < debug.snapshot->numRegions; i++) {
+					size += debug.snapshot->regions[i].end - debug.snapshot->regions[i].begin;
+				}
+				fprintf(out, "Snapshot of %lu bytes in %u mappings taken.\n", size, debug.snapshot->numRegions);
+			} break;
+
+			/* Show which memory changed since the snapshot */
+			case DIFF: {
+				if (debug.snapshot == NULL) {
+					fprintf(out, "No snapshot taken yet.\n");
+					break;
+				}
+				TcdMemRange ranges[64];
+				uint32_t count = tcdDiffSnapshot(&debug, ranges, 64);
+				TcdMapping *maps = NULL;
+				uint32_t numMaps = 0;
+				tcdReadMappings(&debug, &maps, &numMaps);
+				for (uint32_t i = 0; i < count && i < 64; i++) {
+					fprintf(out, "%lu bytes at ", ranges[i].end - ranges[i].begin);
+					printDataWhere(&debug, maps, numMaps, ranges[i].begin, out);
+				}
+				tcdFreeMappings(maps, numMaps);
+				if (count > 64) {
+					fprintf(out, "(%u more)\n", count - 64);
+				}
+				fprintf(out, "%u changed range%s.\n", count, count == 1 ? "" : "s");
+			} break;
+
+			/* Write an ELF core of the stopped process */
+			case GCORE: {
+				char file[160];
+				if (arg1[0] != '\0') {
+					strcpy(file, arg1);
+				} else {
+					sprintf(file, "core.%d", debug.pid);
+				}
+				if (tcdWriteCore(&debug, file) != 0) {
+					fprintf(out, "Unable to write core file '%s'.\n", file);
+					break;
+				}
+				fprintf(out, "Saved core file '%s'.\n", file);
 			} break;
 
 			/* Continue execution */
-			case CONTINUE:
-				ptrace(PTRACE_CONT, debug.pid, NULL, NULL);
+			case CONTINUE: {
+				tcdContinue(&debug, 0);
+				/* 'continue &' returns to the prompt right away */
+				if (strcmp(arg1, "&") == 0) {
+					fprintf(out, "Continuing in the background.\n");
+					break;
+				}
+				resumed = 1;
 				tcdSync(&debug);
-				break;
+				printStop(&debug, out);
+			} break;
+
+			/* Stop a process running in the background */
+			case INTERRUPT: {
+				if (!debug.running) {
+					fprintf(out, "The process is not running.\n");
+					break;
+				}
+				/* It may have stopped on its own in the meantime */
+				if (!tcdPoll(&debug)) {
+					tcdInterrupt(&debug);
+					tcdSync(&debug);
+				}
+				resumed = 1;
+				printStop(&debug, out);
+			} break;
+
+			/* Show the displays periodically while running in the background */
+			case SAMPLE: {
+				double seconds;
+				if (strcmp(arg1, "off") == 0) {
+					seconds = 0;
+				} else if (sscanf(arg1, "%lf", &seconds) != 1 || seconds < 0) {
+					fprintf(out, "usage: sample <seconds> | sample off\n");
+					break;
+				}
+				setSampleInterval(&loop, seconds);
+				if (seconds > 0) {
+					fprintf(out, "Sampling displays every %g seconds while running in the background.\n", seconds);
+				} else {
+					fprintf(out, "Sampling stopped.\n");
+				}
+			} break;
 
 			/* Kill process */
 			case KILL:
@@ -420,12 +1595,28 @@ int main(int argc, char **argv) {
 				tcdSync(&debug);
 				break;
 
-			/* Error */
 			default:
-				fprintf(stderr, "invalid or unknown command\n");
 				break;
 		}
+		if (out != stdout) {
+			tcdJsonStringEnd(json);
+			tcdJsonObjectEnd(json);
+			tcdJsonLineEnd(json);
+		}
+	}
+	for (uint32_t i = 0; i < numDisplays; i++) {
+		free(displays[i].text);
+		cexprFree(displays[i].expr);
 	}
+	free(displays);
+	freeEventLoop(&loop);
+	tcdJsonFree(&jsonWriter);
+	if (script != NULL) {
+		free(script->buf);
+		if (script->fd != STDIN_FILENO) close(script->fd);
+	}
+	res = debug.core == NULL ? exitCode(debug.status) : 0;
+	if (statsAtExit) tcdPrintStats(&debug, stderr);
 	tcdFreeContext(&debug);
-	return 0;
+	return res;
 }
@@ -1,10 +1,66 @@
 #include "tcd.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <elf.h>
+#include <sys/wait.h>
+
+/* Where the entry point of the executable and the dynamic linker ended up,
+ * from the auxiliary vector */
+static void readAuxv(TcdContext *debug, uint64_t *entry, uint64_t *linkerBase) {
+	*entry = 0;
+	*linkerBase = 0;
+	if (debug->core != NULL) {
+		*entry = debug->core->entry;
+		return;
+	}
+	char path[64];
+	sprintf(path, "/proc/%d/auxv", debug->pid);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return;
+	uint64_t pair[2];
+	while (fread(pair, sizeof(pair), 1, file) == 1 && pair[0] != AT_NULL) {
+		if (pair[0] == AT_ENTRY) *entry = pair[1];
+		if (pair[0] == AT_BASE) *linkerBase = pair[1];
+	}
+	fclose(file);
+}
+
+/* Makes the context use <info>, which may be shared with any number of
+ * other contexts, works out where the process has the executable mapped
+ * and starts following its shared libraries. */
+void tcdUseInfo(TcdContext *debug, TcdInfo *info) {
+	debug->info = tcdRetainInfo(info);
+	uint64_t entry, linkerBase;
+	readAuxv(debug, &entry, &linkerBase);
+	debug->loadBias = entry != 0 && info->entry != 0 ? entry - info->entry : 0;
+	tcdTrackLibraries(debug, linkerBase);
+}
 
 void tcdFreeContext(TcdContext *debug) {
-	tcdFreeInfo(&debug->info);
+	tcdFreeLibraries(debug);
+	if (debug->info != NULL) {
+		tcdReleaseInfo(debug->info);
+	}
 	free(debug->breaks);
+	free(debug->followers);
+	/* Checkpoints would resume running once we detach, so kill them */
+	for (uint32_t i = 0; i < debug->numCheckpoints; i++) {
+		kill(debug->checkpoints[i].pid, SIGKILL);
+		waitpid(debug->checkpoints[i].pid, NULL, 0);
+		free(debug->checkpoints[i].breaks);
+	}
+	free(debug->checkpoints);
+	if (debug->core != NULL) {
+		tcdFreeCore(debug->core);
+		free(debug->core);
+	}
+	if (debug->snapshot != NULL) {
+		tcdFreeSnapshot(debug->snapshot);
+		free(debug->snapshot);
+	}
+	free(debug->hostBuffer);
 }
 
 const char *tcdFormulateErrorMessage(int code) {
@@ -17,6 +73,8 @@ const char *tcdFormulateErrorMessage(int code) {
 		case TCDE_LOAD_FUNCTION: return "Encountered corrupt debug information while loading function information.";
 		case TCDE_LOAD_LOCAL: return "Encountered corrupt debug information while loading local variable information.";
 		case TCDE_LOAD_TYPE: return "Encountered corrupt debug information while loading type information.";
+		case TCDE_CORE_OPEN: return "Unable to open the core file.";
+		case TCDE_CORE_FORMAT: return "The core file is not a valid x86-64 ELF core.";
 		default: return "An unrecognized error has occured.";
 	}
 }
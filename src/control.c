@@ -1,62 +1,567 @@
+#define _GNU_SOURCE
 #include "tcd.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/ptrace.h>
 #include <sys/reg.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/user.h>
 #include <sys/wait.h>
 
 const size_t WORD_SIZE = sizeof(void*);
 
+static int forkEvent(int status) {
+	int event = status >> 16;
+	if (!WIFSTOPPED(status) ||
+		(event != PTRACE_EVENT_FORK && event != PTRACE_EVENT_VFORK && event != PTRACE_EVENT_CLONE)) return 0;
+	return event;
+}
+
+/* Remembers the child or thread that <parent> just created */
+static void addFollower(TcdContext *debug, int parent, int event) {
+	unsigned long pid;
+	if (ptrace(PTRACE_GETEVENTMSG, parent, NULL, &pid) < 0) return;
+	debug->followers = realloc(debug->followers, (debug->numFollowers + 1) * sizeof(*debug->followers));
+	debug->followers[debug->numFollowers++] = (TcdFollower){pid, event, 0};
+}
+
+static void pokeByte(int pid, uint64_t address, uint8_t byte) {
+	errno = 0;
+	long word = ptrace(PTRACE_PEEKDATA, pid, address, NULL);
+	if (errno != 0) return;
+	memcpy(&word, &byte, 1);
+	ptrace(PTRACE_POKEDATA, pid, address, (void*)word);
+}
+
+/* A forked child starts out with a copy of the breakpoints; takes them out of it */
+static void removeBreaksIn(TcdContext *debug, int pid) {
+	for (uint32_t i = 0; i < debug->numBreaks; i++) {
+		pokeByte(pid, debug->breaks[i].address, debug->breaks[i].saved);
+	}
+	if (debug->linkerBreak != 0) {
+		pokeByte(pid, debug->linkerBreak, debug->linkerSaved);
+	}
+}
+
+/* A thread or vfork child, which shares the memory of the process, ran into
+ * one of its breakpoints: runs the original instruction in its place. Other
+ * threads can slip past the breakpoint meanwhile. Returns the signal to
+ * resume the follower with, or -1 if it wasn't one of our breakpoints. */
+static int stepOverBreakIn(TcdContext *debug, int pid) {
+	errno = 0;
+	uint64_t address = ptrace(PTRACE_PEEKUSER, pid, RIP * WORD_SIZE, NULL) - 1;
+	if (errno != 0) return -1;
+	uint8_t saved;
+	if (debug->linkerBreak != 0 && address == debug->linkerBreak) {
+		saved = debug->linkerSaved;
+		debug->libsStale = 1;
+	} else {
+		uint32_t i = 0;
+		while (i < debug->numBreaks && debug->breaks[i].address != address) i++;
+		if (i == debug->numBreaks) return -1;
+		saved = debug->breaks[i].saved;
+	}
+	pokeByte(pid, address, saved);
+	ptrace(PTRACE_POKEUSER, pid, RIP * WORD_SIZE, (void*)address);
+	int status;
+	ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL);
+	if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status)) return 0;
+	pokeByte(pid, address, 0xCC);
+	return WSTOPSIG(status) != SIGTRAP ? WSTOPSIG(status) : 0;
+}
+
+/* Children and threads of a process with a seccomp filter are ours as well.
+ * They just keep running: event stops take no signal, so caught syscalls go
+ * through, and any other signal is passed on. */
+static void resumeFollower(TcdContext *debug, uint32_t index, int status) {
+	TcdFollower *follower = &debug->followers[index];
+	int pid = follower->pid;
+	if (!follower->started) {
+		follower->started = 1;
+		if (follower->event == PTRACE_EVENT_FORK) removeBreaksIn(debug, pid);
+	}
+	int sig = WSTOPSIG(status);
+	int event = forkEvent(status);
+	if (event != 0) addFollower(debug, pid, event);
+	if (status >> 16 != 0 || sig == SIGSTOP) {
+		sig = 0;
+	} else if (sig == SIGTRAP) {
+		int next = stepOverBreakIn(debug, pid);
+		if (next >= 0) sig = next;
+	}
+	ptrace(PTRACE_CONT, pid, NULL, (void*)(long)sig);
+}
+
+/* Takes care of the followers that stopped or went away */
+static void pollFollowers(TcdContext *debug) {
+	for (uint32_t i = 0; i < debug->numFollowers; ) {
+		int pid = debug->followers[i].pid;
+		int status;
+		int res = waitpid(pid, &status, WNOHANG | __WALL);
+		if (res == 0) {
+			i++;
+		} else if (res < 0 || !WIFSTOPPED(status)) {
+			debug->followers[i] = debug->followers[--debug->numFollowers];
+		} else {
+			resumeFollower(debug, i, status);
+			i++;
+		}
+	}
+}
+
+static int isOurs(TcdContext *debug, int pid) {
+	if (pid == debug->pid) return 1;
+	for (uint32_t i = 0; i < debug->numFollowers; i++) {
+		if (debug->followers[i].pid == pid) return 1;
+	}
+	return 0;
+}
+
+/* waitpid() for the process itself, taking care of the stops of followers on
+ * the way. Only our own tracees are waited for: the same thread may trace the
+ * processes of other contexts as well. */
+static int waitProcess(TcdContext *debug, int *status, int options) {
+	if (debug->numFollowers == 0) return waitpid(debug->pid, status, options);
+	for (;;) {
+		int pid = waitpid(debug->pid, status, WNOHANG);
+		if (pid != 0) return pid;
+		pollFollowers(debug);
+		if (options & WNOHANG) return 0;
+		/* Sleeps until any child has something to report, but leaves it to be
+		 * picked up above, as it may belong to another context. Should that
+		 * one be ahead in the queue, there is nothing to do but poll. */
+		siginfo_t info;
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOWAIT | __WALL | __WNOTHREAD) < 0) return -1;
+		if (!isOurs(debug, info.si_pid)) {
+			nanosleep(&(struct timespec){0, 1000000}, NULL);
+		}
+	}
+}
+
+/* Fork and clone events of the process are only there to get the new ones traced */
+static int resumeAfterFork(TcdContext *debug) {
+	int event = forkEvent(debug->status);
+	if (event == 0) return 0;
+	addFollower(debug, debug->pid, event);
+	debug->stats.continues++;
+	ptrace(debug->resumeRequest != 0 ? debug->resumeRequest : PTRACE_CONT, debug->pid, NULL, NULL);
+	return 1;
+}
+
 void tcdSync(TcdContext *debug) {
-	waitpid(debug->pid, &debug->status, 0);
+	do {
+		uint64_t start = tcdNow();
+		waitProcess(debug, &debug->status, 0);
+		debug->stats.waits++;
+		debug->stats.waitNanos += tcdNow() - start;
+		debug->regsValid = 0;
+		debug->running = 0;
+		debug->hostBufferUsed = 0;
+		debug->libsStale = 1;
+	} while (tcdStepOverLinkerBreak(debug) || resumeAfterFork(debug));
+}
+
+/* Like tcdSync(), but doesn't wait; returns 1 if the process changed its state */
+int tcdPoll(TcdContext *debug) {
+	int status;
+	debug->stats.waits++;
+	if (waitProcess(debug, &status, WNOHANG) != debug->pid) return 0;
+	debug->status = status;
+	debug->regsValid = 0;
+	debug->running = 0;
+	debug->hostBufferUsed = 0;
+	debug->libsStale = 1;
+	/* Library loads and forks are none of the caller's business */
+	if (resumeAfterFork(debug) || tcdStepOverLinkerBreak(debug)) {
+		debug->running = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Takes over a child that stopped itself with SIGSTOP right before calling exec(),
+ * and runs it up to the exec. Unlike with PTRACE_TRACEME, the process can then be
+ * stopped with tcdInterrupt() while it runs. */
+static int seizeChild(TcdContext *debug) {
+	int status;
+	if (waitpid(debug->pid, &status, WUNTRACED) < 0 || !WIFSTOPPED(status)) return -1;
+	debug->ptraceOptions = PTRACE_O_TRACEEXEC;
+	if (ptrace(PTRACE_SEIZE, debug->pid, NULL, (void*)debug->ptraceOptions) < 0) return -1;
+	kill(debug->pid, SIGCONT);
+	for (;;) {
+		tcdSync(debug);
+		if (!WIFSTOPPED(debug->status)) return -1;
+		if (debug->status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) break;
+		/* Swallow the SIGCONT and stop notifications on the way */
+		ptrace(PTRACE_CONT, debug->pid, NULL, NULL);
+	}
+	/* The exec event comes before execve() has set its return value, which would
+	 * clobber injected syscalls; stop again once it has left the kernel. */
+	ptrace(PTRACE_SYSCALL, debug->pid, NULL, NULL);
+	tcdSync(debug);
+	return WIFSTOPPED(debug->status) ? 0 : -1;
+}
+
+/* Starts <path> stopped at its first instruction. The calling thread becomes the
+ * tracer, and the kernel takes ptrace requests for the process only from it. */
+int tcdSpawn(TcdContext *debug, const char *path, char *const *argv, int flags) {
+	int pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		/* Only async-signal-safe calls from here on, the parent may have threads */
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		if (flags & TCD_SPAWN_NULL_STDIN) {
+			int null = open("/dev/null", O_RDONLY);
+			dup2(null, STDIN_FILENO);
+			close(null);
+		}
+		raise(SIGSTOP);
+		execv(path, argv);
+		_exit(127);
+	}
+	debug->pid = pid;
+	if (seizeChild(debug) != 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/* Takes over the running process (its main thread) and stops it */
+int tcdAttach(TcdContext *debug, int pid) {
+	if (ptrace(PTRACE_SEIZE, pid, NULL, NULL) < 0) return -1;
+	debug->pid = pid;
+	if (tcdInterrupt(debug) != 0) {
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
+		return -1;
+	}
+	tcdSync(debug);
+	return WIFSTOPPED(debug->status) ? 0 : -1;
 }
 
-void tcdReadMemory(TcdContext *debug, uint64_t address, uint32_t size, void *data) {
+/* Lets the stopped process go on without us, taking out the breakpoints first.
+ * Refused once syscalls are caught, as they would fail with ENOSYS afterwards. */
+int tcdDetach(TcdContext *debug) {
+	if (debug->core != NULL || debug->seccompFilter) return -1;
+	while (debug->numBreaks > 0) {
+		tcdRemoveBreakpoint(debug, debug->breaks[0].address);
+	}
+	if (debug->linkerBreak != 0) {
+		tcdWriteMemory(debug, debug->linkerBreak, 1, &debug->linkerSaved);
+		debug->linkerBreak = 0;
+	}
+	return ptrace(PTRACE_DETACH, debug->pid, NULL, NULL) < 0 ? -1 : 0;
+}
+
+/* Asks a running process to stop; the stop is then picked up by tcdSync() or tcdPoll() */
+int tcdInterrupt(TcdContext *debug) {
+	return ptrace(PTRACE_INTERRUPT, debug->pid, NULL, NULL) < 0 ? -1 : 0;
+}
+
+/* Words are peeked one by one only where process_vm_readv() can't get
+ * through, e.g. on pages mapped without read permission. Returns how many
+ * bytes could be read before the first failure; unreadable words are zeroed. */
+static uint32_t peekMemory(TcdContext *debug, uint64_t address, uint32_t size, uint8_t *bytes) {
+	uint32_t read = 0, valid = size;
+	debug->stats.peeks += (size + WORD_SIZE - 1) / WORD_SIZE;
+	debug->stats.bytesRead += size;
+	while (read < size) {
+		/* The last word ends with the range where it can, so as not to run into the next page */
+		uint32_t skip = 0;
+		if (size - read < WORD_SIZE && size >= WORD_SIZE) {
+			skip = WORD_SIZE - (size - read);
+		}
+		errno = 0;
+		long word = ptrace(PTRACE_PEEKDATA, debug->pid, address + read - skip, NULL);
+		if (errno != 0) {
+			word = 0;
+			if (valid == size) valid = read;
+		}
+		uint32_t chunk = size - read < WORD_SIZE ? size - read : WORD_SIZE;
+		memcpy(bytes + read, (uint8_t*)&word + skip, chunk);
+		read += chunk;
+	}
+	return valid;
+}
+
+/* Returns how many bytes from the start could be read. Later parts can still
+ * have been read; what couldn't is zeroed. */
+uint32_t tcdReadMemory(TcdContext *debug, uint64_t address, uint32_t size, void *data) {
+	if (debug->core != NULL) {
+		return tcdReadCoreMemory(debug->core, address, size, data);
+	}
 	uint8_t *bytes = data;
-	uint32_t read = 0;
-	while (size - read >= WORD_SIZE) {
-		long word = ptrace(PTRACE_PEEKDATA, debug->pid, address + read, NULL);
-		memcpy(bytes + read, &word, WORD_SIZE);
-		read += WORD_SIZE;
+	uint32_t read = 0, valid = size;
+	while (read < size) {
+		struct iovec local  = {bytes + read, size - read};
+		struct iovec remote = {(void*)(address + read), size - read};
+		ssize_t got = process_vm_readv(debug->pid, &local, 1, &remote, 1, 0);
+		debug->stats.vmReads++;
+		if (got > 0) {
+			debug->stats.bytesRead += got;
+			read += got;
+			continue;
+		}
+		/* Get past the faulting page the slow way */
+		uint32_t chunk = PAGE_SIZE - (address + read) % PAGE_SIZE;
+		if (chunk > size - read) chunk = size - read;
+		uint32_t peeked = peekMemory(debug, address + read, chunk, bytes + read);
+		if (peeked < chunk && valid == size) valid = read + peeked;
+		read += chunk;
+	}
+	return valid;
+}
+
+/* Memory as the program sees it, with the bytes under our int3s restored.
+ * Returns how many bytes from the start could be read, like tcdReadMemory(). */
+uint32_t tcdReadProgramMemory(TcdContext *debug, uint64_t address, uint32_t size, void *data) {
+	uint8_t *bytes = data;
+	uint32_t valid = tcdReadMemory(debug, address, size, data);
+	for (uint32_t i = 0; i < debug->numBreaks; i++) {
+		uint64_t at = debug->breaks[i].address;
+		if (at >= address && at - address < size) {
+			bytes[at - address] = debug->breaks[i].saved;
+		}
+	}
+	/* The one on the dynamic linker's r_brk as well */
+	uint64_t at = debug->linkerBreak;
+	if (at != 0 && at >= address && at - address < size) {
+		bytes[at - address] = debug->linkerSaved;
+	}
+	return valid;
+}
+
+static int compareRequests(const void *a, const void *b) {
+	const TcdReadRequest *ra = *(TcdReadRequest* const*)a, *rb = *(TcdReadRequest* const*)b;
+	return ra->address < rb->address ? -1 : ra->address > rb->address;
+}
+
+/* Requests closer than this are fetched together, including the gap */
+#define BATCH_MERGE_GAP 256
+#define BATCH_MAX_IOVS 1024
+
+/* Serves many small reads at once: overlapping and nearby requests are
+ * merged into spans, and all spans are fetched with a single process_vm_readv(). */
+void tcdReadMemoryBatch(TcdContext *debug, TcdReadRequest *reqs, uint32_t count) {
+	if (debug->core != NULL || count == 1) {
+		for (uint32_t i = 0; i < count; i++) {
+			tcdReadMemory(debug, reqs[i].address, reqs[i].size, reqs[i].data);
+		}
+		return;
+	}
+	TcdReadRequest **sorted = malloc(count * sizeof(*sorted));
+	for (uint32_t i = 0; i < count; i++) {
+		sorted[i] = &reqs[i];
+	}
+	qsort(sorted, count, sizeof(*sorted), compareRequests);
+	struct iovec remote[BATCH_MAX_IOVS], local[BATCH_MAX_IOVS];
+	for (uint32_t first = 0; first < count; ) {
+		/* Merge requests into spans until the iovecs run out */
+		uint32_t numSpans = 0, last = first;
+		uint64_t total = 0;
+		for (; last < count; last++) {
+			uint64_t begin = sorted[last]->address, end = begin + sorted[last]->size;
+			if (numSpans > 0) {
+				uint64_t spanBegin = (uint64_t)remote[numSpans - 1].iov_base;
+				uint64_t spanEnd = spanBegin + remote[numSpans - 1].iov_len;
+				if (begin <= spanEnd + BATCH_MERGE_GAP) {
+					if (end > spanEnd) {
+						remote[numSpans - 1].iov_len = end - spanBegin;
+						total += end - spanEnd;
+					}
+					continue;
+				}
+			}
+			if (numSpans == BATCH_MAX_IOVS) break;
+			remote[numSpans].iov_base = (void*)begin;
+			remote[numSpans].iov_len = end - begin;
+			numSpans++;
+			total += end - begin;
+		}
+		uint8_t *staging = malloc(total);
+		uint64_t offset = 0;
+		for (uint32_t s = 0; s < numSpans; s++) {
+			local[s].iov_base = staging + offset;
+			local[s].iov_len = remote[s].iov_len;
+			offset += remote[s].iov_len;
+		}
+		ssize_t got = process_vm_readv(debug->pid, local, numSpans, remote, numSpans, 0);
+		debug->stats.vmReads++;
+		if (got == (ssize_t)total) {
+			debug->stats.bytesRead += got;
+			/* Hand out the pieces of each span */
+			uint32_t s = 0;
+			for (uint32_t i = first; i < last; i++) {
+				while ((uint64_t)remote[s].iov_base + remote[s].iov_len < sorted[i]->address + sorted[i]->size) s++;
+				uint64_t delta = sorted[i]->address - (uint64_t)remote[s].iov_base;
+				memcpy(sorted[i]->data, (uint8_t*)local[s].iov_base + delta, sorted[i]->size);
+			}
+		} else {
+			/* Some span is (partially) unreadable, let the slow path sort it out */
+			for (uint32_t i = first; i < last; i++) {
+				tcdReadMemory(debug, sorted[i]->address, sorted[i]->size, sorted[i]->data);
+			}
+		}
+		free(staging);
+		first = last;
+	}
+	free(sorted);
+}
+
+int tcdReadMappings(TcdContext *debug, TcdMapping **oMaps, uint32_t *oNumMaps) {
+	TcdMapping *maps = NULL;
+	uint32_t numMaps = 0;
+	if (debug->core != NULL) {
+		TcdCore *core = debug->core;
+		maps = calloc(core->numSegments, sizeof(*maps));
+		for (uint32_t i = 0; i < core->numSegments; i++) {
+			maps[i].begin = core->segments[i].begin;
+			maps[i].end   = core->segments[i].end;
+			maps[i].prot  = core->segments[i].prot;
+			maps[i].name  = strdup("");
+		}
+		*oMaps = maps;
+		*oNumMaps = core->numSegments;
+		return 0;
 	}
-	if (size - read > 0) {
-		long word = ptrace(PTRACE_PEEKDATA, debug->pid, address + read, NULL);
-		memcpy(bytes + read, &word, size - read);
+	char path[64];
+	sprintf(path, "/proc/%d/maps", debug->pid);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return -1;
+	char line[4096 + 128];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		TcdMapping map = {0};
+		char perms[8];
+		unsigned major, minor;
+		int nameStart = 0;
+		if (sscanf(line, "%lx-%lx %7s %lx %x:%x %lu %n", &map.begin, &map.end, perms, &map.offset,
+			&major, &minor, &map.inode, &nameStart) < 7)
+			continue;
+		map.device = makedev(major, minor);
+		if (perms[0] == 'r') map.prot |= TCDP_READ;
+		if (perms[1] == 'w') map.prot |= TCDP_WRITE;
+		if (perms[2] == 'x') map.prot |= TCDP_EXEC;
+		if (perms[3] == 's') map.prot |= TCDP_SHARED;
+		char *name = line + nameStart;
+		name[strcspn(name, "\n")] = '\0';
+		map.name = strdup(name);
+		maps = realloc(maps, ++numMaps * sizeof(*maps));
+		maps[numMaps - 1] = map;
 	}
+	fclose(file);
+	*oMaps = maps;
+	*oNumMaps = numMaps;
+	return 0;
+}
+
+void tcdFreeMappings(TcdMapping *maps, uint32_t numMaps) {
+	for (uint32_t i = 0; i < numMaps; i++) {
+		free(maps[i].name);
+	}
+	free(maps);
 }
 
 void tcdWriteMemory(TcdContext *debug, uint64_t address, uint32_t size, void *data) {
+	if (debug->core != NULL) return;
 	uint8_t *bytes = data;
 	uint32_t i = 0;
+	debug->stats.pokes += (size + WORD_SIZE - 1) / WORD_SIZE;
+	debug->stats.bytesWritten += size;
 	while (size - i >= WORD_SIZE) {
-		long word = 0;
-		for (uint32_t b = 0; b < WORD_SIZE; b++) {
-			word |= bytes[i + b] << (b * 8);
-		}
+		long word;
+		memcpy(&word, bytes + i, WORD_SIZE);
 		ptrace(PTRACE_POKEDATA, debug->pid, address + i, (void*)word);
 		i += WORD_SIZE;
 	}
 	if (size - i > 0) {
+		debug->stats.peeks++;
 		long word = ptrace(PTRACE_PEEKDATA, debug->pid, address + i, NULL);
-		for (uint32_t b = 0; b < size - i; b++) {
-			word &= ~(0xFF << (b * 8));
-			word |= bytes[i + b] << (b * 8);
-		}
+		memcpy(&word, bytes + i, size - i);
 		ptrace(PTRACE_POKEDATA, debug->pid, address + i, (void*)word);
 	}
 }
 
-void tcdReadRegisters(TcdContext *debug) {
-	/* TODO */
+/* Fills the register cache from a struct user_regs_struct */
+void tcdUnpackRegisters(TcdContext *debug, const void *data) {
+	const struct user_regs_struct *user = data;
+	memcpy(debug->rawRegs, user, sizeof(debug->rawRegs));
+	debug->regs[TCD_RAX] = user->rax;
+	debug->regs[TCD_RDX] = user->rdx;
+	debug->regs[TCD_RCX] = user->rcx;
+	debug->regs[TCD_RBX] = user->rbx;
+	debug->regs[TCD_RSI] = user->rsi;
+	debug->regs[TCD_RDI] = user->rdi;
+	debug->regs[TCD_RBP] = user->rbp;
+	debug->regs[TCD_RSP] = user->rsp;
+	debug->regs[TCD_R8 ] = user->r8;
+	debug->regs[TCD_R9 ] = user->r9;
+	debug->regs[TCD_R10] = user->r10;
+	debug->regs[TCD_R11] = user->r11;
+	debug->regs[TCD_R12] = user->r12;
+	debug->regs[TCD_R13] = user->r13;
+	debug->regs[TCD_R14] = user->r14;
+	debug->regs[TCD_R15] = user->r15;
+	debug->regs[TCD_RIP] = user->rip;
+	debug->regsValid = 1;
+}
+
+/* The cache stays valid until the process is resumed (see tcdSync);
+ * returns -1 and zeroes it if the process isn't stopped */
+int tcdReadRegisters(TcdContext *debug) {
+	if (debug->regsValid) return 0;
+	struct user_regs_struct user;
+	if (debug->running) {
+		memset(debug->regs, 0, sizeof(debug->regs));
+		return -1;
+	}
+	debug->stats.regReads++;
+	if (ptrace(PTRACE_GETREGS, debug->pid, NULL, &user) < 0) {
+		memset(debug->regs, 0, sizeof(debug->regs));
+		return -1;
+	}
+	tcdUnpackRegisters(debug, &user);
+	return 0;
+}
+
+/* Writes a struct user_regs_struct to the process and the cache */
+int tcdWriteRawRegisters(TcdContext *debug, const void *data) {
+	if (debug->core != NULL) return -1;
+	debug->stats.regWrites++;
+	if (ptrace(PTRACE_SETREGS, debug->pid, NULL, data) < 0) return -1;
+	tcdUnpackRegisters(debug, data);
+	return 0;
 }
 
 uint64_t tcdReadIP(TcdContext *debug) {
-	return ptrace(PTRACE_PEEKUSER, debug->pid, 8 * RIP, NULL);
+	tcdReadRegisters(debug);
+	return debug->regs[TCD_RIP];
 }
 
 uint64_t tcdReadBP(TcdContext *debug) {
-	return ptrace(PTRACE_PEEKUSER, debug->pid, 8 * RBP, NULL);
+	tcdReadRegisters(debug);
+	return debug->regs[TCD_RBP];
+}
+
+void tcdWriteIP(TcdContext *debug, uint64_t ip) {
+	if (debug->core != NULL) return;
+	debug->stats.regWrites++;
+	ptrace(PTRACE_POKEUSER, debug->pid, 8 * RIP, ip);
+	debug->regs[TCD_RIP] = ip;
+	debug->rawRegs[RIP] = ip;
 }
 
 void tcdReadRtLoc(TcdContext *debug, TcdRtLoc rtloc, uint32_t size, void *data) {
@@ -65,34 +570,72 @@ void tcdReadRtLoc(TcdContext *debug, TcdRtLoc rtloc, uint32_t size, void *data)
 			tcdReadMemory(debug, rtloc.address, size, data);
 			break;
 		case TCDR_REGISTER:
-			/* TODO implement */
+			/* Vector registers are not cached, so they read as zero */
 			memset(data, 0, size);
+			if (rtloc.address < TCD_NUM_REGS) {
+				tcdReadRegisters(debug);
+				memcpy(data, &debug->regs[rtloc.address], size <= 8 ? size : 8);
+			}
 			break;
 		case TCDR_HOST_TEMP:
 			memcpy(data, &rtloc.address, size <= 8 ? size : 8);
 			break;
+		case TCDR_HOST_BUFFER:
+			memset(data, 0, size);
+			if (rtloc.address < debug->hostBufferUsed) {
+				uint32_t avail = debug->hostBufferUsed - rtloc.address;
+				memcpy(data, debug->hostBuffer + rtloc.address, size <= avail ? size : avail);
+			}
+			break;
 	}
 }
 
-void tcdStepInstruction(TcdContext *debug) {
-	ptrace(PTRACE_SINGLESTEP, debug->pid, NULL, NULL);
+/* <sig>, or else one of the signals held back while a syscall was injected */
+static int nextSignal(TcdContext *debug, int sig) {
+	if (sig != 0 || debug->deferredSignals == 0) return sig;
+	sig = __builtin_ctzll(debug->deferredSignals) + 1;
+	debug->deferredSignals &= ~(1ull << (sig - 1));
+	return sig;
+}
+
+/* Executes a single instruction, delivering <sig> first unless it is 0 */
+void tcdStepInstruction(TcdContext *debug, int sig) {
+	debug->stats.steps++;
+	debug->resumeRequest = PTRACE_SINGLESTEP;
+	debug->regsValid = 0;
+	debug->running = 1;
+	ptrace(PTRACE_SINGLESTEP, debug->pid, NULL, (void*)(long)nextSignal(debug, sig));
+}
+
+/* Resumes the process, delivering <sig> to it unless it is 0 */
+void tcdContinue(TcdContext *debug, int sig) {
+	debug->stats.continues++;
+	debug->resumeRequest = PTRACE_CONT;
+	debug->regsValid = 0;
+	debug->running = 1;
+	ptrace(PTRACE_CONT, debug->pid, NULL, (void*)(long)nextSignal(debug, sig));
+}
+
+/* Whether <ip> is the first instruction of a line, following <func> along */
+static int atLineStart(TcdContext *debug, TcdFunction **func, uint64_t ip) {
+	uint64_t link = ip - debug->loadBias;
+	if (*func == NULL || !tcdFunctionContains(*func, link)) {
+		*func = tcdFunctionAt(debug, ip);
+	}
+	if (*func == NULL) return 0;
+	TcdLine *line = tcdNearestLine(*func, link);
+	return line != NULL && line->address == link;
 }
 
 uint64_t tcdStep(TcdContext *debug) {
 	uint64_t ip = tcdReadIP(debug);
-	TcdFunction *func = tcdSurroundingFunction(&debug->info, ip);
+	TcdFunction *func = tcdFunctionAt(debug, ip);
 	do {
-		tcdStepInstruction(debug);
+		tcdStepInstruction(debug, 0);
 		tcdSync(debug);
 		ip = tcdReadIP(debug);
-		if (func == NULL || !(ip >= func->begin && ip <= func->end)) {
-			func = tcdSurroundingFunction(&debug->info, ip);
-		}
-		if (func != NULL) {
-			TcdLine *line = tcdNearestLine(func, ip);
-			if (line != NULL && line->address == ip)
-				break;
-		}
+		if (atLineStart(debug, &func, ip))
+			break;
 	} while (WIFSTOPPED(debug->status));
 	return ip;
 }
@@ -100,28 +643,37 @@ uint64_t tcdStep(TcdContext *debug) {
 uint64_t tcdNext(TcdContext *debug) {
 	uint64_t level = tcdReadBP(debug);
 	uint64_t ip = tcdReadIP(debug);
-	TcdFunction *func = tcdSurroundingFunction(&debug->info, ip);
+	TcdFunction *func = tcdFunctionAt(debug, ip);
 	do {
-		tcdStepInstruction(debug);
+		tcdStepInstruction(debug, 0);
 		tcdSync(debug);
 		uint64_t bp = tcdReadBP(debug);
 		if (bp >= level) {
 			ip = tcdReadIP(debug);
-			if (func == NULL || !(ip >= func->begin && ip <= func->end)) {
-				func = tcdSurroundingFunction(&debug->info, ip);
-			}
-			if (func != NULL) {
-				TcdLine *line = tcdNearestLine(func, ip);
-				if (line != NULL && line->address == ip)
-					break;
-			}
+			if (atLineStart(debug, &func, ip))
+				break;
 		}
 	} while (WIFSTOPPED(debug->status));
 	return ip;
 }
 
+uint64_t tcdFindCallSite(TcdContext *debug) {
+	uint64_t ip = tcdReadIP(debug);
+	if (tcdFunctionAt(debug, ip) != NULL) return ip;
+	/* Inside code we know nothing about (libc, most likely);
+	 * the innermost return address into known code is the call site. */
+	uint64_t sp = debug->regs[TCD_RSP];
+	uint64_t words[256];
+	tcdReadMemory(debug, sp, sizeof(words), words);
+	for (uint32_t i = 0; i < 256; i++) {
+		if (tcdFunctionAt(debug, words[i]) != NULL)
+			return words[i];
+	}
+	return ip;
+}
+
 uint16_t tcdGetStackTrace(TcdContext *debug, uint64_t *trace, int max) {
-	TcdFunction *fmain = tcdFunctionByName(&debug->info, "main");
+	TcdFunction *fmain = tcdFunctionByName(debug->info, "main");
 	if (fmain == NULL) return 0;
 	uint64_t address   = tcdReadIP(debug);
 	uint64_t framebase = tcdReadBP(debug);
@@ -129,7 +681,8 @@ uint16_t tcdGetStackTrace(TcdContext *debug, uint64_t *trace, int max) {
 	while (level < max) {
 		trace[level] = address;
 		level++;
-		if (address >= fmain->begin && address < fmain->end)
+		uint64_t link = address - debug->loadBias;
+		if (tcdFunctionContains(fmain, link))
 			break;
 		uint64_t ufb;
 		tcdReadMemory(debug, framebase    , 8, &ufb);
@@ -153,3 +706,136 @@ void tcdInsertBreakpoint(TcdContext *debug, uint64_t address, uint32_t line) {
 	debug->breaks = realloc(debug->breaks, ++debug->numBreaks * sizeof(*debug->breaks));
 	debug->breaks[debug->numBreaks - 1] = point;
 }
+
+/* Puts the original instruction back; returns -1 if there is no breakpoint at <address> */
+int tcdRemoveBreakpoint(TcdContext *debug, uint64_t address) {
+	for (uint32_t i = 0; i < debug->numBreaks; i++) {
+		if (debug->breaks[i].address != address) continue;
+		tcdWriteMemory(debug, address, 1, &debug->breaks[i].saved);
+		memmove(debug->breaks + i, debug->breaks + i + 1, (debug->numBreaks - i - 1) * sizeof(*debug->breaks));
+		debug->numBreaks--;
+		return 0;
+	}
+	return -1;
+}
+
+/* syscall; int3 */
+static const uint8_t SYSCALL_STUB[] = {0x0F, 0x05, 0xCC};
+
+/* Makes the stopped process execute a single system call at its current
+ * instruction pointer, then puts its code and registers back in place.
+ * Signals that arrive meanwhile are added to <deferred>, by bit sig - 1. */
+static int injectSyscall(int pid, uint64_t nr, const uint64_t args[6], int64_t *ret, uint64_t *deferred) {
+	struct user_regs_struct saved, regs;
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &saved) < 0) return -1;
+	errno = 0;
+	long word = ptrace(PTRACE_PEEKTEXT, pid, saved.rip, NULL);
+	if (errno != 0) return -1;
+	long patched = word;
+	memcpy(&patched, SYSCALL_STUB, sizeof(SYSCALL_STUB));
+	if (ptrace(PTRACE_POKETEXT, pid, saved.rip, (void*)patched) < 0) return -1;
+	regs = saved;
+	regs.orig_rax = -1; /* Don't let the kernel restart an interrupted call */
+	regs.rax = nr;
+	regs.rdi = args[0];
+	regs.rsi = args[1];
+	regs.rdx = args[2];
+	regs.r10 = args[3];
+	regs.r8  = args[4];
+	regs.r9  = args[5];
+	ptrace(PTRACE_SETREGS, pid, NULL, &regs);
+	/* Run until the int3 behind the syscall, passing over any
+	 * ptrace event stops (e.g. a caught syscall) on the way. */
+	int status;
+	for (;;) {
+		ptrace(PTRACE_CONT, pid, NULL, NULL);
+		if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+		if (status >> 16 != 0) continue;
+		int sig = WSTOPSIG(status);
+		if (sig == SIGTRAP) {
+			ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+			if (regs.rip == saved.rip + sizeof(SYSCALL_STUB)) break;
+		}
+		if (sig >= 1 && sig <= 64) *deferred |= 1ull << (sig - 1);
+	}
+	*ret = regs.rax;
+	/* Restore */
+	ptrace(PTRACE_POKETEXT, pid, saved.rip, (void*)word);
+	ptrace(PTRACE_SETREGS, pid, NULL, &saved);
+	return 0;
+}
+
+int tcdInjectSyscall(TcdContext *debug, uint64_t nr, const uint64_t *args, int64_t *ret) {
+	return injectSyscall(debug->pid, nr, args, ret, &debug->deferredSignals);
+}
+
+/* Forks the stopped process. The child is traced by us as well (CLONE_PTRACE)
+ * and is left stopped in exactly the state the parent is in. */
+static int forkStopped(int pid, uint64_t *deferred, int *oChild, int *oStatus) {
+	struct user_regs_struct saved;
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &saved) < 0) return -1;
+	errno = 0;
+	long word = ptrace(PTRACE_PEEKTEXT, pid, saved.rip, NULL);
+	if (errno != 0) return -1;
+	uint64_t args[6] = {CLONE_PTRACE | SIGCHLD, 0, 0, 0, 0, 0};
+	int64_t child;
+	if (injectSyscall(pid, SYS_clone, args, &child, deferred) != 0 || child <= 0) return -1;
+	/* The child starts with a pending SIGSTOP */
+	int status;
+	if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+	/* Undo the injection inside the child, too */
+	ptrace(PTRACE_POKETEXT, child, saved.rip, (void*)word);
+	ptrace(PTRACE_SETREGS, child, NULL, &saved);
+	*oChild = child;
+	*oStatus = status;
+	return 0;
+}
+
+int tcdForkProcess(TcdContext *debug, int *oPid) {
+	int status;
+	return forkStopped(debug->pid, &debug->deferredSignals, oPid, &status);
+}
+
+int tcdCheckpoint(TcdContext *debug) {
+	TcdCheckpoint cp = {0};
+	int status;
+	if (forkStopped(debug->pid, &debug->deferredSignals, &cp.pid, &status) != 0) return -1;
+	cp.address = tcdReadIP(debug);
+	cp.breaks = malloc(debug->numBreaks * sizeof(*cp.breaks));
+	memcpy(cp.breaks, debug->breaks, debug->numBreaks * sizeof(*cp.breaks));
+	cp.numBreaks = debug->numBreaks;
+	cp.linkerBreak = debug->linkerBreak;
+	debug->checkpoints = realloc(debug->checkpoints, ++debug->numCheckpoints * sizeof(*debug->checkpoints));
+	debug->checkpoints[debug->numCheckpoints - 1] = cp;
+	return debug->numCheckpoints - 1;
+}
+
+int tcdRestart(TcdContext *debug, uint32_t index) {
+	if (index >= debug->numCheckpoints) return -1;
+	TcdCheckpoint *cp = &debug->checkpoints[index];
+	/* Fork the checkpoint again so that it stays reusable */
+	int pid, status;
+	uint64_t deferred = 0;
+	int res = forkStopped(cp->pid, &deferred, &pid, &status);
+	/* Signals sent to the checkpoint stay with it */
+	for (int sig = 1; sig <= 64; sig++) {
+		if (deferred & 1ull << (sig - 1)) kill(cp->pid, sig);
+	}
+	if (res != 0) return -1;
+	/* Discard the current process */
+	if (!WIFEXITED(debug->status) && !WIFSIGNALED(debug->status)) {
+		kill(debug->pid, SIGKILL);
+		waitpid(debug->pid, NULL, 0);
+	}
+	debug->pid = pid;
+	debug->status = status;
+	debug->regsValid = 0;
+	debug->deferredSignals = 0;
+	debug->breaks = realloc(debug->breaks, cp->numBreaks * sizeof(*debug->breaks));
+	memcpy(debug->breaks, cp->breaks, cp->numBreaks * sizeof(*debug->breaks));
+	debug->numBreaks = cp->numBreaks;
+	/* The libraries may differ, and pending breakpoints may have come or gone */
+	debug->linkerBreak = cp->linkerBreak;
+	tcdRefreshLibraries(debug);
+	return 0;
+}
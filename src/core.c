@@ -0,0 +1,371 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define NOTE_ALIGN(n) (((n) + 3) & ~3UL)
+
+#define CORE_PAGE_SIZE 4096
+/* Memory is copied into the core in chunks of this size */
+#define CORE_CHUNK_SIZE (1 << 20)
+
+static int compareSegments(const void *a, const void *b) {
+	const TcdCoreSegment *sa = a, *sb = b;
+	return sa->begin < sb->begin ? -1 : sa->begin > sb->begin;
+}
+
+/* Picks the registers of the first thread (the one that received the signal),
+ * and the entry point from the auxiliary vector */
+static int loadNotes(TcdCore *core, const uint8_t *notes, uint64_t size, TcdContext *debug) {
+	uint64_t pos = 0;
+	int haveRegs = 0;
+	while (pos + sizeof(Elf64_Nhdr) <= size) {
+		const Elf64_Nhdr *nhdr = (const Elf64_Nhdr*)(notes + pos);
+		uint64_t desc = pos + sizeof(*nhdr) + NOTE_ALIGN(nhdr->n_namesz);
+		if (desc + nhdr->n_descsz > size) break;
+		if (nhdr->n_type == NT_PRSTATUS && nhdr->n_descsz >= sizeof(struct elf_prstatus) && !haveRegs) {
+			const struct elf_prstatus *status = (const struct elf_prstatus*)(notes + desc);
+			core->pid = status->pr_pid;
+			core->signal = status->pr_cursig;
+			tcdUnpackRegisters(debug, &status->pr_reg);
+			haveRegs = 1;
+		} else if (nhdr->n_type == NT_AUXV) {
+			const Elf64_auxv_t *auxv = (const Elf64_auxv_t*)(notes + desc);
+			for (uint64_t i = 0; i < nhdr->n_descsz / sizeof(*auxv); i++) {
+				if (auxv[i].a_type == AT_ENTRY) core->entry = auxv[i].a_un.a_val;
+			}
+		}
+		pos = desc + NOTE_ALIGN(nhdr->n_descsz);
+	}
+	return haveRegs ? 0 : -1;
+}
+
+int tcdLoadCore(const char *file, TcdContext *debug) {
+	TcdCore core = {0};
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return TCDE_CORE_OPEN;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return TCDE_CORE_FORMAT;
+	}
+	/* Pages are only faulted in once they are actually read */
+	core.mapSize = st.st_size;
+	core.map = mmap(NULL, core.mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (core.map == MAP_FAILED) return TCDE_CORE_OPEN;
+	const uint8_t *base = core.map;
+	const Elf64_Ehdr *ehdr = core.map;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+		ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+		ehdr->e_type != ET_CORE || ehdr->e_machine != EM_X86_64 ||
+		ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > core.mapSize) {
+		munmap(core.map, core.mapSize);
+		return TCDE_CORE_FORMAT;
+	}
+	const Elf64_Phdr *phdrs = (const Elf64_Phdr*)(base + ehdr->e_phoff);
+	int haveRegs = 0;
+	core.segments = malloc(ehdr->e_phnum * sizeof(*core.segments));
+	for (uint32_t i = 0; i < ehdr->e_phnum; i++) {
+		const Elf64_Phdr *phdr = &phdrs[i];
+		/* Tolerate truncated cores */
+		uint64_t fileSize = phdr->p_filesz;
+		if (phdr->p_offset >= core.mapSize) {
+			fileSize = 0;
+		} else if (phdr->p_offset + fileSize > core.mapSize) {
+			fileSize = core.mapSize - phdr->p_offset;
+		}
+		if (phdr->p_type == PT_LOAD) {
+			TcdCoreSegment seg;
+			seg.begin = phdr->p_vaddr;
+			seg.end = phdr->p_vaddr + phdr->p_memsz;
+			seg.fileSize = fileSize;
+			seg.prot = 0;
+			if (phdr->p_flags & PF_R) seg.prot |= TCDP_READ;
+			if (phdr->p_flags & PF_W) seg.prot |= TCDP_WRITE;
+			if (phdr->p_flags & PF_X) seg.prot |= TCDP_EXEC;
+			seg.data = base + phdr->p_offset;
+			core.segments[core.numSegments++] = seg;
+		} else if (phdr->p_type == PT_NOTE && !haveRegs) {
+			haveRegs = loadNotes(&core, base + phdr->p_offset, fileSize, debug) == 0;
+		}
+	}
+	if (!haveRegs) {
+		tcdFreeCore(&core);
+		return TCDE_CORE_FORMAT;
+	}
+	qsort(core.segments, core.numSegments, sizeof(*core.segments), compareSegments);
+	debug->core = malloc(sizeof(core));
+	*debug->core = core;
+	debug->pid = core.pid;
+	return TCDE_OK;
+}
+
+/* On a miss, *oNext is the index of the first segment above the address */
+static TcdCoreSegment *findSegment(TcdCore *core, uint64_t address, uint32_t *oNext) {
+	uint32_t lo = 0, hi = core->numSegments;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		TcdCoreSegment *seg = &core->segments[mid];
+		if (address < seg->begin) {
+			hi = mid;
+		} else if (address >= seg->end) {
+			lo = mid + 1;
+		} else {
+			return seg;
+		}
+	}
+	*oNext = lo;
+	return NULL;
+}
+
+/* Memory that was not dumped (or never mapped) reads as zeroes. Returns how
+ * many bytes from the start lie in mapped segments. */
+uint32_t tcdReadCoreMemory(TcdCore *core, uint64_t address, uint32_t size, void *data) {
+	uint8_t *bytes = data;
+	uint32_t read = 0, valid = size;
+	while (size > 0) {
+		uint32_t next;
+		TcdCoreSegment *seg = findSegment(core, address, &next);
+		uint32_t chunk = size;
+		if (seg == NULL) {
+			if (next < core->numSegments && core->segments[next].begin - address < chunk)
+				chunk = core->segments[next].begin - address;
+			memset(bytes, 0, chunk);
+			if (valid > read) valid = read;
+		} else {
+			if (seg->end - address < chunk)
+				chunk = seg->end - address;
+			uint64_t offset = address - seg->begin;
+			uint64_t avail = offset < seg->fileSize ? seg->fileSize - offset : 0;
+			if (avail >= chunk) {
+				memcpy(bytes, seg->data + offset, chunk);
+			} else {
+				memcpy(bytes, seg->data + offset, avail);
+				memset(bytes + avail, 0, chunk - avail);
+			}
+		}
+		bytes += chunk;
+		address += chunk;
+		size -= chunk;
+		read += chunk;
+	}
+	return valid;
+}
+
+void tcdFreeCore(TcdCore *core) {
+	munmap(core->map, core->mapSize);
+	free(core->segments);
+}
+
+static void appendNote(uint8_t **notes, uint64_t *size, uint32_t type, const void *desc, uint32_t descSize) {
+	static const char name[] = "CORE";
+	Elf64_Nhdr nhdr;
+	nhdr.n_namesz = sizeof(name);
+	nhdr.n_descsz = descSize;
+	nhdr.n_type = type;
+	uint64_t total = sizeof(nhdr) + NOTE_ALIGN(sizeof(name)) + NOTE_ALIGN(descSize);
+	*notes = realloc(*notes, *size + total);
+	uint8_t *note = *notes + *size;
+	memset(note, 0, total);
+	memcpy(note, &nhdr, sizeof(nhdr));
+	memcpy(note + sizeof(nhdr), name, sizeof(name));
+	memcpy(note + sizeof(nhdr) + NOTE_ALIGN(sizeof(name)), desc, descSize);
+	*size += total;
+}
+
+static uint8_t *readProcFile(int pid, const char *entry, uint32_t *oSize) {
+	char path[64];
+	sprintf(path, "/proc/%d/%s", pid, entry);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	uint8_t *data = NULL;
+	uint32_t size = 0;
+	for (;;) {
+		data = realloc(data, size + 4096);
+		ssize_t got = read(fd, data + size, 4096);
+		if (got <= 0) break;
+		size += got;
+	}
+	close(fd);
+	*oSize = size;
+	return data;
+}
+
+/* NT_PRSTATUS, NT_PRPSINFO, NT_AUXV and NT_FILE, as the kernel writes them */
+static uint8_t *buildNotes(TcdContext *debug, TcdMapping *maps, uint32_t numMaps, uint64_t *oSize) {
+	uint8_t *notes = NULL;
+	uint64_t size = 0;
+
+	struct elf_prstatus status;
+	memset(&status, 0, sizeof(status));
+	status.pr_pid = debug->pid;
+	status.pr_cursig = WIFSTOPPED(debug->status) ? WSTOPSIG(debug->status) : 0;
+	status.pr_info.si_signo = status.pr_cursig;
+	tcdReadRegisters(debug);
+	memcpy(&status.pr_reg, debug->rawRegs, sizeof(status.pr_reg));
+	appendNote(&notes, &size, NT_PRSTATUS, &status, sizeof(status));
+
+	struct elf_prpsinfo info;
+	memset(&info, 0, sizeof(info));
+	info.pr_pid = debug->pid;
+	info.pr_sname = 't';
+	uint32_t commSize = 0;
+	uint8_t *comm = readProcFile(debug->pid, "comm", &commSize);
+	if (comm != NULL) {
+		if (commSize > 0 && comm[commSize - 1] == '\n') commSize--;
+		memcpy(info.pr_fname, comm, commSize < sizeof(info.pr_fname) - 1 ? commSize : sizeof(info.pr_fname) - 1);
+		free(comm);
+	}
+	appendNote(&notes, &size, NT_PRPSINFO, &info, sizeof(info));
+
+	uint32_t auxvSize = 0;
+	uint8_t *auxv = readProcFile(debug->pid, "auxv", &auxvSize);
+	if (auxv != NULL) {
+		appendNote(&notes, &size, NT_AUXV, auxv, auxvSize);
+		free(auxv);
+	}
+
+	/* count, page size, {start, end, page offset} * count, names */
+	uint64_t count = 0, namesSize = 0;
+	for (uint32_t i = 0; i < numMaps; i++) {
+		if (maps[i].name[0] == '/') {
+			count++;
+			namesSize += strlen(maps[i].name) + 1;
+		}
+	}
+	uint64_t fileSize = 2 * 8 + count * 3 * 8 + namesSize;
+	uint64_t *file = malloc(fileSize);
+	file[0] = count;
+	file[1] = CORE_PAGE_SIZE;
+	uint64_t *entry = file + 2;
+	char *names = (char*)(file + 2 + count * 3);
+	for (uint32_t i = 0; i < numMaps; i++) {
+		if (maps[i].name[0] != '/') continue;
+		*entry++ = maps[i].begin;
+		*entry++ = maps[i].end;
+		*entry++ = maps[i].offset / CORE_PAGE_SIZE;
+		strcpy(names, maps[i].name);
+		names += strlen(maps[i].name) + 1;
+	}
+	appendNote(&notes, &size, NT_FILE, file, fileSize);
+	free(file);
+
+	*oSize = size;
+	return notes;
+}
+
+static int isZeroPage(const uint8_t *page) {
+	const uint64_t *words = (const uint64_t*)page;
+	uint64_t acc = 0;
+	for (uint32_t i = 0; i < CORE_PAGE_SIZE / 8; i++) {
+		acc |= words[i];
+	}
+	return acc == 0;
+}
+
+/* Streams a mapping into the file, leaving holes where pages are all zero */
+static int copyMapping(TcdContext *debug, int fd, TcdMapping *map, uint64_t fileOffset, uint8_t *buffer) {
+	for (uint64_t address = map->begin; address < map->end; address += CORE_CHUNK_SIZE) {
+		uint32_t chunk = map->end - address < CORE_CHUNK_SIZE ? map->end - address : CORE_CHUNK_SIZE;
+		tcdReadProgramMemory(debug, address, chunk, buffer);
+		uint32_t runStart = 0;
+		for (uint32_t page = 0; page <= chunk; page += CORE_PAGE_SIZE) {
+			if (page < chunk && !isZeroPage(buffer + page)) continue;
+			if (page > runStart) {
+				uint64_t at = fileOffset + (address - map->begin) + runStart;
+				if (pwrite(fd, buffer + runStart, page - runStart, at) != page - runStart) return -1;
+			}
+			runStart = page + CORE_PAGE_SIZE;
+		}
+	}
+	return 0;
+}
+
+int tcdWriteCore(TcdContext *debug, const char *file) {
+	if (debug->core != NULL) return -1;
+	TcdMapping *maps;
+	uint32_t numMaps;
+	if (tcdReadMappings(debug, &maps, &numMaps) != 0) return -1;
+	/* Unreadable mappings (guard pages, [vvar], ...) are described but not dumped */
+	uint64_t *dumpSizes = malloc(numMaps * sizeof(*dumpSizes));
+	for (uint32_t i = 0; i < numMaps; i++) {
+		int dump = (maps[i].prot & TCDP_READ) && strcmp(maps[i].name, "[vvar]") != 0 &&
+			strcmp(maps[i].name, "[vsyscall]") != 0;
+		dumpSizes[i] = dump ? maps[i].end - maps[i].begin : 0;
+	}
+	uint64_t notesSize;
+	uint8_t *notes = buildNotes(debug, maps, numMaps, &notesSize);
+
+	/* Layout: header, program headers, notes, then page aligned memory */
+	uint32_t numPhdrs = numMaps + 1;
+	uint64_t notesOffset = sizeof(Elf64_Ehdr) + numPhdrs * sizeof(Elf64_Phdr);
+	uint64_t dataOffset = (notesOffset + notesSize + CORE_PAGE_SIZE - 1) & ~(uint64_t)(CORE_PAGE_SIZE - 1);
+
+	Elf64_Ehdr ehdr;
+	memset(&ehdr, 0, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr.e_type = ET_CORE;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(Elf64_Phdr);
+	ehdr.e_phnum = numPhdrs;
+
+	Elf64_Phdr *phdrs = calloc(numPhdrs, sizeof(*phdrs));
+	phdrs[0].p_type = PT_NOTE;
+	phdrs[0].p_offset = notesOffset;
+	phdrs[0].p_filesz = notesSize;
+	uint64_t offset = dataOffset;
+	for (uint32_t i = 0; i < numMaps; i++) {
+		Elf64_Phdr *phdr = &phdrs[i + 1];
+		phdr->p_type = PT_LOAD;
+		phdr->p_offset = offset;
+		phdr->p_vaddr = maps[i].begin;
+		phdr->p_memsz = maps[i].end - maps[i].begin;
+		phdr->p_filesz = dumpSizes[i];
+		phdr->p_align = CORE_PAGE_SIZE;
+		if (maps[i].prot & TCDP_READ)  phdr->p_flags |= PF_R;
+		if (maps[i].prot & TCDP_WRITE) phdr->p_flags |= PF_W;
+		if (maps[i].prot & TCDP_EXEC)  phdr->p_flags |= PF_X;
+		offset += dumpSizes[i];
+	}
+
+	int res = -1;
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0) {
+		uint8_t *buffer = malloc(CORE_CHUNK_SIZE);
+		res = 0;
+		if (pwrite(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+			pwrite(fd, phdrs, numPhdrs * sizeof(*phdrs), sizeof(ehdr)) != numPhdrs * sizeof(*phdrs) ||
+			pwrite(fd, notes, notesSize, notesOffset) != notesSize) {
+			res = -1;
+		}
+		for (uint32_t i = 0; i < numMaps && res == 0; i++) {
+			if (dumpSizes[i] == 0) continue;
+			res = copyMapping(debug, fd, &maps[i], phdrs[i + 1].p_offset, buffer);
+		}
+		/* Trailing zero pages become a hole, too */
+		if (res == 0 && ftruncate(fd, offset) != 0) res = -1;
+		free(buffer);
+		close(fd);
+	}
+	free(phdrs);
+	free(notes);
+	free(dumpSizes);
+	tcdFreeMappings(maps, numMaps);
+	return res;
+}
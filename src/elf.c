@@ -0,0 +1,213 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
+int tcdElfOpen(const char *file, TcdElf *elf) {
+	memset(elf, 0, sizeof(*elf));
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return -1;
+	}
+	elf->mapSize = st.st_size;
+	elf->map = mmap(NULL, elf->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf->map == MAP_FAILED) {
+		elf->map = NULL;
+		return -1;
+	}
+	const Elf64_Ehdr *ehdr = elf->map;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+		ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+		ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > elf->mapSize ||
+		ehdr->e_shstrndx >= ehdr->e_shnum) {
+		tcdElfClose(elf);
+		return -1;
+	}
+	return 0;
+}
+
+static const Elf64_Shdr *sectionHeader(TcdElf *elf, uint16_t index) {
+	const uint8_t *base = elf->map;
+	const Elf64_Ehdr *ehdr = elf->map;
+	return (const Elf64_Shdr*)(base + ehdr->e_shoff) + index;
+}
+
+static const char *sectionName(TcdElf *elf, const Elf64_Shdr *shdr) {
+	const Elf64_Ehdr *ehdr = elf->map;
+	const Elf64_Shdr *strtab = sectionHeader(elf, ehdr->e_shstrndx);
+	if (shdr->sh_name >= strtab->sh_size || strtab->sh_offset + strtab->sh_size > elf->mapSize) return "";
+	return (const char*)elf->map + strtab->sh_offset + shdr->sh_name;
+}
+
+uint16_t tcdElfSectionCount(TcdElf *elf) {
+	if (elf->map == NULL) return 0;
+	const Elf64_Ehdr *ehdr = elf->map;
+	return ehdr->e_shnum;
+}
+
+/* Index of the named section; -1 if it is missing or has no contents in the file */
+int tcdElfSectionIndex(TcdElf *elf, const char *name) {
+	for (uint16_t i = 0; i < tcdElfSectionCount(elf); i++) {
+		const Elf64_Shdr *shdr = sectionHeader(elf, i);
+		if (strcmp(sectionName(elf, shdr), name) != 0) continue;
+		if (shdr->sh_type == SHT_NOBITS || shdr->sh_offset + shdr->sh_size > elf->mapSize) return -1;
+		return i;
+	}
+	return -1;
+}
+
+/* The compression header of a SHF_COMPRESSED section, or NULL */
+static const Elf64_Chdr *compressionHeader(TcdElf *elf, const Elf64_Shdr *shdr) {
+	if (!(shdr->sh_flags & SHF_COMPRESSED) || shdr->sh_type == SHT_NOBITS) return NULL;
+	if (shdr->sh_size < sizeof(Elf64_Chdr) || shdr->sh_offset + shdr->sh_size > elf->mapSize) return NULL;
+	return (const Elf64_Chdr*)((const uint8_t*)elf->map + shdr->sh_offset);
+}
+
+int tcdElfSectionInfo(TcdElf *elf, uint16_t index, TcdElfSectionInfo *si) {
+	if (index >= tcdElfSectionCount(elf)) return -1;
+	const Elf64_Shdr *shdr = sectionHeader(elf, index);
+	const Elf64_Chdr *chdr = compressionHeader(elf, shdr);
+	si->name = sectionName(elf, shdr);
+	si->addr = shdr->sh_addr;
+	si->size = chdr != NULL ? chdr->ch_size : shdr->sh_size;
+	si->type = shdr->sh_type;
+	si->link = shdr->sh_link;
+	si->info = shdr->sh_info;
+	si->entrySize = shdr->sh_entsize;
+	return 0;
+}
+
+static uint8_t *inflateSection(const Elf64_Chdr *chdr, const uint8_t *data, uint64_t size) {
+	uint8_t *out = malloc(chdr->ch_size > 0 ? chdr->ch_size : 1);
+	if (out == NULL) return NULL;
+	int ok = 0;
+	if (chdr->ch_type == ELFCOMPRESS_ZLIB) {
+		uLongf outSize = chdr->ch_size;
+		ok = uncompress(out, &outSize, data, size) == Z_OK && outSize == chdr->ch_size;
+	} else if (chdr->ch_type == ELFCOMPRESS_ZSTD) {
+		size_t got = ZSTD_decompress(out, chdr->ch_size, data, size);
+		ok = !ZSTD_isError(got) && got == chdr->ch_size;
+	}
+	if (!ok) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/* Contents of a section; compressed ones are inflated on first use only.
+ * Returns NULL if the section is missing, truncated or can't be inflated. */
+const uint8_t *tcdElfSectionAt(TcdElf *elf, uint16_t index, uint64_t *size) {
+	if (index >= tcdElfSectionCount(elf)) return NULL;
+	const Elf64_Shdr *shdr = sectionHeader(elf, index);
+	if (shdr->sh_type == SHT_NOBITS || shdr->sh_offset + shdr->sh_size > elf->mapSize) return NULL;
+	const uint8_t *data = (const uint8_t*)elf->map + shdr->sh_offset;
+	const Elf64_Chdr *chdr = compressionHeader(elf, shdr);
+	if (chdr == NULL) {
+		*size = shdr->sh_size;
+		return data;
+	}
+	if (elf->inflated == NULL) {
+		elf->inflated = calloc(tcdElfSectionCount(elf), sizeof(*elf->inflated));
+	}
+	if (elf->inflated[index] == NULL) {
+		elf->inflated[index] = inflateSection(chdr, data + sizeof(*chdr), shdr->sh_size - sizeof(*chdr));
+		if (elf->inflated[index] == NULL) return NULL;
+	}
+	*size = chdr->ch_size;
+	return elf->inflated[index];
+}
+
+const uint8_t *tcdElfSection(TcdElf *elf, const char *name, uint64_t *size) {
+	int index = tcdElfSectionIndex(elf, name);
+	return index < 0 ? NULL : tcdElfSectionAt(elf, index, size);
+}
+
+/* A separate debug file is only taken if it has debug info, and for
+ * .gnu_debuglink also only if the checksum matches */
+static int tryDebugFile(const char *path, int checkCrc, uint32_t crc) {
+	TcdElf candidate;
+	if (tcdElfOpen(path, &candidate) != 0) return -1;
+	int ok = tcdElfSectionIndex(&candidate, ".debug_info") >= 0;
+	if (ok && checkCrc) {
+		ok = crc32(0, candidate.map, candidate.mapSize) == crc;
+	}
+	tcdElfClose(&candidate);
+	return ok ? 0 : -1;
+}
+
+/* Looks for the separate debug file of <elf>, which was opened from <path>,
+ * where GDB would: by build ID under /usr/lib/debug/.build-id, then by the
+ * .gnu_debuglink name next to the file, in its .debug directory and under
+ * /usr/lib/debug. */
+int tcdElfFindDebugFile(TcdElf *elf, const char *path, char *out, size_t outSize) {
+	uint64_t size;
+	const uint8_t *note = tcdElfSection(elf, ".note.gnu.build-id", &size);
+	if (note != NULL && size >= sizeof(Elf64_Nhdr)) {
+		const Elf64_Nhdr *nhdr = (const Elf64_Nhdr*)note;
+		uint64_t descOffset = sizeof(*nhdr) + ((nhdr->n_namesz + 3) & ~3u);
+		if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_descsz >= 2 && descOffset + nhdr->n_descsz <= size) {
+			const uint8_t *id = note + descOffset;
+			char hex[2 * 64 + 1] = {0};
+			for (uint32_t i = 1; i < nhdr->n_descsz && i < 64; i++) {
+				sprintf(hex + 2 * (i - 1), "%02x", id[i]);
+			}
+			snprintf(out, outSize, "/usr/lib/debug/.build-id/%02x/%s.debug", id[0], hex);
+			if (tryDebugFile(out, 0, 0) == 0) return 0;
+		}
+	}
+	const char *link = (const char*)tcdElfSection(elf, ".gnu_debuglink", &size);
+	if (link == NULL) return -1;
+	size_t nameLen = strnlen(link, size);
+	uint64_t crcOffset = (nameLen + 4) & ~(uint64_t)3;
+	if (nameLen == size || crcOffset + 4 > size) return -1;
+	uint32_t crc;
+	memcpy(&crc, link + crcOffset, 4);
+	char real[PATH_MAX];
+	if (realpath(path, real) == NULL) return -1;
+	char *slash = strrchr(real, '/');
+	*slash = '\0';
+	const char *formats[] = {"%s/%s", "%s/.debug/%s", "/usr/lib/debug%s/%s"};
+	for (int i = 0; i < 3; i++) {
+		snprintf(out, outSize, formats[i], real, link);
+		if (tryDebugFile(out, 1, crc) == 0) return 0;
+	}
+	return -1;
+}
+
+/* Link time address of the entry point */
+uint64_t tcdElfEntry(TcdElf *elf) {
+	if (elf->map == NULL) return 0;
+	const Elf64_Ehdr *ehdr = elf->map;
+	return ehdr->e_entry;
+}
+
+void tcdElfClose(TcdElf *elf) {
+	if (elf->inflated != NULL) {
+		for (uint16_t i = 0; i < tcdElfSectionCount(elf); i++) {
+			free(elf->inflated[i]);
+		}
+		free(elf->inflated);
+		elf->inflated = NULL;
+	}
+	if (elf->map != NULL) {
+		munmap(elf->map, elf->mapSize);
+		elf->map = NULL;
+	}
+}
@@ -0,0 +1,427 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * Values are fetched with a single read of at most FORMAT_CHUNK bytes and
+ * formatted from the host copy. Top level arrays in memory are streamed in
+ * chunks of the same size instead, so memory use does not depend on the
+ * array length. Runs of identical elements are collapsed like in gdb.
+ */
+#define FORMAT_CHUNK (64 * 1024)
+#define FORMAT_MAX_DEPTH 16
+#define FORMAT_REPEAT_THRESHOLD 10
+
+static void formatChar(int c, FILE *out) {
+	switch (c) {
+		case '\0': fputs("\\0", out); break;
+		case '\n': fputs("\\n", out); break;
+		case '\t': fputs("\\t", out); break;
+		case '\r': fputs("\\r", out); break;
+		case '"':  fputs("\\\"", out); break;
+		case '\'': fputs("\\'", out); break;
+		case '\\': fputs("\\\\", out); break;
+		default:
+			if (isprint(c)) {
+				fputc(c, out);
+			} else {
+				fprintf(out, "\\x%02x", (uint8_t)c);
+			}
+			break;
+	}
+}
+
+static void formatString(const uint8_t *data, uint64_t len, FILE *out) {
+	fputc('"', out);
+	for (uint64_t i = 0; i < len && data[i] != '\0'; i++) {
+		formatChar(data[i], out);
+	}
+	fputc('"', out);
+}
+
+/* Streams a NUL terminated string of at most <len> bytes from memory */
+static void streamString(TcdContext *debug, uint64_t address, uint64_t len, uint64_t limit, FILE *out) {
+	uint8_t chunk[4096];
+	fputc('"', out);
+	for (uint64_t i = 0; i < len; ) {
+		uint32_t n = len - i < sizeof(chunk) ? len - i : sizeof(chunk);
+		tcdReadMemory(debug, address + i, n, chunk);
+		for (uint32_t j = 0; j < n; j++, i++) {
+			if (chunk[j] == '\0') goto done;
+			if (limit != 0 && i >= limit) {
+				fputs("\"...", out);
+				return;
+			}
+			formatChar(chunk[j], out);
+		}
+	}
+done:
+	fputc('"', out);
+}
+
+static int isCharType(TcdType *type) {
+	type = tcdResolveType(type);
+	return type != NULL && type->tclass == TCDT_BASE && type->size == 1 &&
+		(type->as.base.interp == TCDI_CHAR || type->as.base.interp == TCDI_UCHAR);
+}
+
+/* Little endian load of up to 8 bytes, sign extended if requested */
+static uint64_t loadInteger(const uint8_t *data, uint32_t size, int sign) {
+	uint64_t raw = 0;
+	memcpy(&raw, data, size < 8 ? size : 8);
+	if (sign && size < 8 && (raw >> (size * 8 - 1)) & 1)
+		raw |= (-1ULL) << (size * 8);
+	return raw;
+}
+
+static void formatPointer(TcdContext *debug, uint64_t address, FILE *out) {
+	fprintf(out, "0x%lx", address);
+	uint64_t offset;
+	TcdLocal *var = tcdVariableByAddress(debug->info, address - debug->loadBias, &offset);
+	if (var != NULL) {
+		fprintf(out, " <%s+%lu>", var->name, offset);
+	}
+}
+
+/* Applies an explicit output format to a scalar; returns 0 if it doesn't apply */
+static int formatExplicit(const uint8_t *data, uint32_t size, char format, FILE *out) {
+	if (size == 0 || size > 8) return 0;
+	switch (format) {
+		case 'x':
+			fprintf(out, "0x%lx", loadInteger(data, size, 0));
+			return 1;
+		case 'd':
+			fprintf(out, "%ld", (int64_t)loadInteger(data, size, 1));
+			return 1;
+		case 'f':
+			if (size == 4) {
+				float f;
+				memcpy(&f, data, 4);
+				fprintf(out, "%g", f);
+			} else if (size == 8) {
+				double f;
+				memcpy(&f, data, 8);
+				fprintf(out, "%g", f);
+			} else {
+				fprintf(out, "%ld", (int64_t)loadInteger(data, size, 1));
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static void formatBase(TcdType *type, const uint8_t *data, FILE *out) {
+	switch (type->as.base.interp) {
+		case TCDI_ADDRESS:
+			fprintf(out, "0x%lx", loadInteger(data, type->size, 0));
+			break;
+		case TCDI_SIGNED:
+			fprintf(out, "%ld", (int64_t)loadInteger(data, type->size, 1));
+			break;
+		case TCDI_UNSIGNED:
+			fprintf(out, "%lu", loadInteger(data, type->size, 0));
+			break;
+		case TCDI_CHAR:
+		case TCDI_UCHAR: {
+			int c = type->as.base.interp == TCDI_CHAR ? (int8_t)data[0] : data[0];
+			fprintf(out, "%d '", c);
+			formatChar(data[0], out);
+			fputc('\'', out);
+		} break;
+		case TCDI_FLOAT:
+			if (type->size == 4) {
+				float f;
+				memcpy(&f, data, 4);
+				fprintf(out, "%g", f);
+			} else if (type->size == 8) {
+				double f;
+				memcpy(&f, data, 8);
+				fprintf(out, "%g", f);
+			} else if (type->size == 16) {
+				long double f = 0;
+				memcpy(&f, data, 10);
+				fprintf(out, "%Lg", f);
+			} else {
+				fprintf(out, "<%u byte float>", type->size);
+			}
+			break;
+		case TCDI_BOOL:
+			fputs(data[0] ? "true" : "false", out);
+			break;
+	}
+}
+
+static void formatData(TcdContext*, TcdType*, const uint8_t*, uint64_t, const TcdFormat*, FILE*, uint32_t);
+
+/* Collapses runs of identical array elements */
+struct ElemRun {
+	TcdContext *debug;
+	TcdType *elem;
+	const TcdFormat *fmt;
+	FILE *out;
+	uint32_t depth;
+	/* Bytes compared per element; 0 disables collapsing */
+	uint32_t span;
+	uint8_t *prev;
+	uint64_t count;
+	uint64_t printed;
+};
+typedef struct ElemRun ElemRun;
+
+static void initRun(ElemRun *run, TcdContext *debug, TcdType *elem, uint32_t span, const TcdFormat *fmt, FILE *out, uint32_t depth) {
+	*run = (ElemRun){debug, elem, fmt, out, depth, span, NULL, 0, 0};
+	run->prev = malloc(span + 8);
+}
+
+/* Prints the pending run; returns -1 if the element limit cut it short */
+static int flushRun(ElemRun *run) {
+	uint64_t limit = run->fmt->maxElems;
+	int repeated = run->count >= FORMAT_REPEAT_THRESHOLD;
+	uint64_t count = repeated ? 1 : run->count;
+	for (uint64_t i = 0; i < count; i++) {
+		if (limit != 0 && run->printed >= limit) return -1;
+		if (run->printed > 0) fputs(", ", run->out);
+		formatData(run->debug, run->elem, run->prev, run->span, run->fmt, run->out, run->depth + 1);
+		if (repeated) fprintf(run->out, " <repeats %lu times>", run->count);
+		run->printed++;
+	}
+	run->count = 0;
+	return 0;
+}
+
+static int pushRun(ElemRun *run, const uint8_t *data, int collapse) {
+	if (collapse && run->count > 0 && memcmp(run->prev, data, run->span) == 0) {
+		run->count++;
+		return 0;
+	}
+	if (run->count > 0 && flushRun(run) != 0) return -1;
+	if (run->fmt->maxElems != 0 && run->printed >= run->fmt->maxElems) return -1;
+	memcpy(run->prev, data, run->span);
+	run->count = 1;
+	return 0;
+}
+
+/* Closes the array, marking it as truncated if elements are left */
+static void finishRun(ElemRun *run, int more) {
+	if (run->count > 0 && flushRun(run) != 0) more = 1;
+	if (more) fputs(run->printed > 0 ? ", ..." : "...", run->out);
+	fputc('}', run->out);
+	free(run->prev);
+}
+
+static void formatMember(TcdContext *debug, TcdMember *member, const uint8_t *data, uint64_t avail, const TcdFormat *fmt, FILE *out, uint32_t depth) {
+	if (member->name != NULL) {
+		fprintf(out, "%s = ", member->name);
+	}
+	if (member->offset >= avail) {
+		fputs("...", out);
+		return;
+	}
+	if (member->bitSize == 0) {
+		formatData(debug, member->type, data + member->offset, avail - member->offset, fmt, out, depth + 1);
+		return;
+	}
+	/* Extract the bitfield into a host temporary of the member's type */
+	TcdType *type = tcdResolveType(member->type);
+	uint32_t bytes = (member->bitOffset + member->bitSize + 7) / 8;
+	if (bytes > 8 || member->offset + bytes > avail || type == NULL) {
+		fputs("?", out);
+		return;
+	}
+	uint64_t value = loadInteger(data + member->offset, bytes, 0) >> member->bitOffset;
+	if (member->bitSize < 64) {
+		value &= (1ULL << member->bitSize) - 1;
+		int sign = (type->tclass == TCDT_BASE && type->as.base.interp == TCDI_SIGNED) ||
+			(type->tclass == TCDT_ENUM && type->as.enumer.interp == TCDI_SIGNED);
+		if (sign && (value >> (member->bitSize - 1)) & 1)
+			value |= (-1ULL) << member->bitSize;
+	}
+	uint8_t temp[8];
+	memcpy(temp, &value, 8);
+	formatData(debug, type, temp, 8, fmt, out, depth + 1);
+}
+
+/* Formats a value from a host buffer, of which <avail> bytes were actually read */
+static void formatData(TcdContext *debug, TcdType *type, const uint8_t *data, uint64_t avail, const TcdFormat *fmt, FILE *out, uint32_t depth) {
+	type = tcdResolveType(type);
+	if (type == NULL) {
+		fputs("<unknown type>", out);
+		return;
+	}
+	if (depth > FORMAT_MAX_DEPTH) {
+		fputs("{...}", out);
+		return;
+	}
+	if (type->tclass != TCDT_ARRAY && type->tclass != TCDT_STRUCT && type->tclass != TCDT_UNION && type->size > avail) {
+		fputs("...", out);
+		return;
+	}
+	if (fmt->format != '\0' && (type->tclass == TCDT_BASE || type->tclass == TCDT_POINTER || type->tclass == TCDT_ENUM) &&
+		formatExplicit(data, type->size, fmt->format, out)) return;
+	switch (type->tclass) {
+		case TCDT_BASE:
+			formatBase(type, data, out);
+			break;
+		case TCDT_POINTER:
+			formatPointer(debug, loadInteger(data, 8, 0), out);
+			break;
+		case TCDT_ENUM: {
+			int64_t value = loadInteger(data, type->size, type->as.enumer.interp == TCDI_SIGNED);
+			for (uint32_t i = 0; i < type->as.enumer.numValues; i++) {
+				if (type->as.enumer.values[i].value == value) {
+					fputs(type->as.enumer.values[i].name, out);
+					return;
+				}
+			}
+			fprintf(out, "%ld", value);
+		} break;
+		case TCDT_STRUCT:
+		case TCDT_UNION:
+			fputc('{', out);
+			for (uint32_t i = 0; i < type->as.struc.numMembers; i++) {
+				if (i > 0) fputs(", ", out);
+				formatMember(debug, &type->as.struc.members[i], data, avail, fmt, out, depth);
+			}
+			fputc('}', out);
+			break;
+		case TCDT_ARRAY: {
+			TcdType *of = type->as.array.of;
+			uint64_t count = type->as.array.count;
+			uint32_t elemSize = of != NULL ? of->size : 0;
+			if (fmt->format == '\0' && isCharType(of)) {
+				formatString(data, count < avail ? count : avail, out);
+				break;
+			}
+			if (elemSize == 0) {
+				fputs("{...}", out);
+				break;
+			}
+			ElemRun run;
+			initRun(&run, debug, of, elemSize, fmt, out, depth);
+			fputc('{', out);
+			uint64_t i;
+			for (i = 0; i < count && (i + 1) * elemSize <= avail; i++) {
+				if (pushRun(&run, data + i * elemSize, 1) != 0) break;
+			}
+			finishRun(&run, i < count);
+		} break;
+		default:
+			fputs("?", out);
+			break;
+	}
+}
+
+/* Streams an array from memory through a fixed size buffer */
+static void streamArray(TcdContext *debug, TcdType *type, uint64_t address, const TcdFormat *fmt, FILE *out) {
+	TcdType *of = type->as.array.of;
+	uint64_t count = type->as.array.count;
+	uint32_t elemSize = of != NULL ? of->size : 0;
+	if (fmt->format == '\0' && isCharType(of)) {
+		streamString(debug, address, count, fmt->maxElems, out);
+		return;
+	}
+	if (elemSize == 0) {
+		fputs("{...}", out);
+		return;
+	}
+	/* Elements larger than a chunk are truncated and never collapsed */
+	uint32_t span = elemSize < FORMAT_CHUNK ? elemSize : FORMAT_CHUNK;
+	uint32_t perChunk = FORMAT_CHUNK / span;
+	int collapse = span == elemSize;
+	uint8_t *chunk = malloc(FORMAT_CHUNK + 8);
+	ElemRun run;
+	initRun(&run, debug, of, span, fmt, out, 0);
+	fputc('{', out);
+	uint64_t i = 0;
+	while (i < count) {
+		uint32_t n = count - i < perChunk ? count - i : perChunk;
+		if (collapse) {
+			tcdReadMemory(debug, address + i * elemSize, n * elemSize, chunk);
+		} else {
+			tcdReadMemory(debug, address + i * elemSize, span, chunk);
+		}
+		uint32_t j;
+		for (j = 0; j < n; j++) {
+			if (pushRun(&run, chunk + j * span, collapse) != 0) break;
+		}
+		i += j;
+		if (j < n) break;
+	}
+	finishRun(&run, i < count);
+	free(chunk);
+}
+
+/* Prints a value; arrays in memory are streamed, everything else is fetched with a single read */
+void tcdFormatValue(TcdContext *debug, TcdType *type, TcdRtLoc rtloc, const TcdFormat *fmt, FILE *out) {
+	TcdType *resolved = tcdResolveType(type);
+	if (resolved == NULL) {
+		fputs("<unknown type>", out);
+		return;
+	}
+	if (resolved->tclass == TCDT_ARRAY && rtloc.region == TCDR_ADDRESS) {
+		streamArray(debug, resolved, rtloc.address, fmt, out);
+		return;
+	}
+	uint32_t size = resolved->size < FORMAT_CHUNK ? resolved->size : FORMAT_CHUNK;
+	uint8_t *data = calloc(1, size + 8);
+	tcdReadRtLoc(debug, rtloc, size, data);
+	tcdFormatBuffer(debug, resolved, data, size, fmt, out);
+	free(data);
+}
+
+/* Prints a value that was already fetched; <size> bytes of <data> are valid */
+void tcdFormatBuffer(TcdContext *debug, TcdType *type, const void *data, uint64_t size, const TcdFormat *fmt, FILE *out) {
+	TcdType *resolved = tcdResolveType(type);
+	formatData(debug, resolved, data, size, fmt, out, 0);
+	/* Follow top level strings */
+	if (fmt->format == '\0' && resolved != NULL && resolved->tclass == TCDT_POINTER &&
+		isCharType(resolved->as.pointer.to) && size >= 8) {
+		uint64_t address = loadInteger(data, 8, 0);
+		uint8_t string[256] = {0};
+		if (address != 0) {
+			tcdReadMemory(debug, address, sizeof(string) - 1, string);
+			fputc(' ', out);
+			formatString(string, sizeof(string) - 1, out);
+		}
+	}
+}
+
+/* Hex dump in rows of 16 bytes; identical rows are collapsed into a single '*' */
+void tcdDumpMemory(TcdContext *debug, uint64_t address, uint64_t length, FILE *out) {
+	uint8_t *chunk = malloc(FORMAT_CHUNK);
+	uint8_t prev[16];
+	int skipping = 0;
+	for (uint64_t done = 0; done < length; ) {
+		uint32_t n = length - done < FORMAT_CHUNK ? length - done : FORMAT_CHUNK;
+		tcdReadMemory(debug, address + done, n, chunk);
+		for (uint32_t row = 0; row < n; row += 16) {
+			uint32_t width = n - row < 16 ? n - row : 16;
+			const uint8_t *bytes = chunk + row;
+			if (done + row > 0 && width == 16 && memcmp(prev, bytes, 16) == 0) {
+				if (!skipping) fputs("*\n", out);
+				skipping = 1;
+				continue;
+			}
+			skipping = 0;
+			memcpy(prev, bytes, width);
+			fprintf(out, "0x%lx: ", address + done + row);
+			for (uint32_t i = 0; i < 16; i++) {
+				if (i < width) {
+					fprintf(out, "%02X ", bytes[i]);
+				} else {
+					fputs("   ", out);
+				}
+			}
+			fputc(' ', out);
+			for (uint32_t i = 0; i < width; i++) {
+				fputc(isprint(bytes[i]) ? bytes[i] : '.', out);
+			}
+			fputc('\n', out);
+		}
+		done += n;
+	}
+	free(chunk);
+}
@@ -0,0 +1,346 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libdwarf/dwarf.h>
+
+/*
+ * Call frame information from .eh_frame, or .debug_frame where there is none,
+ * for the canonical frame address (CFA) that DW_OP_call_frame_cfa stands for.
+ * Only the CFA rule is followed: that is all locals need, and in code without
+ * frame pointers there is no other way to find the frame. The FDEs are indexed
+ * by address when loading; the rule at a pc is worked out on every lookup, from
+ * the section contents alone, so any number of contexts can share it.
+ */
+
+/* Pointer encodings of .eh_frame (DW_EH_PE_*) */
+enum {
+	PE_ABSPTR = 0x00, PE_ULEB128 = 0x01, PE_UDATA2 = 0x02, PE_UDATA4 = 0x03, PE_UDATA8 = 0x04,
+	PE_SLEB128 = 0x09, PE_SDATA2 = 0x0A, PE_SDATA4 = 0x0B, PE_SDATA8 = 0x0C,
+	PE_PCREL = 0x10, PE_OMIT = 0xFF
+};
+
+/* Depth of DW_CFA_remember_state */
+#define MAX_STATES 16
+
+typedef struct {
+	uint64_t codeAlign;
+	int64_t dataAlign;
+	uint8_t fdeEncoding;
+	int augmented;
+	const uint8_t *instr, *instrEnd;
+} Cie;
+
+typedef struct {
+	uint32_t reg;
+	int64_t offset;
+	int expression;
+} CfaRule;
+
+static uint64_t readFixed(const uint8_t **p, const uint8_t *end, uint32_t size) {
+	if (end - *p < size) {
+		*p = end;
+		return 0;
+	}
+	uint64_t value = 0;
+	for (uint32_t i = 0; i < size; i++) {
+		value |= (uint64_t)(*p)[i] << (i * 8);
+	}
+	*p += size;
+	return value;
+}
+
+/* Reads a pointer in one of the encodings above; pc relative ones are relative to where they are */
+static uint64_t readEncoded(const TcdFrameInfo *frames, const uint8_t **p, const uint8_t *end, uint8_t encoding) {
+	const uint8_t *start = *p;
+	uint64_t value;
+	switch (encoding & 0x0F) {
+		case PE_ABSPTR:  value = readFixed(p, end, 8); break;
+		case PE_ULEB128: value = tcdDecodeUleb128(p, end); break;
+		case PE_UDATA2:  value = readFixed(p, end, 2); break;
+		case PE_UDATA4:  value = readFixed(p, end, 4); break;
+		case PE_UDATA8:  value = readFixed(p, end, 8); break;
+		case PE_SLEB128: value = tcdDecodeSleb128(p, end); break;
+		case PE_SDATA2:  value = (int16_t)readFixed(p, end, 2); break;
+		case PE_SDATA4:  value = (int32_t)readFixed(p, end, 4); break;
+		case PE_SDATA8:  value = readFixed(p, end, 8); break;
+		default:
+			*p = end;
+			return 0;
+	}
+	if ((encoding & 0x70) == PE_PCREL)
+		value += frames->address + (start - frames->section);
+	return value;
+}
+
+/* Bounds of the entry at <offset>, and for FDEs, the offset of their CIE.
+ * Returns -1 at the end of the section or on entries we can't read. */
+static int readEntry(const TcdFrameInfo *frames, uint64_t offset, const uint8_t **body, const uint8_t **end, int *isCie, uint64_t *cieOffset) {
+	const uint8_t *sectionEnd = frames->section + frames->sectionSize;
+	const uint8_t *p = frames->section + offset;
+	if (offset + 8 > frames->sectionSize) return -1;
+	uint64_t length = readFixed(&p, sectionEnd, 4);
+	/* A zero length terminates .eh_frame; 64 bit DWARF isn't used on x86-64 */
+	if (length == 0 || length == 0xFFFFFFFF || length > (uint64_t)(sectionEnd - p)) return -1;
+	*end = p + length;
+	uint64_t idOffset = p - frames->section;
+	uint64_t id = readFixed(&p, *end, 4);
+	if (frames->eh) {
+		*isCie = id == 0;
+		*cieOffset = idOffset - id;
+	} else {
+		*isCie = id == 0xFFFFFFFF;
+		*cieOffset = id;
+	}
+	*body = p;
+	return 0;
+}
+
+static int parseCie(const TcdFrameInfo *frames, uint64_t offset, Cie *cie) {
+	const uint8_t *p, *end;
+	int isCie;
+	uint64_t unused;
+	if (readEntry(frames, offset, &p, &end, &isCie, &unused) != 0 || !isCie || p >= end) return -1;
+	memset(cie, 0, sizeof(*cie));
+	uint8_t version = *p++;
+	const char *augmentation = (const char*)p;
+	size_t len = strnlen(augmentation, end - p);
+	if (len == (size_t)(end - p)) return -1;
+	p += len + 1;
+	if (strstr(augmentation, "eh") != NULL) p += 8;
+	/* Address and segment selector size */
+	if (version >= 4) p += 2;
+	cie->codeAlign = tcdDecodeUleb128(&p, end);
+	cie->dataAlign = tcdDecodeSleb128(&p, end);
+	/* Return address register */
+	if (version == 1) {
+		p++;
+	} else {
+		tcdDecodeUleb128(&p, end);
+	}
+	cie->fdeEncoding = PE_ABSPTR;
+	if (augmentation[0] == 'z') {
+		cie->augmented = 1;
+		uint64_t augLength = tcdDecodeUleb128(&p, end);
+		if (augLength > (uint64_t)(end - p)) return -1;
+		const uint8_t *augEnd = p + augLength;
+		for (const char *c = augmentation + 1; *c != '\0' && p < augEnd; c++) {
+			if (*c == 'R') {
+				cie->fdeEncoding = *p++;
+			} else if (*c == 'P') {
+				uint8_t encoding = *p++;
+				readEncoded(frames, &p, augEnd, encoding);
+			} else if (*c == 'L') {
+				p++;
+			} else if (*c != 'S' && *c != 'B') {
+				break;
+			}
+		}
+		p = augEnd;
+	} else if (augmentation[0] != '\0') {
+		return -1;
+	}
+	if (p > end) return -1;
+	cie->instr = p;
+	cie->instrEnd = end;
+	return 0;
+}
+
+/* Parses the FDE at <offset> up to its instructions */
+static int parseFde(const TcdFrameInfo *frames, uint64_t offset, Cie *cie, uint64_t *begin, uint64_t *end, const uint8_t **instr, const uint8_t **instrEnd) {
+	const uint8_t *p, *entryEnd;
+	int isCie;
+	uint64_t cieOffset;
+	if (readEntry(frames, offset, &p, &entryEnd, &isCie, &cieOffset) != 0 || isCie) return -1;
+	if (parseCie(frames, cieOffset, cie) != 0) return -1;
+	if (cie->fdeEncoding == PE_OMIT) return -1;
+	*begin = readEncoded(frames, &p, entryEnd, cie->fdeEncoding);
+	*end = *begin + readEncoded(frames, &p, entryEnd, cie->fdeEncoding & 0x0F);
+	if (cie->augmented) {
+		uint64_t augLength = tcdDecodeUleb128(&p, entryEnd);
+		if (augLength > (uint64_t)(entryEnd - p)) return -1;
+		p += augLength;
+	}
+	*instr = p;
+	*instrEnd = entryEnd;
+	return 0;
+}
+
+/* Runs CFA instructions while the rows begin at or before <pc> */
+static int execute(const TcdFrameInfo *frames, const Cie *cie, const uint8_t *p, const uint8_t *end,
+	uint64_t *loc, uint64_t pc, CfaRule *rule, CfaRule *states, uint32_t *numStates) {
+	while (p < end) {
+		uint8_t op = *p++;
+		uint64_t advance = 0;
+		switch (op >> 6) {
+			case 1: /* DW_CFA_advance_loc */
+				advance = op & 0x3F;
+				break;
+			case 2: /* DW_CFA_offset */
+				tcdDecodeUleb128(&p, end);
+				break;
+			case 3: /* DW_CFA_restore */
+				break;
+			default:
+				switch (op) {
+					case DW_CFA_nop:
+						break;
+					case DW_CFA_set_loc:
+						*loc = readEncoded(frames, &p, end, cie->fdeEncoding);
+						if (*loc > pc) return 0;
+						break;
+					case DW_CFA_advance_loc1: advance = readFixed(&p, end, 1); break;
+					case DW_CFA_advance_loc2: advance = readFixed(&p, end, 2); break;
+					case DW_CFA_advance_loc4: advance = readFixed(&p, end, 4); break;
+					case DW_CFA_offset_extended:
+					case DW_CFA_register:
+					case DW_CFA_val_offset:
+					case DW_CFA_GNU_negative_offset_extended:
+						tcdDecodeUleb128(&p, end);
+						tcdDecodeUleb128(&p, end);
+						break;
+					case DW_CFA_offset_extended_sf:
+					case DW_CFA_val_offset_sf:
+						tcdDecodeUleb128(&p, end);
+						tcdDecodeSleb128(&p, end);
+						break;
+					case DW_CFA_restore_extended:
+					case DW_CFA_undefined:
+					case DW_CFA_same_value:
+					case DW_CFA_GNU_args_size:
+						tcdDecodeUleb128(&p, end);
+						break;
+					case DW_CFA_remember_state:
+						if (*numStates == MAX_STATES) return -1;
+						states[(*numStates)++] = *rule;
+						break;
+					case DW_CFA_restore_state:
+						if (*numStates == 0) return -1;
+						*rule = states[--(*numStates)];
+						break;
+					case DW_CFA_def_cfa:
+						rule->reg = tcdDecodeUleb128(&p, end);
+						rule->offset = tcdDecodeUleb128(&p, end);
+						rule->expression = 0;
+						break;
+					case DW_CFA_def_cfa_sf:
+						rule->reg = tcdDecodeUleb128(&p, end);
+						rule->offset = tcdDecodeSleb128(&p, end) * cie->dataAlign;
+						rule->expression = 0;
+						break;
+					case DW_CFA_def_cfa_register:
+						rule->reg = tcdDecodeUleb128(&p, end);
+						rule->expression = 0;
+						break;
+					case DW_CFA_def_cfa_offset:
+						rule->offset = tcdDecodeUleb128(&p, end);
+						break;
+					case DW_CFA_def_cfa_offset_sf:
+						rule->offset = tcdDecodeSleb128(&p, end) * cie->dataAlign;
+						break;
+					case DW_CFA_def_cfa_expression:
+						/* Like the PLT's; not supported */
+						p += tcdDecodeUleb128(&p, end);
+						rule->expression = 1;
+						break;
+					case DW_CFA_expression:
+					case DW_CFA_val_expression:
+						tcdDecodeUleb128(&p, end);
+						p += tcdDecodeUleb128(&p, end);
+						break;
+					default:
+						return -1;
+				}
+				break;
+		}
+		if (advance != 0) {
+			*loc += advance * cie->codeAlign;
+			if (*loc > pc) return 0;
+		}
+	}
+	return 0;
+}
+
+static int compareFdes(const void *a, const void *b) {
+	const TcdFde *fa = a, *fb = b;
+	return fa->begin < fb->begin ? -1 : fa->begin > fb->begin;
+}
+
+static int loadSection(TcdElf *elf, const char *name, TcdFrameInfo *frames) {
+	int index = tcdElfSectionIndex(elf, name);
+	TcdElfSectionInfo si;
+	uint64_t size;
+	const uint8_t *data = index >= 0 ? tcdElfSectionAt(elf, index, &size) : NULL;
+	if (data == NULL || tcdElfSectionInfo(elf, index, &si) != 0) return -1;
+	frames->section = malloc(size > 0 ? size : 1);
+	memcpy(frames->section, data, size);
+	frames->sectionSize = size;
+	frames->address = si.addr;
+	frames->eh = strcmp(name, ".eh_frame") == 0;
+	/* Index all FDEs by the code they cover */
+	for (uint64_t offset = 0; ; ) {
+		const uint8_t *body, *end;
+		int isCie;
+		uint64_t cieOffset;
+		if (readEntry(frames, offset, &body, &end, &isCie, &cieOffset) != 0) break;
+		Cie cie;
+		TcdFde fde = {0, 0, offset};
+		const uint8_t *instr, *instrEnd;
+		/* Functions dropped by the linker are left at address 0 */
+		if (!isCie && parseFde(frames, offset, &cie, &fde.begin, &fde.end, &instr, &instrEnd) == 0 &&
+			fde.begin != 0 && fde.begin < fde.end) {
+			frames->fdes = realloc(frames->fdes, (frames->numFdes + 1) * sizeof(*frames->fdes));
+			frames->fdes[frames->numFdes++] = fde;
+		}
+		offset = end - frames->section;
+	}
+	qsort(frames->fdes, frames->numFdes, sizeof(*frames->fdes), compareFdes);
+	return frames->numFdes > 0 ? 0 : -1;
+}
+
+/* Loads the call frame information of <elf>; returns -1 if it has none */
+int tcdLoadFrames(TcdElf *elf, TcdFrameInfo *frames) {
+	memset(frames, 0, sizeof(*frames));
+	if (loadSection(elf, ".eh_frame", frames) == 0) return 0;
+	tcdFreeFrames(frames);
+	if (loadSection(elf, ".debug_frame", frames) == 0) return 0;
+	tcdFreeFrames(frames);
+	return -1;
+}
+
+/* The CFA at <pc> (link time) is register <reg> plus <offset>; returns -1
+ * if no FDE covers the pc or the rule is a DWARF expression */
+int tcdFrameRule(const TcdFrameInfo *frames, uint64_t pc, uint32_t *reg, int64_t *offset) {
+	uint32_t lo = 0, hi = frames->numFdes;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (frames->fdes[mid].begin <= pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || pc >= frames->fdes[lo - 1].end) return -1;
+	Cie cie;
+	uint64_t begin, end;
+	const uint8_t *instr, *instrEnd;
+	if (parseFde(frames, frames->fdes[lo - 1].offset, &cie, &begin, &end, &instr, &instrEnd) != 0) return -1;
+	CfaRule rule = {0};
+	CfaRule states[MAX_STATES];
+	uint32_t numStates = 0;
+	uint64_t loc = begin;
+	/* The CIE's initial instructions apply from the start */
+	if (execute(frames, &cie, cie.instr, cie.instrEnd, &loc, ~0ULL, &rule, states, &numStates) != 0) return -1;
+	loc = begin;
+	if (execute(frames, &cie, instr, instrEnd, &loc, pc, &rule, states, &numStates) != 0) return -1;
+	if (rule.expression) return -1;
+	*reg = rule.reg;
+	*offset = rule.offset;
+	return 0;
+}
+
+void tcdFreeFrames(TcdFrameInfo *frames) {
+	free(frames->section);
+	free(frames->fdes);
+	memset(frames, 0, sizeof(*frames));
+}
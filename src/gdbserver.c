@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * GDB remote serial protocol server on top of the control layer. Only a
+ * single connection and a single thread are served, and the process can't
+ * be interrupted while it runs. Memory can be moved with the binary x/X
+ * packets, and once gdb asks for QStartNoAckMode no acknowledgements are
+ * exchanged, so a bulk transfer is one round trip.
+ */
+
+#define PACKET_SIZE 0x20000
+
+struct Server {
+	TcdContext *debug;
+	int fd;
+	int noAck;
+	/* No-ack mode starts after the reply to QStartNoAckMode */
+	int startNoAck;
+	/* Receive buffer */
+	uint8_t in[4096];
+	uint32_t inPos, inLen;
+	/* Unescaped payload of the current packet */
+	uint8_t *packet;
+	uint32_t packetLen;
+	/* Reply under construction, escaped where binary */
+	uint8_t *reply;
+	uint32_t replyLen;
+};
+typedef struct Server Server;
+
+/* Where each register of gdb's amd64 'g' packet lives in struct user_regs_struct */
+#define USER_REG(r) (offsetof(struct user_regs_struct, r) / 8)
+static const struct {
+	uint8_t index;
+	uint8_t size;
+} GDB_REGS[] = {
+	{USER_REG(rax), 8}, {USER_REG(rbx), 8}, {USER_REG(rcx), 8}, {USER_REG(rdx), 8},
+	{USER_REG(rsi), 8}, {USER_REG(rdi), 8}, {USER_REG(rbp), 8}, {USER_REG(rsp), 8},
+	{USER_REG(r8 ), 8}, {USER_REG(r9 ), 8}, {USER_REG(r10), 8}, {USER_REG(r11), 8},
+	{USER_REG(r12), 8}, {USER_REG(r13), 8}, {USER_REG(r14), 8}, {USER_REG(r15), 8},
+	{USER_REG(rip), 8}, {USER_REG(eflags), 4},
+	{USER_REG(cs), 4}, {USER_REG(ss), 4}, {USER_REG(ds), 4},
+	{USER_REG(es), 4}, {USER_REG(fs), 4}, {USER_REG(gs), 4}
+};
+#define NUM_GDB_REGS (sizeof(GDB_REGS) / sizeof(*GDB_REGS))
+
+static const char TARGET_XML[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target><architecture>i386:x86-64</architecture><osabi>GNU/Linux</osabi></target>";
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/* ----- Transport ----- */
+
+static int getByte(Server *server) {
+	if (server->inPos == server->inLen) {
+		ssize_t got = recv(server->fd, server->in, sizeof(server->in), 0);
+		if (got <= 0) return -1;
+		server->inPos = 0;
+		server->inLen = got;
+	}
+	return server->in[server->inPos++];
+}
+
+static int sendAll(Server *server, const void *data, size_t size) {
+	const uint8_t *bytes = data;
+	while (size > 0) {
+		ssize_t sent = send(server->fd, bytes, size, MSG_NOSIGNAL);
+		if (sent <= 0) return -1;
+		bytes += sent;
+		size -= sent;
+	}
+	return 0;
+}
+
+static int hexValue(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* Receives the next packet, unescaping binary data; returns -1 once the connection is gone */
+static int readPacket(Server *server) {
+	for (;;) {
+		int c;
+		/* Skip acks and interrupts until the start of a packet */
+		do {
+			c = getByte(server);
+			if (c < 0) return -1;
+		} while (c != '$');
+		uint8_t sum = 0;
+		server->packetLen = 0;
+		while ((c = getByte(server)) != '#') {
+			if (c < 0) return -1;
+			sum += c;
+			if (c == '}') {
+				c = getByte(server);
+				if (c < 0) return -1;
+				sum += c;
+				c ^= 0x20;
+			}
+			if (server->packetLen < PACKET_SIZE) {
+				server->packet[server->packetLen++] = c;
+			}
+		}
+		int hi = getByte(server), lo = getByte(server);
+		if (hi < 0 || lo < 0) return -1;
+		server->packet[server->packetLen] = '\0';
+		if (server->noAck) return 0;
+		if (hexValue(hi) * 16 + hexValue(lo) == sum) {
+			return sendAll(server, "+", 1);
+		}
+		if (sendAll(server, "-", 1) != 0) return -1;
+	}
+}
+
+static int sendReply(Server *server) {
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < server->replyLen; i++) {
+		sum += server->reply[i];
+	}
+	char trailer[3] = {'#', HEX_DIGITS[sum >> 4], HEX_DIGITS[sum & 15]};
+	for (;;) {
+		if (sendAll(server, "$", 1) != 0) return -1;
+		if (sendAll(server, server->reply, server->replyLen) != 0) return -1;
+		if (sendAll(server, trailer, 3) != 0) return -1;
+		if (server->noAck) break;
+		int c;
+		do {
+			c = getByte(server);
+			if (c < 0) return -1;
+		} while (c != '+' && c != '-');
+		if (c == '+') break;
+	}
+	server->replyLen = 0;
+	return 0;
+}
+
+/* ----- Reply construction ----- */
+
+static void putString(Server *server, const char *str) {
+	size_t len = strlen(str);
+	if (server->replyLen + len > 2 * PACKET_SIZE) return;
+	memcpy(server->reply + server->replyLen, str, len);
+	server->replyLen += len;
+}
+
+static void putHex(Server *server, const void *data, uint32_t size) {
+	const uint8_t *bytes = data;
+	if (server->replyLen + 2 * size > 2 * PACKET_SIZE) return;
+	for (uint32_t i = 0; i < size; i++) {
+		server->reply[server->replyLen++] = HEX_DIGITS[bytes[i] >> 4];
+		server->reply[server->replyLen++] = HEX_DIGITS[bytes[i] & 15];
+	}
+}
+
+static void putBinary(Server *server, const void *data, uint32_t size) {
+	const uint8_t *bytes = data;
+	for (uint32_t i = 0; i < size && server->replyLen + 2 <= 2 * PACKET_SIZE; i++) {
+		uint8_t c = bytes[i];
+		if (c == '#' || c == '$' || c == '}' || c == '*') {
+			server->reply[server->replyLen++] = '}';
+			c ^= 0x20;
+		}
+		server->reply[server->replyLen++] = c;
+	}
+}
+
+static void putFormat(Server *server, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void putFormat(Server *server, const char *format, ...) {
+	char buf[128];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	putString(server, buf);
+}
+
+/* ----- Parsing ----- */
+
+static uint64_t parseHex(const char **str) {
+	uint64_t value = 0;
+	int digit;
+	while ((digit = hexValue(**str)) >= 0) {
+		value = value * 16 + digit;
+		(*str)++;
+	}
+	return value;
+}
+
+/* Parses "addr,length" and the following separator */
+static int parseRange(const char **str, uint64_t *address, uint64_t *length) {
+	*address = parseHex(str);
+	if (**str != ',') return -1;
+	(*str)++;
+	*length = parseHex(str);
+	return 0;
+}
+
+static int decodeHex(const char *str, uint8_t *out, uint32_t size) {
+	for (uint32_t i = 0; i < size; i++) {
+		int hi = hexValue(str[2 * i]), lo = hexValue(str[2 * i + 1]);
+		if (hi < 0 || lo < 0) return -1;
+		out[i] = hi * 16 + lo;
+	}
+	return 0;
+}
+
+/* ----- Packets ----- */
+
+static void stopReply(Server *server) {
+	TcdContext *debug = server->debug;
+	int status = debug->status;
+	if (WIFEXITED(status)) {
+		putFormat(server, "W%02x", WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		putFormat(server, "X%02x", WTERMSIG(status));
+	} else {
+		int sig = WIFSTOPPED(status) ? WSTOPSIG(status) & 0x7F : SIGTRAP;
+		putFormat(server, "T%02xthread:%x;", sig, debug->pid);
+		/* With swbreak the pc has to point at the breakpoint itself */
+		if (sig == SIGTRAP && debug->core == NULL) {
+			uint64_t bip = tcdReadIP(debug) - 1;
+			for (uint32_t i = 0; i < debug->numBreaks; i++) {
+				if (debug->breaks[i].address == bip) {
+					tcdWriteIP(debug, bip);
+					putString(server, "swbreak:;");
+					break;
+				}
+			}
+		}
+	}
+}
+
+/* Serves "qXfer:<object>:read:<annex>:<offset>,<length>" from a buffer */
+static void xferReply(Server *server, const void *data, uint64_t size, uint64_t offset, uint64_t length) {
+	if (offset >= size) {
+		putString(server, "l");
+		return;
+	}
+	if (length > PACKET_SIZE - 1) length = PACKET_SIZE - 1;
+	uint64_t n = size - offset < length ? size - offset : length;
+	putString(server, offset + n < size ? "m" : "l");
+	putBinary(server, (const uint8_t*)data + offset, n);
+}
+
+static void handleXfer(Server *server, const char *args) {
+	char object[32], annex[64];
+	int used = -1;
+	if (sscanf(args, "%31[^:]:read:%63[^:]:%n", object, annex, &used) != 2 || used < 0) {
+		/* The annex may be empty, as for auxv */
+		annex[0] = '\0';
+		used = -1;
+		sscanf(args, "%31[^:]:read::%n", object, &used);
+		if (used < 0) {
+			putString(server, "E00");
+			return;
+		}
+	}
+	const char *range = args + used;
+	uint64_t offset, length;
+	if (parseRange(&range, &offset, &length) != 0) {
+		putString(server, "E00");
+		return;
+	}
+	TcdContext *debug = server->debug;
+	if (strcmp(object, "features") == 0 && strcmp(annex, "target.xml") == 0) {
+		xferReply(server, TARGET_XML, sizeof(TARGET_XML) - 1, offset, length);
+	} else if (strcmp(object, "auxv") == 0 || strcmp(object, "exec-file") == 0) {
+		char path[64], data[4096];
+		ssize_t size;
+		if (object[0] == 'a') {
+			sprintf(path, "/proc/%d/auxv", debug->pid);
+			int fd = open(path, O_RDONLY);
+			size = fd >= 0 ? read(fd, data, sizeof(data)) : -1;
+			if (fd >= 0) close(fd);
+		} else {
+			sprintf(path, "/proc/%d/exe", debug->pid);
+			size = readlink(path, data, sizeof(data));
+		}
+		if (size < 0) {
+			putString(server, "E01");
+			return;
+		}
+		xferReply(server, data, size, offset, length);
+	} else {
+		putString(server, "");
+	}
+}
+
+static void handleQuery(Server *server, const char *packet) {
+	TcdContext *debug = server->debug;
+	if (strncmp(packet, "qSupported", 10) == 0) {
+		putFormat(server, "PacketSize=%x;QStartNoAckMode+;binary-upload+;swbreak+;"
+			"qXfer:features:read+;qXfer:auxv:read+;qXfer:exec-file:read+", PACKET_SIZE);
+	} else if (strcmp(packet, "QStartNoAckMode") == 0) {
+		/* This reply is still acknowledged */
+		putString(server, "OK");
+		server->startNoAck = 1;
+	} else if (strncmp(packet, "qXfer:", 6) == 0) {
+		handleXfer(server, packet + 6);
+	} else if (strcmp(packet, "qAttached") == 0) {
+		putString(server, "0");
+	} else if (strcmp(packet, "qC") == 0) {
+		putFormat(server, "QC%x", debug->pid);
+	} else if (strcmp(packet, "qfThreadInfo") == 0) {
+		putFormat(server, "m%x", debug->pid);
+	} else if (strcmp(packet, "qsThreadInfo") == 0) {
+		putString(server, "l");
+	} else {
+		putString(server, "");
+	}
+}
+
+/* Resumes the process with an optional signal; the stop reply is sent once it stops again */
+static void resume(Server *server, int step, int sig) {
+	TcdContext *debug = server->debug;
+	if (debug->core != NULL || !WIFSTOPPED(debug->status)) {
+		putString(server, "E01");
+		return;
+	}
+	if (step) {
+		tcdStepInstruction(debug, sig);
+	} else {
+		tcdContinue(debug, sig);
+	}
+	tcdSync(debug);
+	stopReply(server);
+}
+
+static void handleVCont(Server *server, const char *packet) {
+	if (strcmp(packet, "vCont?") == 0) {
+		putString(server, "vCont;c;C;s;S");
+		return;
+	}
+	if (strncmp(packet, "vCont;", 6) != 0) {
+		putString(server, "");
+		return;
+	}
+	/* There is a single thread, so the first action applies */
+	const char *action = packet + 6;
+	int sig = 0;
+	if (action[0] == 'C' || action[0] == 'S') {
+		const char *num = action + 1;
+		sig = parseHex(&num);
+	}
+	switch (action[0]) {
+		case 'c': case 'C': resume(server, 0, sig); break;
+		case 's': case 'S': resume(server, 1, sig); break;
+		default: putString(server, "E00"); break;
+	}
+}
+
+/* Handles one packet; returns 1 if the session is over */
+static int handlePacket(Server *server) {
+	TcdContext *debug = server->debug;
+	const char *packet = (const char*)server->packet;
+	const char *args = packet + 1;
+	switch (packet[0]) {
+		case '?':
+			stopReply(server);
+			break;
+
+		case 'g': {
+			tcdReadRegisters(debug);
+			for (uint32_t i = 0; i < NUM_GDB_REGS; i++) {
+				putHex(server, &debug->rawRegs[GDB_REGS[i].index], GDB_REGS[i].size);
+			}
+		} break;
+
+		case 'G': {
+			tcdReadRegisters(debug);
+			struct user_regs_struct user;
+			memcpy(&user, debug->rawRegs, sizeof(user));
+			uint64_t *words = (uint64_t*)&user;
+			const char *hex = args;
+			for (uint32_t i = 0; i < NUM_GDB_REGS && strlen(hex) >= 2u * GDB_REGS[i].size; i++) {
+				words[GDB_REGS[i].index] = 0;
+				decodeHex(hex, (uint8_t*)&words[GDB_REGS[i].index], GDB_REGS[i].size);
+				hex += 2 * GDB_REGS[i].size;
+			}
+			putString(server, tcdWriteRawRegisters(debug, &user) == 0 ? "OK" : "E01");
+		} break;
+
+		case 'p': {
+			uint64_t n = parseHex(&args);
+			if (n >= NUM_GDB_REGS) {
+				putString(server, "E00");
+				break;
+			}
+			tcdReadRegisters(debug);
+			putHex(server, &debug->rawRegs[GDB_REGS[n].index], GDB_REGS[n].size);
+		} break;
+
+		case 'P': {
+			uint64_t n = parseHex(&args);
+			if (n >= NUM_GDB_REGS || *args != '=') {
+				putString(server, "E00");
+				break;
+			}
+			tcdReadRegisters(debug);
+			struct user_regs_struct user;
+			memcpy(&user, debug->rawRegs, sizeof(user));
+			uint64_t *word = (uint64_t*)&user + GDB_REGS[n].index;
+			*word = 0;
+			if (decodeHex(args + 1, (uint8_t*)word, GDB_REGS[n].size) != 0) {
+				putString(server, "E00");
+				break;
+			}
+			putString(server, tcdWriteRawRegisters(debug, &user) == 0 ? "OK" : "E01");
+		} break;
+
+		case 'm':
+		case 'x': {
+			uint64_t address, length;
+			if (parseRange(&args, &address, &length) != 0) {
+				putString(server, "E00");
+				break;
+			}
+			/* Hex takes twice the space */
+			uint64_t max = packet[0] == 'm' ? PACKET_SIZE / 2 - 1 : PACKET_SIZE - 1;
+			if (length > max) length = max;
+			uint8_t *data = malloc(length + 1);
+			/* gdb takes a shorter reply as a partial read, but needs an error if nothing is readable */
+			uint32_t got = tcdReadProgramMemory(debug, address, length, data);
+			if (got == 0 && length > 0) {
+				putString(server, "E14");
+			} else if (packet[0] == 'm') {
+				putHex(server, data, got);
+			} else {
+				putString(server, "b");
+				putBinary(server, data, got);
+			}
+			free(data);
+		} break;
+
+		case 'M':
+		case 'X': {
+			uint64_t address, length;
+			if (parseRange(&args, &address, &length) != 0 || *args != ':' || debug->core != NULL) {
+				putString(server, "E00");
+				break;
+			}
+			const uint8_t *payload = (const uint8_t*)args + 1;
+			uint32_t avail = server->packetLen - (payload - server->packet);
+			/* The length comes from the wire; the data has to be in this packet */
+			uint64_t needed = packet[0] == 'X' ? length : 2 * length;
+			if (length > PACKET_SIZE || needed > avail) {
+				putString(server, "E00");
+				break;
+			}
+			uint8_t *data = malloc(length + 1);
+			int ok = packet[0] == 'X' || decodeHex((const char*)payload, data, length) == 0;
+			if (ok && packet[0] == 'X') memcpy(data, payload, length);
+			if (ok) tcdWriteMemory(debug, address, length, data);
+			putString(server, ok ? "OK" : "E00");
+			free(data);
+		} break;
+
+		case 'Z':
+		case 'z': {
+			/* Only software breakpoints */
+			if (args[0] != '0' || args[1] != ',' || debug->core != NULL) {
+				putString(server, "");
+				break;
+			}
+			args += 2;
+			uint64_t address = parseHex(&args);
+			if (packet[0] == 'Z') {
+				tcdRemoveBreakpoint(debug, address);
+				tcdInsertBreakpoint(debug, address, 0);
+				putString(server, "OK");
+			} else {
+				putString(server, tcdRemoveBreakpoint(debug, address) == 0 ? "OK" : "E01");
+			}
+		} break;
+
+		case 'c':
+		case 's':
+			/* A resume address is not supported */
+			resume(server, packet[0] == 's', 0);
+			break;
+
+		case 'C':
+		case 'S':
+			resume(server, packet[0] == 'S', parseHex(&args));
+			break;
+
+		case 'v':
+			handleVCont(server, packet);
+			break;
+
+		case 'q':
+		case 'Q':
+			handleQuery(server, packet);
+			break;
+
+		case 'H':
+		case 'T':
+			putString(server, "OK");
+			break;
+
+		case 'D':
+			/* Not with a syscall filter in place, which needs a tracer */
+			if (tcdDetach(debug) != 0) {
+				putString(server, "E01");
+				break;
+			}
+			putString(server, "OK");
+			return 1;
+
+		case 'k':
+			if (debug->core == NULL) {
+				kill(debug->pid, SIGKILL);
+				tcdSync(debug);
+			}
+			return 1;
+
+		default:
+			putString(server, "");
+			break;
+	}
+	return 0;
+}
+
+/* ----- Listening ----- */
+
+/* "port" or "host:port" is a TCP address, anything else the path of a unix
+ * socket. A bare port is only reachable from this machine, as whoever
+ * connects controls the process; ":port" listens on all interfaces. */
+static int listenOn(const char *address) {
+	const char *colon = strrchr(address, ':');
+	const char *port = colon != NULL ? colon + 1 : address;
+	int fd;
+	if (*port != '\0' && strspn(port, "0123456789") == strlen(port)) {
+		char *host = colon != NULL ? strndup(address, colon - address) : strdup("127.0.0.1");
+		struct addrinfo hints = {0}, *info;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		int res = getaddrinfo(*host != '\0' ? host : NULL, port, &hints, &info);
+		free(host);
+		if (res != 0) return -1;
+		fd = socket(info->ai_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			freeaddrinfo(info);
+			return -1;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		res = bind(fd, info->ai_addr, info->ai_addrlen);
+		freeaddrinfo(info);
+		if (res != 0) {
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct sockaddr_un addr = {0};
+		if (strlen(address) >= sizeof(addr.sun_path)) return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) return -1;
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, address);
+		unlink(address);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (listen(fd, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Waits for one gdb connection on <address> and serves it until it detaches or kills */
+int tcdServe(TcdContext *debug, const char *address) {
+	int listener = listenOn(address);
+	if (listener < 0) return -1;
+	int fd = accept(listener, NULL, NULL);
+	close(listener);
+	if (fd < 0) return -1;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	Server server = {0};
+	server.debug = debug;
+	server.fd = fd;
+	server.packet = malloc(PACKET_SIZE + 1);
+	server.reply = malloc(2 * PACKET_SIZE);
+	while (readPacket(&server) == 0) {
+		int done = handlePacket(&server);
+		/* An empty reply tells gdb the packet isn't supported; after k there is none */
+		if ((!done || server.replyLen > 0) && sendReply(&server) != 0) break;
+		if (server.startNoAck) server.noAck = 1;
+		if (done) break;
+	}
+	free(server.packet);
+	free(server.reply);
+	close(fd);
+	return 0;
+}
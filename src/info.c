@@ -3,44 +3,135 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int inRanges(const TcdRange *ranges, uint32_t numRanges, uint64_t address) {
+	for (uint32_t i = 0; i < numRanges; i++) {
+		if (address >= ranges[i].begin && address < ranges[i].end) return 1;
+	}
+	return 0;
+}
+
 TcdCompUnit *tcdSurroundingCompUnit(TcdInfo *info, uint64_t address) {
 	for (uint32_t u = 0; u < info->numCompUnits; u++) {
 		TcdCompUnit *cu = &info->compUnits[u];
-		if (address >= cu->begin && address <= cu->end) {
+		if (cu->ranges != NULL ? inRanges(cu->ranges, cu->numRanges, address) :
+			address >= cu->begin && address < cu->end) {
 			return cu;
 		}
 	}
 	return NULL;
 }
 
-TcdFunction *tcdSurroundingFunction(TcdInfo *info, uint64_t address) {
-	TcdCompUnit *cu = tcdSurroundingCompUnit(info, address);
-	if (cu == NULL) return NULL;
-	for (uint32_t i = 0; i < cu->numFuncs; i++) {
-		if (address >= cu->funcs[i].begin && address < cu->funcs[i].end) {
-			return &cu->funcs[i];
+int tcdFunctionContains(TcdFunction *func, uint64_t address) {
+	if (func->ranges != NULL) return inRanges(func->ranges, func->numRanges, address);
+	return address >= func->begin && address < func->end;
+}
+
+static uint32_t hashName(const char *name) {
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (uint8_t)*name) * 16777619u;
+	}
+	return hash;
+}
+
+/* Ties keep the order of loading, as all functions of a unit are in one array */
+static int compareFuncRanges(const void *a, const void *b) {
+	const TcdFunctionRange *ra = a, *rb = b;
+	if (ra->begin != rb->begin) return ra->begin < rb->begin ? -1 : 1;
+	return ra->func < rb->func ? -1 : ra->func > rb->func;
+}
+
+static uint32_t countFunctionRanges(TcdFunction *funcs, uint32_t numFuncs) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < numFuncs; i++) {
+		count += funcs[i].ranges != NULL ? funcs[i].numRanges : 1;
+	}
+	return count;
+}
+
+/* Declarations and inlined-only functions have no code, and get no entries */
+static void appendFunctionRanges(TcdFunction *funcs, uint32_t numFuncs, TcdFunctionRange *out, uint32_t *numOut) {
+	for (uint32_t i = 0; i < numFuncs; i++) {
+		TcdFunction *func = &funcs[i];
+		if (func->ranges == NULL) {
+			if (func->end > func->begin)
+				out[(*numOut)++] = (TcdFunctionRange){func->begin, func->end, func, 0};
+			continue;
+		}
+		for (uint32_t j = 0; j < func->numRanges; j++) {
+			out[(*numOut)++] = (TcdFunctionRange){func->ranges[j].begin, func->ranges[j].end, func, 0};
 		}
 	}
-	return NULL;
 }
 
-TcdFunction *tcdFunctionByName(TcdInfo *info, char *name) {
-	for (uint32_t u = 0; u < info->numCompUnits; u++) {
-		TcdCompUnit *cu = info->compUnits + u;
-		for (uint32_t i = 0; i < cu->numFuncs; i++) {
-			if (strcmp(cu->funcs[i].name, name) == 0) {
-				return &cu->funcs[i];
-			}
+static void sortFunctionRanges(TcdFunctionRange *ranges, uint32_t numRanges) {
+	qsort(ranges, numRanges, sizeof(*ranges), compareFuncRanges);
+	uint64_t maxEnd = 0;
+	for (uint32_t i = 0; i < numRanges; i++) {
+		if (ranges[i].end > maxEnd) maxEnd = ranges[i].end;
+		ranges[i].maxEnd = maxEnd;
+	}
+}
+
+/* Interval index over the parts of <funcs>, for tcdFunctionInRanges() */
+TcdFunctionRange *tcdIndexFunctionRanges(TcdFunction *funcs, uint32_t numFuncs, uint32_t *numRanges) {
+	TcdFunctionRange *ranges = malloc(countFunctionRanges(funcs, numFuncs) * sizeof(*ranges));
+	*numRanges = 0;
+	appendFunctionRanges(funcs, numFuncs, ranges, numRanges);
+	sortFunctionRanges(ranges, *numRanges);
+	return ranges;
+}
+
+TcdFunction *tcdFunctionInRanges(const TcdFunctionRange *ranges, uint32_t numRanges, uint64_t address) {
+	/* Last part beginning at or before the address */
+	uint32_t lo = 0, hi = numRanges;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (ranges[mid].begin <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
+	/* Parts can overlap, e.g. symbols of different sizes at one address. Of
+	 * those holding the address, the one beginning last wins; further back,
+	 * maxEnd tells once no earlier part reaches the address anymore. */
+	const TcdFunctionRange *found = NULL;
+	for (uint32_t i = lo; i > 0 && ranges[i - 1].maxEnd > address; i--) {
+		const TcdFunctionRange *range = &ranges[i - 1];
+		if (found != NULL && range->begin != found->begin) break;
+		/* Of functions sharing an address, like aliases, the first one loaded */
+		if (address < range->end) found = range;
+	}
+	return found != NULL ? found->func : NULL;
+}
+
+TcdFunction *tcdSurroundingFunction(TcdInfo *info, uint64_t address) {
+	return tcdFunctionInRanges(info->funcRanges, info->numFuncRanges, address);
+}
+
+TcdFunction *tcdFunctionByName(TcdInfo *info, char *name) {
+	if (info->funcsByNameSize == 0) return NULL;
+	uint32_t mask = info->funcsByNameSize - 1;
+	for (uint32_t slot = hashName(name) & mask; info->funcsByName[slot] != NULL; slot = (slot + 1) & mask) {
+		if (strcmp(info->funcsByName[slot]->name, name) == 0)
+			return info->funcsByName[slot];
+	}
 	return NULL;
 }
 
 /* TODO Check max bounds! */
 TcdLine *tcdNearestLine(TcdFunction *func, uint64_t address) {
+	/* Of a split function only the part holding the address counts; the
+	 * lines of its parts aren't in address order, so look at all of them */
+	uint64_t begin = func->begin;
+	for (uint32_t i = 0; i < func->numRanges; i++) {
+		if (address >= func->ranges[i].begin && address < func->ranges[i].end) begin = func->ranges[i].begin;
+	}
 	TcdLine *line = NULL;
 	for (uint32_t i = 0; i < func->numLines; i++) {
-		if (func->lines[i].address > address) break;
+		if (func->lines[i].address > address || func->lines[i].address < begin) continue;
 		if (line == NULL || func->lines[i].address > line->address) {
 			line = &func->lines[i];
 		}
@@ -48,26 +139,175 @@ TcdLine *tcdNearestLine(TcdFunction *func, uint64_t address) {
 	return line;
 }
 
-void tcdFreeInfo(TcdInfo *info) {
+static int compareVarAddresses(const void *a, const void *b) {
+	const TcdVarAddress *va = a, *vb = b;
+	return va->address < vb->address ? -1 : va->address > vb->address;
+}
+
+/* Indexes the functions of all units; the first one of a name with code wins */
+static void indexFunctions(TcdInfo *info) {
+	uint32_t numFuncs = 0, numRanges = 0;
+	for (uint32_t u = 0; u < info->numCompUnits; u++) {
+		numFuncs += info->compUnits[u].numFuncs;
+		numRanges += countFunctionRanges(info->compUnits[u].funcs, info->compUnits[u].numFuncs);
+	}
+	uint32_t size = 16;
+	while (size < numFuncs * 2) size *= 2;
+	info->funcsByNameSize = size;
+	info->funcsByName = calloc(size, sizeof(*info->funcsByName));
+	info->funcRanges = malloc(numRanges * sizeof(*info->funcRanges));
+	info->numFuncRanges = 0;
+	for (uint32_t u = 0; u < info->numCompUnits; u++) {
+		TcdCompUnit *cu = &info->compUnits[u];
+		for (uint32_t i = 0; i < cu->numFuncs; i++) {
+			TcdFunction *func = &cu->funcs[i];
+			if (func->name == NULL) continue;
+			uint32_t slot = hashName(func->name) & (size - 1);
+			while (info->funcsByName[slot] != NULL &&
+				strcmp(info->funcsByName[slot]->name, func->name) != 0) {
+				slot = (slot + 1) & (size - 1);
+			}
+			TcdFunction *prev = info->funcsByName[slot];
+			if (prev == NULL || (prev->end <= prev->begin && func->end > func->begin))
+				info->funcsByName[slot] = func;
+		}
+		appendFunctionRanges(cu->funcs, cu->numFuncs, info->funcRanges, &info->numFuncRanges);
+	}
+	sortFunctionRanges(info->funcRanges, info->numFuncRanges);
+}
+
+/* Builds the name and address indices; must be called once all compilation units are loaded */
+void tcdIndexGlobals(TcdInfo *info) {
+	indexFunctions(info);
+	uint32_t numGlobals = 0, numAddressed = 0;
+	for (uint32_t u = 0; u < info->numCompUnits; u++) {
+		TcdCompUnit *cu = &info->compUnits[u];
+		numGlobals += cu->numGlobals;
+		numAddressed += cu->numGlobals;
+		for (uint32_t i = 0; i < cu->numFuncs; i++) {
+			numAddressed += cu->funcs[i].numLocals;
+		}
+	}
+	/* Keep the table at most half full */
+	uint32_t size = 16;
+	while (size < numGlobals * 2) size *= 2;
+	info->globalsByNameSize = size;
+	info->globalsByName = calloc(size, sizeof(*info->globalsByName));
+	info->varsByAddress = malloc(numAddressed * sizeof(*info->varsByAddress));
+	info->numVarsByAddress = 0;
+	for (uint32_t u = 0; u < info->numCompUnits; u++) {
+		TcdCompUnit *cu = &info->compUnits[u];
+		for (uint32_t i = 0; i < cu->numGlobals; i++) {
+			TcdLocal *var = &cu->globals[i];
+			/* The first definition of a name wins, but one with external linkage
+			 * beats the statics of the same name in other compilation units */
+			uint32_t slot = hashName(var->name) & (size - 1);
+			while (info->globalsByName[slot] != NULL &&
+				strcmp(info->globalsByName[slot]->name, var->name) != 0) {
+				slot = (slot + 1) & (size - 1);
+			}
+			TcdLocal *prev = info->globalsByName[slot];
+			if (prev == NULL || (var->external && !prev->external))
+				info->globalsByName[slot] = var;
+			if (var->locdesc.kind == TCDL_ADDR)
+				info->varsByAddress[info->numVarsByAddress++] = (TcdVarAddress){var->locdesc.offset, var};
+		}
+		/* Function-level statics */
+		for (uint32_t i = 0; i < cu->numFuncs; i++) {
+			for (uint32_t j = 0; j < cu->funcs[i].numLocals; j++) {
+				TcdLocal *var = &cu->funcs[i].locals[j];
+				if (var->locdesc.kind == TCDL_ADDR)
+					info->varsByAddress[info->numVarsByAddress++] = (TcdVarAddress){var->locdesc.offset, var};
+			}
+		}
+	}
+	qsort(info->varsByAddress, info->numVarsByAddress, sizeof(*info->varsByAddress), compareVarAddresses);
+}
+
+TcdLocal *tcdGlobalByName(TcdInfo *info, const char *name) {
+	if (info->globalsByNameSize == 0) return NULL;
+	uint32_t mask = info->globalsByNameSize - 1;
+	for (uint32_t slot = hashName(name) & mask; info->globalsByName[slot] != NULL; slot = (slot + 1) & mask) {
+		if (strcmp(info->globalsByName[slot]->name, name) == 0)
+			return info->globalsByName[slot];
+	}
+	return NULL;
+}
+
+/* Finds the global or static variable containing <address>, and the offset into it */
+TcdLocal *tcdVariableByAddress(TcdInfo *info, uint64_t address, uint64_t *offset) {
+	uint32_t lo = 0, hi = info->numVarsByAddress;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (info->varsByAddress[mid].address <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return NULL;
+	TcdVarAddress *entry = &info->varsByAddress[lo - 1];
+	uint64_t size = entry->var->type != NULL && entry->var->type->size > 0 ? entry->var->type->size : 1;
+	if (address >= entry->address + size) return NULL;
+	*offset = address - entry->address;
+	return entry->var;
+}
+
+/* Function at an address of the process */
+TcdFunction *tcdFunctionAt(TcdContext *debug, uint64_t address) {
+	return tcdSurroundingFunction(debug->info, address - debug->loadBias);
+}
+
+TcdInfo *tcdRetainInfo(TcdInfo *info) {
+	__atomic_add_fetch(&info->refs, 1, __ATOMIC_RELAXED);
+	return info;
+}
+
+static void freeInfo(TcdInfo *info) {
 	for (uint32_t u = 0; u < info->numCompUnits; u++) {
 		TcdCompUnit *cu = info->compUnits + u;
 		for (uint32_t i = 0; i < cu->numFuncs; i++) {
 			TcdFunction *func = cu->funcs + i;
 			free(func->name);
+			tcdFreeLocation(&func->frameBase);
 			for (uint32_t j = 0; j < func->numLocals; j++) {
 				free(func->locals[j].name);
-				free(func->locals[j].locdesc.expr);
+				tcdFreeLocation(&func->locals[j].locdesc);
 			}
 			free(func->locals);
 			free(func->lines);
+			free(func->ranges);
 		}
 		free(cu->funcs);
+		for (uint32_t i = 0; i < cu->numGlobals; i++) {
+			free(cu->globals[i].name);
+			tcdFreeLocation(&cu->globals[i].locdesc);
+		}
+		free(cu->globals);
 		for (uint32_t i = 0; i < cu->numTypes; i++) {
 			TcdType *type = cu->types + i;
 			switch (type->tclass) {
 				case TCDT_BASE:
 					free(type->as.base.name);
 					break;
+				case TCDT_STRUCT:
+				case TCDT_UNION:
+					free(type->as.struc.name);
+					for (uint32_t j = 0; j < type->as.struc.numMembers; j++) {
+						free(type->as.struc.members[j].name);
+					}
+					free(type->as.struc.members);
+					break;
+				case TCDT_ENUM:
+					free(type->as.enumer.name);
+					for (uint32_t j = 0; j < type->as.enumer.numValues; j++) {
+						free(type->as.enumer.values[j].name);
+					}
+					free(type->as.enumer.values);
+					break;
+				case TCDT_TYPEDEF:
+					free(type->as.alias.name);
+					break;
 				default: break;
 			}
 		}
@@ -75,6 +315,19 @@ void tcdFreeInfo(TcdInfo *info) {
 		free(cu->name);
 		free(cu->compDir);
 		free(cu->producer);
+		free(cu->ranges);
 	}
 	free(info->compUnits);
+	free(info->globalsByName);
+	free(info->varsByAddress);
+	free(info->funcsByName);
+	free(info->funcRanges);
+	tcdFreeFrames(&info->frames);
+}
+
+/* Frees the info once the last context using it lets go */
+void tcdReleaseInfo(TcdInfo *info) {
+	if (__atomic_sub_fetch(&info->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	freeInfo(info);
+	free(info);
 }
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include "tcd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Streaming JSON writer. Values go straight to the output as they are
+ * produced, so nothing is buffered apart from the nesting state; the
+ * caller is responsible for well-formed nesting.
+ */
+
+/* Comma between the elements of an object or array */
+static void separate(TcdJson *json) {
+	if (json->afterKey) {
+		json->afterKey = 0;
+		return;
+	}
+	uint64_t bit = 1ULL << (json->depth & 63);
+	if (json->hasElems & bit) fputc(',', json->out);
+	json->hasElems |= bit;
+}
+
+static void escape(FILE *out, const char *str, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = str[i];
+		switch (c) {
+			case '"':  fputs("\\\"", out); break;
+			case '\\': fputs("\\\\", out); break;
+			case '\n': fputs("\\n", out); break;
+			case '\t': fputs("\\t", out); break;
+			case '\r': fputs("\\r", out); break;
+			default:
+				if (c < 0x20) {
+					fprintf(out, "\\u%04x", c);
+				} else {
+					fputc(c, out);
+				}
+				break;
+		}
+	}
+}
+
+static ssize_t streamWrite(void *cookie, const char *data, size_t size) {
+	TcdJson *json = cookie;
+	escape(json->out, data, size);
+	return size;
+}
+
+void tcdJsonInit(TcdJson *json, FILE *out) {
+	memset(json, 0, sizeof(*json));
+	json->out = out;
+	/* Opened once here, so that string values don't allocate */
+	cookie_io_functions_t funcs = {NULL, streamWrite, NULL, NULL};
+	json->string = fopencookie(json, "w", funcs);
+}
+
+void tcdJsonFree(TcdJson *json) {
+	if (json->string != NULL) {
+		fclose(json->string);
+	}
+}
+
+static void begin(TcdJson *json, char c) {
+	separate(json);
+	fputc(c, json->out);
+	json->depth++;
+	json->hasElems &= ~(1ULL << (json->depth & 63));
+}
+
+void tcdJsonObjectBegin(TcdJson *json) { begin(json, '{'); }
+void tcdJsonArrayBegin (TcdJson *json) { begin(json, '['); }
+
+void tcdJsonObjectEnd(TcdJson *json) {
+	json->depth--;
+	fputc('}', json->out);
+}
+
+void tcdJsonArrayEnd(TcdJson *json) {
+	json->depth--;
+	fputc(']', json->out);
+}
+
+void tcdJsonKey(TcdJson *json, const char *key) {
+	separate(json);
+	fputc('"', json->out);
+	escape(json->out, key, strlen(key));
+	fputs("\":", json->out);
+	json->afterKey = 1;
+}
+
+void tcdJsonString(TcdJson *json, const char *str) {
+	if (str == NULL) {
+		tcdJsonNull(json);
+		return;
+	}
+	separate(json);
+	fputc('"', json->out);
+	escape(json->out, str, strlen(str));
+	fputc('"', json->out);
+}
+
+void tcdJsonInt(TcdJson *json, int64_t value) {
+	separate(json);
+	fprintf(json->out, "%ld", value);
+}
+
+void tcdJsonUint(TcdJson *json, uint64_t value) {
+	separate(json);
+	fprintf(json->out, "%lu", value);
+}
+
+/* Addresses are strings, as they don't fit into a double */
+void tcdJsonHex(TcdJson *json, uint64_t value) {
+	separate(json);
+	fprintf(json->out, "\"0x%lx\"", value);
+}
+
+void tcdJsonDouble(TcdJson *json, double value) {
+	separate(json);
+	fprintf(json->out, "%.15g", value);
+}
+
+void tcdJsonBool(TcdJson *json, int value) {
+	separate(json);
+	fputs(value ? "true" : "false", json->out);
+}
+
+void tcdJsonNull(TcdJson *json) {
+	separate(json);
+	fputs("null", json->out);
+}
+
+/* Bytes as a string of hex digits */
+void tcdJsonBytes(TcdJson *json, const void *data, uint64_t size) {
+	tcdJsonBytesBegin(json);
+	tcdJsonBytesPart(json, data, size);
+	tcdJsonBytesEnd(json);
+}
+
+void tcdJsonBytesBegin(TcdJson *json) {
+	separate(json);
+	fputc('"', json->out);
+}
+
+void tcdJsonBytesPart(TcdJson *json, const void *data, uint64_t size) {
+	static const char digits[] = "0123456789abcdef";
+	const uint8_t *bytes = data;
+	for (uint64_t i = 0; i < size; i++) {
+		fputc(digits[bytes[i] >> 4], json->out);
+		fputc(digits[bytes[i] & 15], json->out);
+	}
+}
+
+void tcdJsonBytesEnd(TcdJson *json) {
+	fputc('"', json->out);
+}
+
+/* Returns the string stream, whose output becomes a string value up to
+ * tcdJsonStringEnd(); it is the same stream for every string */
+FILE *tcdJsonStringBegin(TcdJson *json) {
+	separate(json);
+	fputc('"', json->out);
+	if (json->string == NULL) {
+		fputc('"', json->out);
+	}
+	return json->string;
+}
+
+void tcdJsonStringEnd(TcdJson *json) {
+	if (json->string == NULL) return;
+	fflush(json->string);
+	fputc('"', json->out);
+}
+
+/* Ends a top level value */
+void tcdJsonLineEnd(TcdJson *json) {
+	fputc('\n', json->out);
+	fflush(json->out);
+	json->depth = 0;
+	json->hasElems = 0;
+	json->afterKey = 0;
+}
@@ -0,0 +1,363 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+/*
+ * Shared libraries. The list comes from /proc/<pid>/maps, looked at again at
+ * most once per stop when an address can't be placed, and whenever the
+ * dynamic linker reports a change while there are library breakpoints. The
+ * debug info of a library is only loaded once an address inside it is
+ * symbolized or a breakpoint is set in it, so the hundreds of libraries of a
+ * large program cost nothing up front.
+ */
+
+/* <name> is the path or file name of a library, or just its stem like "libc" */
+static int matchesLibrary(const char *path, const char *name) {
+	const char *file = strrchr(path, '/');
+	file = file != NULL ? file + 1 : path;
+	if (strcmp(path, name) == 0 || strcmp(file, name) == 0) return 1;
+	size_t len = strlen(name);
+	return strncmp(file, name, len) == 0 && (file[len] == '.' || file[len] == '-');
+}
+
+static TcdLibrary *libraryByName(TcdContext *debug, const char *name) {
+	for (uint32_t i = 0; i < debug->numLibs; i++) {
+		if (matchesLibrary(debug->libs[i].path, name)) return &debug->libs[i];
+	}
+	return NULL;
+}
+
+static TcdLibrary *libraryAt(TcdContext *debug, uint64_t address) {
+	for (uint32_t i = 0; i < debug->numLibs; i++) {
+		if (address >= debug->libs[i].begin && address < debug->libs[i].end) return &debug->libs[i];
+	}
+	return NULL;
+}
+
+/* The infos of libraries are shared by all contexts, and kept once the last
+ * of them is done with one, as the same libraries tend to come back. */
+typedef struct {
+	char *path;
+	uint64_t device, inode;
+	TcdInfo *info;
+	int loaded;
+	/* Where _dl_debug_state() is, for the dynamic linker */
+	uint64_t hook;
+	int hookLooked;
+} CachedLibrary;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CachedLibrary *cache;
+static uint32_t cacheSize;
+
+/* Finds or adds the entry of <lib>; cacheLock must be held */
+static CachedLibrary *cachedLibrary(TcdLibrary *lib) {
+	for (uint32_t i = 0; i < cacheSize; i++) {
+		CachedLibrary *entry = &cache[i];
+		if (entry->device == lib->device && entry->inode == lib->inode && strcmp(entry->path, lib->path) == 0)
+			return entry;
+	}
+	cache = realloc(cache, (cacheSize + 1) * sizeof(*cache));
+	CachedLibrary *entry = &cache[cacheSize++];
+	memset(entry, 0, sizeof(*entry));
+	entry->path = strdup(lib->path);
+	entry->device = lib->device;
+	entry->inode = lib->inode;
+	return entry;
+}
+
+/* Loads the info of the library on first use; NULL if it has none at all */
+static TcdInfo *libraryInfo(TcdLibrary *lib) {
+	if (lib->info == NULL && !lib->loadFailed) {
+		pthread_mutex_lock(&cacheLock);
+		CachedLibrary *entry = cachedLibrary(lib);
+		if (!entry->loaded) {
+			entry->loaded = 1;
+			if (tcdLoadInfo(lib->path, &entry->info) != TCDE_OK) entry->info = NULL;
+		}
+		if (entry->info != NULL) {
+			lib->info = tcdRetainInfo(entry->info);
+		} else {
+			lib->loadFailed = 1;
+		}
+		pthread_mutex_unlock(&cacheLock);
+	}
+	return lib->info;
+}
+
+/* Link time address of _dl_debug_state() in the dynamic linker; 0 if it has none */
+static uint64_t linkerHook(TcdLibrary *linker) {
+	pthread_mutex_lock(&cacheLock);
+	CachedLibrary *entry = cachedLibrary(linker);
+	if (!entry->hookLooked) {
+		entry->hookLooked = 1;
+		/* The symbol table is enough here, and much quicker to get than DWARF */
+		TcdInfo *symbols;
+		if (tcdLoadSymbols(linker->path, &symbols) == TCDE_OK) {
+			TcdFunction *func = tcdFunctionByName(symbols, "_dl_debug_state");
+			entry->hook = func != NULL ? func->begin : 0;
+			tcdReleaseInfo(symbols);
+		}
+	}
+	uint64_t hook = entry->hook;
+	pthread_mutex_unlock(&cacheLock);
+	return hook;
+}
+
+static int hasLibraryBreaks(TcdContext *debug) {
+	for (uint32_t i = 0; i < debug->numBreaks; i++) {
+		if (libraryAt(debug, debug->breaks[i].address) != NULL) return 1;
+	}
+	return 0;
+}
+
+/* The hidden breakpoint is only in while breakpoints are pending or in a
+ * library that could be unloaded: threads and children we don't trace
+ * would die of the SIGTRAP when they load a library. */
+static void updateLinkerBreak(TcdContext *debug) {
+	int wanted = debug->linkerHook != 0 && debug->core == NULL && (debug->numPending > 0 || hasLibraryBreaks(debug));
+	if (wanted && debug->linkerBreak == 0) {
+		uint8_t int3 = 0xCC;
+		debug->linkerBreak = debug->linkerHook;
+		tcdReadMemory(debug, debug->linkerBreak, 1, &debug->linkerSaved);
+		tcdWriteMemory(debug, debug->linkerBreak, 1, &int3);
+	} else if (!wanted && debug->linkerBreak != 0) {
+		tcdWriteMemory(debug, debug->linkerBreak, 1, &debug->linkerSaved);
+		debug->linkerBreak = 0;
+	}
+}
+
+static int insertAtFunction(TcdContext *debug, TcdFunction *func, uint64_t bias, uint64_t *address, uint32_t *line) {
+	/* Functions only known from the symbol table have no lines */
+	*address = (func->numLines > 0 ? func->lines[0].address : func->begin) + bias;
+	*line = func->numLines > 0 ? func->lines[0].number : 0;
+	tcdInsertBreakpoint(debug, *address, *line);
+	return TCD_BREAK_INSERTED;
+}
+
+static int breakInLibrary(TcdContext *debug, TcdLibrary *lib, const char *name, uint64_t *address, uint32_t *line) {
+	TcdInfo *info = libraryInfo(lib);
+	TcdFunction *func = info != NULL ? tcdFunctionByName(info, (char*)name) : NULL;
+	if (func == NULL) return TCD_BREAK_NOT_FOUND;
+	insertAtFunction(debug, func, lib->bias, address, line);
+	updateLinkerBreak(debug);
+	return TCD_BREAK_INSERTED;
+}
+
+static void resolvePending(TcdContext *debug) {
+	for (uint32_t i = 0; i < debug->numPending; ) {
+		TcdPendingBreak *pending = &debug->pending[i];
+		TcdLibrary *lib = libraryByName(debug, pending->library);
+		if (lib == NULL) {
+			i++;
+			continue;
+		}
+		uint64_t address;
+		uint32_t line;
+		breakInLibrary(debug, lib, pending->function, &address, &line);
+		free(pending->library);
+		free(pending->function);
+		memmove(pending, pending + 1, (debug->numPending - i - 1) * sizeof(*pending));
+		debug->numPending--;
+	}
+	updateLinkerBreak(debug);
+}
+
+/* Takes out the breakpoints of a library that was unloaded, without touching
+ * whatever is mapped there now, and has them wait for it to come back */
+static void pendBreakpoints(TcdContext *debug, TcdLibrary *lib) {
+	for (uint32_t i = 0; i < debug->numBreaks; ) {
+		TcdBreakpoint *point = &debug->breaks[i];
+		if (point->address < lib->begin || point->address >= lib->end) {
+			i++;
+			continue;
+		}
+		TcdFunction *func = lib->info != NULL ? tcdSurroundingFunction(lib->info, point->address - lib->bias) : NULL;
+		if (func != NULL && func->name != NULL) {
+			debug->pending = realloc(debug->pending, ++debug->numPending * sizeof(*debug->pending));
+			debug->pending[debug->numPending - 1] = (TcdPendingBreak){strdup(lib->path), strdup(func->name)};
+		}
+		memmove(point, point + 1, (debug->numBreaks - i - 1) * sizeof(*point));
+		debug->numBreaks--;
+	}
+}
+
+static void freeLibraries(TcdLibrary *libs, uint32_t numLibs) {
+	for (uint32_t i = 0; i < numLibs; i++) {
+		free(libs[i].path);
+		if (libs[i].info != NULL) {
+			tcdReleaseInfo(libs[i].info);
+		}
+	}
+	free(libs);
+}
+
+void tcdRefreshLibraries(TcdContext *debug) {
+	debug->libsStale = 0;
+	TcdMapping *maps;
+	uint32_t numMaps;
+	if (debug->core != NULL || tcdReadMappings(debug, &maps, &numMaps) != 0) return;
+	/* The executable itself is covered by debug->info */
+	const char *exe = NULL;
+	uint64_t entry = debug->info != NULL ? debug->info->entry + debug->loadBias : 0;
+	for (uint32_t i = 0; i < numMaps; i++) {
+		if (entry >= maps[i].begin && entry < maps[i].end) exe = maps[i].name;
+	}
+	TcdLibrary *libs = NULL;
+	uint32_t numLibs = 0;
+	int executable = 0;
+	for (uint32_t i = 0; i < numMaps; i++) {
+		TcdMapping *map = &maps[i];
+		if (map->name[0] != '/' || (exe != NULL && strcmp(map->name, exe) == 0)) continue;
+		/* The mappings of a file are adjacent; data files like the locale
+		 * archive never have executable ones, so they are dropped again */
+		if (numLibs > 0 && strcmp(libs[numLibs - 1].path, map->name) == 0) {
+			libs[numLibs - 1].end = map->end;
+			executable |= (map->prot & TCDP_EXEC) != 0;
+			continue;
+		}
+		if (numLibs > 0 && !executable) {
+			free(libs[--numLibs].path);
+		}
+		libs = realloc(libs, (numLibs + 1) * sizeof(*libs));
+		TcdLibrary *lib = &libs[numLibs++];
+		memset(lib, 0, sizeof(*lib));
+		lib->path = strdup(map->name);
+		lib->device = map->device;
+		lib->inode = map->inode;
+		lib->begin = map->begin;
+		lib->end = map->end;
+		/* Assumes the first segment is linked at address 0, as for any regular library */
+		lib->bias = map->begin - map->offset;
+		executable = (map->prot & TCDP_EXEC) != 0;
+	}
+	if (numLibs > 0 && !executable) {
+		free(libs[--numLibs].path);
+	}
+	tcdFreeMappings(maps, numMaps);
+	/* Libraries that are still there keep their info */
+	for (uint32_t j = 0; j < debug->numLibs; j++) {
+		TcdLibrary *old = &debug->libs[j];
+		uint32_t i = 0;
+		while (i < numLibs && (old->begin != libs[i].begin || old->inode != libs[i].inode || strcmp(old->path, libs[i].path) != 0)) {
+			i++;
+		}
+		if (i == numLibs) {
+			pendBreakpoints(debug, old);
+			continue;
+		}
+		libs[i].info = old->info;
+		libs[i].loadFailed = old->loadFailed;
+		old->info = NULL;
+	}
+	freeLibraries(debug->libs, debug->numLibs);
+	debug->libs = libs;
+	debug->numLibs = numLibs;
+	resolvePending(debug);
+}
+
+/* Finds the dynamic linker at <linkerBase> (AT_BASE), if there is one, so that
+ * pending breakpoints can follow library loads; statically linked programs
+ * have none. */
+void tcdTrackLibraries(TcdContext *debug, uint64_t linkerBase) {
+	debug->libsStale = 1;
+	if (debug->core != NULL || linkerBase == 0) return;
+	tcdRefreshLibraries(debug);
+	TcdLibrary *linker = libraryAt(debug, linkerBase);
+	if (linker == NULL) return;
+	uint64_t hook = linkerHook(linker);
+	if (hook != 0) {
+		debug->linkerHook = hook + linker->bias;
+	}
+	updateLinkerBreak(debug);
+}
+
+/* Called at every stop. If it is the hidden breakpoint, catches up with the
+ * libraries and steps over it; returns 1 if the process was resumed again,
+ * so the caller has to wait for the next stop. */
+int tcdStepOverLinkerBreak(TcdContext *debug) {
+	if (debug->linkerBreak == 0 || !WIFSTOPPED(debug->status) || debug->status >> 8 != SIGTRAP) return 0;
+	if (tcdReadIP(debug) != debug->linkerBreak + 1) return 0;
+	tcdWriteMemory(debug, debug->linkerBreak, 1, &debug->linkerSaved);
+	tcdWriteIP(debug, debug->linkerBreak);
+	debug->linkerBreak = 0;
+	debug->stats.steps++;
+	debug->stats.waits++;
+	ptrace(PTRACE_SINGLESTEP, debug->pid, NULL, NULL);
+	waitpid(debug->pid, &debug->status, 0);
+	debug->regsValid = 0;
+	if (!WIFSTOPPED(debug->status)) return 0;
+	/* Puts the breakpoint back if it is still needed */
+	tcdRefreshLibraries(debug);
+	if (debug->resumeRequest == PTRACE_SINGLESTEP) return 0;
+	debug->stats.continues++;
+	ptrace(debug->resumeRequest != 0 ? debug->resumeRequest : PTRACE_CONT, debug->pid, NULL, NULL);
+	return 1;
+}
+
+/* Like tcdFunctionAt(), but also looks into the libraries; <bias> receives
+ * the load bias of the module the function belongs to. */
+TcdFunction *tcdSymbolize(TcdContext *debug, uint64_t address, uint64_t *bias) {
+	TcdFunction *func = tcdFunctionAt(debug, address);
+	if (func != NULL) {
+		*bias = debug->loadBias;
+		return func;
+	}
+	TcdLibrary *lib = libraryAt(debug, address);
+	if (lib == NULL && debug->libsStale) {
+		tcdRefreshLibraries(debug);
+		lib = libraryAt(debug, address);
+	}
+	if (lib == NULL || libraryInfo(lib) == NULL) return NULL;
+	*bias = lib->bias;
+	return tcdSurroundingFunction(lib->info, address - lib->bias);
+}
+
+/* Sets a breakpoint on the function named by <spec>, either "function" for the
+ * executable and libraries loaded so far, or "library:function". A library
+ * that isn't there yet gets the breakpoint once the dynamic linker loads it. */
+int tcdBreakAtFunction(TcdContext *debug, const char *spec, uint64_t *address, uint32_t *line) {
+	*address = 0;
+	*line = 0;
+	const char *colon = strchr(spec, ':');
+	if (colon == NULL) {
+		TcdFunction *func = tcdFunctionByName(debug->info, (char*)spec);
+		if (func != NULL) return insertAtFunction(debug, func, debug->loadBias, address, line);
+		/* Only libraries that had to be loaded anyway, the rest must be named */
+		for (uint32_t i = 0; i < debug->numLibs; i++) {
+			TcdLibrary *lib = &debug->libs[i];
+			if (lib->info != NULL && breakInLibrary(debug, lib, spec, address, line) == TCD_BREAK_INSERTED)
+				return TCD_BREAK_INSERTED;
+		}
+		return TCD_BREAK_NOT_FOUND;
+	}
+	char *library = strndup(spec, colon - spec);
+	if (debug->libsStale) tcdRefreshLibraries(debug);
+	TcdLibrary *lib = libraryByName(debug, library);
+	if (lib != NULL || debug->core != NULL) {
+		free(library);
+		return lib != NULL ? breakInLibrary(debug, lib, colon + 1, address, line) : TCD_BREAK_NOT_FOUND;
+	}
+	debug->pending = realloc(debug->pending, ++debug->numPending * sizeof(*debug->pending));
+	debug->pending[debug->numPending - 1] = (TcdPendingBreak){library, strdup(colon + 1)};
+	updateLinkerBreak(debug);
+	return TCD_BREAK_PENDING;
+}
+
+void tcdFreeLibraries(TcdContext *debug) {
+	freeLibraries(debug->libs, debug->numLibs);
+	debug->libs = NULL;
+	debug->numLibs = 0;
+	for (uint32_t i = 0; i < debug->numPending; i++) {
+		free(debug->pending[i].library);
+		free(debug->pending[i].function);
+	}
+	free(debug->pending);
+	debug->pending = NULL;
+	debug->numPending = 0;
+}
@@ -4,8 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <limits.h>
 #include <libdwarf/dwarf.h>
 #include <libdwarf/libdwarf.h>
 
@@ -32,7 +31,8 @@
 	res = dwarf_child(parent, &child, &error); \
 	CHECK_DWARF_RESULT(res); \
 	Dwarf_Die cur_die = child; \
-	for (;;) { \
+	/* DIEs without children have nothing to handle */ \
+	for (; res == DW_DLV_OK;) { \
 		Dwarf_Half tag; \
 		res = dwarf_tag(cur_die, &tag, &error); \
 		CHECK_DWARF_RESULT(res); \
@@ -84,6 +84,7 @@ static TcdType *makePlaceholder(uint64_t typeOffset) {
 }
 
 static void replacePlaceholder(TcdType **ptr, uint64_t *typeIds, uint32_t numTypeIds, TcdCompUnit *cu) {
+	if (*ptr == NULL) return;
 	uint64_t id = *(uint64_t*)*ptr;
 	free(*ptr);
 	for (int i = 0; i < numTypeIds; i++) {
@@ -92,9 +93,97 @@ static void replacePlaceholder(TcdType **ptr, uint64_t *typeIds, uint32_t numTyp
 			return;
 		}
 	}
+	/* Types we do not load (yet) */
+	*ptr = NULL;
 }
 
-static int loadLocal(Dwarf_Debug dbg, Dwarf_Die die, TcdLocal *oLocal) {
+/* Per compilation unit state needed to decode location and range lists */
+struct LoadUnit {
+	TcdLocListInfo locLists;
+	uint64_t loclistsBase;
+	TcdLocListInfo rangeLists;
+	uint64_t rnglistsBase;
+};
+typedef struct LoadUnit LoadUnit;
+
+/* Compiles an exprloc or location list attribute. Unsupported locations are left as TCDL_NONE. */
+static void loadLocation(Dwarf_Attribute attr, const LoadUnit *unit, TcdLocDesc *desc) {
+	Dwarf_Error error;
+	Dwarf_Half form;
+	int res = dwarf_whatform(attr, &form, &error);
+	if (res != DW_DLV_OK) return;
+	switch (form) {
+		case DW_FORM_exprloc: {
+			Dwarf_Ptr data;
+			Dwarf_Unsigned size;
+			res = dwarf_formexprloc(attr, &size, &data, &error);
+			if (res != DW_DLV_OK) return;
+			tcdCompileLocation(data, size, &unit->locLists, desc);
+		} break;
+		case DW_FORM_sec_offset: {
+			Dwarf_Off offset;
+			res = dwarf_global_formref(attr, &offset, &error);
+			if (res != DW_DLV_OK) return;
+			tcdCompileLocationList(&unit->locLists, offset, desc);
+		} break;
+		case DW_FORM_loclistx: {
+			/* Index into the offset table following DW_AT_loclists_base */
+			Dwarf_Unsigned index;
+			res = dwarf_formudata(attr, &index, &error);
+			if (res != DW_DLV_OK) return;
+			uint64_t entry = unit->loclistsBase + index * 4;
+			if (entry + 4 > unit->locLists.sectionSize) return;
+			uint32_t offset;
+			memcpy(&offset, unit->locLists.section + entry, 4);
+			tcdCompileLocationList(&unit->locLists, unit->loclistsBase + offset, desc);
+		} break;
+		case DW_FORM_data4:
+		case DW_FORM_data8: {
+			/* DWARF 2 and 3 location list pointers */
+			Dwarf_Unsigned offset;
+			res = dwarf_formudata(attr, &offset, &error);
+			if (res != DW_DLV_OK) return;
+			tcdCompileLocationList(&unit->locLists, offset, desc);
+		} break;
+		default: break;
+	}
+}
+
+/* DW_AT_ranges refers to a range list by offset, or since DWARF 5 also by index.
+ * It is only decoded once all attributes are read, as it needs DW_AT_rnglists_base. */
+static int rangesReference(Dwarf_Attribute attr, Dwarf_Half *form, uint64_t *value) {
+	Dwarf_Error error;
+	int res = dwarf_whatform(attr, form, &error);
+	if (res != DW_DLV_OK) return res;
+	if (*form == DW_FORM_sec_offset) {
+		Dwarf_Off offset;
+		res = dwarf_global_formref(attr, &offset, &error);
+		*value = offset;
+	} else {
+		/* DW_FORM_rnglistx, or the data4 and data8 pointers of DWARF 2 and 3 */
+		Dwarf_Unsigned data;
+		res = dwarf_formudata(attr, &data, &error);
+		*value = data;
+	}
+	return res;
+}
+
+/* Decodes a range list; <ranges> is left NULL if it can't be */
+static void loadRanges(const LoadUnit *unit, Dwarf_Half form, uint64_t value, TcdRange **ranges, uint32_t *numRanges) {
+	*ranges = NULL;
+	*numRanges = 0;
+	if (form == DW_FORM_rnglistx) {
+		/* Index into the offset table following DW_AT_rnglists_base */
+		uint64_t entry = unit->rnglistsBase + value * 4;
+		if (entry + 4 > unit->rangeLists.sectionSize) return;
+		uint32_t offset;
+		memcpy(&offset, unit->rangeLists.section + entry, 4);
+		value = unit->rnglistsBase + offset;
+	}
+	tcdReadRangeList(&unit->rangeLists, value, ranges, numRanges);
+}
+
+static int loadLocal(Dwarf_Debug dbg, Dwarf_Die die, const LoadUnit *unit, TcdLocal *oLocal) {
 	const int ErrorCode = TCDE_LOAD_LOCAL;
 	Dwarf_Error error;
 	int res;
@@ -107,31 +196,68 @@ static int loadLocal(Dwarf_Debug dbg, Dwarf_Die die, TcdLocal *oLocal) {
 			local.name = strdup(data); /* TODO should this be duplicated? */
 		} break;
 		case DW_AT_location: {
-			Dwarf_Ptr data;
-			Dwarf_Unsigned size;
-			res = dwarf_formexprloc(attr, &size, &data, &error);
-			if (res == DW_DLV_ERROR) break;
-			local.locdesc.expr = malloc(size + 1);
-			memcpy(local.locdesc.expr, data, size);
-			local.locdesc.expr[size] = 0;
-			/* dwarf_dealloc(dbg, data, DW_DLA_PTR); */
+			loadLocation(attr, unit, &local.locdesc);
 		} break;
 		case DW_AT_type: {
 			Dwarf_Off offset;
-			res = dwarf_formref(attr, &offset, &error);
+			res = dwarf_global_formref(attr, &offset, &error);
 			if (res == DW_DLV_ERROR) break;
 			local.type = makePlaceholder(offset);
 		} break;
+		case DW_AT_external: {
+			Dwarf_Bool flag;
+			res = dwarf_formflag(attr, &flag, &error);
+			CHECK_DWARF_RESULT(res);
+			local.external = flag != 0;
+		} break;
 	)
 	*oLocal = local;
 	return TCDE_OK;
 }
 
-static int loadFunction(Dwarf_Debug dbg, Dwarf_Die die, TcdFunction *oFunc) {
+/* A global or static variable at compilation unit level */
+static int loadGlobal(Dwarf_Debug dbg, Dwarf_Die die, const LoadUnit *unit, TcdLocal *oGlobal) {
+	const int ErrorCode = TCDE_LOAD_LOCAL;
+	Dwarf_Error error;
+	int res = loadLocal(dbg, die, unit, oGlobal);
+	CHECK_LOAD_RESULT(res);
+	if (oGlobal->name != NULL) return TCDE_OK;
+	/* The definition of a previously declared variable takes name and type from the declaration */
+	Dwarf_Attribute attr;
+	res = dwarf_attr(die, DW_AT_specification, &attr, &error);
+	if (res != DW_DLV_OK) return TCDE_OK;
+	Dwarf_Off offset;
+	res = dwarf_global_formref(attr, &offset, &error);
+	dwarf_dealloc(dbg, attr, DW_DLA_ATTR);
+	CHECK_DWARF_RESULT(res);
+	Dwarf_Die decl;
+	res = dwarf_offdie(dbg, offset, &decl, &error);
+	if (res != DW_DLV_OK) return TCDE_OK;
+	TcdLocal declared;
+	res = loadLocal(dbg, decl, unit, &declared);
+	dwarf_dealloc(dbg, decl, DW_DLA_DIE);
+	CHECK_LOAD_RESULT(res);
+	oGlobal->name = declared.name;
+	oGlobal->external |= declared.external;
+	if (oGlobal->type == NULL) {
+		oGlobal->type = declared.type;
+	} else {
+		free(declared.type);
+	}
+	tcdFreeLocation(&declared.locdesc);
+	return TCDE_OK;
+}
+
+static int loadFunction(Dwarf_Debug dbg, Dwarf_Die die, const LoadUnit *unit, TcdFunction *oFunc) {
 	const int ErrorCode = TCDE_LOAD_FUNCTION;
 	Dwarf_Error error;
 	int res;
 	TcdFunction func = {0};
+	int highIsOffset = 0;
+	int hasLow = 0, hasEntry = 0, entryIsOffset = 0;
+	uint64_t entry = 0;
+	Dwarf_Half rangesForm = 0;
+	uint64_t rangesValue = 0;
 	HANDLE_ATTRIBUTES(die,
 		case DW_AT_name: {
 			char *data;
@@ -144,22 +270,77 @@ static int loadFunction(Dwarf_Debug dbg, Dwarf_Die die, TcdFunction *oFunc) {
 			res = dwarf_formaddr(attr, &data, &error);
 			CHECK_DWARF_RESULT(res);
 			func.begin = data;
+			hasLow = 1;
+		} break;
+		case DW_AT_entry_pc: {
+			/* An address, or since DWARF 5 also an offset from the base address */
+			Dwarf_Half form;
+			res = dwarf_whatform(attr, &form, &error);
+			CHECK_DWARF_RESULT(res);
+			if (form == DW_FORM_data1 || form == DW_FORM_data2 || form == DW_FORM_data4 ||
+					form == DW_FORM_data8 || form == DW_FORM_udata) {
+				Dwarf_Unsigned data;
+				res = dwarf_formudata(attr, &data, &error);
+				CHECK_DWARF_RESULT(res);
+				entry = data;
+				entryIsOffset = 1;
+			} else {
+				Dwarf_Addr data;
+				res = dwarf_formaddr(attr, &data, &error);
+				CHECK_DWARF_RESULT(res);
+				entry = data;
+			}
+			hasEntry = 1;
 		} break;
 		case DW_AT_high_pc: {
-			Dwarf_Unsigned data;
-			res = dwarf_formudata(attr, &data, &error);
+			/* An address before DWARF 4, since mostly an offset from DW_AT_low_pc */
+			Dwarf_Addr data;
+			Dwarf_Half form;
+			enum Dwarf_Form_Class formClass;
+			res = dwarf_highpc_b(die, &data, &form, &formClass, &error);
 			CHECK_DWARF_RESULT(res);
 			func.end = data;
+			highIsOffset = formClass == DW_FORM_CLASS_CONSTANT;
+		} break;
+		case DW_AT_ranges: {
+			res = rangesReference(attr, &rangesForm, &rangesValue);
+			CHECK_DWARF_RESULT(res);
+		} break;
+		case DW_AT_frame_base: {
+			loadLocation(attr, unit, &func.frameBase);
 		} break;
 	)
-	func.end += func.begin;
+	if (highIsOffset) func.end += func.begin;
+	if (rangesForm != 0) {
+		/* Split code, like the hot and cold parts of PGO builds. The part holding
+		 * DW_AT_entry_pc or DW_AT_low_pc is the entry; without either, the first. */
+		loadRanges(unit, rangesForm, rangesValue, &func.ranges, &func.numRanges);
+		if (func.ranges != NULL) {
+			uint64_t base = hasLow ? func.begin : func.ranges[0].begin;
+			uint64_t entryPc = hasEntry ? entry + (entryIsOffset ? base : 0) : func.begin;
+			uint32_t part = 0;
+			for (uint32_t i = 0; (hasEntry || hasLow) && i < func.numRanges; i++) {
+				if (entryPc >= func.ranges[i].begin && entryPc < func.ranges[i].end) {
+					part = i;
+					break;
+				}
+			}
+			func.begin = func.ranges[part].begin;
+			func.end = func.ranges[part].end;
+		}
+		if (func.numRanges == 1) {
+			free(func.ranges);
+			func.ranges = NULL;
+			func.numRanges = 0;
+		}
+	}
 
 	HANDLE_SUB_DIES(die,
 		/* Load locals */
 		case DW_TAG_variable:
 		case DW_TAG_formal_parameter: {
 			TcdLocal local;
-			res = loadLocal(dbg, cur_die, &local);
+			res = loadLocal(dbg, cur_die, unit, &local);
 			CHECK_LOAD_RESULT(res);
 			ARRAY_PUSH_BACK(func.locals, func.numLocals, local);
 		} break;
@@ -228,7 +409,7 @@ static int loadPointerType(Dwarf_Debug dbg, Dwarf_Die die, TcdType *oType, uint6
 	HANDLE_ATTRIBUTES(die,
 		case DW_AT_type: {
 			Dwarf_Off to;
-			res = dwarf_formref(attr, &to, &error);
+			res = dwarf_global_formref(attr, &to, &error);
 			CHECK_DWARF_RESULT(res);
 			type.as.pointer.to = makePlaceholder(to);
 		} break;
@@ -238,24 +419,268 @@ static int loadPointerType(Dwarf_Debug dbg, Dwarf_Die die, TcdType *oType, uint6
 	return TCDE_OK;
 }
 
-static int loadArrayType(Dwarf_Debug dbg, Dwarf_Die die, TcdType *oType, uint64_t *oTypeId) {
+/* Reads an unsigned or signed constant attribute */
+static int formConstant(Dwarf_Attribute attr, int64_t *value) {
+	Dwarf_Error error;
+	Dwarf_Half form;
+	int res = dwarf_whatform(attr, &form, &error);
+	if (res != DW_DLV_OK) return -1;
+	if (form == DW_FORM_sdata || form == DW_FORM_implicit_const) {
+		Dwarf_Signed data;
+		res = dwarf_formsdata(attr, &data, &error);
+		*value = data;
+	} else {
+		Dwarf_Unsigned data;
+		res = dwarf_formudata(attr, &data, &error);
+		*value = data;
+	}
+	return res == DW_DLV_OK ? 0 : -1;
+}
+
+/*
+ * Every dimension of an array gets its own TcdType, so this pushes directly
+ * onto the compilation unit. Inner dimensions are given synthetic type ids
+ * above the range of real DIE offsets.
+ */
+static int loadArrayType(Dwarf_Debug dbg, Dwarf_Die die, TcdCompUnit *cu, uint64_t **typeIds, uint32_t *numTypeIds) {
+	const int ErrorCode = TCDE_LOAD_TYPE;
+	Dwarf_Error error;
+	int res;
+	/* Fetch type offset */
+	Dwarf_Off typeId;
+	res = dwarf_dieoffset(die, &typeId, &error);
+	CHECK_DWARF_RESULT(res);
+	/* Load attributes */
+	Dwarf_Off of = 0;
+	HANDLE_ATTRIBUTES(die,
+		case DW_AT_type: {
+			res = dwarf_global_formref(attr, &of, &error);
+			CHECK_DWARF_RESULT(res);
+		} break;
+	)
+	/* Load dimensions */
+	uint32_t first = cu->numTypes;
+	uint64_t dims = 0;
+	HANDLE_SUB_DIES(die,
+		case DW_TAG_subrange_type: {
+			TcdType type = {0};
+			type.tclass = TCDT_ARRAY;
+			HANDLE_ATTRIBUTES(cur_die,
+				case DW_AT_count: {
+					int64_t data;
+					if (formConstant(attr, &data) == 0 && data > 0)
+						type.as.array.count = data;
+				} break;
+				/* Flexible array members have no (or a -1) upper bound */
+				case DW_AT_upper_bound: {
+					int64_t data;
+					if (formConstant(attr, &data) == 0 && data >= 0)
+						type.as.array.count = data + 1;
+				} break;
+			)
+			ARRAY_PUSH_BACK(cu->types, cu->numTypes, type);
+			ARRAY_PUSH_BACK(*typeIds, *numTypeIds, typeId + (dims << 48));
+			dims++;
+		} break;
+	)
+	if (dims == 0) {
+		TcdType type = {0};
+		type.tclass = TCDT_ARRAY;
+		ARRAY_PUSH_BACK(cu->types, cu->numTypes, type);
+		ARRAY_PUSH_BACK(*typeIds, *numTypeIds, typeId);
+		dims = 1;
+	}
+	for (uint64_t d = 0; d < dims; d++) {
+		uint64_t next = d + 1 < dims ? typeId + ((d + 1) << 48) : of;
+		cu->types[first + d].as.array.of = next != 0 ? makePlaceholder(next) : NULL;
+	}
+	return TCDE_OK;
+}
+
+static int loadMember(Dwarf_Debug dbg, Dwarf_Die die, TcdMember *oMember) {
+	const int ErrorCode = TCDE_LOAD_TYPE;
+	Dwarf_Error error;
+	int res;
+	TcdMember member = {0};
+	int64_t storageSize = 0, oldBitOffset = -1, dataBitOffset = -1;
+	HANDLE_ATTRIBUTES(die,
+		case DW_AT_name: {
+			char *data;
+			res = dwarf_formstring(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			member.name = strdup(data);
+		} break;
+		case DW_AT_type: {
+			Dwarf_Off to;
+			res = dwarf_global_formref(attr, &to, &error);
+			CHECK_DWARF_RESULT(res);
+			member.type = makePlaceholder(to);
+		} break;
+		case DW_AT_data_member_location: {
+			int64_t data;
+			Dwarf_Half form;
+			dwarf_whatform(attr, &form, &error);
+			if (form == DW_FORM_exprloc) {
+				/* DWARF 2 style DW_OP_plus_uconst <offset> */
+				TcdLocDesc desc = {0};
+				Dwarf_Ptr expr;
+				Dwarf_Unsigned size;
+				res = dwarf_formexprloc(attr, &size, &expr, &error);
+				if (res == DW_DLV_OK && tcdCompileLocation(expr, size, NULL, &desc) == 0 &&
+					desc.kind == TCDL_PROGRAM && desc.numOps == 1 && desc.ops[0].op == DW_OP_plus_uconst) {
+					member.offset = desc.ops[0].operand;
+				}
+				tcdFreeLocation(&desc);
+			} else if (formConstant(attr, &data) == 0) {
+				member.offset = data;
+			}
+		} break;
+		case DW_AT_byte_size: {
+			formConstant(attr, &storageSize);
+		} break;
+		case DW_AT_bit_size: {
+			int64_t data;
+			if (formConstant(attr, &data) == 0) member.bitSize = data;
+		} break;
+		case DW_AT_bit_offset: {
+			formConstant(attr, &oldBitOffset);
+		} break;
+		case DW_AT_data_bit_offset: {
+			formConstant(attr, &dataBitOffset);
+		} break;
+	)
+	/* Normalize both bitfield encodings to a little endian bit offset */
+	if (dataBitOffset >= 0) {
+		member.offset = dataBitOffset / 8;
+		member.bitOffset = dataBitOffset % 8;
+	} else if (oldBitOffset >= 0 && member.bitSize > 0) {
+		/* DWARF 2/3 count from the most significant bit of the storage unit */
+		int64_t lsb = storageSize * 8 - oldBitOffset - member.bitSize;
+		if (lsb >= 0) {
+			member.offset += lsb / 8;
+			member.bitOffset = lsb % 8;
+		}
+	}
+	*oMember = member;
+	return TCDE_OK;
+}
+
+/* Structs and unions */
+static int loadStructType(Dwarf_Debug dbg, Dwarf_Die die, TcdTypeClass tclass, TcdType *oType, uint64_t *oTypeId) {
 	const int ErrorCode = TCDE_LOAD_TYPE;
 	Dwarf_Error error;
 	int res;
 	TcdType type = {0};
-	type.tclass = TCDT_ARRAY;
-	type.size = 0; /* TODO */
+	type.tclass = tclass;
 	/* Fetch type offset */
 	Dwarf_Off typeId;
 	res = dwarf_dieoffset(die, &typeId, &error);
 	CHECK_DWARF_RESULT(res);
 	/* Load attributes */
 	HANDLE_ATTRIBUTES(die,
+		case DW_AT_name: {
+			char *data;
+			res = dwarf_formstring(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			type.as.struc.name = strdup(data);
+		} break;
+		case DW_AT_byte_size: {
+			Dwarf_Unsigned data;
+			res = dwarf_formudata(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			type.size = data;
+		} break;
+	)
+	/* Load members */
+	HANDLE_SUB_DIES(die,
+		case DW_TAG_member: {
+			TcdMember member;
+			res = loadMember(dbg, cur_die, &member);
+			CHECK_LOAD_RESULT(res);
+			ARRAY_PUSH_BACK(type.as.struc.members, type.as.struc.numMembers, member);
+		} break;
+	)
+	*oType = type;
+	*oTypeId = typeId;
+	return TCDE_OK;
+}
+
+static int loadEnumType(Dwarf_Debug dbg, Dwarf_Die die, TcdType *oType, uint64_t *oTypeId) {
+	const int ErrorCode = TCDE_LOAD_TYPE;
+	Dwarf_Error error;
+	int res;
+	TcdType type = {0};
+	type.tclass = TCDT_ENUM;
+	type.size = 4;
+	type.as.enumer.interp = TCDI_UNSIGNED;
+	/* Fetch type offset */
+	Dwarf_Off typeId;
+	res = dwarf_dieoffset(die, &typeId, &error);
+	CHECK_DWARF_RESULT(res);
+	/* Load attributes */
+	HANDLE_ATTRIBUTES(die,
+		case DW_AT_name: {
+			char *data;
+			res = dwarf_formstring(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			type.as.enumer.name = strdup(data);
+		} break;
+		case DW_AT_byte_size: {
+			Dwarf_Unsigned data;
+			res = dwarf_formudata(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			type.size = data;
+		} break;
+	)
+	/* Load enumerators */
+	HANDLE_SUB_DIES(die,
+		case DW_TAG_enumerator: {
+			TcdEnumerator value = {0};
+			HANDLE_ATTRIBUTES(cur_die,
+				case DW_AT_name: {
+					char *data;
+					res = dwarf_formstring(attr, &data, &error);
+					CHECK_DWARF_RESULT(res);
+					value.name = strdup(data);
+				} break;
+				case DW_AT_const_value: {
+					formConstant(attr, &value.value);
+				} break;
+			)
+			/* Any negative enumerator makes the whole enum signed */
+			if (value.value < 0) type.as.enumer.interp = TCDI_SIGNED;
+			ARRAY_PUSH_BACK(type.as.enumer.values, type.as.enumer.numValues, value);
+		} break;
+	)
+	*oType = type;
+	*oTypeId = typeId;
+	return TCDE_OK;
+}
+
+/* Typedefs and type qualifiers */
+static int loadAliasType(Dwarf_Debug dbg, Dwarf_Die die, TcdTypeClass tclass, TcdType *oType, uint64_t *oTypeId) {
+	const int ErrorCode = TCDE_LOAD_TYPE;
+	Dwarf_Error error;
+	int res;
+	TcdType type = {0};
+	type.tclass = tclass;
+	/* Fetch type offset */
+	Dwarf_Off typeId;
+	res = dwarf_dieoffset(die, &typeId, &error);
+	CHECK_DWARF_RESULT(res);
+	/* Load attributes */
+	HANDLE_ATTRIBUTES(die,
+		case DW_AT_name: {
+			char *data;
+			res = dwarf_formstring(attr, &data, &error);
+			CHECK_DWARF_RESULT(res);
+			if (tclass == TCDT_TYPEDEF) type.as.alias.name = strdup(data);
+		} break;
 		case DW_AT_type: {
-			Dwarf_Off of;
-			res = dwarf_formref(attr, &of, &error);
+			Dwarf_Off to;
+			res = dwarf_global_formref(attr, &to, &error);
 			CHECK_DWARF_RESULT(res);
-			type.as.array.of = makePlaceholder(of);
+			type.as.alias.to = makePlaceholder(to);
 		} break;
 	)
 	*oType = type;
@@ -263,32 +688,71 @@ static int loadArrayType(Dwarf_Debug dbg, Dwarf_Die die, TcdType *oType, uint64_
 	return TCDE_OK;
 }
 
+/* Sizes of arrays and aliases are only known once all placeholders are replaced */
+static uint32_t fixTypeSize(TcdType *type, uint32_t depth) {
+	if (type == NULL || depth > 64) return 0;
+	switch (type->tclass) {
+		case TCDT_ARRAY:
+			type->size = type->as.array.count * fixTypeSize(type->as.array.of, depth + 1);
+			break;
+		case TCDT_TYPEDEF:
+		case TCDT_CONST:
+		case TCDT_VOLATILE:
+		case TCDT_RESTRICT:
+			type->size = fixTypeSize(type->as.alias.to, depth + 1);
+			break;
+		default: break;
+	}
+	return type->size;
+}
+
+/* Moves the lines of the part holding the entry point to the front, keeping their
+ * order, so that lines[0] is the beginning even if a cold part comes first */
+static void entryLinesFirst(TcdFunction *func) {
+	if (func->ranges == NULL || func->numLines == 0) return;
+	TcdLine *lines = malloc(func->numLines * sizeof(*lines));
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < func->numLines; i++) {
+		TcdLine line = func->lines[i];
+		if (line.address >= func->begin && line.address < func->end) lines[n++] = line;
+	}
+	for (uint32_t i = 0; i < func->numLines; i++) {
+		TcdLine line = func->lines[i];
+		if (!(line.address >= func->begin && line.address < func->end)) lines[n++] = line;
+	}
+	free(func->lines);
+	func->lines = lines;
+}
+
 static int loadLines(Dwarf_Debug dbg, Dwarf_Die die, TcdCompUnit *cu) {
 	const int ErrorCode = TCDE_LOAD_LINES;
 	Dwarf_Error error;
 	int res;
-	TcdFunction *curFunc = cu->funcs;
 	/* Fetch line list */
 	Dwarf_Line *dlines;
 	Dwarf_Signed dnumLines;
 	res = dwarf_srclines(die, &dlines, &dnumLines, &error);
 	if (res != DW_DLV_OK) return -1;
+	/* Functions need not be in address order, nor contiguous */
+	uint32_t numRanges;
+	TcdFunctionRange *ranges = tcdIndexFunctionRanges(cu->funcs, cu->numFuncs, &numRanges);
+	TcdFunction *curFunc = NULL;
 	/* For every line ... */
 	uint32_t lastNumber = 0;
-	for (uint32_t i = 0; i < dnumLines && curFunc != NULL; i++) {
+	for (uint32_t i = 0; i < dnumLines; i++) {
 		/* Fetch line number */
 		Dwarf_Unsigned number;
 		res = dwarf_lineno(dlines[i], &number, &error);
+		if (res == DW_DLV_ERROR) free(ranges);
 		CHECK_DWARF_RESULT(res);
 		/* Fetch line address */
 		Dwarf_Addr address;
 		res = dwarf_lineaddr(dlines[i], &address, &error);
+		if (res == DW_DLV_ERROR) free(ranges);
 		CHECK_DWARF_RESULT(res);
-		/* Advance to next function if neccessary */
-		if (address >= curFunc->end) {
-			curFunc++;
-			if (curFunc >= cu->funcs + cu->numFuncs)
-				curFunc = NULL;
+		/* Consecutive lines are mostly in the same function */
+		if (curFunc == NULL || !tcdFunctionContains(curFunc, address)) {
+			curFunc = tcdFunctionInRanges(ranges, numRanges, address);
 		}
 		/* Do not allow multiple addresses per line & lines without surrounding functions */
 		if (number != lastNumber && curFunc != NULL) {
@@ -298,28 +762,125 @@ static int loadLines(Dwarf_Debug dbg, Dwarf_Die die, TcdCompUnit *cu) {
 		lastNumber = number;
 		dwarf_dealloc(dbg, dlines[i], DW_DLA_LINE);
 	}
+	free(ranges);
 	/* Deallocate line list */
 	dwarf_dealloc(dbg, dlines, DW_DLA_LIST);
 	/* Remove first (?) line in every function, as it seems to point into a weird limbo */
 	for (int i = 0; i < cu->numFuncs; i++) {
 		TcdFunction *f = &cu->funcs[i];
+		entryLinesFirst(f);
+		if (f->numLines == 0) continue;
 		memmove(f->lines, f->lines + 1, --f->numLines * sizeof(*f->lines));
 		f->lines = realloc(f->lines, f->numLines * sizeof(*f->lines));
 	}
 	return 0;
 }
 
-int tcdLoadInfo(const char *file, TcdInfo *out_info) {
+/*
+ * libdwarf reads the sections through TcdElf rather than libelf, so that
+ * compressed sections are inflated one by one, and only once libdwarf
+ * actually asks for their contents.
+ */
+
+static int elfSectionInfo(void *obj, Dwarf_Half index, Dwarf_Obj_Access_Section *section, int *error) {
+	TcdElfSectionInfo si;
+	if (tcdElfSectionInfo(obj, index, &si) != 0) return DW_DLV_NO_ENTRY;
+	section->addr = si.addr;
+	section->type = si.type;
+	section->size = si.size;
+	section->name = si.name;
+	section->link = si.link;
+	section->info = si.info;
+	section->entrysize = si.entrySize;
+	return DW_DLV_OK;
+}
+
+static Dwarf_Endianness elfByteOrder(void *obj) {
+	return DW_OBJECT_LSB;
+}
+
+static Dwarf_Small elfLengthSize(void *obj) {
+	return 4;
+}
+
+static Dwarf_Small elfPointerSize(void *obj) {
+	return 8;
+}
+
+static Dwarf_Unsigned elfSectionCount(void *obj) {
+	return tcdElfSectionCount(obj);
+}
+
+static int elfLoadSection(void *obj, Dwarf_Half index, Dwarf_Small **data, int *error) {
+	uint64_t size;
+	const uint8_t *contents = tcdElfSectionAt(obj, index, &size);
+	if (contents == NULL) return DW_DLV_NO_ENTRY;
+	*data = (Dwarf_Small*)contents;
+	return DW_DLV_OK;
+}
+
+static const Dwarf_Obj_Access_Methods ELF_ACCESS_METHODS = {
+	.get_section_info = elfSectionInfo,
+	.get_byte_order = elfByteOrder,
+	.get_length_size = elfLengthSize,
+	.get_pointer_size = elfPointerSize,
+	.get_section_count = elfSectionCount,
+	.load_section = elfLoadSection,
+	/* Executables and libraries have no relocations in their debug sections */
+	.relocate_a_section = NULL
+};
+
+/* Time since the last lap */
+static uint64_t lap(uint64_t *mark) {
+	uint64_t now = tcdNow();
+	uint64_t elapsed = now - *mark;
+	*mark = now;
+	return elapsed;
+}
+
+/* Charges the time since the last lap to <*phase> if the walk moves on to
+ * <next>, so that runs of DIEs of one kind cost no clock reads in between */
+static void switchPhase(uint64_t *loadNanos, int *phase, int next, uint64_t *mark) {
+	if (*phase == next) return;
+	loadNanos[*phase] += lap(mark);
+	*phase = next;
+}
+
+int tcdLoadInfo(const char *file, TcdInfo **out_info) {
 	TcdInfo info = {0};
 	Dwarf_Debug dbg = 0;
 	Dwarf_Error error;
 	int res;
 	Dwarf_Handler errhand = 0;
 	Dwarf_Ptr errarg = 0;
-	int fd = open(file, O_RDONLY);
-	if (fd < 0) return TCDE_LOAD_OPEN;
-	res = dwarf_init(fd, DW_DLC_READ, errhand, errarg, &dbg, &error);
-	if (res != DW_DLV_OK) return TCDE_LOAD_INFO;
+	TcdElf elf, debugElf;
+	if (tcdElfOpen(file, &elf) != 0) return TCDE_LOAD_OPEN;
+	info.entry = tcdElfEntry(&elf);
+	/* Stripped binaries have their DWARF in a separate debug file */
+	TcdElf *dwarfElf = &elf;
+	char debugPath[PATH_MAX];
+	if (tcdElfSectionIndex(&elf, ".debug_info") < 0 &&
+		tcdElfFindDebugFile(&elf, file, debugPath, sizeof(debugPath)) == 0 &&
+		tcdElfOpen(debugPath, &debugElf) == 0) {
+		dwarfElf = &debugElf;
+	}
+	Dwarf_Obj_Access_Interface access = {dwarfElf, &ELF_ACCESS_METHODS};
+	res = dwarf_object_init(&access, errhand, errarg, &dbg, &error);
+	if (res != DW_DLV_OK) {
+		/* No usable DWARF; the symbol table still names the functions */
+		if (dwarfElf != &elf) tcdElfClose(&debugElf);
+		tcdElfClose(&elf);
+		return tcdLoadSymbols(file, out_info);
+	}
+	/* libdwarf does not hand out the location list sections, so get them ourselves */
+	uint64_t locSize = 0, loclistsSize = 0, addrSize = 0;
+	const uint8_t *locSection = tcdElfSection(dwarfElf, ".debug_loc", &locSize);
+	const uint8_t *loclistsSection = tcdElfSection(dwarfElf, ".debug_loclists", &loclistsSize);
+	const uint8_t *addrSection = tcdElfSection(dwarfElf, ".debug_addr", &addrSize);
+	/* Likewise the range list sections */
+	uint64_t rangesSize = 0, rnglistsSize = 0;
+	const uint8_t *rangesSection = tcdElfSection(dwarfElf, ".debug_ranges", &rangesSize);
+	const uint8_t *rnglistsSection = tcdElfSection(dwarfElf, ".debug_rnglists", &rnglistsSize);
 
 	int cu_number = 0;
 	Dwarf_Unsigned cu_header_length = 0;
@@ -327,6 +888,7 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 	Dwarf_Unsigned abbrev_offset    = 0;
 	Dwarf_Half     address_size     = 0;
 	Dwarf_Unsigned next_cu_header   = 0;
+	uint64_t mark = tcdNow();
 	for (;;) {
 		const int ErrorCode = TCDE_LOAD_COMP_UNIT;
 
@@ -345,6 +907,22 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 		if (res == DW_DLV_NO_ENTRY) break; /* "Impossible" */
 		/* Load compilation unit */
 		TcdCompUnit cu = {0};
+		LoadUnit unit = {0};
+		unit.locLists.version = version_stamp;
+		if (version_stamp >= 5) {
+			unit.locLists.section = loclistsSection;
+			unit.locLists.sectionSize = loclistsSize;
+			unit.rangeLists.section = rnglistsSection;
+			unit.rangeLists.sectionSize = rnglistsSize;
+		} else {
+			unit.locLists.section = locSection;
+			unit.locLists.sectionSize = locSize;
+			unit.rangeLists.section = rangesSection;
+			unit.rangeLists.sectionSize = rangesSize;
+		}
+		int highIsOffset = 0;
+		Dwarf_Half rangesForm = 0;
+		uint64_t rangesValue = 0;
 		/* Load compilation unit attributes */
 		HANDLE_ATTRIBUTES(cu_die,
 			case DW_AT_name: {
@@ -366,31 +944,91 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 				cu.producer = strdup(data); /* TODO should this be duplicated? */
 			} break;
 			case DW_AT_low_pc: {
-				Dwarf_Unsigned data;
-				res = dwarf_formudata(attr, &data, &error);
+				Dwarf_Addr data;
+				res = dwarf_formaddr(attr, &data, &error);
 				CHECK_DWARF_RESULT(res);
 				cu.begin = data;
 			} break;
 			case DW_AT_high_pc: {
-				Dwarf_Unsigned data;
-				res = dwarf_formudata(attr, &data, &error);
+				Dwarf_Addr data;
+				Dwarf_Half form;
+				enum Dwarf_Form_Class formClass;
+				res = dwarf_highpc_b(cu_die, &data, &form, &formClass, &error);
 				CHECK_DWARF_RESULT(res);
 				cu.end = data;
+				highIsOffset = formClass == DW_FORM_CLASS_CONSTANT;
+			} break;
+			case DW_AT_ranges: {
+				res = rangesReference(attr, &rangesForm, &rangesValue);
+				CHECK_DWARF_RESULT(res);
+			} break;
+			case DW_AT_addr_base: {
+				Dwarf_Off data;
+				res = dwarf_global_formref(attr, &data, &error);
+				CHECK_DWARF_RESULT(res);
+				if (addrSection != NULL && data < addrSize) {
+					unit.locLists.addrs = addrSection + data;
+					unit.locLists.addrsSize = addrSize - data;
+				}
+			} break;
+			case DW_AT_loclists_base: {
+				Dwarf_Off data;
+				res = dwarf_global_formref(attr, &data, &error);
+				CHECK_DWARF_RESULT(res);
+				unit.loclistsBase = data;
+			} break;
+			case DW_AT_rnglists_base: {
+				Dwarf_Off data;
+				res = dwarf_global_formref(attr, &data, &error);
+				CHECK_DWARF_RESULT(res);
+				unit.rnglistsBase = data;
 			} break;
 		)
-		cu.end += cu.begin;
+		if (highIsOffset) cu.end += cu.begin;
+		/* Location and range list entries are relative to the unit's base address */
+		unit.locLists.base = cu.begin;
+		unit.rangeLists.version = version_stamp;
+		unit.rangeLists.addrs = unit.locLists.addrs;
+		unit.rangeLists.addrsSize = unit.locLists.addrsSize;
+		unit.rangeLists.base = cu.begin;
+		if (rangesForm != 0) {
+			loadRanges(&unit, rangesForm, rangesValue, &cu.ranges, &cu.numRanges);
+			/* Then begin and end only span all of it */
+			for (uint32_t i = 0; i < cu.numRanges; i++) {
+				if (i == 0 || cu.ranges[i].begin < cu.begin) cu.begin = cu.ranges[i].begin;
+				if (i == 0 || cu.ranges[i].end > cu.end) cu.end = cu.ranges[i].end;
+			}
+		}
+		info.loadNanos[TCD_LOAD_UNITS] += lap(&mark);
 
-		/* Load all types, functions etc. */
+		/* Load all types, functions etc.; types are timed as a phase of their own */
+		int phase = TCD_LOAD_DIES;
 		HANDLE_SUB_DIES(cu_die,
 			/* Load function */
 			case DW_TAG_subprogram: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_DIES, &mark);
 				TcdFunction func;
-				res = loadFunction(dbg, cur_die, &func);
+				res = loadFunction(dbg, cur_die, &unit, &func);
 				CHECK_LOAD_RESULT(res);
 				ARRAY_PUSH_BACK(cu.funcs, cu.numFuncs, func);
 			} break;
+			/* Load global or static variable; pure declarations have no location */
+			case DW_TAG_variable: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_DIES, &mark);
+				TcdLocal global;
+				res = loadGlobal(dbg, cur_die, &unit, &global);
+				CHECK_LOAD_RESULT(res);
+				if (global.name == NULL || global.locdesc.kind == TCDL_NONE) {
+					free(global.name);
+					free(global.type);
+					tcdFreeLocation(&global.locdesc);
+					break;
+				}
+				ARRAY_PUSH_BACK(cu.globals, cu.numGlobals, global);
+			} break;
 			/* Load base type */
 			case DW_TAG_base_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
 				uint64_t typeId;
 				TcdType type;
 				res = loadBaseType(dbg, cur_die, &type, &typeId);
@@ -400,6 +1038,7 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 			} break;
 			/* Load pointer type */
 			case DW_TAG_pointer_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
 				uint64_t typeId;
 				TcdType type;
 				res = loadPointerType(dbg, cur_die, &type, &typeId);
@@ -409,18 +1048,55 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 			} break;
 			/* Load array type */
 			case DW_TAG_array_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
+				res = loadArrayType(dbg, cur_die, &cu, &typeIds, &numTypeIds);
+				CHECK_LOAD_RESULT(res);
+			} break;
+			/* Load struct or union type */
+			case DW_TAG_structure_type:
+			case DW_TAG_union_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
 				uint64_t typeId;
 				TcdType type;
-				res = loadArrayType(dbg, cur_die, &type, &typeId);
+				res = loadStructType(dbg, cur_die, tag == DW_TAG_union_type ? TCDT_UNION : TCDT_STRUCT, &type, &typeId);
+				CHECK_LOAD_RESULT(res);
+				ARRAY_PUSH_BACK(cu.types, cu.numTypes, type);
+				ARRAY_PUSH_BACK(typeIds, numTypeIds, typeId);
+			} break;
+			/* Load enum type */
+			case DW_TAG_enumeration_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
+				uint64_t typeId;
+				TcdType type;
+				res = loadEnumType(dbg, cur_die, &type, &typeId);
+				CHECK_LOAD_RESULT(res);
+				ARRAY_PUSH_BACK(cu.types, cu.numTypes, type);
+				ARRAY_PUSH_BACK(typeIds, numTypeIds, typeId);
+			} break;
+			/* Load typedef or qualified type */
+			case DW_TAG_typedef:
+			case DW_TAG_const_type:
+			case DW_TAG_volatile_type:
+			case DW_TAG_restrict_type: {
+				switchPhase(info.loadNanos, &phase, TCD_LOAD_TYPES, &mark);
+				uint64_t typeId;
+				TcdType type;
+				TcdTypeClass tclass = tag == DW_TAG_typedef ? TCDT_TYPEDEF :
+					tag == DW_TAG_const_type ? TCDT_CONST :
+					tag == DW_TAG_volatile_type ? TCDT_VOLATILE : TCDT_RESTRICT;
+				res = loadAliasType(dbg, cur_die, tclass, &type, &typeId);
 				CHECK_LOAD_RESULT(res);
 				ARRAY_PUSH_BACK(cu.types, cu.numTypes, type);
 				ARRAY_PUSH_BACK(typeIds, numTypeIds, typeId);
 			} break;
 		)
 
+		info.loadNanos[phase] += lap(&mark);
+
 		/* Load lines */
 		res = loadLines(dbg, cu_die, &cu);
 		CHECK_LOAD_RESULT(res);
+		info.loadNanos[TCD_LOAD_LINES] += lap(&mark);
 
 		/* Replace type offsets / placeholders by pointers */
 		for (int i = 0; i < cu.numTypes; i++) {
@@ -431,14 +1107,32 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 				case TCDT_ARRAY:
 					replacePlaceholder(&cu.types[i].as.array.of, typeIds, numTypeIds, &cu);
 					break;
+				case TCDT_STRUCT:
+				case TCDT_UNION:
+					for (uint32_t j = 0; j < cu.types[i].as.struc.numMembers; j++) {
+						replacePlaceholder(&cu.types[i].as.struc.members[j].type, typeIds, numTypeIds, &cu);
+					}
+					break;
+				case TCDT_TYPEDEF:
+				case TCDT_CONST:
+				case TCDT_VOLATILE:
+				case TCDT_RESTRICT:
+					replacePlaceholder(&cu.types[i].as.alias.to, typeIds, numTypeIds, &cu);
+					break;
 				default: break;
 			}
 		}
+		for (int i = 0; i < cu.numTypes; i++) {
+			fixTypeSize(&cu.types[i], 0);
+		}
 		for (int i = 0; i < cu.numFuncs; i++) {
 			for (int j = 0; j < cu.funcs[i].numLocals; j++) {
 				replacePlaceholder(&cu.funcs[i].locals[j].type, typeIds, numTypeIds, &cu);
 			}
 		}
+		for (int i = 0; i < cu.numGlobals; i++) {
+			replacePlaceholder(&cu.globals[i].type, typeIds, numTypeIds, &cu);
+		}
 
 		/* Deallocate compilation unit die */
 		dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
@@ -446,15 +1140,26 @@ int tcdLoadInfo(const char *file, TcdInfo *out_info) {
 		/* Add compilation unit to list */
 		ARRAY_PUSH_BACK(info.compUnits, info.numCompUnits, cu);
 		cu_number++;
+		info.loadNanos[TCD_LOAD_FIXUP] += lap(&mark);
 	}
+	info.loadNanos[TCD_LOAD_UNITS] += lap(&mark);
+	tcdIndexGlobals(&info);
+	info.loadNanos[TCD_LOAD_FIXUP] += lap(&mark);
 	/* Close dwarf handle */
-	res = dwarf_finish(dbg, &error);
+	res = dwarf_object_finish(dbg, &error);
 	if (res != DW_DLV_OK) {
-		printf("dwarf_finish failed!\n");
+		printf("dwarf_object_finish failed!\n");
+	}
+	/* .eh_frame is kept with the code, .debug_frame may be in the debug file */
+	if (tcdLoadFrames(&elf, &info.frames) != 0 && dwarfElf != &elf) {
+		tcdLoadFrames(dwarfElf, &info.frames);
 	}
-	/* Close executable's file handle */
-	close(fd);
+	/* Close the executable and its debug file, with any inflated sections */
+	if (dwarfElf != &elf) tcdElfClose(&debugElf);
+	tcdElfClose(&elf);
 	/* Return info */
-	*out_info = info;
+	info.refs = 1;
+	*out_info = malloc(sizeof(info));
+	**out_info = info;
 	return 0;
 }
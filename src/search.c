@@ -0,0 +1,170 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Memory is scanned in chunks of this size */
+#define SEARCH_CHUNK_SIZE (1 << 20)
+
+/*
+ * The vectorized searches compare the first and the last byte of the needle
+ * against a whole block of candidate positions at once, and only run memcmp()
+ * where both match.
+ */
+
+static const uint8_t *searchScalar(const uint8_t *hay, uint64_t size, const uint8_t *needle, uint32_t len) {
+	const uint8_t *end = hay + size - len + 1;
+	const uint8_t *cur = hay;
+	while (cur < end) {
+		cur = memchr(cur, needle[0], end - cur);
+		if (cur == NULL) return NULL;
+		if (memcmp(cur, needle, len) == 0) return cur;
+		cur++;
+	}
+	return NULL;
+}
+
+#if defined(__x86_64__)
+static const uint8_t *searchSse2(const uint8_t *hay, uint64_t size, const uint8_t *needle, uint32_t len) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last  = _mm_set1_epi8(needle[len - 1]);
+	uint64_t i = 0;
+	for (; i + len - 1 + 16 <= size; i += 16) {
+		__m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + i));
+		__m128i blockLast  = _mm_loadu_si128((const __m128i*)(hay + i + len - 1));
+		__m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast));
+		uint32_t mask = _mm_movemask_epi8(eq);
+		while (mask != 0) {
+			uint32_t bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit, needle, len) == 0) return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return i + len <= size ? searchScalar(hay + i, size - i, needle, len) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *searchAvx2(const uint8_t *hay, uint64_t size, const uint8_t *needle, uint32_t len) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last  = _mm256_set1_epi8(needle[len - 1]);
+	uint64_t i = 0;
+	for (; i + len - 1 + 32 <= size; i += 32) {
+		__m256i blockFirst = _mm256_loadu_si256((const __m256i*)(hay + i));
+		__m256i blockLast  = _mm256_loadu_si256((const __m256i*)(hay + i + len - 1));
+		__m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast));
+		uint32_t mask = _mm256_movemask_epi8(eq);
+		while (mask != 0) {
+			uint32_t bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit, needle, len) == 0) return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return i + len <= size ? searchSse2(hay + i, size - i, needle, len) : NULL;
+}
+#endif
+
+const uint8_t *tcdMemSearch(const uint8_t *hay, uint64_t size, const uint8_t *needle, uint32_t len) {
+	if (len == 0 || len > size) return NULL;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return searchAvx2(hay, size, needle, len);
+	return searchSse2(hay, size, needle, len);
+#else
+	return searchScalar(hay, size, needle, len);
+#endif
+}
+
+/* Index of the first byte where a and b differ (or are equal, if <equal> is set) */
+static uint64_t scanScalar(const uint8_t *a, const uint8_t *b, uint64_t size, int equal) {
+	for (uint64_t i = 0; i < size; i++) {
+		if ((a[i] == b[i]) == equal) return i;
+	}
+	return size;
+}
+
+#if defined(__x86_64__)
+static uint64_t scanSse2(const uint8_t *a, const uint8_t *b, uint64_t size, int equal) {
+	uint64_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (!equal) mask = ~mask & 0xFFFF;
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scanScalar(a + i, b + i, size - i, equal);
+}
+
+__attribute__((target("avx2")))
+static uint64_t scanAvx2(const uint8_t *a, const uint8_t *b, uint64_t size, int equal) {
+	uint64_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (!equal) mask = ~mask;
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+	return i + scanSse2(a + i, b + i, size - i, equal);
+}
+#endif
+
+static uint64_t scan(const uint8_t *a, const uint8_t *b, uint64_t size, int equal) {
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return scanAvx2(a, b, size, equal);
+	return scanSse2(a, b, size, equal);
+#else
+	return scanScalar(a, b, size, equal);
+#endif
+}
+
+uint64_t tcdMemMismatch(const uint8_t *a, const uint8_t *b, uint64_t size) {
+	return scan(a, b, size, 0);
+}
+
+uint64_t tcdMemMatch(const uint8_t *a, const uint8_t *b, uint64_t size) {
+	return scan(a, b, size, 1);
+}
+
+static int isSearchable(TcdMapping *map) {
+	return (map->prot & TCDP_READ) &&
+		strcmp(map->name, "[vvar]") != 0 &&
+		strcmp(map->name, "[vsyscall]") != 0;
+}
+
+/* Returns the total number of matches; at most <max> of them are stored */
+uint32_t tcdFindMemory(TcdContext *debug, const void *needle, uint32_t len, uint64_t *results, uint32_t max) {
+	if (len == 0 || len > SEARCH_CHUNK_SIZE / 2) return 0;
+	TcdMapping *maps;
+	uint32_t numMaps;
+	if (tcdReadMappings(debug, &maps, &numMaps) != 0) return 0;
+	uint8_t *buffer = malloc(SEARCH_CHUNK_SIZE);
+	uint32_t count = 0;
+	for (uint32_t m = 0; m < numMaps; m++) {
+		if (!isSearchable(&maps[m])) continue;
+		/* Consecutive chunks overlap by len - 1 bytes, so that no match is cut in half */
+		uint64_t address = maps[m].begin;
+		while (address + len <= maps[m].end) {
+			uint64_t chunk = maps[m].end - address;
+			if (chunk > SEARCH_CHUNK_SIZE) chunk = SEARCH_CHUNK_SIZE;
+			tcdReadProgramMemory(debug, address, chunk, buffer);
+			const uint8_t *cur = buffer;
+			const uint8_t *end = buffer + chunk;
+			while ((cur = tcdMemSearch(cur, end - cur, needle, len)) != NULL) {
+				if (count < max) results[count] = address + (cur - buffer);
+				count++;
+				cur++;
+			}
+			if (address + chunk >= maps[m].end) break;
+			address += chunk - (len - 1);
+		}
+	}
+	free(buffer);
+	tcdFreeMappings(maps, numMaps);
+	return count;
+}
@@ -0,0 +1,153 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define SNAPSHOT_PAGE_SIZE 4096
+/* Memory is hashed and compared in chunks of this size */
+#define SNAPSHOT_CHUNK_SIZE (1 << 20)
+
+/* Four independent multiply-rotate lanes, so that the multiplications overlap */
+static uint64_t hashPage(const uint8_t *page) {
+	const uint64_t prime = 0x9E3779B185EBCA87ULL;
+	uint64_t lanes[4] = {1, 2, 3, 4};
+	for (uint32_t i = 0; i < SNAPSHOT_PAGE_SIZE; i += 32) {
+		for (uint32_t l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, page + i + l * 8, 8);
+			lanes[l] = (lanes[l] ^ word) * prime;
+			lanes[l] = (lanes[l] << 31) | (lanes[l] >> 33);
+		}
+	}
+	return lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+}
+
+/* Private writable memory only; shared mappings are not preserved by the fork */
+static int isSnapshotted(TcdMapping *map) {
+	return (map->prot & TCDP_READ) && (map->prot & TCDP_WRITE) && !(map->prot & TCDP_SHARED) &&
+		strcmp(map->name, "[vvar]") != 0;
+}
+
+int tcdTakeSnapshot(TcdContext *debug) {
+	if (debug->core != NULL) return -1;
+	TcdSnapshot snap = {0};
+	if (tcdForkProcess(debug, &snap.pid) != 0) return -1;
+	TcdMapping *maps;
+	uint32_t numMaps;
+	if (tcdReadMappings(debug, &maps, &numMaps) != 0) {
+		tcdFreeSnapshot(&snap);
+		return -1;
+	}
+	uint8_t *buffer = malloc(SNAPSHOT_CHUNK_SIZE);
+	snap.regions = calloc(numMaps, sizeof(*snap.regions));
+	for (uint32_t m = 0; m < numMaps; m++) {
+		if (!isSnapshotted(&maps[m])) continue;
+		TcdSnapshotRegion *region = &snap.regions[snap.numRegions++];
+		region->begin = maps[m].begin;
+		region->end = maps[m].end;
+		region->hashes = malloc((region->end - region->begin) / SNAPSHOT_PAGE_SIZE * sizeof(*region->hashes));
+		uint64_t *hash = region->hashes;
+		for (uint64_t address = region->begin; address < region->end; address += SNAPSHOT_CHUNK_SIZE) {
+			uint64_t chunk = region->end - address;
+			if (chunk > SNAPSHOT_CHUNK_SIZE) chunk = SNAPSHOT_CHUNK_SIZE;
+			tcdReadMemory(debug, address, chunk, buffer);
+			for (uint64_t page = 0; page < chunk; page += SNAPSHOT_PAGE_SIZE) {
+				*hash++ = hashPage(buffer + page);
+			}
+		}
+	}
+	free(buffer);
+	tcdFreeMappings(maps, numMaps);
+	if (debug->snapshot != NULL) {
+		tcdFreeSnapshot(debug->snapshot);
+	} else {
+		debug->snapshot = malloc(sizeof(snap));
+	}
+	*debug->snapshot = snap;
+	return 0;
+}
+
+static void pushRange(TcdMemRange *ranges, uint32_t max, uint32_t *count, uint64_t begin, uint64_t end) {
+	/* Extend the previous range if the two touch */
+	if (*count > 0 && *count <= max && ranges[*count - 1].end == begin) {
+		ranges[*count - 1].end = end;
+		return;
+	}
+	if (*count < max) {
+		ranges[*count].begin = begin;
+		ranges[*count].end = end;
+	}
+	(*count)++;
+}
+
+/* Compares a run of pages whose hashes changed against the frozen fork */
+static void diffRun(TcdContext *frozen, uint64_t address, const uint8_t *cur, uint8_t *old, uint64_t size,
+	TcdMemRange *ranges, uint32_t max, uint32_t *count) {
+	tcdReadMemory(frozen, address, size, old);
+	uint64_t pos = 0;
+	while (pos < size) {
+		pos += tcdMemMismatch(cur + pos, old + pos, size - pos);
+		if (pos >= size) break;
+		uint64_t end = pos + tcdMemMatch(cur + pos, old + pos, size - pos);
+		pushRange(ranges, max, count, address + pos, address + end);
+		pos = end;
+	}
+}
+
+/* Returns the number of changed ranges; at most <max> of them are stored */
+uint32_t tcdDiffSnapshot(TcdContext *debug, TcdMemRange *ranges, uint32_t max) {
+	TcdSnapshot *snap = debug->snapshot;
+	if (snap == NULL) return 0;
+	TcdContext frozen = {0};
+	frozen.pid = snap->pid;
+	TcdMapping *maps;
+	uint32_t numMaps;
+	if (tcdReadMappings(debug, &maps, &numMaps) != 0) return 0;
+	uint8_t *cur = malloc(SNAPSHOT_CHUNK_SIZE);
+	uint8_t *old = malloc(SNAPSHOT_CHUNK_SIZE);
+	uint32_t count = 0;
+	for (uint32_t r = 0; r < snap->numRegions; r++) {
+		TcdSnapshotRegion *region = &snap->regions[r];
+		/* Only look at what is still mapped */
+		uint64_t end = region->begin;
+		for (uint32_t m = 0; m < numMaps; m++) {
+			if (maps[m].begin <= region->begin && maps[m].end > region->begin) {
+				end = maps[m].end < region->end ? maps[m].end : region->end;
+				break;
+			}
+		}
+		for (uint64_t address = region->begin; address < end; address += SNAPSHOT_CHUNK_SIZE) {
+			uint64_t chunk = end - address;
+			if (chunk > SNAPSHOT_CHUNK_SIZE) chunk = SNAPSHOT_CHUNK_SIZE;
+			tcdReadMemory(debug, address, chunk, cur);
+			const uint64_t *hashes = region->hashes + (address - region->begin) / SNAPSHOT_PAGE_SIZE;
+			uint64_t runStart = 0;
+			for (uint64_t page = 0; page <= chunk; page += SNAPSHOT_PAGE_SIZE) {
+				int changed = page < chunk && hashPage(cur + page) != hashes[page / SNAPSHOT_PAGE_SIZE];
+				if (changed) continue;
+				if (page > runStart) {
+					diffRun(&frozen, address + runStart, cur + runStart, old + runStart, page - runStart,
+						ranges, max, &count);
+				}
+				runStart = page + SNAPSHOT_PAGE_SIZE;
+			}
+		}
+	}
+	free(cur);
+	free(old);
+	tcdFreeMappings(maps, numMaps);
+	return count;
+}
+
+void tcdFreeSnapshot(TcdSnapshot *snap) {
+	if (snap->pid > 0) {
+		kill(snap->pid, SIGKILL);
+		waitpid(snap->pid, NULL, 0);
+	}
+	for (uint32_t i = 0; i < snap->numRegions; i++) {
+		free(snap->regions[i].hashes);
+	}
+	free(snap->regions);
+}
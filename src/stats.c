@@ -0,0 +1,62 @@
+#include "tcd.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static const char *const loadPhaseNames[TCD_NUM_LOAD_PHASES] = {
+	"units", "dies", "types", "lines", "fixup"
+};
+
+/* Monotonic time in nanoseconds */
+uint64_t tcdNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double millis(uint64_t nanos) {
+	return nanos / 1e6;
+}
+
+void tcdPrintStats(TcdContext *debug, FILE *out) {
+	TcdStats *st = &debug->stats;
+	fprintf(out, "ptrace: %lu peeks, %lu pokes, %lu steps, %lu continues, %lu register reads, %lu register writes\n",
+		st->peeks, st->pokes, st->steps, st->continues, st->regReads, st->regWrites);
+	fprintf(out, "waitpid: %lu calls, %.3f ms waiting", st->waits, millis(st->waitNanos));
+	if (st->waits > 0) {
+		fprintf(out, ", %.1f us on average", st->waitNanos / 1e3 / st->waits);
+	}
+	fprintf(out, "\n");
+	fprintf(out, "memory: %lu process_vm_readv calls, %lu bytes read, %lu bytes written\n",
+		st->vmReads, st->bytesRead, st->bytesWritten);
+	fprintf(out, "load:");
+	for (int i = 0; i < TCD_NUM_LOAD_PHASES; i++) {
+		fprintf(out, " %s %.3f ms%s", loadPhaseNames[i], millis((debug->info != NULL ? debug->info->loadNanos[i] : 0)),
+			i + 1 < TCD_NUM_LOAD_PHASES ? "," : "\n");
+	}
+}
+
+void tcdJsonStats(TcdContext *debug, TcdJson *json) {
+	TcdStats *st = &debug->stats;
+	const char *const names[] = {
+		"peeks", "pokes", "steps", "continues", "regReads", "regWrites",
+		"vmReads", "bytesRead", "bytesWritten", "waits", "waitNanos"
+	};
+	const uint64_t values[] = {
+		st->peeks, st->pokes, st->steps, st->continues, st->regReads, st->regWrites,
+		st->vmReads, st->bytesRead, st->bytesWritten, st->waits, st->waitNanos
+	};
+	tcdJsonObjectBegin(json);
+	for (uint32_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+		tcdJsonKey(json, names[i]);
+		tcdJsonUint(json, values[i]);
+	}
+	tcdJsonKey(json, "loadNanos");
+	tcdJsonObjectBegin(json);
+	for (int i = 0; i < TCD_NUM_LOAD_PHASES; i++) {
+		tcdJsonKey(json, loadPhaseNames[i]);
+		tcdJsonUint(json, (debug->info != NULL ? debug->info->loadNanos[i] : 0));
+	}
+	tcdJsonObjectEnd(json);
+	tcdJsonObjectEnd(json);
+}
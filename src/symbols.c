@@ -0,0 +1,98 @@
+#include "tcd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+/*
+ * Fallback for binaries without DWARF, like stripped third party libraries:
+ * a single compilation unit with a function for every function symbol in
+ * .symtab and .dynsym, without lines, locals or types. That is still enough
+ * for symbolized traces and breakpoints on symbols.
+ */
+
+typedef struct {
+	const Elf64_Sym *sym;
+	const char *name;
+	int local;
+} Symbol;
+
+/* By address; where several symbols alias, global ones and then the
+ * shortest names come first, so "puts" wins over "_IO_puts" */
+static int compareSymbols(const void *a, const void *b) {
+	const Symbol *sa = a, *sb = b;
+	if (sa->sym->st_value != sb->sym->st_value)
+		return sa->sym->st_value < sb->sym->st_value ? -1 : 1;
+	if (sa->local != sb->local)
+		return sa->local - sb->local;
+	size_t la = strlen(sa->name), lb = strlen(sb->name);
+	if (la != lb)
+		return la < lb ? -1 : 1;
+	return strcmp(sa->name, sb->name);
+}
+
+static void collectSymbols(TcdElf *elf, const char *symName, const char *strName, Symbol **syms, uint32_t *numSyms) {
+	uint64_t symSize, strSize;
+	const Elf64_Sym *table = (const Elf64_Sym*)tcdElfSection(elf, symName, &symSize);
+	const char *strs = (const char*)tcdElfSection(elf, strName, &strSize);
+	if (table == NULL || strs == NULL) return;
+	uint64_t count = symSize / sizeof(Elf64_Sym);
+	*syms = realloc(*syms, (*numSyms + count) * sizeof(**syms));
+	for (uint64_t i = 0; i < count; i++) {
+		const Elf64_Sym *sym = &table[i];
+		int type = ELF64_ST_TYPE(sym->st_info);
+		if (type != STT_FUNC && type != STT_GNU_IFUNC) continue;
+		if (sym->st_shndx == SHN_UNDEF || sym->st_size == 0) continue;
+		/* The name has to end within the string table */
+		if (sym->st_name >= strSize || memchr(strs + sym->st_name, '\0', strSize - sym->st_name) == NULL) continue;
+		Symbol *out = &(*syms)[(*numSyms)++];
+		out->sym = sym;
+		out->name = strs + sym->st_name;
+		out->local = ELF64_ST_BIND(sym->st_info) == STB_LOCAL;
+	}
+}
+
+int tcdLoadSymbols(const char *file, TcdInfo **out_info) {
+	TcdElf elf;
+	if (tcdElfOpen(file, &elf) != 0) return TCDE_LOAD_OPEN;
+	Symbol *syms = NULL;
+	uint32_t numSyms = 0;
+	collectSymbols(&elf, ".symtab", ".strtab", &syms, &numSyms);
+	collectSymbols(&elf, ".dynsym", ".dynstr", &syms, &numSyms);
+	if (numSyms == 0) {
+		free(syms);
+		tcdElfClose(&elf);
+		return TCDE_LOAD_INFO;
+	}
+	qsort(syms, numSyms, sizeof(*syms), compareSymbols);
+
+	TcdCompUnit cu = {0};
+	const char *slash = strrchr(file, '/');
+	cu.name = strdup(slash != NULL ? slash + 1 : file);
+	cu.compDir = slash != NULL ? strndup(file, slash - file) : strdup(".");
+	cu.funcs = calloc(numSyms, sizeof(*cu.funcs));
+	cu.begin = syms[0].sym->st_value;
+	for (uint32_t i = 0; i < numSyms; i++) {
+		const Elf64_Sym *sym = syms[i].sym;
+		/* .dynsym repeats what .symtab has; aliases stay, for breakpoints by any name */
+		if (i > 0 && syms[i - 1].sym->st_value == sym->st_value && strcmp(syms[i - 1].name, syms[i].name) == 0) continue;
+		TcdFunction *func = &cu.funcs[cu.numFuncs++];
+		func->name = strdup(syms[i].name);
+		func->begin = sym->st_value;
+		func->end = sym->st_value + sym->st_size;
+		if (func->end > cu.end) cu.end = func->end;
+	}
+	free(syms);
+
+	TcdInfo info = {0};
+	info.entry = tcdElfEntry(&elf);
+	tcdElfClose(&elf);
+	info.compUnits = malloc(sizeof(cu));
+	info.compUnits[0] = cu;
+	info.numCompUnits = 1;
+	tcdIndexGlobals(&info);
+	info.refs = 1;
+	*out_info = malloc(sizeof(info));
+	**out_info = info;
+	return TCDE_OK;
+}